@@ -88,6 +88,19 @@ gboolean		_ctk_source_buffer_has_source_marks		(CtkSourceBuffer        *buffer);
 CTK_SOURCE_INTERNAL
 gboolean		_ctk_source_buffer_has_spaces_tag		(CtkSourceBuffer        *buffer);
 
+CTK_SOURCE_INTERNAL
+void			 _ctk_source_buffer_set_frame_clock		(CtkSourceBuffer        *buffer,
+									 CdkFrameClock          *frame_clock);
+
+CTK_SOURCE_INTERNAL
+CdkFrameClock		*_ctk_source_buffer_get_frame_clock		(CtkSourceBuffer        *buffer);
+
+CTK_SOURCE_INTERNAL
+void			 _ctk_source_buffer_text_loaded		(CtkSourceBuffer        *buffer);
+
+CTK_SOURCE_INTERNAL
+CtkSourceEngine		*_ctk_source_buffer_get_highlight_engine	(CtkSourceBuffer        *buffer);
+
 G_END_DECLS
 
 #endif /* CTK_SOURCE_BUFFER_PRIVATE_H */
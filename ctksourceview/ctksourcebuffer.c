@@ -189,6 +189,12 @@ enum
 	PROP_STYLE_SCHEME,
 	PROP_UNDO_MANAGER,
 	PROP_IMPLICIT_TRAILING_NEWLINE,
+	PROP_HIGHLIGHT_SCHEDULE,
+	PROP_HIGHLIGHT_SYNC_POINTS,
+	PROP_HIGHLIGHT_CACHE,
+	PROP_HIGHLIGHT_IN_THREAD,
+	PROP_HIGHLIGHT_ON_DRAW,
+	PROP_HIGHLIGHT_MIRROR,
 	N_PROPERTIES
 };
 
@@ -209,6 +215,30 @@ struct _CtkSourceBufferPrivate
 	CtkSourceUndoManager *undo_manager;
 	gint max_undo_levels;
 
+	CtkSourceHighlightSchedule highlight_schedule;
+	guint highlight_sync_points : 1;
+	guint highlight_cache : 1;
+	guint highlight_in_thread : 1;
+	guint highlight_on_draw : 1;
+
+	/* Whether the text is unmodified since it was loaded by a
+	 * CtkSourceFileLoader, so that the highlight cache or a thread
+	 * can be used. */
+	guint loaded_from_file : 1;
+
+	/* The buffer whose syntax analysis is shared, and the buffers
+	 * sharing the analysis of this one. Not referenced: a buffer
+	 * forgets the others when it is disposed. */
+	CtkSourceBuffer *highlight_mirror;
+	GSList *highlight_mirrored_by;
+
+	/* See ctk_source_buffer_freeze_highlight(). */
+	gint highlight_freeze_count;
+
+	/* Weak pointer to the frame clock of the last view which drew
+	 * the buffer. */
+	CdkFrameClock *frame_clock;
+
 	CtkTextMark *tmp_insert_mark;
 	CtkTextMark *tmp_selection_bound_mark;
 
@@ -269,6 +299,9 @@ static void	 ctk_source_buffer_real_highlight_updated
 							(CtkSourceBuffer         *buffer,
 							 CtkTextIter             *start,
 							 CtkTextIter             *end);
+static gboolean	 set_highlight_mirror			(CtkSourceBuffer         *buffer,
+							 CtkSourceBuffer         *mirror);
+static void	 update_highlight_engine		(CtkSourceBuffer         *buffer);
 
 static void
 ctk_source_buffer_check_tag_for_spaces (CtkSourceBuffer *buffer,
@@ -468,6 +501,112 @@ ctk_source_buffer_class_init (CtkSourceBufferClass *klass)
 				      G_PARAM_CONSTRUCT |
 				      G_PARAM_STATIC_STRINGS);
 
+	/**
+	 * CtkSourceBuffer:highlight-schedule:
+	 *
+	 * How the syntax highlighting of the text which is not visible is
+	 * scheduled. See ctk_source_buffer_set_highlight_schedule().
+	 *
+	 * Since: 4.14
+	 */
+	buffer_properties[PROP_HIGHLIGHT_SCHEDULE] =
+		g_param_spec_enum ("highlight-schedule",
+				   "Highlight Schedule",
+				   "How background syntax highlighting is scheduled",
+				   CTK_SOURCE_TYPE_HIGHLIGHT_SCHEDULE,
+				   CTK_SOURCE_HIGHLIGHT_SCHEDULE_FIXED,
+				   G_PARAM_READWRITE |
+				   G_PARAM_EXPLICIT_NOTIFY |
+				   G_PARAM_STATIC_STRINGS);
+
+	/**
+	 * CtkSourceBuffer:highlight-sync-points:
+	 *
+	 * Whether text far away from the analyzed part of the buffer is
+	 * highlighted from a nearby sync point while the analysis catches
+	 * up. See ctk_source_buffer_set_highlight_sync_points().
+	 *
+	 * Since: 4.14
+	 */
+	buffer_properties[PROP_HIGHLIGHT_SYNC_POINTS] =
+		g_param_spec_boolean ("highlight-sync-points",
+				      "Highlight Sync Points",
+				      "Whether to highlight from sync points before the analysis is done",
+				      FALSE,
+				      G_PARAM_READWRITE |
+				      G_PARAM_EXPLICIT_NOTIFY |
+				      G_PARAM_STATIC_STRINGS);
+
+	/**
+	 * CtkSourceBuffer:highlight-cache:
+	 *
+	 * Whether the syntax highlighting state of the text loaded from a
+	 * file is kept in a cache on disk. See
+	 * ctk_source_buffer_set_highlight_cache().
+	 *
+	 * Since: 4.14
+	 */
+	buffer_properties[PROP_HIGHLIGHT_CACHE] =
+		g_param_spec_boolean ("highlight-cache",
+				      "Highlight Cache",
+				      "Whether to cache the highlighting state of loaded files",
+				      FALSE,
+				      G_PARAM_READWRITE |
+				      G_PARAM_EXPLICIT_NOTIFY |
+				      G_PARAM_STATIC_STRINGS);
+
+	/**
+	 * CtkSourceBuffer:highlight-in-thread:
+	 *
+	 * Whether big texts are analyzed in a thread.
+	 * See ctk_source_buffer_set_highlight_in_thread().
+	 *
+	 * Since: 4.14
+	 */
+	buffer_properties[PROP_HIGHLIGHT_IN_THREAD] =
+		g_param_spec_boolean ("highlight-in-thread",
+				      "Highlight In Thread",
+				      "Whether to analyze big texts in a thread",
+				      FALSE,
+				      G_PARAM_READWRITE |
+				      G_PARAM_EXPLICIT_NOTIFY |
+				      G_PARAM_STATIC_STRINGS);
+
+	/**
+	 * CtkSourceBuffer:highlight-on-draw:
+	 *
+	 * Whether the syntax highlighting tags are only kept on the text
+	 * being drawn, the context classes being looked up in the syntax
+	 * tree instead. See ctk_source_buffer_set_highlight_on_draw().
+	 *
+	 * Since: 4.14
+	 */
+	buffer_properties[PROP_HIGHLIGHT_ON_DRAW] =
+		g_param_spec_boolean ("highlight-on-draw",
+				      "Highlight On Draw",
+				      "Whether to only tag the text being drawn",
+				      FALSE,
+				      G_PARAM_READWRITE |
+				      G_PARAM_EXPLICIT_NOTIFY |
+				      G_PARAM_STATIC_STRINGS);
+
+	/**
+	 * CtkSourceBuffer:highlight-mirror:
+	 *
+	 * The buffer with the same text whose syntax analysis is used for
+	 * the highlighting. See ctk_source_buffer_set_highlight_mirror().
+	 *
+	 * Since: 4.14
+	 */
+	buffer_properties[PROP_HIGHLIGHT_MIRROR] =
+		g_param_spec_object ("highlight-mirror",
+				     "Highlight Mirror",
+				     "Buffer with the same text whose syntax analysis is used",
+				     CTK_SOURCE_TYPE_BUFFER,
+				     G_PARAM_READWRITE |
+				     G_PARAM_EXPLICIT_NOTIFY |
+				     G_PARAM_STATIC_STRINGS);
+
 	g_object_class_install_properties (object_class, N_PROPERTIES, buffer_properties);
 
 	/**
@@ -680,11 +819,24 @@ ctk_source_buffer_dispose (GObject *object)
 		set_undo_manager (buffer, NULL);
 	}
 
+	set_highlight_mirror (buffer, NULL);
+
+	while (buffer->priv->highlight_mirrored_by != NULL)
+	{
+		CtkSourceBuffer *mirrored_by = buffer->priv->highlight_mirrored_by->data;
+
+		set_highlight_mirror (mirrored_by, NULL);
+		update_highlight_engine (mirrored_by);
+		g_object_notify_by_pspec (G_OBJECT (mirrored_by), buffer_properties[PROP_HIGHLIGHT_MIRROR]);
+	}
+
 	if (buffer->priv->highlight_engine != NULL)
 	{
 		_ctk_source_engine_attach_buffer (buffer->priv->highlight_engine, NULL);
 	}
 
+	_ctk_source_buffer_set_frame_clock (buffer, NULL);
+
 	g_clear_object (&buffer->priv->highlight_engine);
 	g_clear_object (&buffer->priv->language);
 	g_clear_object (&buffer->priv->style_scheme);
@@ -754,6 +906,30 @@ ctk_source_buffer_set_property (GObject      *object,
 			ctk_source_buffer_set_implicit_trailing_newline (buffer, g_value_get_boolean (value));
 			break;
 
+		case PROP_HIGHLIGHT_SCHEDULE:
+			ctk_source_buffer_set_highlight_schedule (buffer, g_value_get_enum (value));
+			break;
+
+		case PROP_HIGHLIGHT_SYNC_POINTS:
+			ctk_source_buffer_set_highlight_sync_points (buffer, g_value_get_boolean (value));
+			break;
+
+		case PROP_HIGHLIGHT_CACHE:
+			ctk_source_buffer_set_highlight_cache (buffer, g_value_get_boolean (value));
+			break;
+
+		case PROP_HIGHLIGHT_IN_THREAD:
+			ctk_source_buffer_set_highlight_in_thread (buffer, g_value_get_boolean (value));
+			break;
+
+		case PROP_HIGHLIGHT_ON_DRAW:
+			ctk_source_buffer_set_highlight_on_draw (buffer, g_value_get_boolean (value));
+			break;
+
+		case PROP_HIGHLIGHT_MIRROR:
+			ctk_source_buffer_set_highlight_mirror (buffer, g_value_get_object (value));
+			break;
+
 		default:
 			G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
 			break;
@@ -810,6 +986,30 @@ ctk_source_buffer_get_property (GObject    *object,
 			g_value_set_boolean (value, buffer->priv->implicit_trailing_newline);
 			break;
 
+		case PROP_HIGHLIGHT_SCHEDULE:
+			g_value_set_enum (value, buffer->priv->highlight_schedule);
+			break;
+
+		case PROP_HIGHLIGHT_SYNC_POINTS:
+			g_value_set_boolean (value, buffer->priv->highlight_sync_points);
+			break;
+
+		case PROP_HIGHLIGHT_CACHE:
+			g_value_set_boolean (value, buffer->priv->highlight_cache);
+			break;
+
+		case PROP_HIGHLIGHT_IN_THREAD:
+			g_value_set_boolean (value, buffer->priv->highlight_in_thread);
+			break;
+
+		case PROP_HIGHLIGHT_ON_DRAW:
+			g_value_set_boolean (value, buffer->priv->highlight_on_draw);
+			break;
+
+		case PROP_HIGHLIGHT_MIRROR:
+			g_value_set_object (value, buffer->priv->highlight_mirror);
+			break;
+
 		default:
 			G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
 			break;
@@ -1216,6 +1416,8 @@ ctk_source_buffer_content_inserted (CtkTextBuffer *buffer,
 
 	cursor_moved (source_buffer);
 
+	source_buffer->priv->loaded_from_file = FALSE;
+
 	if (source_buffer->priv->highlight_engine != NULL)
 	{
 		_ctk_source_engine_text_inserted (source_buffer->priv->highlight_engine,
@@ -1326,6 +1528,8 @@ ctk_source_buffer_real_delete_range (CtkTextBuffer *buffer,
 
 	cursor_moved (source_buffer);
 
+	source_buffer->priv->loaded_from_file = FALSE;
+
 	/* emit text deleted for engines */
 	if (source_buffer->priv->highlight_engine != NULL)
 	{
@@ -1794,29 +1998,377 @@ ctk_source_buffer_set_highlight_syntax (CtkSourceBuffer *buffer,
 }
 
 /**
- * ctk_source_buffer_set_language:
+ * ctk_source_buffer_get_highlight_schedule:
  * @buffer: a #CtkSourceBuffer.
- * @language: (nullable): a #CtkSourceLanguage to set, or %NULL.
  *
- * Associates a #CtkSourceLanguage with the buffer.
+ * Returns: how background syntax highlighting is scheduled.
+ * Since: 4.14
+ */
+CtkSourceHighlightSchedule
+ctk_source_buffer_get_highlight_schedule (CtkSourceBuffer *buffer)
+{
+	g_return_val_if_fail (CTK_SOURCE_IS_BUFFER (buffer), CTK_SOURCE_HIGHLIGHT_SCHEDULE_FIXED);
+
+	return buffer->priv->highlight_schedule;
+}
+
+/**
+ * ctk_source_buffer_set_highlight_schedule:
+ * @buffer: a #CtkSourceBuffer.
+ * @schedule: a #CtkSourceHighlightSchedule.
  *
- * Note that a #CtkSourceLanguage affects not only the syntax highlighting, but
- * also the [context classes][context-classes]. If you want to disable just the
- * syntax highlighting, see ctk_source_buffer_set_highlight_syntax().
+ * Sets how the text which is not visible is highlighted in the background.
  *
- * The buffer holds a reference to @language.
+ * With %CTK_SOURCE_HIGHLIGHT_SCHEDULE_FIXED (the default value), the
+ * highlighting engine works in time slices of fixed length when the main
+ * loop is idle, whatever the views are doing.
+ *
+ * With %CTK_SOURCE_HIGHLIGHT_SCHEDULE_FRAME_CLOCK, each time slice is sized
+ * from the frame timings of the #CtkSourceView which last drew the @buffer,
+ * so that it ends before the next frame is due while the view is animating
+ * or scrolling. When the view is not being redrawn, or if there is no view,
+ * the fixed time slices are used.
+ *
+ * Since: 4.14
  */
 void
-ctk_source_buffer_set_language (CtkSourceBuffer   *buffer,
-				CtkSourceLanguage *language)
+ctk_source_buffer_set_highlight_schedule (CtkSourceBuffer            *buffer,
+					  CtkSourceHighlightSchedule  schedule)
 {
 	g_return_if_fail (CTK_SOURCE_IS_BUFFER (buffer));
-	g_return_if_fail (CTK_SOURCE_IS_LANGUAGE (language) || language == NULL);
 
-	if (!g_set_object (&buffer->priv->language, language))
+	if (buffer->priv->highlight_schedule != schedule)
 	{
-		return;
+		buffer->priv->highlight_schedule = schedule;
+		g_object_notify_by_pspec (G_OBJECT (buffer), buffer_properties[PROP_HIGHLIGHT_SCHEDULE]);
+	}
+}
+
+/**
+ * ctk_source_buffer_get_highlight_sync_points:
+ * @buffer: a #CtkSourceBuffer.
+ *
+ * Returns: whether text far from the analyzed part of the @buffer is
+ * highlighted from sync points.
+ * Since: 4.14
+ */
+gboolean
+ctk_source_buffer_get_highlight_sync_points (CtkSourceBuffer *buffer)
+{
+	g_return_val_if_fail (CTK_SOURCE_IS_BUFFER (buffer), FALSE);
+
+	return buffer->priv->highlight_sync_points;
+}
+
+/**
+ * ctk_source_buffer_set_highlight_sync_points:
+ * @buffer: a #CtkSourceBuffer.
+ * @sync_points: whether to highlight from sync points.
+ *
+ * Syntax analysis always starts at the beginning of the @buffer, so in a
+ * huge file the text shown after jumping near the end stays unhighlighted
+ * until everything above it has been analyzed.
+ *
+ * If @sync_points is %TRUE, such text is highlighted right away by
+ * analyzing it from a nearby line where the language is known to be back
+ * in its initial state: a line matching the "sync-point-pattern" metadata
+ * of the language, or otherwise a fixed number of lines above the visible
+ * text. That highlighting is a guess, which is replaced by the result of
+ * the normal analysis when it reaches that text.
+ *
+ * Since: 4.14
+ */
+void
+ctk_source_buffer_set_highlight_sync_points (CtkSourceBuffer *buffer,
+					     gboolean         sync_points)
+{
+	g_return_if_fail (CTK_SOURCE_IS_BUFFER (buffer));
+
+	sync_points = sync_points != FALSE;
+
+	if (buffer->priv->highlight_sync_points != sync_points)
+	{
+		buffer->priv->highlight_sync_points = sync_points;
+		g_object_notify_by_pspec (G_OBJECT (buffer), buffer_properties[PROP_HIGHLIGHT_SYNC_POINTS]);
+	}
+}
+
+/**
+ * ctk_source_buffer_get_highlight_cache:
+ * @buffer: a #CtkSourceBuffer.
+ *
+ * Returns: whether the highlighting state of the text loaded from a file
+ * is cached on disk.
+ * Since: 4.14
+ */
+gboolean
+ctk_source_buffer_get_highlight_cache (CtkSourceBuffer *buffer)
+{
+	g_return_val_if_fail (CTK_SOURCE_IS_BUFFER (buffer), FALSE);
+
+	return buffer->priv->highlight_cache;
+}
+
+/**
+ * ctk_source_buffer_set_highlight_cache:
+ * @buffer: a #CtkSourceBuffer.
+ * @highlight_cache: whether to cache the highlighting state.
+ *
+ * If @highlight_cache is %TRUE, the result of the syntax analysis of text
+ * loaded with a #CtkSourceFileLoader is stored in the user cache directory
+ * once the whole @buffer has been analyzed. When the same text is loaded
+ * again with the same language, the analysis is read back from the cache
+ * instead of being done again, so that big files are highlighted right
+ * away.
+ *
+ * The cache is looked up and written in a thread, while @buffer is
+ * analyzed as usual. It is only used for the text as it was loaded: once
+ * the @buffer is modified, the lookup is abandoned. Small files which are
+ * analyzed at once are not cached.
+ *
+ * This must be set before the file is loaded.
+ *
+ * Since: 4.14
+ */
+void
+ctk_source_buffer_set_highlight_cache (CtkSourceBuffer *buffer,
+				       gboolean         highlight_cache)
+{
+	g_return_if_fail (CTK_SOURCE_IS_BUFFER (buffer));
+
+	highlight_cache = highlight_cache != FALSE;
+
+	if (buffer->priv->highlight_cache != highlight_cache)
+	{
+		buffer->priv->highlight_cache = highlight_cache;
+		g_object_notify_by_pspec (G_OBJECT (buffer), buffer_properties[PROP_HIGHLIGHT_CACHE]);
+	}
+}
+
+/**
+ * ctk_source_buffer_get_highlight_in_thread:
+ * @buffer: a #CtkSourceBuffer.
+ *
+ * Returns: whether big texts loaded from a file are analyzed in a thread.
+ * Since: 4.14
+ */
+gboolean
+ctk_source_buffer_get_highlight_in_thread (CtkSourceBuffer *buffer)
+{
+	g_return_val_if_fail (CTK_SOURCE_IS_BUFFER (buffer), FALSE);
+
+	return buffer->priv->highlight_in_thread;
+}
+
+/**
+ * ctk_source_buffer_set_highlight_in_thread:
+ * @buffer: a #CtkSourceBuffer.
+ * @in_thread: whether to analyze big texts in a thread.
+ *
+ * If @in_thread is %TRUE, a big text loaded with a #CtkSourceFileLoader,
+ * set with ctk_text_buffer_set_text() or inserted in one go is analyzed
+ * in a thread, from a copy of the text, instead of a bit at a time in
+ * idle callbacks of the main loop; so is the whole text when the language
+ * changes. The text which is drawn is still highlighted right away on the
+ * main thread; the rest of @buffer is highlighted at once when the thread
+ * is done.
+ *
+ * The analysis in a thread is abandoned as soon as @buffer is modified,
+ * and the text is then analyzed as usual. Once @buffer is left unchanged
+ * for a while, the analysis starts again in a thread if much of the text
+ * is left to analyze.
+ *
+ * This must be set before the text is loaded or set.
+ *
+ * Since: 4.14
+ */
+void
+ctk_source_buffer_set_highlight_in_thread (CtkSourceBuffer *buffer,
+					   gboolean         in_thread)
+{
+	g_return_if_fail (CTK_SOURCE_IS_BUFFER (buffer));
+
+	in_thread = in_thread != FALSE;
+
+	if (buffer->priv->highlight_in_thread != in_thread)
+	{
+		buffer->priv->highlight_in_thread = in_thread;
+		g_object_notify_by_pspec (G_OBJECT (buffer), buffer_properties[PROP_HIGHLIGHT_IN_THREAD]);
+	}
+}
+
+/**
+ * ctk_source_buffer_get_highlight_on_draw:
+ * @buffer: a #CtkSourceBuffer.
+ *
+ * Returns: whether the syntax highlighting tags are only kept on the text
+ * being drawn.
+ * Since: 4.14
+ */
+gboolean
+ctk_source_buffer_get_highlight_on_draw (CtkSourceBuffer *buffer)
+{
+	g_return_val_if_fail (CTK_SOURCE_IS_BUFFER (buffer), FALSE);
+
+	return buffer->priv->highlight_on_draw;
+}
+
+/**
+ * ctk_source_buffer_set_highlight_on_draw:
+ * @buffer: a #CtkSourceBuffer.
+ * @highlight_on_draw: whether to only tag the text being drawn.
+ *
+ * By default, once the text of @buffer is analyzed, the syntax
+ * highlighting and context class tags are applied to all of it, which
+ * costs a lot of memory and time for big files.
+ *
+ * If @highlight_on_draw is %TRUE, the syntax highlighting tags are only
+ * applied to the text when a #CtkSourceView draws it, and removed again
+ * from the text which is not drawn anymore once too much text has them.
+ * The context class tags are not applied at all: the context class
+ * functions, like ctk_source_buffer_iter_has_context_class(), look the
+ * classes up in the result of the syntax analysis instead. So in this
+ * mode the context classes can only be found with these functions, not
+ * with the "ctksourceview:context-classes:" tags.
+ *
+ * Since: 4.14
+ */
+void
+ctk_source_buffer_set_highlight_on_draw (CtkSourceBuffer *buffer,
+					 gboolean         highlight_on_draw)
+{
+	g_return_if_fail (CTK_SOURCE_IS_BUFFER (buffer));
+
+	highlight_on_draw = highlight_on_draw != FALSE;
+
+	if (buffer->priv->highlight_on_draw != highlight_on_draw)
+	{
+		buffer->priv->highlight_on_draw = highlight_on_draw;
+		g_object_notify_by_pspec (G_OBJECT (buffer), buffer_properties[PROP_HIGHLIGHT_ON_DRAW]);
+	}
+}
+
+/* Returns whether the mirror changed. The engine is not updated. */
+static gboolean
+set_highlight_mirror (CtkSourceBuffer *buffer,
+		      CtkSourceBuffer *mirror)
+{
+	CtkSourceBuffer *old_mirror = buffer->priv->highlight_mirror;
+
+	if (old_mirror == mirror)
+	{
+		return FALSE;
+	}
+
+	if (old_mirror != NULL)
+	{
+		old_mirror->priv->highlight_mirrored_by =
+			g_slist_remove (old_mirror->priv->highlight_mirrored_by, buffer);
+	}
+
+	buffer->priv->highlight_mirror = mirror;
+
+	if (mirror != NULL)
+	{
+		/* update_highlight_engine() on @mirror updates @buffer too,
+		 * since the engine of @buffer uses the tree of the engine
+		 * of @mirror, or of the buffer @mirror mirrors. */
+		mirror->priv->highlight_mirrored_by =
+			g_slist_prepend (mirror->priv->highlight_mirrored_by, buffer);
+	}
+
+	return TRUE;
+}
+
+/* Whether the analysis of @buffer comes from @other, directly or through
+ * other mirrors. */
+static gboolean
+is_highlight_mirror_of (CtkSourceBuffer *buffer,
+			CtkSourceBuffer *other)
+{
+	CtkSourceBuffer *mirror;
+
+	for (mirror = buffer->priv->highlight_mirror;
+	     mirror != NULL;
+	     mirror = mirror->priv->highlight_mirror)
+	{
+		if (mirror == other)
+		{
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+/**
+ * ctk_source_buffer_get_highlight_mirror:
+ * @buffer: a #CtkSourceBuffer.
+ *
+ * Returns: (transfer none) (nullable): the buffer whose syntax analysis
+ * is used for @buffer, or %NULL.
+ * Since: 4.14
+ */
+CtkSourceBuffer *
+ctk_source_buffer_get_highlight_mirror (CtkSourceBuffer *buffer)
+{
+	g_return_val_if_fail (CTK_SOURCE_IS_BUFFER (buffer), NULL);
+
+	return buffer->priv->highlight_mirror;
+}
+
+/**
+ * ctk_source_buffer_set_highlight_mirror:
+ * @buffer: a #CtkSourceBuffer.
+ * @mirror: (nullable): a #CtkSourceBuffer with the same text, or %NULL.
+ *
+ * Shares the syntax analysis of @mirror with @buffer, for example when
+ * the same document is shown in two buffers side by side. @buffer does
+ * not analyze its text anymore: it takes the syntax highlighting and
+ * context class tags from what @mirror found, which saves the time and
+ * the memory of a second analysis.
+ *
+ * The application must make sure that both buffers always have the
+ * same text, applying every change to both of them. @mirror must also
+ * share the #CtkTextTagTable of @buffer, see ctk_source_buffer_new(),
+ * and the tags get the style scheme of @mirror.
+ *
+ * The analysis is only shared while both buffers have the same
+ * language, otherwise @buffer is highlighted on its own. @mirror may
+ * be a mirror itself, in which case @buffer shares the analysis of the
+ * first buffer of the chain which is not a mirror with the same
+ * language, but @mirror must not mirror @buffer. @buffer does not keep
+ * a reference to @mirror: it is highlighted on its own once @mirror is
+ * disposed.
+ *
+ * Since: 4.14
+ */
+void
+ctk_source_buffer_set_highlight_mirror (CtkSourceBuffer *buffer,
+					CtkSourceBuffer *mirror)
+{
+	g_return_if_fail (CTK_SOURCE_IS_BUFFER (buffer));
+	g_return_if_fail (mirror == NULL || CTK_SOURCE_IS_BUFFER (mirror));
+	g_return_if_fail (mirror != buffer);
+	g_return_if_fail (mirror == NULL || !is_highlight_mirror_of (mirror, buffer));
+	g_return_if_fail (mirror == NULL ||
+			  ctk_text_buffer_get_tag_table (CTK_TEXT_BUFFER (mirror)) ==
+			  ctk_text_buffer_get_tag_table (CTK_TEXT_BUFFER (buffer)));
+
+	if (set_highlight_mirror (buffer, mirror))
+	{
+		update_highlight_engine (buffer);
+		g_object_notify_by_pspec (G_OBJECT (buffer), buffer_properties[PROP_HIGHLIGHT_MIRROR]);
 	}
+}
+
+/* Creates the engine for the language of @buffer, which shares the
+ * analysis of the mirrored buffer if they have the same language.
+ */
+static void
+create_highlight_engine (CtkSourceBuffer *buffer)
+{
+	CtkSourceBuffer *mirror = buffer->priv->highlight_mirror;
 
 	if (buffer->priv->highlight_engine != NULL)
 	{
@@ -1826,23 +2378,90 @@ ctk_source_buffer_set_language (CtkSourceBuffer   *buffer,
 		buffer->priv->highlight_engine = NULL;
 	}
 
-	if (language != NULL)
+	if (buffer->priv->language == NULL)
+	{
+		return;
+	}
+
+	if (mirror != NULL &&
+	    mirror->priv->language == buffer->priv->language &&
+	    CTK_SOURCE_IS_CONTEXT_ENGINE (mirror->priv->highlight_engine))
+	{
+		CtkSourceContextEngine *source = CTK_SOURCE_CONTEXT_ENGINE (mirror->priv->highlight_engine);
+
+		buffer->priv->highlight_engine = CTK_SOURCE_ENGINE (_ctk_source_context_engine_new_mirror (source));
+	}
+	else
 	{
 		/* get a new engine */
-		buffer->priv->highlight_engine = _ctk_source_language_create_engine (language);
+		buffer->priv->highlight_engine = _ctk_source_language_create_engine (buffer->priv->language);
+	}
 
-		if (buffer->priv->highlight_engine != NULL)
+	if (buffer->priv->highlight_engine != NULL)
+	{
+		_ctk_source_engine_attach_buffer (buffer->priv->highlight_engine,
+						  CTK_TEXT_BUFFER (buffer));
+
+		if (buffer->priv->style_scheme != NULL)
 		{
-			_ctk_source_engine_attach_buffer (buffer->priv->highlight_engine,
-							  CTK_TEXT_BUFFER (buffer));
+			_ctk_source_engine_set_style_scheme (buffer->priv->highlight_engine,
+							     buffer->priv->style_scheme);
+		}
 
-			if (buffer->priv->style_scheme != NULL)
-			{
-				_ctk_source_engine_set_style_scheme (buffer->priv->highlight_engine,
-								     buffer->priv->style_scheme);
-			}
+		if (buffer->priv->loaded_from_file &&
+		    (buffer->priv->highlight_cache || buffer->priv->highlight_in_thread))
+		{
+			_ctk_source_engine_text_loaded (buffer->priv->highlight_engine);
 		}
+
+		if (buffer->priv->highlight_freeze_count > 0)
+		{
+			_ctk_source_engine_freeze (buffer->priv->highlight_engine);
+		}
+	}
+}
+
+/* Replaces the engine of @buffer, then the engines of the buffers which
+ * share its analysis, since they use the tree of the old one. */
+static void
+update_highlight_engine (CtkSourceBuffer *buffer)
+{
+	GSList *l;
+
+	create_highlight_engine (buffer);
+
+	for (l = buffer->priv->highlight_mirrored_by; l != NULL; l = l->next)
+	{
+		update_highlight_engine (l->data);
 	}
+}
+
+/**
+ * ctk_source_buffer_set_language:
+ * @buffer: a #CtkSourceBuffer.
+ * @language: (nullable): a #CtkSourceLanguage to set, or %NULL.
+ *
+ * Associates a #CtkSourceLanguage with the buffer.
+ *
+ * Note that a #CtkSourceLanguage affects not only the syntax highlighting, but
+ * also the [context classes][context-classes]. If you want to disable just the
+ * syntax highlighting, see ctk_source_buffer_set_highlight_syntax().
+ *
+ * The buffer holds a reference to @language.
+ */
+void
+ctk_source_buffer_set_language (CtkSourceBuffer   *buffer,
+				CtkSourceLanguage *language)
+{
+	g_return_if_fail (CTK_SOURCE_IS_BUFFER (buffer));
+	g_return_if_fail (CTK_SOURCE_IS_LANGUAGE (language) || language == NULL);
+
+	if (!g_set_object (&buffer->priv->language, language))
+	{
+		return;
+	}
+
+	update_highlight_engine (buffer);
 
 	g_object_notify_by_pspec (G_OBJECT (buffer), buffer_properties[PROP_LANGUAGE]);
 }
@@ -1938,6 +2557,67 @@ ctk_source_buffer_ensure_highlight (CtkSourceBuffer   *buffer,
 	_ctk_source_buffer_update_search_highlight (buffer, start, end, TRUE);
 }
 
+/**
+ * ctk_source_buffer_freeze_highlight:
+ * @buffer: a #CtkSourceBuffer.
+ *
+ * Suspends the syntax analysis of @buffer until
+ * ctk_source_buffer_thaw_highlight() is called, typically around a batch
+ * of many edits such as a search and replace or a scripted refactoring.
+ *
+ * While the analysis is suspended, an edit only extends the area which
+ * needs to be analyzed again, and the highlighting is neither updated
+ * nor extended, not even by ctk_source_buffer_ensure_highlight(). When
+ * the analysis resumes, the whole area touched by the edits is analyzed
+ * at once, instead of once after each edit.
+ *
+ * Calls to this function can be nested; the analysis resumes after the
+ * last matching call to ctk_source_buffer_thaw_highlight().
+ *
+ * Since: 4.14
+ */
+void
+ctk_source_buffer_freeze_highlight (CtkSourceBuffer *buffer)
+{
+	g_return_if_fail (CTK_SOURCE_IS_BUFFER (buffer));
+
+	if (buffer->priv->highlight_freeze_count++ > 0)
+	{
+		return;
+	}
+
+	if (buffer->priv->highlight_engine != NULL)
+	{
+		_ctk_source_engine_freeze (buffer->priv->highlight_engine);
+	}
+}
+
+/**
+ * ctk_source_buffer_thaw_highlight:
+ * @buffer: a #CtkSourceBuffer.
+ *
+ * Resumes the syntax analysis suspended by
+ * ctk_source_buffer_freeze_highlight().
+ *
+ * Since: 4.14
+ */
+void
+ctk_source_buffer_thaw_highlight (CtkSourceBuffer *buffer)
+{
+	g_return_if_fail (CTK_SOURCE_IS_BUFFER (buffer));
+	g_return_if_fail (buffer->priv->highlight_freeze_count > 0);
+
+	if (--buffer->priv->highlight_freeze_count > 0)
+	{
+		return;
+	}
+
+	if (buffer->priv->highlight_engine != NULL)
+	{
+		_ctk_source_engine_thaw (buffer->priv->highlight_engine);
+	}
+}
+
 /**
  * ctk_source_buffer_set_style_scheme:
  * @buffer: a #CtkSourceBuffer.
@@ -2433,6 +3113,13 @@ ctk_source_buffer_iter_has_context_class (CtkSourceBuffer   *buffer,
 	g_return_val_if_fail (iter != NULL, FALSE);
 	g_return_val_if_fail (context_class != NULL, FALSE);
 
+	if (buffer->priv->highlight_on_draw && buffer->priv->highlight_engine != NULL)
+	{
+		return _ctk_source_engine_has_context_class (buffer->priv->highlight_engine,
+							     iter,
+							     context_class);
+	}
+
 	tag = get_context_class_tag (buffer, context_class);
 
 	if (tag != NULL)
@@ -2470,6 +3157,12 @@ ctk_source_buffer_get_context_classes_at_iter (CtkSourceBuffer   *buffer,
 	g_return_val_if_fail (CTK_SOURCE_IS_BUFFER (buffer), NULL);
 	g_return_val_if_fail (iter != NULL, NULL);
 
+	if (buffer->priv->highlight_on_draw && buffer->priv->highlight_engine != NULL)
+	{
+		return _ctk_source_engine_get_context_classes (buffer->priv->highlight_engine,
+							       iter);
+	}
+
 	tags = ctk_text_iter_get_tags (iter);
 	ret = g_ptr_array_new ();
 
@@ -2526,6 +3219,13 @@ ctk_source_buffer_iter_forward_to_context_class_toggle (CtkSourceBuffer *buffer,
 	g_return_val_if_fail (iter != NULL, FALSE);
 	g_return_val_if_fail (context_class != NULL, FALSE);
 
+	if (buffer->priv->highlight_on_draw && buffer->priv->highlight_engine != NULL)
+	{
+		return _ctk_source_engine_forward_to_context_class_toggle (buffer->priv->highlight_engine,
+									   iter,
+									   context_class);
+	}
+
 	tag = get_context_class_tag (buffer, context_class);
 
 	if (tag != NULL)
@@ -2565,6 +3265,13 @@ ctk_source_buffer_iter_backward_to_context_class_toggle (CtkSourceBuffer *buffer
 	g_return_val_if_fail (iter != NULL, FALSE);
 	g_return_val_if_fail (context_class != NULL, FALSE);
 
+	if (buffer->priv->highlight_on_draw && buffer->priv->highlight_engine != NULL)
+	{
+		return _ctk_source_engine_backward_to_context_class_toggle (buffer->priv->highlight_engine,
+									    iter,
+									    context_class);
+	}
+
 	tag = get_context_class_tag (buffer, context_class);
 
 	if (tag != NULL)
@@ -3411,3 +4118,79 @@ _ctk_source_buffer_has_spaces_tag (CtkSourceBuffer *buffer)
 
 	return buffer->priv->has_draw_spaces_tag;
 }
+
+/*
+ * _ctk_source_buffer_set_frame_clock:
+ * @buffer: a #CtkSourceBuffer.
+ * @frame_clock: (nullable): the frame clock of a view drawing @buffer.
+ *
+ * Called by the views when they draw @buffer, for
+ * %CTK_SOURCE_HIGHLIGHT_SCHEDULE_FRAME_CLOCK.
+ */
+void
+_ctk_source_buffer_set_frame_clock (CtkSourceBuffer *buffer,
+				    CdkFrameClock   *frame_clock)
+{
+	g_return_if_fail (CTK_SOURCE_IS_BUFFER (buffer));
+	g_return_if_fail (frame_clock == NULL || CDK_IS_FRAME_CLOCK (frame_clock));
+
+	if (buffer->priv->frame_clock == frame_clock)
+	{
+		return;
+	}
+
+	if (buffer->priv->frame_clock != NULL)
+	{
+		g_object_remove_weak_pointer (G_OBJECT (buffer->priv->frame_clock),
+					      (gpointer *) &buffer->priv->frame_clock);
+	}
+
+	buffer->priv->frame_clock = frame_clock;
+
+	if (frame_clock != NULL)
+	{
+		g_object_add_weak_pointer (G_OBJECT (frame_clock),
+					   (gpointer *) &buffer->priv->frame_clock);
+	}
+}
+
+CdkFrameClock *
+_ctk_source_buffer_get_frame_clock (CtkSourceBuffer *buffer)
+{
+	g_return_val_if_fail (CTK_SOURCE_IS_BUFFER (buffer), NULL);
+
+	return buffer->priv->frame_clock;
+}
+
+/*
+ * _ctk_source_buffer_text_loaded:
+ * @buffer: a #CtkSourceBuffer.
+ *
+ * Called by CtkSourceFileLoader when the text has been loaded, for
+ * #CtkSourceBuffer:highlight-cache and #CtkSourceBuffer:highlight-in-thread.
+ */
+void
+_ctk_source_buffer_text_loaded (CtkSourceBuffer *buffer)
+{
+	g_return_if_fail (CTK_SOURCE_IS_BUFFER (buffer));
+
+	if (!buffer->priv->highlight_cache && !buffer->priv->highlight_in_thread)
+	{
+		return;
+	}
+
+	buffer->priv->loaded_from_file = TRUE;
+
+	if (buffer->priv->highlight_engine != NULL)
+	{
+		_ctk_source_engine_text_loaded (buffer->priv->highlight_engine);
+	}
+}
+
+CtkSourceEngine *
+_ctk_source_buffer_get_highlight_engine (CtkSourceBuffer *buffer)
+{
+	g_return_val_if_fail (CTK_SOURCE_IS_BUFFER (buffer), NULL);
+
+	return buffer->priv->highlight_engine;
+}
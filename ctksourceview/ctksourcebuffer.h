@@ -94,6 +94,22 @@ typedef enum _CtkSourceSortFlags
 	CTK_SOURCE_SORT_FLAGS_REMOVE_DUPLICATES = 1 << 2,
 } CtkSourceSortFlags;
 
+/**
+ * CtkSourceHighlightSchedule:
+ * @CTK_SOURCE_HIGHLIGHT_SCHEDULE_FIXED: the text which is not visible is
+ *  highlighted in the background in time slices of fixed length.
+ * @CTK_SOURCE_HIGHLIGHT_SCHEDULE_FRAME_CLOCK: the background time slices
+ *  are sized from the frame timings of the #CtkSourceView displaying the
+ *  buffer, so that they end before the next frame is due.
+ *
+ * Since: 4.14
+ */
+typedef enum _CtkSourceHighlightSchedule
+{
+	CTK_SOURCE_HIGHLIGHT_SCHEDULE_FIXED,
+	CTK_SOURCE_HIGHLIGHT_SCHEDULE_FRAME_CLOCK
+} CtkSourceHighlightSchedule;
+
 struct _CtkSourceBuffer
 {
 	CtkTextBuffer parent_instance;
@@ -140,6 +156,49 @@ CTK_SOURCE_AVAILABLE_IN_ALL
 void			 ctk_source_buffer_set_highlight_matching_brackets	(CtkSourceBuffer        *buffer,
 										 gboolean                highlight);
 
+CTK_SOURCE_AVAILABLE_IN_4_14
+CtkSourceHighlightSchedule
+			 ctk_source_buffer_get_highlight_schedule		(CtkSourceBuffer        *buffer);
+
+CTK_SOURCE_AVAILABLE_IN_4_14
+void			 ctk_source_buffer_set_highlight_schedule		(CtkSourceBuffer        *buffer,
+										 CtkSourceHighlightSchedule schedule);
+
+CTK_SOURCE_AVAILABLE_IN_4_14
+gboolean		 ctk_source_buffer_get_highlight_sync_points		(CtkSourceBuffer        *buffer);
+
+CTK_SOURCE_AVAILABLE_IN_4_14
+void			 ctk_source_buffer_set_highlight_sync_points		(CtkSourceBuffer        *buffer,
+										 gboolean                sync_points);
+
+CTK_SOURCE_AVAILABLE_IN_4_14
+gboolean		 ctk_source_buffer_get_highlight_cache			(CtkSourceBuffer        *buffer);
+
+CTK_SOURCE_AVAILABLE_IN_4_14
+void			 ctk_source_buffer_set_highlight_cache			(CtkSourceBuffer        *buffer,
+										 gboolean                highlight_cache);
+
+CTK_SOURCE_AVAILABLE_IN_4_14
+gboolean		 ctk_source_buffer_get_highlight_in_thread		(CtkSourceBuffer        *buffer);
+
+CTK_SOURCE_AVAILABLE_IN_4_14
+void			 ctk_source_buffer_set_highlight_in_thread		(CtkSourceBuffer        *buffer,
+										 gboolean                in_thread);
+
+CTK_SOURCE_AVAILABLE_IN_4_14
+gboolean		 ctk_source_buffer_get_highlight_on_draw		(CtkSourceBuffer        *buffer);
+
+CTK_SOURCE_AVAILABLE_IN_4_14
+void			 ctk_source_buffer_set_highlight_on_draw		(CtkSourceBuffer        *buffer,
+										 gboolean                highlight_on_draw);
+
+CTK_SOURCE_AVAILABLE_IN_4_14
+CtkSourceBuffer		*ctk_source_buffer_get_highlight_mirror			(CtkSourceBuffer        *buffer);
+
+CTK_SOURCE_AVAILABLE_IN_4_14
+void			 ctk_source_buffer_set_highlight_mirror			(CtkSourceBuffer        *buffer,
+										 CtkSourceBuffer        *mirror);
+
 CTK_SOURCE_AVAILABLE_IN_ALL
 gint			 ctk_source_buffer_get_max_undo_levels			(CtkSourceBuffer        *buffer);
 
@@ -172,6 +231,12 @@ void			 ctk_source_buffer_ensure_highlight			(CtkSourceBuffer        *buffer,
 										 const CtkTextIter      *start,
 										 const CtkTextIter      *end);
 
+CTK_SOURCE_AVAILABLE_IN_4_14
+void			 ctk_source_buffer_freeze_highlight			(CtkSourceBuffer        *buffer);
+
+CTK_SOURCE_AVAILABLE_IN_4_14
+void			 ctk_source_buffer_thaw_highlight			(CtkSourceBuffer        *buffer);
+
 CTK_SOURCE_AVAILABLE_IN_ALL
 void			 ctk_source_buffer_undo					(CtkSourceBuffer        *buffer);
 
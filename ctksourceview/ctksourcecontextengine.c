@@ -25,16 +25,20 @@
 
 #include "ctksourcecontextengine.h"
 #include <string.h>
+#include <errno.h>
 #include <glib.h>
 #include <glib/gi18n-lib.h>
+#include <glib/gstdio.h>
 #include "ctksourceregion.h"
 #include "ctksourcelanguage.h"
 #include "ctksourcelanguage-private.h"
 #include "ctksourcebuffer.h"
+#include "ctksourcebuffer-private.h"
 #include "ctksourceregex.h"
 #include "ctksourcestyle.h"
 #include "ctksourcestylescheme.h"
 #include "ctksourceutils-private.h"
+#include "ctksourceversion.h"
 
 #undef ENABLE_DEBUG
 #undef ENABLE_PROFILE
@@ -81,11 +85,85 @@
  */
 #define INCREMENTAL_UPDATE_TIME_SLICE	30
 
+/* With CTK_SOURCE_HIGHLIGHT_SCHEDULE_FRAME_CLOCK, shortest background time
+ * slice and time (both in milliseconds) left for drawing before the next
+ * frame, see get_incremental_time_slice().
+ */
+#define FRAME_CLOCK_MIN_TIME_SLICE	2
+#define FRAME_CLOCK_MARGIN		3
+
 /* Maximal amount of time (in milliseconds) allowed to spend highlihting a
- * single line. If it is not enough, then highlighting is disabled.
+ * single line. If it is not enough, then highlighting is disabled. Lines
+ * longer than LONG_LINE_LENGTH are only limited in the time spent looking
+ * for the next context in them.
  */
 #define MAX_TIME_FOR_ONE_LINE		2000
 
+/* Length (in bytes) from which a line analyzed by the idle worker may be
+ * left half done when its time slice is over, see analyze_line(). */
+#define LONG_LINE_LENGTH		10000
+
+/* Maximal number of end regexes resolved from start matches which are kept
+ * around in each context definition, see resolved_end_lookup().
+ */
+#define RESOLVED_END_CACHE_SIZE		64
+
+/* Number of nodes allocated at once by a NodePool. */
+#define NODE_POOL_CHUNK_SIZE		256
+
+/* Maximal number of characters fetched from the buffer at once by
+ * update_syntax(), rounded up to the end of a line, see get_line_info(). */
+#define LINE_CHUNK_SIZE			16384
+
+/* Number of characters from which a text is analyzed in a thread with
+ * CtkSourceBuffer:highlight-in-thread, see start_background_analysis().
+ * Smaller texts take less time to analyze on the main thread than to
+ * copy. It's also the size of an insertion which starts the thread right
+ * away, and of the part of the text left to analyze from which it's
+ * worth restarting it after edits, see schedule_background_analysis().
+ */
+#define BACKGROUND_ANALYSIS_MIN_CHARS	65536
+
+/* Time in milliseconds the text must stay unchanged after an edit before
+ * the analysis in a thread is restarted, see schedule_background_analysis().
+ */
+#define BACKGROUND_ANALYSIS_DELAY	500
+
+/* Number of siblings walked while looking for a segment by offset after
+ * which the index of the children of the parent is used instead, see
+ * segment_find_child_().
+ */
+#define SEGMENT_INDEX_MIN_WALK		32
+
+/* With CtkSourceBuffer:highlight-sync-points, minimal number of lines
+ * between the analyzed part of the buffer and the visible text for which
+ * the visible text is highlighted from a sync point, and maximal number of
+ * lines above the visible text searched for a sync point, see
+ * highlight_from_sync_point().
+ */
+#define SYNC_POINT_DISTANCE		1000
+#define SYNC_POINT_LINES		100
+
+/* With CtkSourceBuffer:highlight-on-draw, approximate number of characters
+ * which may keep their tags before the tags outside the text being drawn
+ * are removed, see track_tagged_region().
+ */
+#define HIGHLIGHT_ON_DRAW_MAX_CHARS	100000
+
+/* Version and layout of the files written by save_highlight_cache(), and
+ * maximal number and total size in bytes of such files kept in the cache
+ * directory, see prune_highlight_cache().
+ */
+#define HIGHLIGHT_CACHE_VERSION		2
+#define HIGHLIGHT_CACHE_SEGMENT_FORMAT	"(uuiiiiba(uii))"
+#define HIGHLIGHT_CACHE_FORMAT		"(ussia" HIGHLIGHT_CACHE_SEGMENT_FORMAT ")"
+#define HIGHLIGHT_CACHE_MAX_FILES	64
+#define HIGHLIGHT_CACHE_MAX_SIZE	(256 << 20)
+
+/* Number of bytes of text checksummed between two checks of whether
+ * the lookup in the highlight cache was cancelled. */
+#define HIGHLIGHT_CACHE_CHECKSUM_CHUNK	(1 << 20)
+
 #define CTK_SOURCE_CONTEXT_ENGINE_ERROR (ctk_source_context_engine_error_quark ())
 
 #define HAS_OPTION(def,opt) (((def)->flags & CTK_SOURCE_CONTEXT_##opt) != 0)
@@ -123,15 +201,24 @@
 
 typedef struct _SubPatternDefinition SubPatternDefinition;
 typedef struct _SubPattern SubPattern;
+typedef struct _NodePool NodePool;
 typedef struct _Segment Segment;
+typedef struct _SegmentIndex SegmentIndex;
 typedef struct _Context Context;
 typedef struct _ContextPtr ContextPtr;
 typedef struct _ContextDefinition ContextDefinition;
 typedef struct _DefinitionChild DefinitionChild;
 typedef struct _DefinitionsIter DefinitionsIter;
 typedef struct _LineInfo LineInfo;
+typedef struct _LineChunk LineChunk;
+typedef struct _TagRun TagRun;
 typedef struct _InvalidRegion InvalidRegion;
 typedef struct _ContextClassTag ContextClassTag;
+typedef struct _ResolvedEnd ResolvedEnd;
+typedef struct _ResolvedEndCache ResolvedEndCache;
+typedef struct _DefinitionProfile DefinitionProfile;
+typedef struct _HighlightProfile HighlightProfile;
+typedef struct _HighlightCacheKey HighlightCacheKey;
 
 typedef enum _CtkSourceContextEngineError {
 	CTK_SOURCE_CONTEXT_ENGINE_ERROR_DUPLICATED_ID = 0,
@@ -185,6 +272,15 @@ struct _ContextDefinition
 	/* Union of every regular expression we can find from this context. */
 	CtkSourceRegex *reg_all;
 
+	/* End regexes resolved from start matches, for containers whose end
+	 * refers to the start (\%{...@start}). Created on demand.
+	 */
+	ResolvedEndCache *resolved_ends;
+
+	/* Counters kept when the CTKSOURCEVIEW_HIGHLIGHT_PROFILE environment
+	 * variable is set, see highlight_profile_dump(). */
+	DefinitionProfile *profile;
+
 	guint flags : 8;
 	guint ref_count : 24;
 };
@@ -286,6 +382,65 @@ struct _Context
 	guint ignore_children_style : 1;
 };
 
+struct _ResolvedEnd
+{
+	/* What the end regex was resolved from, key in the cache, see
+	 * _ctk_source_regex_resolve_key(). */
+	gchar *resolve_key;
+
+	/* End regex resolved from the start match. */
+	CtkSourceRegex *end;
+
+	/* reg_all built with @end, or %NULL if it was not needed yet. */
+	CtkSourceRegex *reg_all;
+
+	/* Link in the LRU queue, data points to this structure. */
+	GList link;
+};
+
+struct _ResolvedEndCache
+{
+	/* gchar* -> ResolvedEnd* */
+	GHashTable *entries;
+
+	/* ResolvedEnd's, most recently used first. */
+	GQueue lru;
+
+	guint hits;
+	guint misses;
+};
+
+/* Protects the regexes which context_new() keeps in the definitions and
+ * their ResolvedEndCache, when the text is analyzed in a thread, see
+ * start_background_analysis(). */
+static GMutex definition_cache_mutex;
+
+struct _DefinitionProfile
+{
+	/* Regexes of the definition run on the text, and how many of
+	 * them matched. The union of the regexes of the children of a
+	 * container counts for the container. */
+	guint64 n_regex_calls;
+	guint64 n_matches;
+
+	/* Time spent in these regexes, in microseconds. */
+	gint64 regex_time;
+
+	/* Segments created for contexts of the definition. */
+	guint64 n_segments;
+};
+
+/* Time spent in the stages of highlighting around the regexes, in
+ * microseconds, for a language. update_syntax() includes the tree
+ * updates, the regexes and the context class tags. */
+struct _HighlightProfile
+{
+	gint64 analysis_time;
+	gint64 tree_time;
+	gint64 class_tags_time;
+	gint64 tags_time;
+};
+
 struct _ContextPtr
 {
 	ContextDefinition *definition;
@@ -321,15 +476,31 @@ struct _Segment
 	/* Subpatterns found in this segment. */
 	SubPattern *sub_patterns;
 
-	/* The context is used in the interval [start_at; end_at). */
-	gint start_at;
-	gint end_at;
+	/* Index of the children of this segment, and link of this segment
+	 * into the index of its parent, see SegmentIndex. NULL for the
+	 * segments which have neither, i.e. most of them.
+	 */
+	SegmentIndex *index;
+
+	/* The context is used in the interval [start; start + length) of
+	 * the buffer, see segment_start().
+	 */
+	gint rel_start;
+	gint length;
+
+	/* Start of the segment in the buffer, valid if abs_stamp is the
+	 * tree_stamp of the engine.
+	 */
+	gint abs_start;
+	guint abs_stamp;
 
 	/* In case of container contexts, start_len/end_len is length in chars
-	 * of start/end match.
+	 * of start/end match. end_len shares its word with is_start to keep
+	 * the structure small; both are unsigned, since bit-fields of
+	 * different types are not packed together by MSVC.
 	 */
 	gint start_len;
-	gint end_len;
+	guint end_len : 31;
 
 	/* Whether this segment is a whole good segment, or it's an end of
 	 * a bigger one left after erase_segments() call.
@@ -337,6 +508,35 @@ struct _Segment
 	guint is_start : 1;
 };
 
+/* The children of a segment with more than SEGMENT_INDEX_MIN_WALK of
+ * them are also kept in a treap ordered like the children list, updated
+ * as children are added and removed, which finds children by offset,
+ * see segment_find_child_(). The nodes of the treap are allocated apart
+ * from the segments, only for the segments which need them.
+ */
+struct _SegmentIndex
+{
+	Segment *segment;
+
+	/* Root of the treap of the children of @segment, NULL if they are
+	 * not indexed. */
+	SegmentIndex *root;
+
+	/* Link of @segment into the treap of its parent. */
+	SegmentIndex *up;
+	SegmentIndex *left;
+	SegmentIndex *right;
+
+	/* Shift of the siblings below this node, not yet added to their
+	 * rel_start, see segment_shift_following_(). */
+	gint shift;
+};
+
+#define SEGMENT_CHILDREN_INDEXED(s) ((s) != NULL && (s)->index != NULL && (s)->index->root != NULL)
+
+/* Offsets of a subpattern are relative to the start of the segment
+ * it belongs to, so that shifting the segment after an edit does not
+ * have to visit its subpatterns. */
 struct _SubPattern
 {
 	SubPatternDefinition *definition;
@@ -345,6 +545,9 @@ struct _SubPattern
 	SubPattern *next;
 };
 
+#define SUB_PATTERN_START(ce,segment,sp) (segment_start (ce, (segment)) + (sp)->start_at)
+#define SUB_PATTERN_END(ce,segment,sp) (segment_start (ce, (segment)) + (sp)->end_at)
+
 /* Line terminator characters (\n, \r, \r\n, or unicode paragraph separator)
  * are removed from the line text. The problem is that pcre does not understand
  * arbitrary line terminators, so $ in pcre means (?=\n) (not quite, it's also
@@ -379,6 +582,55 @@ struct _LineInfo
 	/* Length of the line text not including line terminator. */
 	gint char_length;
 	gint byte_length;
+
+	/* Identifies the text for _ctk_source_regex_match_line(). */
+	guint stamp;
+
+	/* Where the text comes from, see line_pos_to_offset(). */
+	LineChunk *chunk;
+};
+
+/* A line is pure ASCII if and only if its byte and character lengths are
+ * the same, then byte positions are character offsets. */
+#define LINE_IS_ASCII(line) ((line)->char_length == (line)->byte_length)
+
+/* Text of consecutive lines fetched from the buffer in one go; the
+ * text of a LineInfo points into it. */
+struct _LineChunk
+{
+	gchar *text;
+	const gchar *text_end;
+
+	/* Start of the next line in @text, and its offset in the buffer. */
+	const gchar *next;
+	gint next_offset;
+
+	/* End of @text in the buffer, always at a line start or at
+	 * the end of the buffer. */
+	CtkTextIter end;
+
+	/* Offset the caller expects to analyze up to, and number of
+	 * characters in @text, see get_line_info(). */
+	gint limit_offset;
+	gint n_chars;
+
+	/* Number of characters before every CHAR_INDEX_STEP-th byte of the
+	 * line whose stamp is @char_index_stamp, built when a position is
+	 * converted in a long non-ASCII line. */
+	GArray *char_index;
+	guint char_index_stamp;
+};
+
+/* Non-ASCII lines shorter than that are simply decoded. */
+#define CHAR_INDEX_MIN_LENGTH	256
+#define CHAR_INDEX_STEP		64
+
+/* Range of characters [start, end) where a tag is applied, see
+ * tag_runs_add(). */
+struct _TagRun
+{
+	gint start;
+	gint end;
 };
 
 struct _InvalidRegion
@@ -391,12 +643,6 @@ struct _InvalidRegion
 	gint delta;
 };
 
-struct _CtkSourceContextClass
-{
-	gchar *name;
-	gboolean enabled;
-};
-
 struct _ContextClassTag
 {
 	CtkTextTag *tag;
@@ -411,6 +657,40 @@ struct _CtkSourceContextData
 
 	/* Contains every ContextDefinition indexed by its id. */
 	GHashTable *definitions;
+
+	/* Path, modification time and size of the files the definitions
+	 * were parsed from, identifies them in the highlight cache. */
+	gchar *files_key;
+
+	/* See highlight_profile_enabled(). */
+	HighlightProfile profile;
+};
+
+/* Fixed size allocator for segments, subpatterns and index nodes. Nodes
+ * are carved from chunks of NODE_POOL_CHUNK_SIZE nodes and recycled
+ * through a free list, so erasing and re-analyzing a region does not go
+ * through the system allocator for every node. Chunks left empty are
+ * released by node_pool_trim() once the buffer is analyzed, and all of
+ * them when the pool is cleared.
+ */
+struct _NodePool
+{
+	gsize node_size;
+
+	/* Freed nodes, linked through their first word. */
+	gpointer free_nodes;
+
+	/* List of chunks, g_free()'d by node_pool_clear(). */
+	GSList *chunks;
+	guint n_chunks;
+
+	guint n_used;
+	guint n_peak;
+
+	/* Number of nodes handed out and of chunks allocated since the
+	 * pool was created. */
+	guint64 n_allocated;
+	guint n_chunks_allocated;
 };
 
 struct _CtkSourceContextEnginePrivate
@@ -446,27 +726,275 @@ struct _CtkSourceContextEnginePrivate
 	Segment *hint;
 	Segment *hint2;
 
+	/* Changed whenever segments are moved in the buffer by an edit,
+	 * so that their cached starts are resolved again, see
+	 * segment_start().
+	 */
+	guint tree_stamp;
+
 	/* list of Segment* */
 	GSList *invalid;
 	InvalidRegion invalid_region;
 
+	/* Memory for the Segment, SubPattern and SegmentIndex structures. */
+	NodePool segment_pool;
+	NodePool sub_pattern_pool;
+	NodePool index_pool;
+
+	/* Text highlighted by highlight_from_sync_point(), and the root of
+	 * its temporary tree while it runs. */
+	CtkSourceRegion *sync_point_region;
+	Segment *sync_point_root;
+
+	/* Compiled "sync-point-pattern" metadata of the language. */
+	GRegex *sync_point_regex;
+	gboolean sync_point_regex_loaded;
+
+	/* Lookup of the buffer text in the highlight cache, while it runs
+	 * in a thread; and after a miss, the key of the text, to write
+	 * the tree to the cache once the whole buffer is analyzed. Both
+	 * are dropped by any edit. */
+	GCancellable *cache_cancellable;
+	HighlightCacheKey *cache_key;
+	guint n_cache_hits;
+	guint n_cache_misses;
+
+	/* Analysis of the text in a thread, while it runs, see
+	 * start_background_analysis(); dropped by any edit, which
+	 * schedules a new one with @analysis_timeout. */
+	GCancellable *analysis_cancellable;
+	guint analysis_timeout;
+	guint n_thread_analyses;
+
+	/* Where the analysis of a long line stopped: the state at
+	 * @long_line_pos bytes into the line starting at @long_line_start,
+	 * and the invalid segment marking the rest of the line. The line
+	 * is kept as it was analyzed, in @long_line_chunk which ends at
+	 * @long_line_chunk_end, so that its text is not fetched again and
+	 * its stamp and character index stay valid. */
+	Segment *long_line_state;
+	Segment *long_line_marker;
+	gint long_line_start;
+	gint long_line_pos;
+	LineInfo long_line;
+	LineChunk long_line_chunk;
+	gint long_line_chunk_end;
+	guint n_long_line_resumes;
+
+	/* With CtkSourceBuffer:highlight-on-draw, the tagged text and
+	 * roughly its size. Context class tags are not applied at all. */
+	gboolean highlight_on_draw;
+	CtkSourceRegion *tagged_region;
+	gint n_tagged_chars;
+
+	/* For a mirror, see _ctk_source_context_engine_new_mirror(), the
+	 * engine whose tree and tags are used; for that engine, its
+	 * mirrors (not referenced). */
+	CtkSourceContextEngine *mirror_source;
+	GSList *mirrors;
+
+	/* Nesting level of CtkSourceEngine::freeze. While frozen, edits
+	 * are only added to invalid_region and nothing is analyzed. */
+	gint freeze_count;
+
 	guint first_update;
 	guint incremental_update;
 };
 
 #ifdef ENABLE_CHECK_TREE
 static void check_tree (CtkSourceContextEngine *ce);
-static void check_segment_list (Segment *segment);
-static void check_segment_children (Segment *segment);
+static void check_segment_list (CtkSourceContextEngine *ce,
+				Segment                *segment);
+static void check_segment_children (CtkSourceContextEngine *ce,
+				    Segment                *segment);
 #define CHECK_TREE check_tree
 #define CHECK_SEGMENT_LIST check_segment_list
 #define CHECK_SEGMENT_CHILDREN check_segment_children
 #else
 #define CHECK_TREE(ce)
-#define CHECK_SEGMENT_LIST(s)
-#define CHECK_SEGMENT_CHILDREN(s)
+#define CHECK_SEGMENT_LIST(ce,s)
+#define CHECK_SEGMENT_CHILDREN(ce,s)
 #endif
 
+/* SEGMENT OFFSETS -------------------------------------------------------- */
+
+/* The start of a segment is stored relative to the start of its parent,
+ * so that moving a segment moves its children too, and the siblings
+ * following an edit are moved all at once through the index of their
+ * parent if it has one, see segment_shift_following_(). The start in
+ * the buffer is resolved from these and cached until the next edit.
+ */
+
+static gint
+segment_resolve_start_ (CtkSourceContextEngine *ce,
+			Segment                *segment);
+
+/**
+ * segment_start:
+ * @ce: the engine.
+ * @segment: the segment.
+ *
+ * Returns: the start of @segment in the buffer, in characters.
+ */
+static inline gint
+segment_start (CtkSourceContextEngine *ce,
+	       Segment                *segment)
+{
+	if (G_LIKELY (segment->abs_stamp == ce->priv->tree_stamp))
+		return segment->abs_start;
+
+	return segment_resolve_start_ (ce, segment);
+}
+
+/**
+ * segment_end:
+ * @ce: the engine.
+ * @segment: the segment.
+ *
+ * Returns: the end of @segment in the buffer, in characters.
+ */
+static inline gint
+segment_end (CtkSourceContextEngine *ce,
+	     Segment                *segment)
+{
+	return segment_start (ce, segment) + segment->length;
+}
+
+/**
+ * segment_resolve_start_:
+ * @ce: the engine.
+ * @segment: the segment.
+ *
+ * Computes the start of @segment from the start of its parent and the
+ * shifts pending above it in the index of the parent, in O(log n) once
+ * the parent is resolved, and caches it.
+ *
+ * Returns: the start of @segment in the buffer.
+ */
+static gint
+segment_resolve_start_ (CtkSourceContextEngine *ce,
+			Segment                *segment)
+{
+	gint start_at = segment->rel_start;
+
+	if (segment->parent != NULL)
+	{
+		start_at += segment_start (ce, segment->parent);
+
+		if (SEGMENT_CHILDREN_INDEXED (segment->parent))
+		{
+			SegmentIndex *node;
+
+			for (node = segment->index->up; node != NULL; node = node->up)
+				start_at += node->shift;
+		}
+	}
+
+	segment->abs_start = start_at;
+	segment->abs_stamp = ce->priv->tree_stamp;
+
+	return start_at;
+}
+
+/**
+ * segment_index_shift_subtree_:
+ * @node: a node of an index.
+ * @delta: the shift.
+ *
+ * Moves the segment of @node and the siblings below it in the index
+ * of their parent by @delta characters, in O(1).
+ */
+static inline void
+segment_index_shift_subtree_ (SegmentIndex *node,
+			      gint          delta)
+{
+	node->segment->rel_start += delta;
+	node->shift += delta;
+}
+
+/**
+ * segment_set_start:
+ * @ce: the engine.
+ * @segment: the segment.
+ * @start_at: new start offset, characters.
+ *
+ * Moves the start of @segment, keeping its end and its children
+ * where they are in the buffer.
+ */
+static void
+segment_set_start (CtkSourceContextEngine *ce,
+		   Segment                *segment,
+		   gint                    start_at)
+{
+	gint delta = start_at - segment_start (ce, segment);
+
+	segment->rel_start += delta;
+	segment->length -= delta;
+	segment->abs_start = start_at;
+
+	if (SEGMENT_CHILDREN_INDEXED (segment))
+	{
+		segment_index_shift_subtree_ (segment->index->root, -delta);
+	}
+	else
+	{
+		Segment *child;
+
+		for (child = segment->children; child != NULL; child = child->next)
+			child->rel_start -= delta;
+	}
+}
+
+/**
+ * segment_set_end:
+ * @ce: the engine.
+ * @segment: the segment.
+ * @end_at: new end offset, characters.
+ *
+ * Moves the end of @segment.
+ */
+static inline void
+segment_set_end (CtkSourceContextEngine *ce,
+		 Segment                *segment,
+		 gint                    end_at)
+{
+	segment->length = end_at - segment_start (ce, segment);
+}
+
+static void
+segment_forget_starts_ (Segment *segment)
+{
+	Segment *child;
+
+	segment->abs_stamp = 0;
+
+	for (child = segment->children; child != NULL; child = child->next)
+		segment_forget_starts_ (child);
+}
+
+/**
+ * segment_tree_moved:
+ * @ce: the engine.
+ *
+ * Drops the cached starts of all the segments, to be called when
+ * segments are moved by an edit.
+ */
+static void
+segment_tree_moved (CtkSourceContextEngine *ce)
+{
+	/* Stamp 0 is never valid, if it wraps around the segments which
+	 * were not resolved since then could look valid. */
+	if (G_UNLIKELY (++ce->priv->tree_stamp == 0))
+	{
+		ce->priv->tree_stamp = 1;
+
+		if (ce->priv->root_segment != NULL)
+			segment_forget_starts_ (ce->priv->root_segment);
+		if (ce->priv->sync_point_root != NULL)
+			segment_forget_starts_ (ce->priv->sync_point_root);
+	}
+}
+
 static GQuark		ctk_source_context_engine_error_quark (void) G_GNUC_CONST;
 
 static Segment	       *create_segment		(CtkSourceContextEngine *ce,
@@ -485,6 +1013,7 @@ static Segment	       *segment_new		(CtkSourceContextEngine *ce,
 static Context	       *context_new		(Context		*parent,
 						 ContextDefinition	*definition,
 						 const gchar		*line_text,
+						 const gchar		*resolve_key,
 						 const gchar		*style,
 						 gboolean                ignore_children_style);
 static void		context_unref		(Context		*context);
@@ -497,7 +1026,8 @@ static void		erase_segments		(CtkSourceContextEngine *ce,
 static void		segment_remove		(CtkSourceContextEngine *ce,
 						 Segment                *segment);
 
-static void		find_insertion_place	(Segment		*segment,
+static void		find_insertion_place	(CtkSourceContextEngine	*ce,
+						 Segment		*segment,
 						 gint			 offset,
 						 Segment	       **parent,
 						 Segment	       **prev,
@@ -508,7 +1038,8 @@ static void		segment_destroy		(CtkSourceContextEngine	*ce,
 static ContextDefinition *context_definition_ref(ContextDefinition	*definition);
 static void		context_definition_unref(ContextDefinition	*definition);
 
-static void		segment_extend		(Segment		*state,
+static void		segment_extend		(CtkSourceContextEngine	*ce,
+						 Segment		*state,
 						 gint			 end_at);
 static Context	       *ancestor_context_ends_here (Context		*state,
 						 LineInfo		*line,
@@ -521,8 +1052,37 @@ static void		definition_iter_destroy	(DefinitionsIter	*iter);
 static void		update_syntax		(CtkSourceContextEngine	*ce,
 						 const CtkTextIter	*end,
 						 gint			 time);
+static void		highlight_from_sync_point
+						(CtkSourceContextEngine	*ce,
+						 const CtkTextIter	*start,
+						 const CtkTextIter	*end);
+static void		save_highlight_cache	(CtkSourceContextEngine	*ce);
+static void		forget_highlight_cache	(CtkSourceContextEngine	*ce);
+static void		forget_background_analysis
+						(CtkSourceContextEngine	*ce);
+static void		schedule_background_analysis
+						(CtkSourceContextEngine	*ce,
+						 gboolean		 now);
+static void		ctk_source_context_engine_text_loaded
+						(CtkSourceEngine	*engine);
 static void		install_idle_worker	(CtkSourceContextEngine	*ce);
 static void		install_first_update	(CtkSourceContextEngine	*ce);
+static void		line_chunk_clear	(LineChunk		*chunk);
+static void		update_context_class_tags
+						(CtkSourceContextEngine	*ce,
+						 Segment		*root,
+						 const CtkTextIter	*start,
+						 const CtkTextIter	*end);
+static void		refresh_mirror_range	(CtkSourceContextEngine	*mirror,
+						 gint			 start_offset,
+						 gint			 end_offset);
+
+/* The engine whose syntax tree and tags are used for @ce. */
+static inline CtkSourceContextEngine *
+get_tree_engine (CtkSourceContextEngine *ce)
+{
+	return ce->priv->mirror_source != NULL ? ce->priv->mirror_source : ce;
+}
 
 static ContextDefinition *
 ctk_source_context_data_lookup (CtkSourceContextData *ctx_data,
@@ -546,64 +1106,242 @@ ctk_source_context_data_lookup_root (CtkSourceContextData *ctx_data)
 	return root_definition;
 }
 
-/* TAGS AND STUFF -------------------------------------------------------------- */
-
-CtkSourceContextClass *
-ctk_source_context_class_new (gchar const *name,
-                              gboolean     enabled)
+/**
+ * highlight_profile_enabled:
+ *
+ * Returns: whether the CTKSOURCEVIEW_HIGHLIGHT_PROFILE environment variable
+ * is set, in which case regexes and segments are counted for every context
+ * definition, the stages of highlighting are timed for every language, and
+ * a report is printed when a language is not used anymore, or by
+ * _ctk_source_context_engine_dump_profile().
+ */
+static gboolean
+highlight_profile_enabled (void)
 {
-	CtkSourceContextClass *def = g_slice_new (CtkSourceContextClass);
+	static gint enabled = -1;
 
-	def->name = g_strdup (name);
-	def->enabled = enabled;
+	if (G_UNLIKELY (enabled < 0))
+		enabled = g_getenv ("CTKSOURCEVIEW_HIGHLIGHT_PROFILE") != NULL;
 
-	return def;
+	return enabled;
 }
 
-static CtkSourceContextClass *
-ctk_source_context_class_copy (CtkSourceContextClass *cclass)
+/* Returns the time to pass to highlight_profile_stop(). */
+static inline gint64
+highlight_profile_start (void)
 {
-	return ctk_source_context_class_new (cclass->name, cclass->enabled);
+	if (G_LIKELY (!highlight_profile_enabled ()))
+		return 0;
+
+	return g_get_monotonic_time ();
 }
 
-void
-ctk_source_context_class_free (CtkSourceContextClass *cclass)
+static inline void
+highlight_profile_stop (gint64 *total,
+			gint64  start)
 {
-	g_free (cclass->name);
-	g_slice_free (CtkSourceContextClass, cclass);
+	if (G_UNLIKELY (start != 0))
+		*total += g_get_monotonic_time () - start;
 }
 
-static ContextClassTag *
-context_class_tag_new (CtkTextTag *tag,
-		       gboolean    enabled)
+static DefinitionProfile *
+highlight_profile_get (ContextDefinition *definition)
 {
-	ContextClassTag *attrtag = g_slice_new (ContextClassTag);
-
-	attrtag->tag = tag;
-	attrtag->enabled = enabled;
+	if (definition->profile == NULL)
+		definition->profile = g_new0 (DefinitionProfile, 1);
 
-	return attrtag;
+	return definition->profile;
 }
 
-static void
-context_class_tag_free (ContextClassTag *attrtag)
+/**
+ * definition_regex_match:
+ * @definition: the definition @regex belongs to.
+ * @regex: the regex.
+ * @line: the line.
+ * @byte_pos: where to start, bytes.
+ * @match_start: (out) (optional): where the match starts, bytes.
+ *
+ * Same as _ctk_source_regex_match_line(), but counts the call for
+ * @definition when profiling.
+ */
+static inline gboolean
+definition_regex_match (ContextDefinition *definition,
+			CtkSourceRegex    *regex,
+			LineInfo          *line,
+			gint               byte_pos,
+			gint              *match_start)
 {
-	g_slice_free (ContextClassTag, attrtag);
+	DefinitionProfile *profile;
+	gint64 start;
+	gboolean ret;
+
+	if (G_LIKELY (!highlight_profile_enabled ()))
+		return _ctk_source_regex_match_line (regex, line->text, line->byte_length,
+						     line->stamp, byte_pos, match_start, NULL);
+
+	profile = highlight_profile_get (definition);
+
+	start = g_get_monotonic_time ();
+	ret = _ctk_source_regex_match_line (regex, line->text, line->byte_length,
+					    line->stamp, byte_pos, match_start, NULL);
+	profile->regex_time += g_get_monotonic_time () - start;
+
+	profile->n_regex_calls++;
+	if (ret)
+		profile->n_matches++;
+
+	return ret;
 }
 
-struct BufAndIters {
-	CtkTextBuffer *buffer;
-	const CtkTextIter *start, *end;
-};
+static gint
+compare_definition_profiles (gconstpointer a,
+			     gconstpointer b)
+{
+	const ContextDefinition *def_a = *(ContextDefinition * const *) a;
+	const ContextDefinition *def_b = *(ContextDefinition * const *) b;
+
+	if (def_a->profile->regex_time != def_b->profile->regex_time)
+		return def_a->profile->regex_time < def_b->profile->regex_time ? 1 : -1;
 
+	return strcmp (def_a->id, def_b->id);
+}
+
+/**
+ * highlight_profile_dump:
+ * @ctx_data: a #CtkSourceContextData.
+ *
+ * Prints the time spent in the stages of highlighting for @ctx_data, and
+ * the counters of its definitions which were used, those whose regexes
+ * took the most time first. Then resets them.
+ */
 static void
-unhighlight_region_cb (G_GNUC_UNUSED gpointer  style,
-		       GSList                 *tags,
-		       gpointer                user_data)
+highlight_profile_dump (CtkSourceContextData *ctx_data)
 {
-	struct BufAndIters *data = user_data;
+	HighlightProfile *profile = &ctx_data->profile;
+	GHashTableIter iter;
+	ContextDefinition *definition;
+	GPtrArray *definitions;
+	GString *report;
+	gint64 regex_time = 0;
+	guint i;
 
-	while (tags != NULL)
+	definitions = g_ptr_array_new ();
+
+	g_hash_table_iter_init (&iter, ctx_data->definitions);
+	while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &definition))
+	{
+		if (definition->profile != NULL)
+		{
+			g_ptr_array_add (definitions, definition);
+			regex_time += definition->profile->regex_time;
+		}
+	}
+
+	if (definitions->len == 0 && profile->analysis_time == 0 && profile->tags_time == 0)
+	{
+		g_ptr_array_free (definitions, TRUE);
+		return;
+	}
+
+	g_ptr_array_sort (definitions, compare_definition_profiles);
+
+	report = g_string_new (NULL);
+	g_string_append_printf (report,
+				"Highlighting profile of language '%s':\n"
+				"  analysis: %.3f ms (regexes: %.3f ms, tree updates: %.3f ms, "
+				"context class tags: %.3f ms)\n"
+				"  syntax tags: %.3f ms\n"
+				"%12s %12s %12s %12s  %s\n",
+				ctx_data->lang != NULL ? ctk_source_language_get_id (ctx_data->lang) : "",
+				profile->analysis_time / 1000.0,
+				regex_time / 1000.0,
+				profile->tree_time / 1000.0,
+				profile->class_tags_time / 1000.0,
+				profile->tags_time / 1000.0,
+				"time (ms)", "regexes", "matches", "segments", "definition");
+
+	for (i = 0; i < definitions->len; i++)
+	{
+		definition = g_ptr_array_index (definitions, i);
+
+		g_string_append_printf (report,
+					"%12.3f %12" G_GUINT64_FORMAT " %12" G_GUINT64_FORMAT
+					" %12" G_GUINT64_FORMAT "  %s\n",
+					definition->profile->regex_time / 1000.0,
+					definition->profile->n_regex_calls,
+					definition->profile->n_matches,
+					definition->profile->n_segments,
+					definition->id);
+
+		g_clear_pointer (&definition->profile, g_free);
+	}
+
+	memset (profile, 0, sizeof (HighlightProfile));
+
+	g_printerr ("%s", report->str);
+
+	g_string_free (report, TRUE);
+	g_ptr_array_free (definitions, TRUE);
+}
+
+/* TAGS AND STUFF -------------------------------------------------------------- */
+
+CtkSourceContextClass *
+ctk_source_context_class_new (gchar const *name,
+                              gboolean     enabled)
+{
+	CtkSourceContextClass *def = g_slice_new (CtkSourceContextClass);
+
+	def->name = g_strdup (name);
+	def->enabled = enabled;
+
+	return def;
+}
+
+static CtkSourceContextClass *
+ctk_source_context_class_copy (CtkSourceContextClass *cclass)
+{
+	return ctk_source_context_class_new (cclass->name, cclass->enabled);
+}
+
+void
+ctk_source_context_class_free (CtkSourceContextClass *cclass)
+{
+	g_free (cclass->name);
+	g_slice_free (CtkSourceContextClass, cclass);
+}
+
+static ContextClassTag *
+context_class_tag_new (CtkTextTag *tag,
+		       gboolean    enabled)
+{
+	ContextClassTag *attrtag = g_slice_new (ContextClassTag);
+
+	attrtag->tag = tag;
+	attrtag->enabled = enabled;
+
+	return attrtag;
+}
+
+static void
+context_class_tag_free (ContextClassTag *attrtag)
+{
+	g_slice_free (ContextClassTag, attrtag);
+}
+
+struct BufAndIters {
+	CtkTextBuffer *buffer;
+	const CtkTextIter *start, *end;
+};
+
+static void
+unhighlight_region_cb (G_GNUC_UNUSED gpointer  style,
+		       GSList                 *tags,
+		       gpointer                user_data)
+{
+	struct BufAndIters *data = user_data;
+
+	while (tags != NULL)
 	{
 		ctk_text_buffer_remove_tag (data->buffer,
 					    tags->data,
@@ -618,16 +1356,291 @@ unhighlight_region (CtkSourceContextEngine *ce,
 		    const CtkTextIter      *start,
 		    const CtkTextIter      *end)
 {
+	CtkSourceContextEngine *tree_engine = get_tree_engine (ce);
 	struct BufAndIters data;
 
 	data.buffer = ce->priv->buffer;
 	data.start = start;
 	data.end = end;
 
-	if (ctk_text_iter_equal (start, end))
+	if (ctk_text_iter_equal (start, end) || tree_engine->priv->tags == NULL)
+		return;
+
+	g_hash_table_foreach (tree_engine->priv->tags, (GHFunc) unhighlight_region_cb, &data);
+}
+
+/*
+ * Tags are not removed from the text and applied again where they do not
+ * change, since every toggle added to or removed from the text B-tree has
+ * a cost. Instead, the ranges where each tag must be applied are collected
+ * from the tree into a hash table (tag -> sorted array of disjoint
+ * TagRun), and compared with the ranges the tag already covers in the
+ * buffer by update_tag().
+ */
+
+static GHashTable *
+tag_runs_new (void)
+{
+	return g_hash_table_new_full (NULL, NULL, NULL, (GDestroyNotify) g_array_unref);
+}
+
+/* Returns: index of the first run in @array ending at or after @offset. */
+static guint
+tag_runs_lower_bound (GArray *array,
+		      gint    offset)
+{
+	guint lo = 0;
+	guint hi = array->len;
+
+	while (lo < hi)
+	{
+		guint mid = (lo + hi) / 2;
+
+		if (g_array_index (array, TagRun, mid).end < offset)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+static void
+tag_runs_add (GHashTable *runs,
+	      CtkTextTag *tag,
+	      gint        start,
+	      gint        end)
+{
+	GArray *array;
+	TagRun run;
+	guint i, j;
+
+	if (start >= end)
+		return;
+
+	array = g_hash_table_lookup (runs, tag);
+
+	if (array == NULL)
+	{
+		array = g_array_new (FALSE, FALSE, sizeof (TagRun));
+		g_hash_table_insert (runs, tag, array);
+	}
+
+	/* Merge with the runs overlapping or touching [start, end). */
+	i = tag_runs_lower_bound (array, start);
+
+	for (j = i; j < array->len && g_array_index (array, TagRun, j).start <= end; j++)
+	{
+		start = MIN (start, g_array_index (array, TagRun, j).start);
+		end = MAX (end, g_array_index (array, TagRun, j).end);
+	}
+
+	run.start = start;
+	run.end = end;
+
+	if (i < j)
+	{
+		g_array_index (array, TagRun, i) = run;
+		g_array_remove_range (array, i + 1, j - i - 1);
+	}
+	else
+	{
+		g_array_insert_val (array, i, run);
+	}
+}
+
+static void
+tag_runs_remove (GHashTable *runs,
+		 CtkTextTag *tag,
+		 gint        start,
+		 gint        end)
+{
+	GArray *array;
+	guint i;
+
+	array = g_hash_table_lookup (runs, tag);
+
+	if (array == NULL || start >= end)
+		return;
+
+	i = tag_runs_lower_bound (array, start + 1);
+
+	while (i < array->len && g_array_index (array, TagRun, i).start < end)
+	{
+		TagRun *run = &g_array_index (array, TagRun, i);
+
+		if (run->start < start && run->end > end)
+		{
+			TagRun tail;
+
+			tail.start = end;
+			tail.end = run->end;
+			run->end = start;
+			g_array_insert_val (array, i + 1, tail);
+			break;
+		}
+		else if (run->start < start)
+		{
+			run->end = start;
+			i++;
+		}
+		else if (run->end > end)
+		{
+			run->start = end;
+			break;
+		}
+		else
+		{
+			g_array_remove_index (array, i);
+		}
+	}
+}
+
+/* Appends to @result the parts of the runs in @a which are not in @b. */
+static void
+tag_runs_subtract (GArray *a,
+		   GArray *b,
+		   GArray *result)
+{
+	guint i, j = 0;
+
+	for (i = 0; i < a->len; i++)
+	{
+		TagRun *run = &g_array_index (a, TagRun, i);
+		gint pos = run->start;
+		guint k;
+
+		while (j < b->len && g_array_index (b, TagRun, j).end <= pos)
+			j++;
+
+		for (k = j; pos < run->end; k++)
+		{
+			TagRun piece;
+
+			piece.start = pos;
+
+			if (k < b->len && g_array_index (b, TagRun, k).start < run->end)
+			{
+				piece.end = g_array_index (b, TagRun, k).start;
+				pos = MAX (pos, g_array_index (b, TagRun, k).end);
+			}
+			else
+			{
+				piece.end = run->end;
+				pos = run->end;
+			}
+
+			if (piece.start < piece.end)
+				g_array_append_val (result, piece);
+		}
+	}
+}
+
+/* Appends to @array the ranges covered by @tag between @start and @end. */
+static void
+get_buffer_tag_runs (CtkTextTag        *tag,
+		     const CtkTextIter *start,
+		     const CtkTextIter *end,
+		     GArray            *array)
+{
+	CtkTextIter iter = *start;
+	gint end_offset = ctk_text_iter_get_offset (end);
+
+	if (!ctk_text_iter_has_tag (&iter, tag) &&
+	    !ctk_text_iter_forward_to_tag_toggle (&iter, tag))
+	{
+		return;
+	}
+
+	while (ctk_text_iter_compare (&iter, end) < 0)
+	{
+		TagRun run;
+
+		run.start = ctk_text_iter_get_offset (&iter);
+		ctk_text_iter_forward_to_tag_toggle (&iter, tag);
+		run.end = MIN (ctk_text_iter_get_offset (&iter), end_offset);
+		g_array_append_val (array, run);
+
+		if (!ctk_text_iter_forward_to_tag_toggle (&iter, tag))
+			break;
+	}
+}
+
+/**
+ * update_tag:
+ * @tag: a tag.
+ * @runs: the runs collected for the tags.
+ * @start: the beginning of the updated area.
+ * @end: the end of the updated area.
+ *
+ * Makes @tag cover exactly its runs from @runs between @start and @end,
+ * touching only the ranges where it changes. The tags are updated in
+ * the buffer of @start, which is not the buffer of the engine for a
+ * mirror.
+ */
+static void
+update_tag (CtkTextTag        *tag,
+	    GHashTable        *runs,
+	    const CtkTextIter *start,
+	    const CtkTextIter *end)
+{
+	CtkTextBuffer *buffer = ctk_text_iter_get_buffer (start);
+	GArray *new_runs, *old_runs, *changes;
+	CtkTextIter run_start, run_end;
+	guint i;
+
+	new_runs = g_hash_table_lookup (runs, tag);
+
+	if (new_runs == NULL)
+	{
+		ctk_text_buffer_remove_tag (buffer, tag, start, end);
 		return;
+	}
+
+	old_runs = g_array_new (FALSE, FALSE, sizeof (TagRun));
+	changes = g_array_new (FALSE, FALSE, sizeof (TagRun));
+	get_buffer_tag_runs (tag, start, end, old_runs);
+
+	run_start = *start;
+	run_end = *start;
+
+	tag_runs_subtract (old_runs, new_runs, changes);
+
+	for (i = 0; i < changes->len; i++)
+	{
+		ctk_text_iter_set_offset (&run_start, g_array_index (changes, TagRun, i).start);
+		ctk_text_iter_set_offset (&run_end, g_array_index (changes, TagRun, i).end);
+		ctk_text_buffer_remove_tag (buffer, tag, &run_start, &run_end);
+	}
+
+	g_array_set_size (changes, 0);
+	tag_runs_subtract (new_runs, old_runs, changes);
+
+	for (i = 0; i < changes->len; i++)
+	{
+		ctk_text_iter_set_offset (&run_start, g_array_index (changes, TagRun, i).start);
+		ctk_text_iter_set_offset (&run_end, g_array_index (changes, TagRun, i).end);
+		ctk_text_buffer_apply_tag (buffer, tag, &run_start, &run_end);
+	}
+
+	g_array_unref (changes);
+	g_array_unref (old_runs);
+}
+
+struct UpdateTagsData {
+	GHashTable *runs;
+	const CtkTextIter *start, *end;
+};
+
+static void
+update_tags_cb (G_GNUC_UNUSED gpointer  style,
+		GSList                 *tags,
+		gpointer                user_data)
+{
+	struct UpdateTagsData *data = user_data;
 
-	g_hash_table_foreach (ce->priv->tags, (GHFunc) unhighlight_region_cb, &data);
+	for (; tags != NULL; tags = tags->next)
+		update_tag (tags->data, data->runs, data->start, data->end);
 }
 
 #define MAX_STYLE_DEPENDENCY_DEPTH	50
@@ -818,11 +1831,10 @@ static void
 apply_tags (CtkSourceContextEngine *ce,
 	    Segment                *segment,
 	    gint                    start_offset,
-	    gint                    end_offset)
+	    gint                    end_offset,
+	    GHashTable             *runs)
 {
 	CtkTextTag *tag;
-	CtkTextIter start_iter, end_iter;
-	CtkTextBuffer *buffer = ce->priv->buffer;
 	SubPattern *sp;
 	Segment *child;
 
@@ -831,11 +1843,11 @@ apply_tags (CtkSourceContextEngine *ce,
 	if (SEGMENT_IS_INVALID (segment))
 		return;
 
-	if (segment->start_at >= end_offset || segment->end_at <= start_offset)
+	if (segment_start (ce, segment) >= end_offset || segment_end (ce, segment) <= start_offset)
 		return;
 
-	start_offset = MAX (start_offset, segment->start_at);
-	end_offset = MIN (end_offset, segment->end_at);
+	start_offset = MAX (start_offset, segment_start (ce, segment));
+	end_offset = MIN (end_offset, segment_end (ce, segment));
 
 	tag = get_context_tag (ce, segment->context);
 
@@ -848,8 +1860,8 @@ apply_tags (CtkSourceContextEngine *ce,
 
 		if (HAS_OPTION (segment->context->definition, STYLE_INSIDE))
 		{
-			style_start_at = MAX (segment->start_at + segment->start_len, start_offset);
-			style_end_at = MIN (segment->end_at - segment->end_len, end_offset);
+			style_start_at = MAX (segment_start (ce, segment) + segment->start_len, start_offset);
+			style_end_at = MIN (segment_end (ce, segment) - segment->end_len, end_offset);
 		}
 
 		if (style_start_at > style_end_at)
@@ -858,46 +1870,73 @@ apply_tags (CtkSourceContextEngine *ce,
 		}
 		else
 		{
-			ctk_text_buffer_get_iter_at_offset (buffer, &start_iter, style_start_at);
-			end_iter = start_iter;
-			ctk_text_iter_forward_chars (&end_iter, style_end_at - style_start_at);
-			ctk_text_buffer_apply_tag (ce->priv->buffer, tag, &start_iter, &end_iter);
+			tag_runs_add (runs, tag, style_start_at, style_end_at);
 		}
 	}
 
 	for (sp = segment->sub_patterns; sp != NULL; sp = sp->next)
 	{
-		if (sp->start_at >= start_offset && sp->end_at <= end_offset)
+		gint sp_start = SUB_PATTERN_START (ce, segment, sp);
+		gint sp_end = SUB_PATTERN_END (ce, segment, sp);
+
+		if (sp_start >= start_offset && sp_end <= end_offset)
 		{
-			gint start = MAX (start_offset, sp->start_at);
-			gint end = MIN (end_offset, sp->end_at);
+			gint start = MAX (start_offset, sp_start);
+			gint end = MIN (end_offset, sp_end);
 
 			tag = get_subpattern_tag (ce, segment->context, sp->definition);
 
 			if (tag != NULL)
-			{
-				ctk_text_buffer_get_iter_at_offset (buffer, &start_iter, start);
-				end_iter = start_iter;
-				ctk_text_iter_forward_chars (&end_iter, end - start);
-				ctk_text_buffer_apply_tag (ce->priv->buffer, tag, &start_iter, &end_iter);
-			}
+				tag_runs_add (runs, tag, start, end);
 		}
 	}
 
 	for (child = segment->children;
-	     child != NULL && child->start_at < end_offset;
+	     child != NULL && segment_start (ce, child) < end_offset;
 	     child = child->next)
 	{
-		if (child->end_at > start_offset)
-			apply_tags (ce, child, start_offset, end_offset);
+		if (segment_end (ce, child) > start_offset)
+			apply_tags (ce, child, start_offset, end_offset, runs);
 	}
 }
 
+/**
+ * update_syntax_tags:
+ * @ce: a #CtkSourceContextEngine.
+ * @root: the root of the tree to take the tags from.
+ * @start: the beginning of the region.
+ * @end: the end of the region.
+ *
+ * Applies the syntax tags from the tree under @root between @start and
+ * @end, and removes the other ones.
+ */
+static void
+update_syntax_tags (CtkSourceContextEngine *ce,
+		    Segment                *root,
+		    const CtkTextIter      *start,
+		    const CtkTextIter      *end)
+{
+	struct UpdateTagsData data;
+
+	data.runs = tag_runs_new ();
+	data.start = start;
+	data.end = end;
+
+	apply_tags (ce, root,
+		    ctk_text_iter_get_offset (start),
+		    ctk_text_iter_get_offset (end),
+		    data.runs);
+
+	g_hash_table_foreach (ce->priv->tags, (GHFunc) update_tags_cb, &data);
+	g_hash_table_unref (data.runs);
+}
+
 static void
 highlight_region (CtkSourceContextEngine *ce,
 		  CtkTextIter            *start,
 		  CtkTextIter            *end)
 {
+	gint64 profile_start;
 #ifdef ENABLE_PROFILE
 	GTimer *timer;
 #endif
@@ -907,16 +1946,27 @@ highlight_region (CtkSourceContextEngine *ce,
 	if (ctk_text_iter_compare (start, end) >= 0)
 		return;
 
+	profile_start = highlight_profile_start ();
+
 #ifdef ENABLE_PROFILE
 	timer = g_timer_new ();
 #endif
 
-	/* First we need to delete tags in the regions. */
-	unhighlight_region (ce, start, end);
+	if (ce->priv->mirror_source != NULL)
+	{
+		CtkSourceContextEngine *source = ce->priv->mirror_source;
 
-	apply_tags (ce, ce->priv->root_segment,
-		    ctk_text_iter_get_offset (start),
-		    ctk_text_iter_get_offset (end));
+		/* The source applies the context classes to its own buffer
+		 * only, in refresh_range(). */
+		update_syntax_tags (source, source->priv->root_segment, start, end);
+		update_context_class_tags (source, source->priv->root_segment, start, end);
+	}
+	else
+	{
+		update_syntax_tags (ce, ce->priv->root_segment, start, end);
+	}
+
+	highlight_profile_stop (&ce->priv->ctx_data->profile.tags_time, profile_start);
 
 #ifdef ENABLE_PROFILE
 	g_print ("highlight (from %d to %d), %g ms elapsed\n",
@@ -928,47 +1978,112 @@ highlight_region (CtkSourceContextEngine *ce,
 }
 
 /**
- * ensure_highlighted:
+ * track_tagged_region:
  * @ce: a #CtkSourceContextEngine.
- * @start: the beginning of the region to highlight.
- * @end: the end of the region to highlight.
+ * @region: the text which was just tagged.
+ * @start: the beginning of the text being drawn.
+ * @end: the end of the text being drawn.
  *
- * Updates text tags in reanalyzed parts of given area.
- * It applies tags according to whatever is in the syntax
- * tree currently, so highlighting may not be correct
- * (ctk_source_context_engine_update_highlight is the method
- * that actually ensures correct highlighting).
+ * With CtkSourceBuffer:highlight-on-draw, adds @region to the tagged
+ * text. Once more than %HIGHLIGHT_ON_DRAW_MAX_CHARS characters were
+ * tagged, the tags are removed from everything but the text between
+ * @start and @end, which goes back to the refresh region so that it is
+ * tagged again if it is drawn again.
  */
 static void
-ensure_highlighted (CtkSourceContextEngine *ce,
-		    const CtkTextIter      *start,
-		    const CtkTextIter      *end)
+track_tagged_region (CtkSourceContextEngine *ce,
+		     CtkSourceRegion        *region,
+		     const CtkTextIter      *start,
+		     const CtkTextIter      *end)
 {
-	CtkSourceRegion *region;
+	CtkSourceRegion *dropped;
 	CtkSourceRegionIter reg_iter;
 
-	/* Get the subregions not yet highlighted. */
-	region = ctk_source_region_intersect_subregion (ce->priv->refresh_region, start, end);
-
-	if (region == NULL)
-		return;
-
 	ctk_source_region_get_start_region_iter (region, &reg_iter);
 
-	/* Highlight all subregions from the intersection.
-	 * hopefully this will only be one subregion. */
 	while (!ctk_source_region_iter_is_end (&reg_iter))
 	{
 		CtkTextIter s, e;
+
 		ctk_source_region_iter_get_subregion (&reg_iter, &s, &e);
-		highlight_region (ce, &s, &e);
+		ce->priv->n_tagged_chars += ctk_text_iter_get_offset (&e) -
+					    ctk_text_iter_get_offset (&s);
 		ctk_source_region_iter_next (&reg_iter);
 	}
 
-	g_clear_object (&region);
+	ctk_source_region_add_region (ce->priv->tagged_region, region);
+
+	if (ce->priv->n_tagged_chars <= HIGHLIGHT_ON_DRAW_MAX_CHARS)
+		return;
+
+	dropped = ce->priv->tagged_region;
+	ctk_source_region_subtract_subregion (dropped, start, end);
+
+	ce->priv->tagged_region = ctk_source_region_new (ce->priv->buffer);
+	ctk_source_region_add_subregion (ce->priv->tagged_region, start, end);
+	ce->priv->n_tagged_chars = ctk_text_iter_get_offset (end) -
+				   ctk_text_iter_get_offset (start);
+
+	ctk_source_region_get_start_region_iter (dropped, &reg_iter);
+
+	while (!ctk_source_region_iter_is_end (&reg_iter))
+	{
+		CtkTextIter s, e;
+
+		ctk_source_region_iter_get_subregion (&reg_iter, &s, &e);
+		unhighlight_region (ce, &s, &e);
+		ctk_source_region_add_subregion (ce->priv->refresh_region, &s, &e);
+		ctk_source_region_iter_next (&reg_iter);
+	}
+
+	g_object_unref (dropped);
+}
+
+/**
+ * ensure_highlighted:
+ * @ce: a #CtkSourceContextEngine.
+ * @start: the beginning of the region to highlight.
+ * @end: the end of the region to highlight.
+ *
+ * Updates text tags in reanalyzed parts of given area.
+ * It applies tags according to whatever is in the syntax
+ * tree currently, so highlighting may not be correct
+ * (ctk_source_context_engine_update_highlight is the method
+ * that actually ensures correct highlighting).
+ */
+static void
+ensure_highlighted (CtkSourceContextEngine *ce,
+		    const CtkTextIter      *start,
+		    const CtkTextIter      *end)
+{
+	CtkSourceRegion *region;
+	CtkSourceRegionIter reg_iter;
+
+	/* Get the subregions not yet highlighted. */
+	region = ctk_source_region_intersect_subregion (ce->priv->refresh_region, start, end);
+
+	if (region == NULL)
+		return;
+
+	ctk_source_region_get_start_region_iter (region, &reg_iter);
+
+	/* Highlight all subregions from the intersection.
+	 * hopefully this will only be one subregion. */
+	while (!ctk_source_region_iter_is_end (&reg_iter))
+	{
+		CtkTextIter s, e;
+		ctk_source_region_iter_get_subregion (&reg_iter, &s, &e);
+		highlight_region (ce, &s, &e);
+		ctk_source_region_iter_next (&reg_iter);
+	}
 
 	/* Remove the just highlighted region. */
 	ctk_source_region_subtract_subregion (ce->priv->refresh_region, start, end);
+
+	if (ce->priv->highlight_on_draw)
+		track_tagged_region (ce, region, start, end);
+
+	g_clear_object (&region);
 }
 
 static CtkTextTag *
@@ -1051,37 +2166,21 @@ get_context_classes (CtkSourceContextEngine *ce,
 }
 
 static void
-apply_context_classes (CtkSourceContextEngine *ce,
-		       GSList                 *context_classes,
-		       gint                    start,
-		       gint                    end)
+apply_context_classes (GSList     *context_classes,
+		       gint        start,
+		       gint        end,
+		       GHashTable *runs)
 {
-	CtkTextIter start_iter;
-	CtkTextIter end_iter;
 	GSList *item;
 
-	ctk_text_buffer_get_iter_at_offset (ce->priv->buffer, &start_iter, start);
-	end_iter = start_iter;
-	ctk_text_iter_forward_chars (&end_iter, end - start);
-
 	for (item = context_classes; item != NULL; item = g_slist_next (item))
 	{
 		ContextClassTag *attrtag = item->data;
 
 		if (attrtag->enabled)
-		{
-			ctk_text_buffer_apply_tag (ce->priv->buffer,
-			                           attrtag->tag,
-			                           &start_iter,
-			                           &end_iter);
-		}
+			tag_runs_add (runs, attrtag->tag, start, end);
 		else
-		{
-			ctk_text_buffer_remove_tag (ce->priv->buffer,
-			                            attrtag->tag,
-			                            &start_iter,
-			                            &end_iter);
-		}
+			tag_runs_remove (runs, attrtag->tag, start, end);
 	}
 }
 
@@ -1089,7 +2188,8 @@ static void
 add_region_context_classes (CtkSourceContextEngine *ce,
 			    Segment                *segment,
 			    gint                    start_offset,
-			    gint                    end_offset)
+			    gint                    end_offset,
+			    GHashTable             *runs)
 {
 	SubPattern *sp;
 	Segment *child;
@@ -1102,30 +2202,33 @@ add_region_context_classes (CtkSourceContextEngine *ce,
 		return;
 	}
 
-	if (segment->start_at >= end_offset || segment->end_at <= start_offset)
+	if (segment_start (ce, segment) >= end_offset || segment_end (ce, segment) <= start_offset)
 	{
 		return;
 	}
 
-	start_offset = MAX (start_offset, segment->start_at);
-	end_offset = MIN (end_offset, segment->end_at);
+	start_offset = MAX (start_offset, segment_start (ce, segment));
+	end_offset = MIN (end_offset, segment_end (ce, segment));
 
 	context_classes = get_context_classes (ce, segment->context);
 
 	if (context_classes != NULL)
 	{
-		apply_context_classes (ce,
-		                       context_classes,
+		apply_context_classes (context_classes,
 		                       start_offset,
-		                       end_offset);
+		                       end_offset,
+		                       runs);
 	}
 
 	for (sp = segment->sub_patterns; sp != NULL; sp = sp->next)
 	{
-		if (sp->start_at >= start_offset && sp->end_at <= end_offset)
+		gint sp_start = SUB_PATTERN_START (ce, segment, sp);
+		gint sp_end = SUB_PATTERN_END (ce, segment, sp);
+
+		if (sp_start >= start_offset && sp_end <= end_offset)
 		{
-			gint start = MAX (start_offset, sp->start_at);
-			gint end = MIN (end_offset, sp->end_at);
+			gint start = MAX (start_offset, sp_start);
+			gint end = MIN (end_offset, sp_end);
 
 			context_classes = get_subpattern_context_classes (ce,
 			                                                  segment->context,
@@ -1133,43 +2236,69 @@ add_region_context_classes (CtkSourceContextEngine *ce,
 
 			if (context_classes != NULL)
 			{
-				apply_context_classes (ce,
-				                       context_classes,
+				apply_context_classes (context_classes,
 				                       start,
-				                       end);
+				                       end,
+				                       runs);
 			}
 		}
 	}
 
 	for (child = segment->children;
-	     child != NULL && child->start_at < end_offset;
+	     child != NULL && segment_start (ce, child) < end_offset;
 	     child = child->next)
 	{
-		if (child->end_at > start_offset)
+		if (segment_end (ce, child) > start_offset)
 		{
-			add_region_context_classes (ce, child, start_offset, end_offset);
+			add_region_context_classes (ce, child, start_offset, end_offset, runs);
 		}
 	}
 }
 
+/**
+ * update_context_class_tags:
+ * @ce: a #CtkSourceContextEngine.
+ * @root: the root of the tree to take the context classes from.
+ * @start: the beginning of the region.
+ * @end: the end of the region.
+ *
+ * Applies the context class tags from the tree under @root between
+ * @start and @end, and removes the other ones.
+ */
 static void
-remove_region_context_classes (CtkSourceContextEngine *ce,
-			       const CtkTextIter      *start,
-			       const CtkTextIter      *end)
+update_context_class_tags (CtkSourceContextEngine *ce,
+			   Segment                *root,
+			   const CtkTextIter      *start,
+			   const CtkTextIter      *end)
 {
+	GHashTable *runs;
 	GSList *l;
+	gint64 profile_start;
 
 	if (ctk_text_iter_equal (start, end))
 	{
 		return;
 	}
 
+	profile_start = highlight_profile_start ();
+	runs = tag_runs_new ();
+
+	add_region_context_classes (ce,
+	                            root,
+	                            ctk_text_iter_get_offset (start),
+	                            ctk_text_iter_get_offset (end),
+	                            runs);
+
+	/* Collecting the runs may have created new tags, which are in
+	 * the list too. */
 	for (l = ce->priv->context_classes; l != NULL; l = l->next)
 	{
-		CtkTextTag *tag = l->data;
-
-		ctk_text_buffer_remove_tag (ce->priv->buffer, tag, start, end);
+		update_tag (l->data, runs, start, end);
 	}
+
+	g_hash_table_unref (runs);
+
+	highlight_profile_stop (&ce->priv->ctx_data->profile.class_tags_time, profile_start);
 }
 
 static void
@@ -1182,6 +2311,14 @@ refresh_context_classes (CtkSourceContextEngine *ce,
 #endif
 	CtkTextIter realend = *end;
 
+	/* The classes are looked up in the tree, see
+	 * ctk_source_context_engine_get_context_classes(). A mirror
+	 * applies them in highlight_region(). */
+	if (ce->priv->highlight_on_draw || ce->priv->mirror_source != NULL)
+	{
+		return;
+	}
+
 	if (ctk_text_iter_starts_line (&realend))
 	{
 		ctk_text_iter_backward_char (&realend);
@@ -1196,13 +2333,7 @@ refresh_context_classes (CtkSourceContextEngine *ce,
 	timer = g_timer_new ();
 #endif
 
-	/* First we need to delete tags in the regions. */
-	remove_region_context_classes (ce, start, &realend);
-
-	add_region_context_classes (ce,
-	                            ce->priv->root_segment,
-	                            ctk_text_iter_get_offset (start),
-	                            ctk_text_iter_get_offset (&realend));
+	update_context_class_tags (ce, ce->priv->root_segment, start, &realend);
 
 #ifdef ENABLE_PROFILE
 	g_print ("applied context classes (from %d to %d), %g ms elapsed\n",
@@ -1229,6 +2360,7 @@ refresh_range (CtkSourceContextEngine *ce,
 	       const CtkTextIter      *end)
 {
 	CtkTextIter real_end;
+	GSList *l;
 
 	if (ctk_text_iter_equal (start, end))
 		return;
@@ -1236,6 +2368,13 @@ refresh_range (CtkSourceContextEngine *ce,
 	/* Refresh the contex classes here */
 	refresh_context_classes (ce, start, end);
 
+	for (l = ce->priv->mirrors; l != NULL; l = l->next)
+	{
+		refresh_mirror_range (l->data,
+				      ctk_text_iter_get_offset (start),
+				      ctk_text_iter_get_offset (end));
+	}
+
 	/* Here we need to make sure we do not make it redraw next line */
 	real_end = *end;
 	if (ctk_text_iter_starts_line (&real_end))
@@ -1252,34 +2391,274 @@ refresh_range (CtkSourceContextEngine *ce,
 }
 
 
+/**
+ * refresh_mirror_range:
+ * @mirror: a mirror of the engine which updated the area.
+ * @start_offset: the beginning of updated area.
+ * @end_offset: the end of updated area.
+ *
+ * Marks the same area as not highlighted in @mirror, so that it takes
+ * the tags from the tree again when it is drawn.
+ */
+static void
+refresh_mirror_range (CtkSourceContextEngine *mirror,
+		      gint                    start_offset,
+		      gint                    end_offset)
+{
+	CtkTextIter start, end;
+
+	if (mirror->priv->buffer == NULL)
+		return;
+
+	ctk_text_buffer_get_iter_at_offset (mirror->priv->buffer, &start, start_offset);
+	ctk_text_buffer_get_iter_at_offset (mirror->priv->buffer, &end, end_offset);
+
+	ctk_source_region_add_subregion (mirror->priv->refresh_region, &start, &end);
+	refresh_range (mirror, &start, &end);
+}
+
+
 /* SEGMENT TREE ----------------------------------------------------------- */
 
+static void
+node_pool_init (NodePool *pool,
+		gsize     node_size)
+{
+	pool->node_size = (node_size + sizeof (gpointer) - 1) & ~(sizeof (gpointer) - 1);
+	pool->free_nodes = NULL;
+	pool->chunks = NULL;
+	pool->n_chunks = 0;
+	pool->n_used = 0;
+	pool->n_peak = 0;
+	pool->n_allocated = 0;
+	pool->n_chunks_allocated = 0;
+}
+
+static gpointer
+node_pool_alloc0 (NodePool *pool)
+{
+	gpointer node;
+
+	if (pool->free_nodes == NULL)
+	{
+		guint8 *chunk;
+		gint i;
+
+		chunk = g_malloc (pool->node_size * NODE_POOL_CHUNK_SIZE);
+		pool->chunks = g_slist_prepend (pool->chunks, chunk);
+		pool->n_chunks++;
+		pool->n_chunks_allocated++;
+
+		for (i = NODE_POOL_CHUNK_SIZE - 1; i >= 0; i--)
+		{
+			node = chunk + i * pool->node_size;
+			*(gpointer *) node = pool->free_nodes;
+			pool->free_nodes = node;
+		}
+	}
+
+	node = pool->free_nodes;
+	pool->free_nodes = *(gpointer *) node;
+	memset (node, 0, pool->node_size);
+
+	if (++pool->n_used > pool->n_peak)
+		pool->n_peak = pool->n_used;
+
+	pool->n_allocated++;
+
+	return node;
+}
+
+static void
+node_pool_free (NodePool *pool,
+		gpointer  node)
+{
+	g_assert (pool->n_used > 0);
+
+	pool->n_used--;
+
+#ifdef ENABLE_DEBUG
+	/* Never reuse nodes, to catch dangling pointers. */
+	memset (node, 1, pool->node_size);
+#else
+	*(gpointer *) node = pool->free_nodes;
+	pool->free_nodes = node;
+#endif
+}
+
+/**
+ * node_pool_clear:
+ * @pool: the pool.
+ *
+ * Releases memory of all nodes at once. Must be called only when
+ * no node from @pool is in use anymore, i.e. after the segment tree
+ * was destroyed.
+ */
+static void
+node_pool_clear (NodePool *pool)
+{
+	g_assert (pool->n_used == 0);
+
+	PROFILE (g_print ("node pool: %" G_GSIZE_FORMAT " bytes per node, "
+			  "%u nodes at peak, %u chunks\n",
+			  pool->node_size, pool->n_peak,
+			  pool->n_chunks));
+
+	g_slist_free_full (pool->chunks, g_free);
+	pool->chunks = NULL;
+	pool->n_chunks = 0;
+	pool->free_nodes = NULL;
+	pool->n_peak = 0;
+}
+
+static gint
+compare_pointers (gconstpointer a,
+		  gconstpointer b,
+		  gpointer      user_data)
+{
+	const guint8 *p1 = *(const guint8 * const *) a;
+	const guint8 *p2 = *(const guint8 * const *) b;
+
+	return p1 < p2 ? -1 : p1 > p2 ? 1 : 0;
+}
+
+/* Returns the index of the chunk @node was carved from in @chunks,
+ * sorted by address. */
+static guint
+node_pool_find_chunk (NodePool  *pool,
+		      guint8   **chunks,
+		      guint      n_chunks,
+		      gpointer   node)
+{
+	guint lo = 0;
+	guint hi = n_chunks;
+
+	while (hi - lo > 1)
+	{
+		guint mid = lo + (hi - lo) / 2;
+
+		if ((guint8 *) node < chunks[mid])
+			hi = mid;
+		else
+			lo = mid;
+	}
+
+	g_assert ((guint8 *) node >= chunks[lo] &&
+		  (guint8 *) node < chunks[lo] + pool->node_size * NODE_POOL_CHUNK_SIZE);
+
+	return lo;
+}
+
+/**
+ * node_pool_trim:
+ * @pool: the pool.
+ *
+ * Releases the chunks whose nodes are all free, when at least half of
+ * the nodes of @pool are, so that erasing a big part of the tree gives
+ * the memory back. Costs a walk of the free list, which is why it is
+ * not done on every node_pool_free().
+ */
+static void
+node_pool_trim (NodePool *pool)
+{
+#ifndef ENABLE_DEBUG
+	guint capacity = pool->n_chunks * NODE_POOL_CHUNK_SIZE;
+	guint8 **chunks;
+	guint *n_free;
+	gpointer node, next;
+	GSList *l;
+	guint n_chunks, i;
+
+	if (capacity - pool->n_used < MAX (capacity / 2, NODE_POOL_CHUNK_SIZE))
+		return;
+
+	if (pool->n_used == 0)
+	{
+		node_pool_clear (pool);
+		return;
+	}
+
+	chunks = g_new (guint8 *, pool->n_chunks);
+	n_free = g_new0 (guint, pool->n_chunks);
+
+	for (l = pool->chunks, i = 0; l != NULL; l = l->next, i++)
+		chunks[i] = l->data;
+
+	g_qsort_with_data (chunks, pool->n_chunks, sizeof (guint8 *), compare_pointers, NULL);
+
+	for (node = pool->free_nodes; node != NULL; node = *(gpointer *) node)
+		n_free[node_pool_find_chunk (pool, chunks, pool->n_chunks, node)]++;
+
+	/* Keep the free nodes of the chunks in use. */
+	node = pool->free_nodes;
+	pool->free_nodes = NULL;
+
+	for (; node != NULL; node = next)
+	{
+		next = *(gpointer *) node;
+
+		if (n_free[node_pool_find_chunk (pool, chunks, pool->n_chunks, node)] < NODE_POOL_CHUNK_SIZE)
+		{
+			*(gpointer *) node = pool->free_nodes;
+			pool->free_nodes = node;
+		}
+	}
+
+	g_slist_free (pool->chunks);
+	pool->chunks = NULL;
+	n_chunks = 0;
+
+	for (i = 0; i < pool->n_chunks; i++)
+	{
+		if (n_free[i] == NODE_POOL_CHUNK_SIZE)
+		{
+			g_free (chunks[i]);
+		}
+		else
+		{
+			pool->chunks = g_slist_prepend (pool->chunks, chunks[i]);
+			n_chunks++;
+		}
+	}
+
+	PROFILE (g_print ("node pool: released %u of %u chunks\n",
+			  pool->n_chunks - n_chunks, pool->n_chunks));
+
+	pool->n_chunks = n_chunks;
+
+	g_free (n_free);
+	g_free (chunks);
+#endif
+}
+
 /**
  * segment_cmp:
  * @s1: first segment.
  * @s2: second segment.
+ * @ce: the engine.
  *
  * Compares segments by their offset, used to sort list of invalid segments.
  *
  * Returns: an integer like strcmp() does.
  */
 static gint
-segment_cmp (Segment *s1,
-	     Segment *s2)
+segment_cmp (Segment                *s1,
+	     Segment                *s2,
+	     CtkSourceContextEngine *ce)
 {
-	if (s1->start_at < s2->start_at)
+	if (segment_start (ce, s1) < segment_start (ce, s2))
 		return -1;
-	else if (s1->start_at > s2->start_at)
+	else if (segment_start (ce, s1) > segment_start (ce, s2))
 		return 1;
 	/* one of them must be zero-length */
-	g_assert (s1->start_at == s1->end_at || s2->start_at == s2->end_at);
+	g_assert (segment_start (ce, s1) == segment_end (ce, s1) || segment_start (ce, s2) == segment_end (ce, s2));
 #ifdef ENABLE_DEBUG
 	/* A new zero-length segment should never be created if there is
 	 * already an invalid segment. */
 	g_assert_not_reached ();
 #endif
-	g_return_val_if_reached (s1->end_at < s2->end_at ? -1 :
-                                 (s1->end_at > s2->end_at ? 1 : 0));
+	g_return_val_if_reached (segment_end (ce, s1) < segment_end (ce, s2) ? -1 :
+                                 (segment_end (ce, s1) > segment_end (ce, s2) ? 1 : 0));
 }
 
 /**
@@ -1300,13 +2679,31 @@ add_invalid (CtkSourceContextEngine *ce,
 #endif
 	g_return_if_fail (SEGMENT_IS_INVALID (segment));
 
-	ce->priv->invalid = g_slist_insert_sorted (ce->priv->invalid,
-						   segment,
-						   (GCompareFunc) segment_cmp);
+	ce->priv->invalid = g_slist_insert_sorted_with_data (ce->priv->invalid,
+							     segment,
+							     (GCompareDataFunc) segment_cmp,
+							     ce);
 
 	DEBUG (g_print ("%d invalid\n", g_slist_length (ce->priv->invalid)));
 }
 
+/**
+ * forget_long_line:
+ * @ce: the engine.
+ *
+ * Drops the state saved when the analysis of a long line stopped in
+ * its middle, so that the line is analyzed again from its start. Its
+ * marker stays in the tree as an ordinary invalid segment. Must be
+ * called before the tree is changed other than by analyzing it.
+ */
+static void
+forget_long_line (CtkSourceContextEngine *ce)
+{
+	ce->priv->long_line_state = NULL;
+	ce->priv->long_line_marker = NULL;
+	line_chunk_clear (&ce->priv->long_line_chunk);
+}
+
 /**
  * remove_invalid:
  * @ce: the engine.
@@ -1327,701 +2724,732 @@ remove_invalid (CtkSourceContextEngine *ce,
 }
 
 /**
- * fix_offsets_insert_:
- * @segment: segment.
- * @start: start offset.
- * @delta: length of inserted text.
+ * segment_index_priority_:
+ * @node: a node of an index.
  *
- * Recursively updates offsets after inserting text. To be called
- * only from insert_range().
+ * Priority of @node in the treap of its siblings. A hash of the
+ * address of the node is as good as a random number to keep the
+ * treap balanced, and does not need to be stored.
+ *
+ * Returns: the priority.
  */
-static void
-fix_offsets_insert_ (Segment *segment,
-		     gint     start,
-		     gint     delta)
+static inline guint
+segment_index_priority_ (SegmentIndex *node)
 {
-	Segment *child;
-	SubPattern *sp;
+	guint64 h = GPOINTER_TO_SIZE (node);
 
-	g_assert (segment->start_at >= start);
+	h ^= h >> 33;
+	h *= G_GUINT64_CONSTANT (0xff51afd7ed558ccd);
+	h ^= h >> 33;
+	h *= G_GUINT64_CONSTANT (0xc4ceb9fe1a85ec53);
+	h ^= h >> 33;
 
-	if (delta == 0)
-		return;
-
-	segment->start_at += delta;
-	segment->end_at += delta;
-
-	for (child = segment->children; child != NULL; child = child->next)
-		fix_offsets_insert_ (child, start, delta);
+	return (guint) h;
+}
 
-	for (sp = segment->sub_patterns; sp != NULL; sp = sp->next)
+/**
+ * segment_index_push_shift_:
+ * @node: a node of an index.
+ *
+ * Moves the shift pending in @node to its children in the index.
+ */
+static inline void
+segment_index_push_shift_ (SegmentIndex *node)
+{
+	if (node->shift != 0)
 	{
-		sp->start_at += delta;
-		sp->end_at += delta;
+		if (node->left != NULL)
+			segment_index_shift_subtree_ (node->left, node->shift);
+		if (node->right != NULL)
+			segment_index_shift_subtree_ (node->right, node->shift);
+
+		node->shift = 0;
 	}
 }
 
 /**
- * find_insertion_place_forward_:
- * @segment: the (grand)parent segment the new one should be inserted into.
- * @offset: offset at which text is inserted.
- * @start: segment from which to start search (to avoid
- * walking whole tree).
- * @parent: initialized with the parent of new segment.
- * @prev: initialized with the previous sibling of new segment.
- * @next: initialized with the next sibling of new segment.
+ * segment_index_rotate_up_:
+ * @node: a node of an index.
  *
- * Auxiliary function used in find_insertion_place().
+ * Swaps @node with its parent in the treap of its siblings,
+ * keeping the order of the siblings and their offsets.
  */
 static void
-find_insertion_place_forward_ (Segment  *segment,
-			       gint      offset,
-			       Segment  *start,
-			       Segment **parent,
-			       Segment **prev,
-			       Segment **next)
+segment_index_rotate_up_ (SegmentIndex *node)
 {
-	Segment *child;
+	SegmentIndex *up = node->up;
+	SegmentIndex *top = up->up;
 
-	g_assert (start->end_at < offset);
+	/* The shifts of the nodes above stay where they are, these
+	 * two would apply to different subtrees after the rotation. */
+	segment_index_push_shift_ (up);
+	segment_index_push_shift_ (node);
 
-	for (child = start; child != NULL; child = child->next)
+	if (up->left == node)
 	{
-		if (child->start_at <= offset && child->end_at >= offset)
-		{
-			find_insertion_place (child, offset, parent, prev, next, NULL);
-			return;
-		}
-
-		if (child->end_at == offset)
-		{
-			if (SEGMENT_IS_INVALID (child))
-			{
-				*parent = child;
-				*prev = NULL;
-				*next = NULL;
-			}
-			else
-			{
-				*prev = child;
-				*next = child->next;
-				*parent = segment;
-			}
+		up->left = node->right;
+		if (up->left != NULL)
+			up->left->up = up;
+		node->right = up;
+	}
+	else
+	{
+		up->right = node->left;
+		if (up->right != NULL)
+			up->right->up = up;
+		node->left = up;
+	}
 
-			return;
-		}
+	up->up = node;
+	node->up = top;
 
-		if (child->end_at < offset)
-		{
-			*prev = child;
-			continue;
-		}
+	if (top == NULL)
+		node->segment->parent->index->root = node;
+	else if (top->left == up)
+		top->left = node;
+	else
+		top->right = node;
+}
 
-		if (child->start_at > offset)
-		{
-			*next = child;
-			break;
-		}
-
-		g_assert_not_reached ();
+/**
+ * segment_index_node_:
+ * @ce: the engine.
+ * @segment: the segment.
+ *
+ * Returns: the index node of @segment, allocated if it has none.
+ */
+static SegmentIndex *
+segment_index_node_ (CtkSourceContextEngine *ce,
+		     Segment                *segment)
+{
+	if (segment->index == NULL)
+	{
+		segment->index = node_pool_alloc0 (&ce->priv->index_pool);
+		segment->index->segment = segment;
 	}
 
-	*parent = segment;
+	return segment->index;
 }
 
 /**
- * find_insertion_place_backward_:
- * @segment: the (grand)parent segment the new one should be inserted into.
- * @offset: offset at which text is inserted.
- * @start: segment from which to start search (to avoid
- * walking whole tree).
- * @parent: initialized with the parent of new segment.
- * @prev: initialized with the previous sibling of new segment.
- * @next: initialized with the next sibling of new segment.
+ * segment_index_release_:
+ * @ce: the engine.
+ * @segment: the segment.
  *
- * Auxiliary function used in find_insertion_place().
+ * Frees the index node of @segment if its children are not indexed
+ * and it's not in the index of its parent.
  */
 static void
-find_insertion_place_backward_ (Segment  *segment,
-				gint      offset,
-				Segment  *start,
-				Segment **parent,
-				Segment **prev,
-				Segment **next)
+segment_index_release_ (CtkSourceContextEngine *ce,
+			Segment                *segment)
 {
-	Segment *child;
-
-	g_assert (start->end_at >= offset);
-
-	for (child = start; child != NULL; child = child->prev)
+	if (segment->index != NULL &&
+	    segment->index->root == NULL &&
+	    !SEGMENT_CHILDREN_INDEXED (segment->parent))
 	{
-		if (child->start_at <= offset && child->end_at >= offset)
-		{
-			find_insertion_place (child, offset, parent, prev, next, NULL);
-			return;
-		}
+		node_pool_free (&ce->priv->index_pool, segment->index);
+		segment->index = NULL;
+	}
+}
 
-		if (child->end_at == offset)
-		{
-			if (SEGMENT_IS_INVALID (child))
-			{
-				*parent = child;
-				*prev = NULL;
-				*next = NULL;
-			}
-			else
-			{
-				*prev = child;
-				*next = child->next;
-				*parent = segment;
-			}
+/**
+ * segment_index_link_:
+ * @ce: the engine.
+ * @segment: the segment.
+ *
+ * Adds @segment to the index of the children of its parent, which must
+ * have an index node. Must be called after @segment is linked into the
+ * children list, once its previous sibling is in the index, or its next
+ * sibling if it's the first child, with the rel_start of @segment
+ * relative to the start of its parent. In O(log n).
+ */
+static void
+segment_index_link_ (CtkSourceContextEngine *ce,
+		     Segment                *segment)
+{
+	SegmentIndex *parent = segment->parent->index;
+	SegmentIndex *node = segment_index_node_ (ce, segment);
+	SegmentIndex *up;
 
-			return;
-		}
+	node->left = NULL;
+	node->right = NULL;
+	node->shift = 0;
 
-		if (child->end_at < offset)
-		{
-			*prev = child;
-			*next = child->next;
-			break;
-		}
+	if (segment->prev != NULL && segment->prev->index->right == NULL)
+	{
+		up = segment->prev->index;
+		up->right = node;
+	}
+	else if (parent->root != NULL)
+	{
+		/* The next sibling is the leftmost node of the right subtree
+		 * of the previous one, or of the whole treap. */
+		g_assert (segment->next != NULL);
+		up = segment->next->index;
+		g_assert (up->left == NULL);
+		up->left = node;
+	}
+	else
+	{
+		up = NULL;
+		parent->root = node;
+	}
 
-		if (child->start_at > offset)
-		{
-			*next = child;
-			continue;
-		}
+	node->up = up;
 
-		g_assert_not_reached ();
-	}
+	/* The shifts pending above apply to @segment now. */
+	for (; up != NULL; up = up->up)
+		segment->rel_start -= up->shift;
 
-	*parent = segment;
+	while (node->up != NULL &&
+	       segment_index_priority_ (node) > segment_index_priority_ (node->up))
+	{
+		segment_index_rotate_up_ (node);
+	}
 }
 
 /**
- * find_insertion_place:
- * @segment: the (grand)parent segment the new one should be inserted into.
- * @offset: offset at which text is inserted.
- * @start: segment from which to start search (to avoid
- * walking whole tree).
- * @parent: initialized with the parent of new segment.
- * @prev: initialized with the previous sibling of new segment.
- * @hint: a segment somewhere near insertion place to optimize search.
+ * segment_index_build_:
+ * @ce: the engine.
+ * @parent: the segment.
  *
- * After text is inserted, a new invalid segment is created and inserted
- * into the tree. This function finds an appropriate position for the new
- * segment. To make it faster, it uses hint and calls
- * find_insertion_place_forward_ or find_insertion_place_backward_ depending
- * on position of offset relative to hint.
- * There is no return value, it always succeeds (or crashes).
+ * Indexes the children of @parent if they are not indexed yet, and
+ * there are more of them than are walked before the index is used.
+ * The rel_start of the children must be relative to the start of
+ * @parent. In O(SEGMENT_INDEX_MIN_WALK) if nothing is done.
  */
 static void
-find_insertion_place (Segment  *segment,
-		      gint      offset,
-		      Segment **parent,
-		      Segment **prev,
-		      Segment **next,
-		      Segment  *hint)
+segment_index_build_ (CtkSourceContextEngine *ce,
+		      Segment                *parent)
 {
-	g_assert (segment->start_at <= offset && segment->end_at >= offset);
-
-	*prev = NULL;
-	*next = NULL;
+	Segment *child;
+	guint n_children = 0;
 
-	if (SEGMENT_IS_INVALID (segment) || segment->children == NULL)
-	{
-		*parent = segment;
+	if (SEGMENT_CHILDREN_INDEXED (parent))
 		return;
-	}
 
-	if (segment->start_at == offset)
+	for (child = parent->children;
+	     child != NULL && n_children <= SEGMENT_INDEX_MIN_WALK;
+	     child = child->next)
 	{
-#ifdef ENABLE_CHECK_TREE
-		g_assert (!segment->children ||
-			  !SEGMENT_IS_INVALID (segment->children) ||
-			  segment->children->start_at > offset);
-#endif
-
-		*parent = segment;
-		*next = segment->children;
+		n_children++;
+	}
 
+	if (n_children <= SEGMENT_INDEX_MIN_WALK)
 		return;
-	}
 
-	if (hint != NULL)
-		while (hint != NULL && hint->parent != segment)
-			hint = hint->parent;
+	segment_index_node_ (ce, parent);
 
-	if (hint == NULL)
-		hint = segment->children;
+	/* Each child is the last one in the index when it's added. */
+	for (child = parent->children; child != NULL; child = child->next)
+		segment_index_link_ (ce, child);
+}
 
-	if (hint->end_at < offset)
-		find_insertion_place_forward_ (segment, offset, hint, parent, prev, next);
+/**
+ * segment_index_insert:
+ * @ce: the engine.
+ * @segment: the segment.
+ *
+ * Adds @segment to the index of the children of its parent, building
+ * it if there are enough children now. Same requirements as
+ * segment_index_link_().
+ */
+static void
+segment_index_insert (CtkSourceContextEngine *ce,
+		      Segment                *segment)
+{
+	if (SEGMENT_CHILDREN_INDEXED (segment->parent))
+		segment_index_link_ (ce, segment);
 	else
-		find_insertion_place_backward_ (segment, offset, hint, parent, prev, next);
+		segment_index_build_ (ce, segment->parent);
 }
 
 /**
- * get_invalid_at:
+ * segment_index_remove:
  * @ce: the engine.
- * @offset: the offset.
- *
- * Finds invalid segment adjacent to offset (i.e. such that start <= offset <= end),
- * if any.
+ * @segment: the segment.
  *
- * Returns: invalid segment or %NULL.
+ * Removes @segment from the index of the children of its parent, if
+ * they are indexed. The index goes away with the last child, its node
+ * is freed with @segment. In O(log n).
  */
-static Segment *
-get_invalid_at (CtkSourceContextEngine *ce,
-		gint                    offset)
+static void
+segment_index_remove (CtkSourceContextEngine *ce,
+		      Segment                *segment)
 {
-	GSList *link = ce->priv->invalid;
+	Segment *parent = segment->parent;
+	SegmentIndex *node = segment->index;
+	SegmentIndex *child;
 
-	while (link != NULL)
+	if (!SEGMENT_CHILDREN_INDEXED (parent))
+		return;
+
+	while (node->left != NULL && node->right != NULL)
 	{
-		Segment *segment = link->data;
+		if (segment_index_priority_ (node->left) >
+		    segment_index_priority_ (node->right))
+			segment_index_rotate_up_ (node->left);
+		else
+			segment_index_rotate_up_ (node->right);
+	}
 
-		link = link->next;
+	segment_index_push_shift_ (node);
 
-		if (segment->start_at > offset)
-			break;
+	child = node->left != NULL ? node->left : node->right;
 
-		if (segment->end_at < offset)
-			continue;
+	if (child != NULL)
+		child->up = node->up;
 
-		return segment;
-	}
+	if (node->up == NULL)
+		parent->index->root = child;
+	else if (node->up->left == node)
+		node->up->left = child;
+	else
+		node->up->right = child;
 
-	return NULL;
+	node->up = NULL;
+	node->left = NULL;
+	node->right = NULL;
+
+	segment_index_release_ (ce, parent);
 }
 
 /**
- * segment_add_subpattern:
- * @state: the segment.
- * @sp: subpattern.
+ * segment_index_flatten_:
+ * @node: a node of an index, or %NULL.
  *
- * Prepends subpattern to subpatterns list in the segment.
+ * Pushes down all the shifts pending in the subtree of @node, so that
+ * the rel_start of these segments is relative to the start of their
+ * parent.
  */
 static void
-segment_add_subpattern (Segment    *state,
-			SubPattern *sp)
+segment_index_flatten_ (SegmentIndex *node)
 {
-	sp->next = state->sub_patterns;
-	state->sub_patterns = sp;
+	if (node != NULL)
+	{
+		segment_index_push_shift_ (node);
+		segment_index_flatten_ (node->left);
+		segment_index_flatten_ (node->right);
+	}
 }
 
 /**
- * sub_pattern_new:
+ * segment_index_clear_:
+ * @ce: the engine.
  * @segment: the segment.
- * @start_at: start offset of the subpattern.
- * @end_at: end offset of the subpattern.
- * @sp_def: the subppatern definition.
- *
- * Creates new subpattern and adds it to the segment's
- * subpatterns list.
  *
- * Returns: new subpattern.
+ * Drops the index of the children of @segment, if any, leaving their
+ * rel_start relative to the start of @segment. Used before children
+ * are moved to another parent, which is O(n) anyway.
  */
-static SubPattern *
-sub_pattern_new (Segment              *segment,
-		 gint                  start_at,
-		 gint                  end_at,
-		 SubPatternDefinition *sp_def)
+static void
+segment_index_clear_ (CtkSourceContextEngine *ce,
+		      Segment                *segment)
 {
-	SubPattern *sp;
+	Segment *child;
 
-	sp = g_slice_new (SubPattern);
-	sp->start_at = start_at;
-	sp->end_at = end_at;
-	sp->definition = sp_def;
+	if (!SEGMENT_CHILDREN_INDEXED (segment))
+		return;
 
-	segment_add_subpattern (segment, sp);
+	segment_index_flatten_ (segment->index->root);
+	segment->index->root = NULL;
 
-	return sp;
-}
+	for (child = segment->children; child != NULL; child = child->next)
+	{
+		child->index->up = NULL;
+		child->index->left = NULL;
+		child->index->right = NULL;
+		segment_index_release_ (ce, child);
+	}
 
-/**
- * sub_pattern_free:
- * @sp: subppatern.
- *
- * Calls g_free on subpattern, was useful for debugging.
- */
-static inline void
-sub_pattern_free (SubPattern *sp)
-{
-#ifdef ENABLE_DEBUG
-	memset (sp, 1, sizeof (SubPattern));
-#else
-	g_slice_free (SubPattern, sp);
-#endif
+	segment_index_release_ (ce, segment);
 }
 
 /**
- * segment_make_invalid_:
+ * segment_shift_following_:
  * @ce: the engine.
- * @segment: segment to invalidate.
+ * @segment: the segment.
+ * @delta: the shift.
  *
- * Invalidates segment. Called only from insert_range().
+ * Moves the siblings after @segment, and their descendants, by @delta
+ * characters. If they are indexed, it's done in O(log n): walking up
+ * the index from @segment, each node reached from its left subtree is
+ * after @segment, and so is its right subtree, which is shifted as a
+ * whole. Otherwise there are few of them, and they are moved one by one.
  */
 static void
-segment_make_invalid_ (CtkSourceContextEngine *ce,
-		       Segment                *segment)
+segment_shift_following_ (CtkSourceContextEngine *ce,
+			  Segment                *segment,
+			  gint                    delta)
 {
-	Context *ctx;
-	SubPattern *sp;
+	if (SEGMENT_CHILDREN_INDEXED (segment->parent))
+	{
+		SegmentIndex *node = segment->index;
 
-	g_assert (!SEGMENT_IS_INVALID (segment));
+		if (node->right != NULL)
+			segment_index_shift_subtree_ (node->right, delta);
 
-	sp = segment->sub_patterns;
-	segment->sub_patterns = NULL;
+		for (; node->up != NULL; node = node->up)
+		{
+			SegmentIndex *up = node->up;
 
-	while (sp != NULL)
+			if (up->left == node)
+			{
+				up->segment->rel_start += delta;
+
+				if (up->right != NULL)
+					segment_index_shift_subtree_ (up->right, delta);
+			}
+		}
+	}
+	else
 	{
-		SubPattern *next = sp->next;
-		sub_pattern_free (sp);
-		sp = next;
+		Segment *sibling;
+
+		for (sibling = segment->next; sibling != NULL; sibling = sibling->next)
+			sibling->rel_start += delta;
 	}
 
-	ctx = segment->context;
-	segment->context = NULL;
-	segment->is_start = FALSE;
-	segment->start_len = 0;
-	segment->end_len = 0;
-	add_invalid (ce, segment);
-	context_unref (ctx);
+	segment_tree_moved (ce);
 }
 
 /**
- * simple_segment_split_:
+ * segment_find_child_:
  * @ce: the engine.
- * @segment: segment to split.
- * @offset: offset at which text insertion occurred.
+ * @segment: the segment.
+ * @offset: the offset.
  *
- * Creates a new invalid segment and inserts it in the middle
- * of the given one. Called from insert_range() to mark inserted
- * text.
+ * Finds the first child of @segment which ends at or after @offset,
+ * in O(log n) using the index of the children. Children never overlap,
+ * so their ends are sorted like the children themselves. If they are
+ * not indexed, there are few of them, and they are simply walked.
  *
- * Returns: new invalid segment.
+ * Used instead of walking the siblings from a hint when it is too
+ * far, so that finding a segment by offset does not degrade to
+ * O(n) when edits jump around a file with many toplevel segments.
+ *
+ * Returns: the child, or %NULL if all the children end before @offset.
  */
 static Segment *
-simple_segment_split_ (CtkSourceContextEngine *ce,
-		       Segment                *segment,
-		       gint                    offset)
+segment_find_child_ (CtkSourceContextEngine *ce,
+		     Segment                *segment,
+		     gint                    offset)
 {
-	SubPattern *sp;
-	Segment *new_segment, *invalid;
-	gint end_at = segment->end_at;
+	SegmentIndex *node;
+	Segment *found = NULL;
+	gint base;
 
-	g_assert (SEGMENT_IS_SIMPLE (segment));
-	g_assert (segment->start_at < offset && offset < segment->end_at);
+	if (!SEGMENT_CHILDREN_INDEXED (segment))
+	{
+		for (found = segment->children; found != NULL; found = found->next)
+		{
+			if (segment_end (ce, found) >= offset)
+				break;
+		}
 
-	sp = segment->sub_patterns;
-	segment->sub_patterns = NULL;
-	segment->end_at = offset;
+		return found;
+	}
 
-	invalid = create_segment (ce, segment->parent, NULL, offset, offset, FALSE, segment);
-	new_segment = create_segment (ce, segment->parent, segment->context, offset, end_at, FALSE, invalid);
+	node = segment->index->root;
+	base = segment_start (ce, segment);
 
-	while (sp != NULL)
+	while (node != NULL)
 	{
-		Segment *append_to = NULL;
-		SubPattern *next = sp->next;
+		Segment *child = node->segment;
 
-		if (sp->end_at <= offset)
-		{
-			append_to = segment;
-		}
-		else if (sp->start_at >= offset)
+		/* Resolve the starts on the way down, for free. */
+		child->abs_start = base + child->rel_start;
+		child->abs_stamp = ce->priv->tree_stamp;
+		base += node->shift;
+
+		if (child->abs_start + child->length < offset)
 		{
-			append_to = new_segment;
+			node = node->right;
 		}
 		else
 		{
-			sub_pattern_new (new_segment,
-					 offset,
-					 sp->end_at,
-					 sp->definition);
-			sp->end_at = offset;
-			append_to = segment;
+			found = child;
+			node = node->left;
 		}
+	}
 
-		segment_add_subpattern (append_to, sp);
-
-		sp = next;
-	}
-
-	return invalid;
+	return found;
 }
 
 /**
- * invalidate_region:
- * @ce: a #CtkSourceContextEngine.
- * @offset: the start of invalidated area.
- * @length: the length of the area.
+ * segment_find_last_child_:
+ * @ce: the engine.
+ * @segment: the segment.
+ * @offset: the offset.
  *
- * Adds the area to the invalid region and queues highlighting.
- * @length may be negative which means deletion; positive
- * means insertion; 0 means "something happened here", it's
- * treated as zero-length insertion.
+ * Same as segment_find_child_(), but finds the last child of @segment
+ * which starts at or before @offset, i.e. the first child met when
+ * walking the children backward from the end.
+ *
+ * Returns: the child, or %NULL if all the children start after @offset.
  */
-static void
-invalidate_region (CtkSourceContextEngine *ce,
-		   gint                    offset,
-		   gint                    length)
+static Segment *
+segment_find_last_child_ (CtkSourceContextEngine *ce,
+			  Segment                *segment,
+			  gint                    offset)
 {
-	InvalidRegion *region = &ce->priv->invalid_region;
-	CtkTextBuffer *buffer = ce->priv->buffer;
-	CtkTextIter iter;
-	gint end_offset;
-
-	end_offset = length >= 0 ? offset + length : offset;
+	SegmentIndex *node;
+	Segment *found = NULL;
+	gint base;
 
-	if (region->empty)
+	if (!SEGMENT_CHILDREN_INDEXED (segment))
 	{
-		region->empty = FALSE;
-		region->delta = length;
-
-		ctk_text_buffer_get_iter_at_offset (buffer, &iter, offset);
-		ctk_text_buffer_move_mark (buffer, region->start, &iter);
+		for (found = segment->last_child; found != NULL; found = found->prev)
+		{
+			if (segment_start (ce, found) <= offset)
+				break;
+		}
 
-		ctk_text_iter_set_offset (&iter, end_offset);
-		ctk_text_buffer_move_mark (buffer, region->end, &iter);
+		return found;
 	}
-	else
+
+	node = segment->index->root;
+	base = segment_start (ce, segment);
+
+	while (node != NULL)
 	{
-		ctk_text_buffer_get_iter_at_mark (buffer, &iter, region->start);
+		Segment *child = node->segment;
 
-		if (ctk_text_iter_get_offset (&iter) > offset)
+		child->abs_start = base + child->rel_start;
+		child->abs_stamp = ce->priv->tree_stamp;
+		base += node->shift;
+
+		if (child->abs_start <= offset)
 		{
-			ctk_text_iter_set_offset (&iter, offset);
-			ctk_text_buffer_move_mark (buffer, region->start, &iter);
+			found = child;
+			node = node->right;
 		}
-
-		ctk_text_buffer_get_iter_at_mark (buffer, &iter, region->end);
-
-		if (ctk_text_iter_get_offset (&iter) < end_offset)
+		else
 		{
-			ctk_text_iter_set_offset (&iter, end_offset);
-			ctk_text_buffer_move_mark (buffer, region->end, &iter);
+			node = node->left;
 		}
-
-		region->delta += length;
 	}
 
-	DEBUG (({
-		gint start, end;
-		ctk_text_buffer_get_iter_at_mark (buffer, &iter, region->start);
-		start = ctk_text_iter_get_offset (&iter);
-		ctk_text_buffer_get_iter_at_mark (buffer, &iter, region->end);
-		end = ctk_text_iter_get_offset (&iter);
-		g_assert (start <= end - region->delta);
-	}));
-
-	CHECK_TREE (ce);
-
-	install_first_update (ce);
+	return found;
 }
 
 /**
- * insert_range:
- * @ce: a #CtkSourceContextEngine.
- * @offset: the start of new segment.
- * @length: the length of the segment.
+ * find_insertion_place_forward_:
+ * @segment: the (grand)parent segment the new one should be inserted into.
+ * @offset: offset at which text is inserted.
+ * @start: segment from which to start search (to avoid
+ * walking whole tree).
+ * @parent: initialized with the parent of new segment.
+ * @prev: initialized with the previous sibling of new segment.
+ * @next: initialized with the next sibling of new segment.
  *
- * Updates segment tree after insertion: it updates tree
- * offsets as appropriate, and inserts a new invalid segment
- * or extends existing invalid segment as @offset, so
- * after the call segment [@offset, @offset + @length) is marked
- * invalid in the tree.
- * It may be safely called with length == 0 at any moment
- * to invalidate some offset (and it's used here and there).
+ * Auxiliary function used in find_insertion_place().
  */
 static void
-insert_range (CtkSourceContextEngine *ce,
-	      gint                    offset,
-	      gint                    length)
+find_insertion_place_forward_ (CtkSourceContextEngine  *ce,
+			       Segment                 *segment,
+			       gint                     offset,
+			       Segment                 *start,
+			       Segment                **parent,
+			       Segment                **prev,
+			       Segment                **next)
 {
-	Segment *parent, *prev = NULL, *next = NULL, *new_segment;
-	Segment *segment;
+	Segment *child;
+	guint steps = 0;
 
-	/* If there is an invalid segment adjacent to offset, use it.
-	 * Otherwise, find the deepest segment to split and insert
-	 * dummy segment in there. */
+	g_assert (segment_end (ce, start) < offset);
 
-	parent = get_invalid_at (ce, offset);
+	for (child = start; child != NULL; child = child->next)
+	{
+		if (++steps == SEGMENT_INDEX_MIN_WALK)
+		{
+			child = segment_find_child_ (ce, segment, offset);
 
-	if (parent == NULL)
-		find_insertion_place (ce->priv->root_segment, offset,
-				      &parent, &prev, &next,
-				      ce->priv->hint);
+			if (child == NULL)
+			{
+				*prev = segment->last_child;
+				break;
+			}
 
-	g_assert (parent->start_at <= offset);
-	g_assert (parent->end_at >= offset);
-	g_assert (!prev || prev->parent == parent);
-	g_assert (!next || next->parent == parent);
-	g_assert (!prev || prev->next == next);
-	g_assert (!next || next->prev == prev);
+			*prev = child->prev;
+		}
 
-	if (SEGMENT_IS_INVALID (parent))
-	{
-		/* If length is zero, and we already have an invalid segment there,
-		 * do nothing. */
-		if (length == 0)
+		if (segment_start (ce, child) <= offset && segment_end (ce, child) >= offset)
+		{
+			find_insertion_place (ce, child, offset, parent, prev, next, NULL);
 			return;
+		}
 
-		segment = parent;
-	}
-	else if (SEGMENT_IS_SIMPLE (parent))
-	{
-		/* If it's a simple context, then:
-		 * if one of its ends is offset, then we just invalidate it;
-		 * otherwise, we split it into two, and insert zero-lentgh
-		 * invalid segment in the middle. */
-		if (parent->start_at < offset && parent->end_at > offset)
+		if (segment_end (ce, child) == offset)
 		{
-			segment = simple_segment_split_ (ce, parent, offset);
+			if (SEGMENT_IS_INVALID (child))
+			{
+				*parent = child;
+				*prev = NULL;
+				*next = NULL;
+			}
+			else
+			{
+				*prev = child;
+				*next = child->next;
+				*parent = segment;
+			}
+
+			return;
 		}
-		else
+
+		if (segment_end (ce, child) < offset)
 		{
-			segment_make_invalid_ (ce, parent);
-			segment = parent;
+			*prev = child;
+			continue;
 		}
-	}
-	else
-	{
-		/* Just insert new zero-length invalid segment. */
 
-		new_segment = segment_new (ce, parent, NULL, offset, offset, FALSE);
-
-		new_segment->next = next;
-		new_segment->prev = prev;
+		if (segment_start (ce, child) > offset)
+		{
+			*next = child;
+			break;
+		}
 
-		if (next != NULL)
-			next->prev = new_segment;
-		else
-			parent->last_child = new_segment;
+		g_assert_not_reached ();
+	}
 
-		if (prev != NULL)
-			prev->next = new_segment;
-		else
-			parent->children = new_segment;
+	*parent = segment;
+}
 
-		segment = new_segment;
-	}
+/**
+ * find_insertion_place_backward_:
+ * @segment: the (grand)parent segment the new one should be inserted into.
+ * @offset: offset at which text is inserted.
+ * @start: segment from which to start search (to avoid
+ * walking whole tree).
+ * @parent: initialized with the parent of new segment.
+ * @prev: initialized with the previous sibling of new segment.
+ * @next: initialized with the next sibling of new segment.
+ *
+ * Auxiliary function used in find_insertion_place().
+ */
+static void
+find_insertion_place_backward_ (CtkSourceContextEngine  *ce,
+				Segment                 *segment,
+				gint                     offset,
+				Segment                 *start,
+				Segment                **parent,
+				Segment                **prev,
+				Segment                **next)
+{
+	Segment *child;
+	guint steps = 0;
 
-	g_assert (!segment->children);
+	g_assert (segment_end (ce, start) >= offset);
 
-	if (length != 0)
+	for (child = start; child != NULL; child = child->prev)
 	{
-		/* now fix offsets in all the segments "to the right"
-		 * of segment. */
-		while (segment != NULL)
+		if (++steps == SEGMENT_INDEX_MIN_WALK)
 		{
-			Segment *tmp;
-			SubPattern *sp;
+			child = segment_find_last_child_ (ce, segment, offset);
 
-			for (tmp = segment->next; tmp != NULL; tmp = tmp->next)
-				fix_offsets_insert_ (tmp, offset, length);
+			if (child == NULL)
+			{
+				*next = segment->children;
+				break;
+			}
 
-			segment->end_at += length;
+			*next = child->next;
+		}
 
-			for (sp = segment->sub_patterns; sp != NULL; sp = sp->next)
+		if (segment_start (ce, child) <= offset && segment_end (ce, child) >= offset)
+		{
+			find_insertion_place (ce, child, offset, parent, prev, next, NULL);
+			return;
+		}
+
+		if (segment_end (ce, child) == offset)
+		{
+			if (SEGMENT_IS_INVALID (child))
 			{
-				if (sp->start_at > offset)
-					sp->start_at += length;
-				if (sp->end_at > offset)
-					sp->end_at += length;
+				*parent = child;
+				*prev = NULL;
+				*next = NULL;
+			}
+			else
+			{
+				*prev = child;
+				*next = child->next;
+				*parent = segment;
 			}
 
-			segment = segment->parent;
+			return;
+		}
+
+		if (segment_end (ce, child) < offset)
+		{
+			*prev = child;
+			*next = child->next;
+			break;
+		}
+
+		if (segment_start (ce, child) > offset)
+		{
+			*next = child;
+			continue;
 		}
+
+		g_assert_not_reached ();
 	}
 
-	CHECK_TREE (ce);
+	*parent = segment;
 }
 
 /**
- * ctk_source_context_engine_text_inserted:
- * @ce: a #CtkSourceContextEngine.
- * @start_offset: the start of inserted text.
- * @end_offset: the end of inserted text.
+ * find_insertion_place:
+ * @segment: the (grand)parent segment the new one should be inserted into.
+ * @offset: offset at which text is inserted.
+ * @start: segment from which to start search (to avoid
+ * walking whole tree).
+ * @parent: initialized with the parent of new segment.
+ * @prev: initialized with the previous sibling of new segment.
+ * @hint: a segment somewhere near insertion place to optimize search.
  *
- * Called from CtkTextBuffer::insert_text.
+ * After text is inserted, a new invalid segment is created and inserted
+ * into the tree. This function finds an appropriate position for the new
+ * segment. To make it faster, it uses hint and calls
+ * find_insertion_place_forward_ or find_insertion_place_backward_ depending
+ * on position of offset relative to hint.
+ * There is no return value, it always succeeds (or crashes).
  */
 static void
-ctk_source_context_engine_text_inserted (CtkSourceEngine *engine,
-					 gint             start_offset,
-					 gint             end_offset)
+find_insertion_place (CtkSourceContextEngine  *ce,
+		      Segment                 *segment,
+		      gint                     offset,
+		      Segment                **parent,
+		      Segment                **prev,
+		      Segment                **next,
+		      Segment                 *hint)
 {
-	CtkTextIter iter;
-	CtkSourceContextEngine *ce = CTK_SOURCE_CONTEXT_ENGINE (engine);
-
-	if (!ce->priv->disabled)
-	{
-		g_return_if_fail (start_offset < end_offset);
-
-		invalidate_region (ce, start_offset, end_offset - start_offset);
+	g_assert (segment_start (ce, segment) <= offset && segment_end (ce, segment) >= offset);
 
-		/* If end_offset is at the start of a line (enter key pressed) then
-		 * we need to invalidate the whole new line, otherwise it may not be
-		 * highlighted because the engine analyzes the previous line, end
-		 * context there is none, start context at this line is none too,
-		 * and the engine stops. */
-		ctk_text_buffer_get_iter_at_offset (ce->priv->buffer, &iter, end_offset);
-		if (ctk_text_iter_starts_line (&iter) && !ctk_text_iter_ends_line (&iter))
-		{
-			ctk_text_iter_forward_to_line_end (&iter);
-			invalidate_region (ce, ctk_text_iter_get_offset (&iter), 0);
-		}
-	}
-}
+	*prev = NULL;
+	*next = NULL;
 
-/**
- * fix_offset_delete_one_:
- * @offset: segment.
- * @start: start of deleted text.
- * @length: length of deleted text.
- *
- * Returns: new offset depending on location of @offset
- * relative to deleted text.
- * Called only from fix_offsets_delete_().
- */
-static inline gint
-fix_offset_delete_one_ (gint offset,
-			gint start,
-			gint length)
-{
-	if (offset > start)
+	if (SEGMENT_IS_INVALID (segment) || segment->children == NULL)
 	{
-		if (offset >= start + length)
-			offset -= length;
-		else
-			offset = start;
+		*parent = segment;
+		return;
 	}
 
-	return offset;
-}
+	if (segment_start (ce, segment) == offset)
+	{
+#ifdef ENABLE_CHECK_TREE
+		g_assert (!segment->children ||
+			  !SEGMENT_IS_INVALID (segment->children) ||
+			  segment_start (ce, segment->children) > offset);
+#endif
 
-/**
- * fix_offsets_delete_:
- * @segment: segment.
- * @start: start offset.
- * @length: length of deleted text.
- * @hint: some segment somewhere near deleted text to optimize search.
- *
- * Recursively updates offsets after deleting text. To be called
- * only from delete_range_().
- */
-static void
-fix_offsets_delete_ (Segment *segment,
-		     gint     offset,
-		     gint     length,
-		     Segment *hint)
-{
-	Segment *child;
-	SubPattern *sp;
+		*parent = segment;
+		*next = segment->children;
 
-	g_return_if_fail (segment->end_at > offset);
+		return;
+	}
 
 	if (hint != NULL)
 		while (hint != NULL && hint->parent != segment)
@@ -2030,3554 +3458,7014 @@ fix_offsets_delete_ (Segment *segment,
 	if (hint == NULL)
 		hint = segment->children;
 
-	for (child = hint; child != NULL; child = child->next)
-	{
-		if (child->end_at <= offset)
-			continue;
-		fix_offsets_delete_ (child, offset, length, NULL);
-	}
+	if (segment_end (ce, hint) < offset)
+		find_insertion_place_forward_ (ce, segment, offset, hint, parent, prev, next);
+	else
+		find_insertion_place_backward_ (ce, segment, offset, hint, parent, prev, next);
+}
+
+/**
+ * get_invalid_at:
+ * @ce: the engine.
+ * @offset: the offset.
+ *
+ * Finds invalid segment adjacent to offset (i.e. such that start <= offset <= end),
+ * if any.
+ *
+ * Returns: invalid segment or %NULL.
+ */
+static Segment *
+get_invalid_at (CtkSourceContextEngine *ce,
+		gint                    offset)
+{
+	GSList *link = ce->priv->invalid;
 
-	for (child = hint ? hint->prev : NULL; child != NULL; child = child->prev)
+	while (link != NULL)
 	{
-		if (child->end_at <= offset)
+		Segment *segment = link->data;
+
+		link = link->next;
+
+		if (segment_start (ce, segment) > offset)
 			break;
-		fix_offsets_delete_ (child, offset, length, NULL);
-	}
 
-	for (sp = segment->sub_patterns; sp != NULL; sp = sp->next)
-	{
-		sp->start_at = fix_offset_delete_one_ (sp->start_at, offset, length);
-		sp->end_at = fix_offset_delete_one_ (sp->end_at, offset, length);
+		if (segment_end (ce, segment) < offset)
+			continue;
+
+		return segment;
 	}
 
-	segment->start_at = fix_offset_delete_one_ (segment->start_at, offset, length);
-	segment->end_at = fix_offset_delete_one_ (segment->end_at, offset, length);
+	return NULL;
 }
 
 /**
- * delete_range_:
- * @ce: a #CtkSourceContextEngine.
- * @start: the start of deleted area.
- * @end: the end of deleted area.
+ * segment_add_subpattern:
+ * @state: the segment.
+ * @sp: subpattern.
  *
- * Updates segment tree after deletion: removes segments at deleted
- * interval, updates tree offsets, etc.
- * It's called only from update_tree().
+ * Prepends subpattern to subpatterns list in the segment.
  */
 static void
-delete_range_ (CtkSourceContextEngine *ce,
-	       gint                    start,
-	       gint                    end)
+segment_add_subpattern (Segment    *state,
+			SubPattern *sp)
 {
-	g_return_if_fail (start < end);
-
-	/* FIXME adjacent invalid segments? */
-	erase_segments (ce, start, end, NULL);
-	fix_offsets_delete_ (ce->priv->root_segment, start, end - start, ce->priv->hint);
-
-	/* no need to invalidate at start, update_tree will do it */
-
-	CHECK_TREE (ce);
+	sp->next = state->sub_patterns;
+	state->sub_patterns = sp;
 }
 
 /**
- * ctk_source_context_engine_text_deleted:
- * @ce: a #CtkSourceContextEngine.
- * @offset: the start of deleted text.
- * @length: the length (in characters) of deleted text.
+ * sub_pattern_new:
+ * @ce: the engine.
+ * @segment: the segment.
+ * @start_at: start offset of the subpattern in the buffer.
+ * @end_at: end offset of the subpattern in the buffer.
+ * @sp_def: the subppatern definition.
  *
- * Called from CtkTextBuffer::delete_range.
+ * Creates new subpattern and adds it to the segment's
+ * subpatterns list.
+ *
+ * Returns: new subpattern.
  */
-static void
-ctk_source_context_engine_text_deleted (CtkSourceEngine *engine,
-					gint             offset,
-					gint             length)
+static SubPattern *
+sub_pattern_new (CtkSourceContextEngine *ce,
+		 Segment                *segment,
+		 gint                    start_at,
+		 gint                    end_at,
+		 SubPatternDefinition   *sp_def)
 {
-	CtkSourceContextEngine *ce = CTK_SOURCE_CONTEXT_ENGINE (engine);
+	SubPattern *sp;
 
-	g_return_if_fail (length > 0);
+	sp = node_pool_alloc0 (&ce->priv->sub_pattern_pool);
+	sp->start_at = start_at - segment_start (ce, segment);
+	sp->end_at = end_at - segment_start (ce, segment);
+	sp->definition = sp_def;
 
-	if (!ce->priv->disabled)
-	{
-		invalidate_region (ce, offset, - length);
-	}
+	segment_add_subpattern (segment, sp);
+
+	return sp;
 }
 
 /**
- * get_invalid_segment:
- * @ce: a #CtkSourceContextEngine.
+ * sub_pattern_free:
+ * @ce: the engine.
+ * @sp: subppatern.
  *
- * Returns: first invalid segment, or %NULL.
+ * Returns subpattern to the pool of the engine.
  */
-static Segment *
-get_invalid_segment (CtkSourceContextEngine *ce)
+static inline void
+sub_pattern_free (CtkSourceContextEngine *ce,
+		  SubPattern             *sp)
 {
-	g_return_val_if_fail (ce->priv->invalid_region.empty, NULL);
-	return ce->priv->invalid ? ce->priv->invalid->data : NULL;
+	node_pool_free (&ce->priv->sub_pattern_pool, sp);
 }
 
 /**
- * get_invalid_line:
- * @ce: a #CtkSourceContextEngine.
+ * segment_make_invalid_:
+ * @ce: the engine.
+ * @segment: segment to invalidate.
  *
- * Returns: first invalid line, or -1.
+ * Invalidates segment. Called only from insert_range().
  */
-static gint
-get_invalid_line (CtkSourceContextEngine *ce)
+static void
+segment_make_invalid_ (CtkSourceContextEngine *ce,
+		       Segment                *segment)
 {
-	CtkTextIter iter;
-	gint offset = G_MAXINT;
+	Context *ctx;
+	SubPattern *sp;
 
-	if (!ce->priv->invalid_region.empty)
-	{
-		gint tmp;
-		ctk_text_buffer_get_iter_at_mark (ce->priv->buffer,
-						  &iter,
-						  ce->priv->invalid_region.start);
-		tmp = ctk_text_iter_get_offset (&iter);
-		offset = MIN (offset, tmp);
-	}
+	g_assert (!SEGMENT_IS_INVALID (segment));
 
-	if (ce->priv->invalid)
+	sp = segment->sub_patterns;
+	segment->sub_patterns = NULL;
+
+	while (sp != NULL)
 	{
-		Segment *segment = ce->priv->invalid->data;
-		offset = MIN (offset, segment->start_at);
+		SubPattern *next = sp->next;
+		sub_pattern_free (ce, sp);
+		sp = next;
 	}
 
-	if (offset == G_MAXINT)
-		return -1;
-
-	ctk_text_buffer_get_iter_at_offset (ce->priv->buffer, &iter, offset);
-	return ctk_text_iter_get_line (&iter);
+	ctx = segment->context;
+	segment->context = NULL;
+	segment->is_start = FALSE;
+	segment->start_len = 0;
+	segment->end_len = 0;
+	add_invalid (ce, segment);
+	context_unref (ctx);
 }
 
 /**
- * update_tree:
- * @ce: a #CtkSourceContextEngine.
+ * simple_segment_split_:
+ * @ce: the engine.
+ * @segment: segment to split.
+ * @offset: offset at which text insertion occurred.
  *
- * Modifies syntax tree according to data in invalid_region.
+ * Creates a new invalid segment and inserts it in the middle
+ * of the given one. Called from insert_range() to mark inserted
+ * text.
+ *
+ * Returns: new invalid segment.
  */
-static void
-update_tree (CtkSourceContextEngine *ce)
+static Segment *
+simple_segment_split_ (CtkSourceContextEngine *ce,
+		       Segment                *segment,
+		       gint                    offset)
 {
-	InvalidRegion *region = &ce->priv->invalid_region;
-	gint start, end, delta;
-	gint erase_start, erase_end;
-	CtkTextIter iter;
+	SubPattern *sp;
+	Segment *new_segment, *invalid;
+	gint end_at = segment_end (ce, segment);
 
-	if (region->empty)
-		return;
+	g_assert (SEGMENT_IS_SIMPLE (segment));
+	g_assert (segment_start (ce, segment) < offset && offset < segment_end (ce, segment));
 
-	ctk_text_buffer_get_iter_at_mark (ce->priv->buffer, &iter, region->start);
-	start = ctk_text_iter_get_offset (&iter);
-	ctk_text_buffer_get_iter_at_mark (ce->priv->buffer, &iter, region->end);
-	end = ctk_text_iter_get_offset (&iter);
+	sp = segment->sub_patterns;
+	segment->sub_patterns = NULL;
+	segment_set_end (ce, segment, offset);
 
-	delta = region->delta;
+	invalid = create_segment (ce, segment->parent, NULL, offset, offset, FALSE, segment);
+	new_segment = create_segment (ce, segment->parent, segment->context, offset, end_at, FALSE, invalid);
 
-	g_assert (start <= MIN (end, end - delta));
+	while (sp != NULL)
+	{
+		Segment *append_to = NULL;
+		SubPattern *next = sp->next;
 
-	/* Here start and end are actual offsets in the buffer (they do not match offsets
-	 * in the tree if delta is not zero); delta is how much was inserted/removed.
-	 * First, we insert/delete range from the tree, to make offsets in tree
-	 * match offsets in the buffer. Then, create an invalid segment for the rest
-	 * of the area if needed. */
-
-	if (delta > 0)
-		insert_range (ce, start, delta);
-	else if (delta < 0)
-		delete_range_ (ce, end, end - delta);
+		if (SUB_PATTERN_END (ce, segment, sp) <= offset)
+		{
+			append_to = segment;
+		}
+		else if (SUB_PATTERN_START (ce, segment, sp) >= offset)
+		{
+			sp->start_at -= offset - segment_start (ce, segment);
+			sp->end_at -= offset - segment_start (ce, segment);
+			append_to = new_segment;
+		}
+		else
+		{
+			sub_pattern_new (ce,
+					 new_segment,
+					 offset,
+					 SUB_PATTERN_END (ce, segment, sp),
+					 sp->definition);
+			sp->end_at = offset - segment_start (ce, segment);
+			append_to = segment;
+		}
 
-	if (delta <= 0)
-	{
-		erase_start = start;
-		erase_end = end;
-	}
-	else
-	{
-		erase_start = start + delta;
-		erase_end = end;
-	}
+		segment_add_subpattern (append_to, sp);
 
-	if (erase_start < erase_end)
-	{
-		erase_segments (ce, erase_start, erase_end, NULL);
-		create_segment (ce, ce->priv->root_segment, NULL, erase_start, erase_end, FALSE, NULL);
-	}
-	else if (get_invalid_at (ce, start) == NULL)
-	{
-		insert_range (ce, start, 0);
+		sp = next;
 	}
 
-	region->empty = TRUE;
-
-#ifdef ENABLE_CHECK_TREE
-	g_assert (get_invalid_at (ce, start) != NULL);
-	CHECK_TREE (ce);
-#endif
+	return invalid;
 }
 
 /**
- * ctk_source_context_engine_update_highlight:
+ * invalidate_region:
  * @ce: a #CtkSourceContextEngine.
- * @start: start of area to update.
- * @end: start of area to update.
- * @synchronous: whether it should block until everything
- * is analyzed/highlighted.
- *
- * CtkSourceEngine::update_highlight method.
+ * @offset: the start of invalidated area.
+ * @length: the length of the area.
  *
- * Makes sure the area is analyzed and highlighted. If @synchronous
- * is %FALSE, then it queues idle worker.
+ * Adds the area to the invalid region and queues highlighting.
+ * @length may be negative which means deletion; positive
+ * means insertion; 0 means "something happened here", it's
+ * treated as zero-length insertion.
  */
 static void
-ctk_source_context_engine_update_highlight (CtkSourceEngine   *engine,
-					    const CtkTextIter *start,
-					    const CtkTextIter *end,
-					    gboolean           synchronous)
+invalidate_region (CtkSourceContextEngine *ce,
+		   gint                    offset,
+		   gint                    length)
 {
-	gint invalid_line;
-	gint end_line;
-	CtkSourceContextEngine *ce = CTK_SOURCE_CONTEXT_ENGINE (engine);
+	InvalidRegion *region = &ce->priv->invalid_region;
+	CtkTextBuffer *buffer = ce->priv->buffer;
+	CtkTextIter iter;
+	gint end_offset;
 
-	if (!ce->priv->highlight || ce->priv->disabled)
-		return;
+	end_offset = length >= 0 ? offset + length : offset;
 
-	invalid_line = get_invalid_line (ce);
-	end_line = ctk_text_iter_get_line (end);
+	if (region->empty)
+	{
+		region->empty = FALSE;
+		region->delta = length;
 
-	if (ctk_text_iter_starts_line (end) && end_line > 0)
-		end_line -= 1;
+		ctk_text_buffer_get_iter_at_offset (buffer, &iter, offset);
+		ctk_text_buffer_move_mark (buffer, region->start, &iter);
 
-	if (invalid_line < 0 || invalid_line > end_line)
-	{
-		ensure_highlighted (ce, start, end);
-	}
-	else if (synchronous)
-	{
-		/* analyze whole region */
-		update_syntax (ce, end, 0);
-		ensure_highlighted (ce, start, end);
+		ctk_text_iter_set_offset (&iter, end_offset);
+		ctk_text_buffer_move_mark (buffer, region->end, &iter);
 	}
 	else
 	{
-		if (ctk_text_iter_get_line (start) < invalid_line)
+		ctk_text_buffer_get_iter_at_mark (buffer, &iter, region->start);
+
+		if (ctk_text_iter_get_offset (&iter) > offset)
 		{
-			CtkTextIter valid_end = *start;
+			ctk_text_iter_set_offset (&iter, offset);
+			ctk_text_buffer_move_mark (buffer, region->start, &iter);
+		}
 
-			ctk_text_iter_set_line (&valid_end, invalid_line);
-			ensure_highlighted (ce, start, &valid_end);
+		ctk_text_buffer_get_iter_at_mark (buffer, &iter, region->end);
+
+		if (ctk_text_iter_get_offset (&iter) < end_offset)
+		{
+			ctk_text_iter_set_offset (&iter, end_offset);
+			ctk_text_buffer_move_mark (buffer, region->end, &iter);
 		}
 
-		install_first_update (ce);
+		region->delta += length;
 	}
+
+	DEBUG (({
+		gint start, end;
+		ctk_text_buffer_get_iter_at_mark (buffer, &iter, region->start);
+		start = ctk_text_iter_get_offset (&iter);
+		ctk_text_buffer_get_iter_at_mark (buffer, &iter, region->end);
+		end = ctk_text_iter_get_offset (&iter);
+		g_assert (start <= end - region->delta);
+	}));
+
+	CHECK_TREE (ce);
+
+	install_first_update (ce);
+	schedule_background_analysis (ce, length >= BACKGROUND_ANALYSIS_MIN_CHARS);
 }
 
 /**
- * enable_highlight:
+ * insert_range:
  * @ce: a #CtkSourceContextEngine.
- * @enable: whether to enable highlighting.
+ * @offset: the start of new segment.
+ * @length: the length of the segment.
  *
- * Whether to highlight (i.e. apply tags) analyzed area.
- * Note that this does not turn on/off the analyzis stuff,
- * it affects only text tags.
+ * Updates segment tree after insertion: it updates tree
+ * offsets as appropriate, and inserts a new invalid segment
+ * or extends existing invalid segment as @offset, so
+ * after the call segment [@offset, @offset + @length) is marked
+ * invalid in the tree.
+ * It may be safely called with length == 0 at any moment
+ * to invalidate some offset (and it's used here and there).
  */
 static void
-enable_highlight (CtkSourceContextEngine *ce,
-		  gboolean                enable)
+insert_range (CtkSourceContextEngine *ce,
+	      gint                    offset,
+	      gint                    length)
 {
-	CtkTextIter start, end;
+	Segment *parent, *prev = NULL, *next = NULL, *new_segment;
+	Segment *segment;
 
-	if (!enable == !ce->priv->highlight)
-		return;
+	/* If there is an invalid segment adjacent to offset, use it.
+	 * Otherwise, find the deepest segment to split and insert
+	 * dummy segment in there. */
 
-	ce->priv->highlight = enable != 0;
-	ctk_text_buffer_get_bounds (CTK_TEXT_BUFFER (ce->priv->buffer),
-				    &start, &end);
+	parent = get_invalid_at (ce, offset);
 
-	if (enable)
+	if (parent == NULL)
+		find_insertion_place (ce, ce->priv->root_segment, offset,
+				      &parent, &prev, &next,
+				      ce->priv->hint);
+
+	g_assert (segment_start (ce, parent) <= offset);
+	g_assert (segment_end (ce, parent) >= offset);
+	g_assert (!prev || prev->parent == parent);
+	g_assert (!next || next->parent == parent);
+	g_assert (!prev || prev->next == next);
+	g_assert (!next || next->prev == prev);
+
+	if (SEGMENT_IS_INVALID (parent))
 	{
-		ctk_source_region_add_subregion (ce->priv->refresh_region, &start, &end);
+		/* If length is zero, and we already have an invalid segment there,
+		 * do nothing. */
+		if (length == 0)
+			return;
 
-		refresh_range (ce, &start, &end);
+		segment = parent;
+	}
+	else if (SEGMENT_IS_SIMPLE (parent))
+	{
+		/* If it's a simple context, then:
+		 * if one of its ends is offset, then we just invalidate it;
+		 * otherwise, we split it into two, and insert zero-lentgh
+		 * invalid segment in the middle. */
+		if (segment_start (ce, parent) < offset && segment_end (ce, parent) > offset)
+		{
+			segment = simple_segment_split_ (ce, parent, offset);
+		}
+		else
+		{
+			segment_make_invalid_ (ce, parent);
+			segment = parent;
+		}
 	}
 	else
 	{
-		unhighlight_region (ce, &start, &end);
+		/* Just insert new zero-length invalid segment. */
+
+		new_segment = segment_new (ce, parent, NULL, offset, offset, FALSE);
+
+		new_segment->next = next;
+		new_segment->prev = prev;
+
+		if (next != NULL)
+			next->prev = new_segment;
+		else
+			parent->last_child = new_segment;
+
+		if (prev != NULL)
+			prev->next = new_segment;
+		else
+			parent->children = new_segment;
+
+		segment_index_insert (ce, new_segment);
+
+		segment = new_segment;
 	}
-}
 
-static void
-buffer_notify_highlight_syntax_cb (CtkSourceContextEngine *ce)
-{
-	gboolean highlight;
+	g_assert (!segment->children);
 
-	g_object_get (ce->priv->buffer, "highlight-syntax", &highlight, NULL);
-	enable_highlight (ce, highlight);
-}
+	if (length != 0)
+	{
+		/* now extend segment and its ancestors, and move the
+		 * segments "to the right" of them. */
+		while (segment != NULL)
+		{
+			SubPattern *sp;
+			gint start_at = segment_start (ce, segment);
+
+			for (sp = segment->sub_patterns; sp != NULL; sp = sp->next)
+			{
+				if (start_at + sp->start_at > offset)
+					sp->start_at += length;
+				if (start_at + sp->end_at > offset)
+					sp->end_at += length;
+			}
 
+			segment->length += length;
+			segment_shift_following_ (ce, segment, length);
 
-/* IDLE WORKER CODE ------------------------------------------------------- */
+			segment = segment->parent;
+		}
+	}
+
+	CHECK_TREE (ce);
+}
 
 /**
- * all_analyzed:
+ * ctk_source_context_engine_text_inserted:
  * @ce: a #CtkSourceContextEngine.
+ * @start_offset: the start of inserted text.
+ * @end_offset: the end of inserted text.
  *
- * Returns: whether everything is analyzed (but it doesn't care about the tags).
+ * Called from CtkTextBuffer::insert_text.
  */
-static gboolean
-all_analyzed (CtkSourceContextEngine *ce)
+static void
+ctk_source_context_engine_text_inserted (CtkSourceEngine *engine,
+					 gint             start_offset,
+					 gint             end_offset)
 {
-	return ce->priv->invalid == NULL && ce->priv->invalid_region.empty;
-}
+	CtkTextIter iter;
+	CtkSourceContextEngine *ce = CTK_SOURCE_CONTEXT_ENGINE (engine);
+
+	/* The source of a mirror gets the same edit. */
+	if (ce->priv->mirror_source != NULL)
+		return;
+
+	g_clear_object (&ce->priv->sync_point_region);
+	forget_highlight_cache (ce);
+	forget_background_analysis (ce);
+	forget_long_line (ce);
+
+	if (!ce->priv->disabled)
+	{
+		g_return_if_fail (start_offset < end_offset);
+
+		invalidate_region (ce, start_offset, end_offset - start_offset);
+
+		/* If end_offset is at the start of a line (enter key pressed) then
+		 * we need to invalidate the whole new line, otherwise it may not be
+		 * highlighted because the engine analyzes the previous line, end
+		 * context there is none, start context at this line is none too,
+		 * and the engine stops. */
+		ctk_text_buffer_get_iter_at_offset (ce->priv->buffer, &iter, end_offset);
+		if (ctk_text_iter_starts_line (&iter) && !ctk_text_iter_ends_line (&iter))
+		{
+			ctk_text_iter_forward_to_line_end (&iter);
+			invalidate_region (ce, ctk_text_iter_get_offset (&iter), 0);
+		}
+	}
+}
 
 /**
- * idle_worker:
- * @ce: #CtkSourceContextEngine.
+ * fix_offset_delete_one_:
+ * @offset: segment.
+ * @start: start of deleted text.
+ * @length: length of deleted text.
  *
- * Analyzes a batch in idle. Stops when
- * whole buffer is analyzed.
+ * Returns: new offset depending on location of @offset
+ * relative to deleted text.
+ * Called only from fix_offsets_delete_().
  */
-static gboolean
-idle_worker (CtkSourceContextEngine *ce)
+static inline gint
+fix_offset_delete_one_ (gint offset,
+			gint start,
+			gint length)
 {
-	gboolean retval = G_SOURCE_CONTINUE;
-
-	g_return_val_if_fail (ce->priv->buffer != NULL, G_SOURCE_REMOVE);
-
-	/* analyze batch of text */
-	update_syntax (ce, NULL, INCREMENTAL_UPDATE_TIME_SLICE);
-	CHECK_TREE (ce);
-
-	if (all_analyzed (ce))
+	if (offset > start)
 	{
-		ce->priv->incremental_update = 0;
-		retval = G_SOURCE_REMOVE;
+		if (offset >= start + length)
+			offset -= length;
+		else
+			offset = start;
 	}
 
-	return retval;
+	return offset;
 }
 
 /**
- * first_update_callback:
+ * fix_offsets_delete_:
  * @ce: a #CtkSourceContextEngine.
+ * @segment: segment.
+ * @offset: start of deleted text.
+ * @length: length of deleted text.
  *
- * Same as idle_worker, except: it runs once, and install idle_worker
- * if not everything was analyzed at once.
+ * Recursively updates offsets after deleting text. Only the children
+ * overlapping the deleted text are visited, the ones after it are
+ * moved all at once. To be called only from delete_range_().
  */
-static gboolean
-first_update_callback (CtkSourceContextEngine *ce)
+static void
+fix_offsets_delete_ (CtkSourceContextEngine *ce,
+		     Segment                *segment,
+		     gint                    offset,
+		     gint                    length)
 {
-	g_return_val_if_fail (ce->priv->buffer != NULL, G_SOURCE_REMOVE);
+	Segment *child;
+	SubPattern *sp;
+	gint old_start_at, start_at, end_at;
 
-	/* analyze batch of text */
-	update_syntax (ce, NULL, FIRST_UPDATE_TIME_SLICE);
-	CHECK_TREE (ce);
+	old_start_at = segment_start (ce, segment);
+	end_at = old_start_at + segment->length;
 
-	ce->priv->first_update = 0;
+	g_return_if_fail (end_at > offset);
 
-	if (!all_analyzed (ce))
-		install_idle_worker (ce);
+	start_at = fix_offset_delete_one_ (old_start_at, offset, length);
+	end_at = fix_offset_delete_one_ (end_at, offset, length);
 
-	return G_SOURCE_REMOVE;
+	for (child = segment_find_child_ (ce, segment, offset + 1); child != NULL; child = child->next)
+	{
+		if (segment_start (ce, child) >= offset + length)
+		{
+			child->rel_start -= length;
+			segment_shift_following_ (ce, child, -length);
+			break;
+		}
+
+		fix_offsets_delete_ (ce, child, offset, length);
+	}
+
+	for (sp = segment->sub_patterns; sp != NULL; sp = sp->next)
+	{
+		sp->start_at = fix_offset_delete_one_ (old_start_at + sp->start_at, offset, length) - start_at;
+		sp->end_at = fix_offset_delete_one_ (old_start_at + sp->end_at, offset, length) - start_at;
+	}
+
+	segment_set_start (ce, segment, start_at);
+	segment_set_end (ce, segment, end_at);
 }
 
 /**
- * install_idle_worker:
- * @ce: #CtkSourceContextEngine.
+ * delete_range_:
+ * @ce: a #CtkSourceContextEngine.
+ * @start: the start of deleted area.
+ * @end: the end of deleted area.
  *
- * Schedules reanalyzing buffer in idle.
- * Always safe to call.
+ * Updates segment tree after deletion: removes segments at deleted
+ * interval, updates tree offsets, etc.
+ * It's called only from update_tree().
  */
 static void
-install_idle_worker (CtkSourceContextEngine *ce)
+delete_range_ (CtkSourceContextEngine *ce,
+	       gint                    start,
+	       gint                    end)
 {
-	if (ce->priv->first_update == 0 && ce->priv->incremental_update == 0)
-		ce->priv->incremental_update =
-			cdk_threads_add_idle_full (INCREMENTAL_UPDATE_PRIORITY,
-			                           (GSourceFunc) idle_worker, ce, NULL);
+	g_return_if_fail (start < end);
+
+	/* FIXME adjacent invalid segments? */
+	erase_segments (ce, start, end, NULL);
+	fix_offsets_delete_ (ce, ce->priv->root_segment, start, end - start);
+
+	/* no need to invalidate at start, update_tree will do it */
+
+	CHECK_TREE (ce);
 }
 
 /**
- * install_first_update:
- * @ce: #CtkSourceContextEngine.
+ * ctk_source_context_engine_text_deleted:
+ * @ce: a #CtkSourceContextEngine.
+ * @offset: the start of deleted text.
+ * @length: the length (in characters) of deleted text.
  *
- * Schedules first_update_callback call.
- * Always safe to call.
+ * Called from CtkTextBuffer::delete_range.
  */
 static void
-install_first_update (CtkSourceContextEngine *ce)
+ctk_source_context_engine_text_deleted (CtkSourceEngine *engine,
+					gint             offset,
+					gint             length)
 {
-	if (ce->priv->first_update == 0)
-	{
-		if (ce->priv->incremental_update != 0)
-		{
-			g_source_remove (ce->priv->incremental_update);
-			ce->priv->incremental_update = 0;
-		}
-
-		ce->priv->first_update =
-			cdk_threads_add_idle_full (FIRST_UPDATE_PRIORITY,
-			                           (GSourceFunc) first_update_callback,
-			                           ce, NULL);
-	}
-}
-
-/* CtkSourceContextEngine class ------------------------------------------- */
-
-static void _ctk_source_engine_interface_init (CtkSourceEngineInterface *iface);
+	CtkSourceContextEngine *ce = CTK_SOURCE_CONTEXT_ENGINE (engine);
 
-G_DEFINE_TYPE_WITH_CODE (CtkSourceContextEngine,
-			 _ctk_source_context_engine,
-			 G_TYPE_OBJECT,
-			 G_ADD_PRIVATE (CtkSourceContextEngine)
-			 G_IMPLEMENT_INTERFACE (CTK_SOURCE_TYPE_ENGINE,
-						_ctk_source_engine_interface_init))
+	g_return_if_fail (length > 0);
 
-static GQuark
-ctk_source_context_engine_error_quark (void)
-{
-	static GQuark err_q = 0;
-	if (err_q == 0)
-		err_q = g_quark_from_static_string ("ctk-source-context-engine-error-quark");
-	return err_q;
-}
+	if (ce->priv->mirror_source != NULL)
+		return;
 
-static void
-remove_tags_hash_cb (G_GNUC_UNUSED gpointer  style,
-		     GSList                 *tags,
-		     CtkTextTagTable        *table)
-{
-	GSList *l = tags;
+	g_clear_object (&ce->priv->sync_point_region);
+	forget_highlight_cache (ce);
+	forget_background_analysis (ce);
+	forget_long_line (ce);
 
-	while (l != NULL)
+	if (!ce->priv->disabled)
 	{
-		ctk_text_tag_table_remove (table, l->data);
-		g_object_unref (l->data);
-		l = l->next;
+		invalidate_region (ce, offset, - length);
 	}
-
-	g_slist_free (tags);
 }
 
 /**
- * destroy_tags_hash:
- * @ce: #CtkSourceContextEngine.
+ * get_invalid_segment:
+ * @ce: a #CtkSourceContextEngine.
  *
- * Destroys syntax tags cache.
+ * Returns: first invalid segment, or %NULL.
  */
-static void
-destroy_tags_hash (CtkSourceContextEngine *ce)
+static Segment *
+get_invalid_segment (CtkSourceContextEngine *ce)
 {
-	g_hash_table_foreach (ce->priv->tags, (GHFunc) remove_tags_hash_cb,
-                              ctk_text_buffer_get_tag_table (ce->priv->buffer));
-	g_hash_table_destroy (ce->priv->tags);
-	ce->priv->tags = NULL;
+	g_return_val_if_fail (ce->priv->invalid_region.empty, NULL);
+	return ce->priv->invalid ? ce->priv->invalid->data : NULL;
 }
 
-static void
-destroy_context_classes_list (CtkSourceContextEngine *ce)
+/**
+ * get_invalid_line:
+ * @ce: a #CtkSourceContextEngine.
+ *
+ * Returns: first invalid line, or -1.
+ */
+static gint
+get_invalid_line (CtkSourceContextEngine *ce)
 {
-	CtkTextTagTable *table;
-	GSList *l;
-
-	table = ctk_text_buffer_get_tag_table (ce->priv->buffer);
+	CtkTextIter iter;
+	gint offset = G_MAXINT;
 
-	for (l = ce->priv->context_classes; l != NULL; l = l->next)
+	if (!ce->priv->invalid_region.empty)
 	{
-		CtkTextTag *tag = l->data;
+		gint tmp;
+		ctk_text_buffer_get_iter_at_mark (ce->priv->buffer,
+						  &iter,
+						  ce->priv->invalid_region.start);
+		tmp = ctk_text_iter_get_offset (&iter);
+		offset = MIN (offset, tmp);
+	}
 
-		ctk_text_tag_table_remove (table, tag);
-		g_object_unref (tag);
+	if (ce->priv->invalid)
+	{
+		Segment *segment = ce->priv->invalid->data;
+		offset = MIN (offset, segment_start (ce, segment));
 	}
 
-	g_slist_free (ce->priv->context_classes);
-	ce->priv->context_classes = NULL;
+	if (offset == G_MAXINT)
+		return -1;
+
+	ctk_text_buffer_get_iter_at_offset (ce->priv->buffer, &iter, offset);
+	return ctk_text_iter_get_line (&iter);
 }
 
 /**
- * ctk_source_context_engine_attach_buffer:
- * @ce: #CtkSourceContextEngine.
- * @buffer: buffer.
+ * update_tree:
+ * @ce: a #CtkSourceContextEngine.
  *
- * Detaches engine from previous buffer, and attaches to @buffer if
- * it's not %NULL.
+ * Modifies syntax tree according to data in invalid_region.
  */
 static void
-ctk_source_context_engine_attach_buffer (CtkSourceEngine *engine,
-					 CtkTextBuffer   *buffer)
+update_tree (CtkSourceContextEngine *ce)
 {
-	CtkSourceContextEngine *ce = CTK_SOURCE_CONTEXT_ENGINE (engine);
-
-	g_return_if_fail (!buffer || CTK_IS_TEXT_BUFFER (buffer));
+	InvalidRegion *region = &ce->priv->invalid_region;
+	gint start, end, delta;
+	gint erase_start, erase_end;
+	CtkTextIter iter;
+	gint64 profile_start;
 
-	if (ce->priv->buffer == buffer)
+	if (region->empty)
 		return;
 
-	/* Detach previous buffer if there is one. */
-	if (ce->priv->buffer != NULL)
-	{
-		g_signal_handlers_disconnect_by_func (ce->priv->buffer,
-						      (gpointer) buffer_notify_highlight_syntax_cb,
-						      ce);
+	profile_start = highlight_profile_start ();
 
-		if (ce->priv->first_update != 0)
-			g_source_remove (ce->priv->first_update);
-		if (ce->priv->incremental_update != 0)
-			g_source_remove (ce->priv->incremental_update);
-		ce->priv->first_update = 0;
-		ce->priv->incremental_update = 0;
+	ctk_text_buffer_get_iter_at_mark (ce->priv->buffer, &iter, region->start);
+	start = ctk_text_iter_get_offset (&iter);
+	ctk_text_buffer_get_iter_at_mark (ce->priv->buffer, &iter, region->end);
+	end = ctk_text_iter_get_offset (&iter);
 
-		if (ce->priv->root_segment != NULL)
-			segment_destroy (ce, ce->priv->root_segment);
-		if (ce->priv->root_context != NULL)
-			context_unref (ce->priv->root_context);
-		g_assert (!ce->priv->invalid);
-		g_slist_free (ce->priv->invalid);
-		ce->priv->root_segment = NULL;
-		ce->priv->root_context = NULL;
-		ce->priv->invalid = NULL;
+	delta = region->delta;
 
-		if (ce->priv->invalid_region.start != NULL)
-			ctk_text_buffer_delete_mark (ce->priv->buffer,
-						     ce->priv->invalid_region.start);
-		if (ce->priv->invalid_region.end != NULL)
-			ctk_text_buffer_delete_mark (ce->priv->buffer,
-						     ce->priv->invalid_region.end);
-		ce->priv->invalid_region.start = NULL;
-		ce->priv->invalid_region.end = NULL;
+	g_assert (start <= MIN (end, end - delta));
 
-		/* this deletes tags from the tag table, therefore there is no need
-		 * in removing tags from the text (it may be very slow).
-		 * FIXME: don't we want to just destroy and forget everything when
-		 * the buffer is destroyed? Removing tags is still slower than doing
-		 * nothing. Caveat: if tag table is shared with other buffer, we do
-		 * need to remove tags. */
-		destroy_tags_hash (ce);
-		ce->priv->n_tags = 0;
+	/* Here start and end are actual offsets in the buffer (they do not match offsets
+	 * in the tree if delta is not zero); delta is how much was inserted/removed.
+	 * First, we insert/delete range from the tree, to make offsets in tree
+	 * match offsets in the buffer. Then, create an invalid segment for the rest
+	 * of the area if needed. */
 
-		destroy_context_classes_list (ce);
+	if (delta > 0)
+		insert_range (ce, start, delta);
+	else if (delta < 0)
+		delete_range_ (ce, end, end - delta);
 
-		g_clear_object (&ce->priv->refresh_region);
+	if (delta <= 0)
+	{
+		erase_start = start;
+		erase_end = end;
+	}
+	else
+	{
+		erase_start = start + delta;
+		erase_end = end;
 	}
 
-	ce->priv->buffer = buffer;
-
-	if (buffer != NULL)
+	if (erase_start < erase_end)
 	{
-		ContextDefinition *main_definition;
-		CtkTextIter start, end;
+		erase_segments (ce, erase_start, erase_end, NULL);
+		create_segment (ce, ce->priv->root_segment, NULL, erase_start, erase_end, FALSE, NULL);
+	}
+	else if (get_invalid_at (ce, start) == NULL)
+	{
+		insert_range (ce, start, 0);
+	}
 
-		main_definition = ctk_source_context_data_lookup_root (ce->priv->ctx_data);
+	region->empty = TRUE;
 
-		/* If we don't abort here, we will crash later (#485661). But it should
-		 * never happen, _ctk_source_context_data_finish_parse checks main context. */
-		g_assert (main_definition != NULL);
+	highlight_profile_stop (&ce->priv->ctx_data->profile.tree_time, profile_start);
 
-		ce->priv->root_context = context_new (NULL, main_definition, NULL, NULL, FALSE);
-		ce->priv->root_segment = create_segment (ce, NULL, ce->priv->root_context, 0, 0, TRUE, NULL);
+#ifdef ENABLE_CHECK_TREE
+	g_assert (get_invalid_at (ce, start) != NULL);
+	CHECK_TREE (ce);
+#endif
+}
 
-		ce->priv->tags = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
-		ce->priv->context_classes = NULL;
+/**
+ * mirror_update_highlight:
+ * @ce: a mirror #CtkSourceContextEngine.
+ * @start: start of area to update.
+ * @end: start of area to update.
+ * @synchronous: whether it should block until everything
+ * is analyzed/highlighted.
+ *
+ * Same as ctk_source_context_engine_update_highlight(), but the area is
+ * analyzed by the source of @ce, and only highlighted by @ce.
+ */
+static void
+mirror_update_highlight (CtkSourceContextEngine *ce,
+			 const CtkTextIter      *start,
+			 const CtkTextIter      *end,
+			 gboolean                synchronous)
+{
+	CtkSourceContextEngine *source = ce->priv->mirror_source;
+	gint invalid_line;
+	gint end_line;
 
-		ctk_text_buffer_get_bounds (buffer, &start, &end);
-		ce->priv->invalid_region.start = ctk_text_buffer_create_mark (buffer, NULL,
-									      &start, TRUE);
-		ce->priv->invalid_region.end = ctk_text_buffer_create_mark (buffer, NULL,
-									    &end, FALSE);
+	if (source->priv->buffer == NULL || source->priv->disabled ||
+	    source->priv->freeze_count > 0)
+		return;
 
-		if (ctk_text_buffer_get_char_count (buffer) != 0)
-		{
-			ce->priv->invalid_region.empty = FALSE;
-			ce->priv->invalid_region.delta = ctk_text_buffer_get_char_count (buffer);
-		}
-		else
-		{
-			ce->priv->invalid_region.empty = TRUE;
-			ce->priv->invalid_region.delta = 0;
-		}
+	invalid_line = get_invalid_line (source);
+	end_line = ctk_text_iter_get_line (end);
 
-		g_object_get (buffer, "highlight-syntax", &ce->priv->highlight, NULL);
-		ce->priv->refresh_region = ctk_source_region_new (buffer);
+	if (ctk_text_iter_starts_line (end) && end_line > 0)
+		end_line -= 1;
 
-		g_signal_connect_swapped (buffer,
-					  "notify::highlight-syntax",
-					  G_CALLBACK (buffer_notify_highlight_syntax_cb),
-					  ce);
+	if (invalid_line < 0 || invalid_line > end_line)
+	{
+		ensure_highlighted (ce, start, end);
+	}
+	else if (synchronous)
+	{
+		CtkTextIter source_end;
 
-		install_first_update (ce);
+		ctk_text_buffer_get_iter_at_offset (source->priv->buffer,
+						    &source_end,
+						    ctk_text_iter_get_offset (end));
+
+		update_syntax (source, &source_end, 0);
+		ensure_highlighted (ce, start, end);
+	}
+	else
+	{
+		if (ctk_text_iter_get_line (start) < invalid_line)
+		{
+			CtkTextIter valid_end = *start;
+
+			ctk_text_iter_set_line (&valid_end, invalid_line);
+			ensure_highlighted (ce, start, &valid_end);
+		}
+
+		/* The source refreshes the mirrors as it goes. */
+		install_first_update (source);
 	}
 }
 
 /**
- * disable_syntax_analysis:
- * @ce: #CtkSourceContextEngine.
+ * ctk_source_context_engine_update_highlight:
+ * @ce: a #CtkSourceContextEngine.
+ * @start: start of area to update.
+ * @end: start of area to update.
+ * @synchronous: whether it should block until everything
+ * is analyzed/highlighted.
  *
- * Dsiables highlighting in case of errors (currently if highlighting
- * a single line took too long, so that highlighting doesn't freeze
- * text editor).
+ * CtkSourceEngine::update_highlight method.
+ *
+ * Makes sure the area is analyzed and highlighted. If @synchronous
+ * is %FALSE, then it queues idle worker.
  */
 static void
-disable_syntax_analysis (CtkSourceContextEngine *ce)
+ctk_source_context_engine_update_highlight (CtkSourceEngine   *engine,
+					    const CtkTextIter *start,
+					    const CtkTextIter *end,
+					    gboolean           synchronous)
 {
-	if (!ce->priv->disabled)
+	gint invalid_line;
+	gint end_line;
+	CtkSourceContextEngine *ce = CTK_SOURCE_CONTEXT_ENGINE (engine);
+
+	if (!ce->priv->highlight || ce->priv->disabled || ce->priv->freeze_count > 0)
+		return;
+
+	if (ce->priv->mirror_source != NULL)
 	{
-		ce->priv->disabled = TRUE;
-		ctk_source_context_engine_attach_buffer (CTK_SOURCE_ENGINE (ce), NULL);
-		/* FIXME maybe emit some signal here? */
+		mirror_update_highlight (ce, start, end, synchronous);
+		return;
 	}
-}
 
-static void
-set_tag_style_hash_cb (const char             *style,
-		       GSList                 *tags,
-		       CtkSourceContextEngine *ce)
-{
-	while (tags != NULL)
+	invalid_line = get_invalid_line (ce);
+	end_line = ctk_text_iter_get_line (end);
+
+	if (ctk_text_iter_starts_line (end) && end_line > 0)
+		end_line -= 1;
+
+	if (invalid_line < 0 || invalid_line > end_line)
 	{
-		set_tag_style (ce, tags->data, style);
-		tags = tags->next;
+		ensure_highlighted (ce, start, end);
+	}
+	else if (synchronous)
+	{
+		/* analyze whole region */
+		update_syntax (ce, end, 0);
+		ensure_highlighted (ce, start, end);
+	}
+	else
+	{
+		if (ctk_text_iter_get_line (start) < invalid_line)
+		{
+			CtkTextIter valid_end = *start;
+
+			ctk_text_iter_set_line (&valid_end, invalid_line);
+			ensure_highlighted (ce, start, &valid_end);
+		}
+		else if (ctk_text_iter_get_line (start) - invalid_line > SYNC_POINT_DISTANCE &&
+			 CTK_SOURCE_IS_BUFFER (ce->priv->buffer) &&
+			 ctk_source_buffer_get_highlight_sync_points (CTK_SOURCE_BUFFER (ce->priv->buffer)))
+		{
+			highlight_from_sync_point (ce, start, end);
+		}
+
+		install_first_update (ce);
 	}
 }
 
 /**
- * ctk_source_context_engine_set_style_scheme:
- * @engine: #CtkSourceContextEngine.
- * @scheme: #CtkSourceStyleScheme to set.
+ * enable_highlight:
+ * @ce: a #CtkSourceContextEngine.
+ * @enable: whether to enable highlighting.
  *
- * CtkSourceEngine::set_style_scheme method.
- * Sets current style scheme, updates tag styles and everything.
+ * Whether to highlight (i.e. apply tags) analyzed area.
+ * Note that this does not turn on/off the analyzis stuff,
+ * it affects only text tags.
  */
 static void
-ctk_source_context_engine_set_style_scheme (CtkSourceEngine      *engine,
-					    CtkSourceStyleScheme *scheme)
+enable_highlight (CtkSourceContextEngine *ce,
+		  gboolean                enable)
 {
-	CtkSourceContextEngine *ce;
+	CtkTextIter start, end;
 
-	g_return_if_fail (CTK_SOURCE_IS_CONTEXT_ENGINE (engine));
-	g_return_if_fail (CTK_SOURCE_IS_STYLE_SCHEME (scheme) || scheme == NULL);
+	if (!enable == !ce->priv->highlight)
+		return;
 
-	ce = CTK_SOURCE_CONTEXT_ENGINE (engine);
+	ce->priv->highlight = enable != 0;
+	ctk_text_buffer_get_bounds (CTK_TEXT_BUFFER (ce->priv->buffer),
+				    &start, &end);
 
-	if (g_set_object (&ce->priv->style_scheme, scheme))
+	if (enable)
 	{
-		g_hash_table_foreach (ce->priv->tags, (GHFunc) set_tag_style_hash_cb, ce);
+		ctk_source_region_add_subregion (ce->priv->refresh_region, &start, &end);
+
+		refresh_range (ce, &start, &end);
+	}
+	else
+	{
+		unhighlight_region (ce, &start, &end);
 	}
 }
 
 static void
-ctk_source_context_engine_finalize (GObject *object)
+buffer_notify_highlight_syntax_cb (CtkSourceContextEngine *ce)
 {
-	CtkSourceContextEngine *ce = CTK_SOURCE_CONTEXT_ENGINE (object);
+	gboolean highlight;
 
-	if (ce->priv->buffer != NULL)
-	{
-		g_critical ("finalizing engine with attached buffer");
-		/* Disconnect the buffer (if there is one), which destroys almost
-		 * everything. */
-		ctk_source_context_engine_attach_buffer (CTK_SOURCE_ENGINE (ce), NULL);
-	}
+	g_object_get (ce->priv->buffer, "highlight-syntax", &highlight, NULL);
+	enable_highlight (ce, highlight);
+}
 
-	g_assert (!ce->priv->tags);
-	g_assert (!ce->priv->root_context);
-	g_assert (!ce->priv->root_segment);
+/**
+ * enable_highlight_on_draw:
+ * @ce: a #CtkSourceContextEngine.
+ * @enable: whether to only tag the text being drawn.
+ *
+ * Switches CtkSourceBuffer:highlight-on-draw mode. When it is turned on,
+ * all the tags are removed and the text is tagged again as it is drawn;
+ * when it is turned off, the whole buffer is tagged again.
+ */
+static void
+enable_highlight_on_draw (CtkSourceContextEngine *ce,
+			  gboolean                enable)
+{
+	CtkTextIter start, end;
+	GSList *l;
 
-	if (ce->priv->first_update != 0)
-	{
-		g_source_remove (ce->priv->first_update);
-		ce->priv->first_update = 0;
-	}
+	if (!enable == !ce->priv->highlight_on_draw)
+		return;
 
-	if (ce->priv->incremental_update != 0)
+	ce->priv->highlight_on_draw = enable != 0;
+	ctk_text_buffer_get_bounds (CTK_TEXT_BUFFER (ce->priv->buffer),
+				    &start, &end);
+
+	if (enable)
 	{
-		g_source_remove (ce->priv->incremental_update);
-		ce->priv->incremental_update = 0;
-	}
+		unhighlight_region (ce, &start, &end);
 
-	_ctk_source_context_data_unref (ce->priv->ctx_data);
+		for (l = ce->priv->context_classes; l != NULL; l = l->next)
+		{
+			ctk_text_buffer_remove_tag (ce->priv->buffer, l->data, &start, &end);
+		}
 
-	if (ce->priv->style_scheme != NULL)
-		g_object_unref (ce->priv->style_scheme);
+		ce->priv->tagged_region = ctk_source_region_new (ce->priv->buffer);
+		ce->priv->n_tagged_chars = 0;
+	}
+	else
+	{
+		g_clear_object (&ce->priv->tagged_region);
+	}
 
-	G_OBJECT_CLASS (_ctk_source_context_engine_parent_class)->finalize (object);
+	ctk_source_region_add_subregion (ce->priv->refresh_region, &start, &end);
+	refresh_range (ce, &start, &end);
 }
 
 static void
-_ctk_source_engine_interface_init (CtkSourceEngineInterface *iface)
+buffer_notify_highlight_on_draw_cb (CtkSourceContextEngine *ce)
 {
-	iface->attach_buffer = ctk_source_context_engine_attach_buffer;
-	iface->text_inserted = ctk_source_context_engine_text_inserted;
-	iface->text_deleted = ctk_source_context_engine_text_deleted;
-	iface->update_highlight = ctk_source_context_engine_update_highlight;
-	iface->set_style_scheme = ctk_source_context_engine_set_style_scheme;
+	gboolean highlight_on_draw;
+
+	g_object_get (ce->priv->buffer, "highlight-on-draw", &highlight_on_draw, NULL);
+	enable_highlight_on_draw (ce, highlight_on_draw);
 }
 
-static void
-_ctk_source_context_engine_class_init (CtkSourceContextEngineClass *klass)
-{
-	GObjectClass *object_class = G_OBJECT_CLASS (klass);
 
-	object_class->finalize = ctk_source_context_engine_finalize;
-}
+/* IDLE WORKER CODE ------------------------------------------------------- */
 
-static void
-_ctk_source_context_engine_init (CtkSourceContextEngine *ce)
+/**
+ * all_analyzed:
+ * @ce: a #CtkSourceContextEngine.
+ *
+ * Returns: whether everything is analyzed (but it doesn't care about the tags).
+ */
+static gboolean
+all_analyzed (CtkSourceContextEngine *ce)
 {
-	ce->priv = _ctk_source_context_engine_get_instance_private (ce);
+	return ce->priv->invalid == NULL && ce->priv->invalid_region.empty;
 }
 
-CtkSourceContextEngine *
-_ctk_source_context_engine_new (CtkSourceContextData *ctx_data)
+/**
+ * get_incremental_time_slice:
+ * @ce: #CtkSourceContextEngine.
+ *
+ * With %CTK_SOURCE_HIGHLIGHT_SCHEDULE_FRAME_CLOCK, and while the view
+ * which drew the buffer last is producing frames, the time slice lasts
+ * until FRAME_CLOCK_MARGIN milliseconds before the next frame, so that
+ * the analysis does not make the view drop frames on fast displays.
+ *
+ * Returns: time (in milliseconds) allowed for one cycle of background
+ * analysis.
+ */
+static gint
+get_incremental_time_slice (CtkSourceContextEngine *ce)
 {
-	CtkSourceContextEngine *ce;
+	CtkSourceBuffer *buffer;
+	CdkFrameClock *frame_clock;
+	CdkFrameTimings *timings;
+	gint64 frame_time;
+	gint64 refresh_interval;
+	gint64 presentation_time;
+	gint64 elapsed;
+	gint64 remaining;
 
-	g_return_val_if_fail (ctx_data != NULL, NULL);
-	g_return_val_if_fail (ctx_data->lang != NULL, NULL);
+	if (!CTK_SOURCE_IS_BUFFER (ce->priv->buffer))
+		return INCREMENTAL_UPDATE_TIME_SLICE;
 
-	ce = g_object_new (CTK_SOURCE_TYPE_CONTEXT_ENGINE, NULL);
-	ce->priv->ctx_data = _ctk_source_context_data_ref (ctx_data);
+	buffer = CTK_SOURCE_BUFFER (ce->priv->buffer);
 
-	return ce;
+	if (ctk_source_buffer_get_highlight_schedule (buffer) != CTK_SOURCE_HIGHLIGHT_SCHEDULE_FRAME_CLOCK)
+		return INCREMENTAL_UPDATE_TIME_SLICE;
+
+	frame_clock = _ctk_source_buffer_get_frame_clock (buffer);
+
+	if (frame_clock == NULL)
+		return INCREMENTAL_UPDATE_TIME_SLICE;
+
+	timings = cdk_frame_clock_get_timings (frame_clock,
+					       cdk_frame_clock_get_frame_counter (frame_clock));
+
+	if (timings == NULL)
+		return INCREMENTAL_UPDATE_TIME_SLICE;
+
+	frame_time = cdk_frame_timings_get_frame_time (timings);
+	cdk_frame_clock_get_refresh_info (frame_clock,
+					  frame_time,
+					  &refresh_interval,
+					  &presentation_time);
+
+	elapsed = g_get_monotonic_time () - frame_time;
+
+	/* The view is not being redrawn, nothing to keep smooth. */
+	if (refresh_interval <= 0 || elapsed < 0 || elapsed > 2 * refresh_interval)
+		return INCREMENTAL_UPDATE_TIME_SLICE;
+
+	remaining = refresh_interval - elapsed % refresh_interval;
+	remaining = remaining / 1000 - FRAME_CLOCK_MARGIN;
+
+	return CLAMP (remaining, FRAME_CLOCK_MIN_TIME_SLICE, INCREMENTAL_UPDATE_TIME_SLICE);
 }
 
 /**
- * _ctk_source_context_data_new:
- * @lang: #CtkSourceLanguage.
+ * idle_worker:
+ * @ce: #CtkSourceContextEngine.
  *
- * Creates new context definition set. It does not set lang->priv->ctx_data,
- * that's lang business.
+ * Analyzes a batch in idle. Stops when
+ * whole buffer is analyzed.
  */
-CtkSourceContextData *
-_ctk_source_context_data_new (CtkSourceLanguage *lang)
+static gboolean
+idle_worker (CtkSourceContextEngine *ce)
 {
-	CtkSourceContextData *ctx_data;
+	gboolean retval = G_SOURCE_CONTINUE;
 
-	g_return_val_if_fail (CTK_SOURCE_IS_LANGUAGE (lang), NULL);
+	g_return_val_if_fail (ce->priv->buffer != NULL, G_SOURCE_REMOVE);
 
-	ctx_data = g_slice_new (CtkSourceContextData);
-	ctx_data->ref_count = 1;
-	ctx_data->lang = lang;
-	ctx_data->definitions = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
-						       (GDestroyNotify) context_definition_unref);
+	/* analyze batch of text */
+	update_syntax (ce, NULL, get_incremental_time_slice (ce));
+	CHECK_TREE (ce);
 
-	return ctx_data;
-}
+	if (all_analyzed (ce))
+	{
+		ce->priv->incremental_update = 0;
+		retval = G_SOURCE_REMOVE;
+	}
 
-CtkSourceContextData *
-_ctk_source_context_data_ref (CtkSourceContextData *ctx_data)
-{
-	g_return_val_if_fail (ctx_data != NULL, NULL);
-	ctx_data->ref_count++;
-	return ctx_data;
+	return retval;
 }
 
 /**
- * _ctk_source_context_data_unref:
- * @ctx_data: #CtkSourceContextData.
+ * first_update_callback:
+ * @ce: a #CtkSourceContextEngine.
  *
- * Decreases reference count in ctx_data. When reference count
- * drops to zero, ctx_data is freed, and ctx_data->lang->priv->ctx_data
- * is unset.
+ * Same as idle_worker, except: it runs once, and install idle_worker
+ * if not everything was analyzed at once.
  */
-void
-_ctk_source_context_data_unref (CtkSourceContextData *ctx_data)
+static gboolean
+first_update_callback (CtkSourceContextEngine *ce)
 {
-	g_return_if_fail (ctx_data != NULL);
+	g_return_val_if_fail (ce->priv->buffer != NULL, G_SOURCE_REMOVE);
 
-	if (--ctx_data->ref_count == 0)
-	{
-		if (ctx_data->lang != NULL && ctx_data->lang->priv != NULL &&
-		    ctx_data->lang->priv->ctx_data == ctx_data)
-			ctx_data->lang->priv->ctx_data = NULL;
-		g_hash_table_destroy (ctx_data->definitions);
-		g_slice_free (CtkSourceContextData, ctx_data);
-	}
-}
+	/* analyze batch of text */
+	update_syntax (ce, NULL, FIRST_UPDATE_TIME_SLICE);
+	CHECK_TREE (ce);
 
-/* SYNTAX TREE ------------------------------------------------------------ */
+	ce->priv->first_update = 0;
+
+	if (!all_analyzed (ce))
+		install_idle_worker (ce);
+
+	return G_SOURCE_REMOVE;
+}
 
 /**
- * apply_sub_patterns:
- * @contextstate: a #Context.
- * @line_starts_at: beginning offset of the line.
- * @line: the line to analyze.
- * @line_pos: the position inside @line.
- * @line_length: the length of @line.
- * @regex: regex that matched.
- * @where: kind of sub patterns to apply.
+ * install_idle_worker:
+ * @ce: #CtkSourceContextEngine.
  *
- * Applies sub patterns of kind @where to the matched text.
+ * Schedules reanalyzing buffer in idle.
+ * Always safe to call.
  */
 static void
-apply_sub_patterns (Segment         *state,
-		    LineInfo        *line,
-		    CtkSourceRegex  *regex,
-		    SubPatternWhere  where)
+install_idle_worker (CtkSourceContextEngine *ce)
 {
-	GSList *sub_pattern_list = state->context->definition->sub_patterns;
+	if (ce->priv->freeze_count > 0)
+		return;
 
-	if (SEGMENT_IS_CONTAINER (state))
-	{
-		gint start_pos;
-		gint end_pos;
+	/* The thread analyzes the whole buffer, see
+	 * background_analysis_done(). */
+	if (ce->priv->analysis_cancellable != NULL)
+		return;
 
-		_ctk_source_regex_fetch_pos (regex, line->text, 0, &start_pos, &end_pos);
+	if (ce->priv->first_update == 0 && ce->priv->incremental_update == 0)
+		ce->priv->incremental_update =
+			cdk_threads_add_idle_full (INCREMENTAL_UPDATE_PRIORITY,
+			                           (GSourceFunc) idle_worker, ce, NULL);
+}
 
-		if (where == SUB_PATTERN_WHERE_START)
-		{
-			if (line->start_at + start_pos != state->start_at)
-				g_critical ("%s: oops", G_STRLOC);
-			else if (line->start_at + end_pos > state->end_at)
-				g_critical ("%s: oops", G_STRLOC);
-			else
-				state->start_len = line->start_at + end_pos - state->start_at;
-		}
-		else
-		{
-			if (line->start_at + start_pos < state->start_at)
-				g_critical ("%s: oops", G_STRLOC);
-			else if (line->start_at + end_pos != state->end_at)
-				g_critical ("%s: oops", G_STRLOC);
-			else
-				state->end_len = state->end_at - line->start_at - start_pos;
-		}
-	}
+/**
+ * install_first_update:
+ * @ce: #CtkSourceContextEngine.
+ *
+ * Schedules first_update_callback call.
+ * Always safe to call.
+ */
+static void
+install_first_update (CtkSourceContextEngine *ce)
+{
+	if (ce->priv->freeze_count > 0)
+		return;
 
-	while (sub_pattern_list != NULL)
+	if (ce->priv->first_update == 0)
 	{
-		SubPatternDefinition *sp_def = sub_pattern_list->data;
-
-		if (sp_def->where == where)
+		if (ce->priv->incremental_update != 0)
 		{
-			gint start_pos;
-			gint end_pos;
-
-			if (sp_def->is_named)
-			{
-				_ctk_source_regex_fetch_named_pos (regex,
-								   line->text,
-								   sp_def->u.name,
-								   &start_pos,
-								   &end_pos);
-			}
-			else
-			{
-				_ctk_source_regex_fetch_pos (regex,
-							     line->text,
-							     sp_def->u.num,
-							     &start_pos,
-							     &end_pos);
-			}
-
-			if (start_pos >= 0 && start_pos != end_pos)
-			{
-				sub_pattern_new (state,
-						 line->start_at + start_pos,
-						 line->start_at + end_pos,
-						 sp_def);
-			}
+			g_source_remove (ce->priv->incremental_update);
+			ce->priv->incremental_update = 0;
 		}
 
-		sub_pattern_list = sub_pattern_list->next;
+		ce->priv->first_update =
+			cdk_threads_add_idle_full (FIRST_UPDATE_PRIORITY,
+			                           (GSourceFunc) first_update_callback,
+			                           ce, NULL);
 	}
 }
 
 /**
- * can_apply_match:
- * @state: the current state of the parser.
- * @line: the line to analyze.
- * @match_start: start position of match, bytes.
- * @match_end: where to put end of match, bytes.
- * @where: kind of sub patterns to apply.
+ * ctk_source_context_engine_freeze:
+ * @ce: a #CtkSourceContextEngine.
  *
- * See apply_match(), this function is a helper function
- * called from where, it doesn't modify syntax tree.
+ * CtkSourceEngine::freeze method.
  *
- * Returns: %TRUE if the match can be applied.
+ * Suspends the analysis until the matching thaw. The edits made in
+ * the meantime only extend the invalid region, the way they do between
+ * two runs of first_update_callback(); the tree is updated once, when
+ * the analysis resumes.
  */
-static gboolean
-can_apply_match (Context        *state,
-		 LineInfo       *line,
-		 gint            match_start,
-		 gint           *match_end,
-		 CtkSourceRegex *regex)
+static void
+ctk_source_context_engine_freeze (CtkSourceEngine *engine)
 {
-	gint end_match_pos;
-	gboolean ancestor_ends;
-	gint pos;
-
-	ancestor_ends = FALSE;
+	CtkSourceContextEngine *ce = CTK_SOURCE_CONTEXT_ENGINE (engine);
 
-	/* end_match_pos is the position of the end of the matched regex. */
-	_ctk_source_regex_fetch_pos_bytes (regex, 0, NULL, &end_match_pos);
+	if (ce->priv->freeze_count++ > 0)
+		return;
 
-	g_assert (end_match_pos <= line->byte_length);
+	if (ce->priv->first_update != 0)
+	{
+		g_source_remove (ce->priv->first_update);
+		ce->priv->first_update = 0;
+	}
 
-	/* Verify if an ancestor ends in the matched text. */
-	if (ANCESTOR_CAN_END_CONTEXT (state) &&
-	    /* there is no middle of zero-length match */
-	    match_start < end_match_pos)
+	if (ce->priv->incremental_update != 0)
 	{
-		pos = match_start + 1;
+		g_source_remove (ce->priv->incremental_update);
+		ce->priv->incremental_update = 0;
+	}
+}
 
-		while (pos < end_match_pos)
-		{
-			if (ancestor_context_ends_here (state, line, pos))
-			{
-				ancestor_ends = TRUE;
-				break;
-			}
+/**
+ * ctk_source_context_engine_thaw:
+ * @ce: a #CtkSourceContextEngine.
+ *
+ * CtkSourceEngine::thaw method.
+ */
+static void
+ctk_source_context_engine_thaw (CtkSourceEngine *engine)
+{
+	CtkSourceContextEngine *ce = CTK_SOURCE_CONTEXT_ENGINE (engine);
 
-			pos = g_utf8_next_char (line->text + pos) - line->text;
-		}
-	}
-	else
+	g_return_if_fail (ce->priv->freeze_count > 0);
+
+	if (--ce->priv->freeze_count > 0)
+		return;
+
+	if (ce->priv->buffer == NULL || ce->priv->disabled)
+		return;
+
+	if (ce->priv->mirror_source == NULL && !all_analyzed (ce))
 	{
-		pos = end_match_pos;
+		install_first_update (ce);
+		schedule_background_analysis (ce, TRUE);
 	}
 
-	if (ancestor_ends)
+	/* The views skipped the highlighting of what they drew meanwhile,
+	 * make them come back for it. */
+	if (ce->priv->highlight && !ctk_source_region_is_empty (ce->priv->refresh_region))
 	{
-		/* An ancestor ends in the middle of the match, we verify
-		 * if the regex matches against the available string before
-		 * the end of the ancestor.
-		 * For instance in C a net-address context matches even if
-		 * it contains the end of a multi-line comment. */
-		if (!_ctk_source_regex_match (regex, line->text, pos, match_start))
-		{
-			/* This match is not valid, so we can try to match
-			 * the next definition, so the position should not
-			 * change. */
-			return FALSE;
-		}
+		CtkTextIter start, end;
+
+		ctk_source_region_get_bounds (ce->priv->refresh_region, &start, &end);
+		g_signal_emit_by_name (ce->priv->buffer, "highlight-updated", &start, &end);
 	}
+}
 
-	*match_end = pos;
-	return TRUE;
+/* CtkSourceContextEngine class ------------------------------------------- */
+
+static void _ctk_source_engine_interface_init (CtkSourceEngineInterface *iface);
+
+G_DEFINE_TYPE_WITH_CODE (CtkSourceContextEngine,
+			 _ctk_source_context_engine,
+			 G_TYPE_OBJECT,
+			 G_ADD_PRIVATE (CtkSourceContextEngine)
+			 G_IMPLEMENT_INTERFACE (CTK_SOURCE_TYPE_ENGINE,
+						_ctk_source_engine_interface_init))
+
+static GQuark
+ctk_source_context_engine_error_quark (void)
+{
+	static GQuark err_q = 0;
+	if (err_q == 0)
+		err_q = g_quark_from_static_string ("ctk-source-context-engine-error-quark");
+	return err_q;
 }
 
-static gint
-line_pos_to_offset (LineInfo *line,
-		    gint      pos)
+static void
+remove_tags_hash_cb (G_GNUC_UNUSED gpointer  style,
+		     GSList                 *tags,
+		     CtkTextTagTable        *table)
 {
-	if (line->char_length != line->byte_length)
-		pos = g_utf8_pointer_to_offset (line->text, line->text + pos);
-	return line->start_at + pos;
+	GSList *l = tags;
+
+	while (l != NULL)
+	{
+		ctk_text_tag_table_remove (table, l->data);
+		g_object_unref (l->data);
+		l = l->next;
+	}
+
+	g_slist_free (tags);
 }
 
 /**
- * apply_match:
- * @state: the current state of the parser.
- * @line: the line to analyze.
- * @line_pos: position in the line, bytes.
- * @regex: regex that matched.
- * @where: kind of sub patterns to apply.
- *
- * Moves @line_pos after the matched text. @line_pos is not
- * updated and the function returns %FALSE if the match cannot be
- * applied because an ancestor ends in the middle of the matched
- * text.
- *
- * If the match can be applied the function applies the appropriate
- * sub patterns.
+ * destroy_tags_hash:
+ * @ce: #CtkSourceContextEngine.
  *
- * Returns: %TRUE if the match can be applied.
+ * Destroys syntax tags cache.
  */
-static gboolean
-apply_match (Segment         *state,
-	     LineInfo        *line,
-	     gint            *line_pos,
-	     CtkSourceRegex  *regex,
-	     SubPatternWhere  where)
+static void
+destroy_tags_hash (CtkSourceContextEngine *ce)
 {
-	gint match_end;
+	g_hash_table_foreach (ce->priv->tags, (GHFunc) remove_tags_hash_cb,
+                              ctk_text_buffer_get_tag_table (ce->priv->buffer));
+	g_hash_table_destroy (ce->priv->tags);
+	ce->priv->tags = NULL;
+}
 
-	if (!can_apply_match (state->context, line, *line_pos, &match_end, regex))
-		return FALSE;
+static void
+destroy_context_classes_list (CtkSourceContextEngine *ce)
+{
+	CtkTextTagTable *table;
+	GSList *l;
 
-	segment_extend (state, line_pos_to_offset (line, match_end));
-	apply_sub_patterns (state, line, regex, where);
-	*line_pos = match_end;
+	table = ctk_text_buffer_get_tag_table (ce->priv->buffer);
 
-	return TRUE;
+	for (l = ce->priv->context_classes; l != NULL; l = l->next)
+	{
+		CtkTextTag *tag = l->data;
+
+		ctk_text_tag_table_remove (table, tag);
+		g_object_unref (tag);
+	}
+
+	g_slist_free (ce->priv->context_classes);
+	ce->priv->context_classes = NULL;
 }
 
 /**
- * create_reg_all:
- * @context: context.
- * @definition: context definition.
- *
- * Creates regular expression for all possible transitions: it
- * combines terminating regex, terminating regexes of parent
- * contexts if those can terminate this one, and start regexes
- * of child contexts.
- *
- * It takes as an argument actual context or a context definition. In
- * case when context end depends on start (\%{foo@start} references),
- * it must use the context, definition is not enough. If there are no
- * those references, then the reg_all is created right in the definition
- * when no contexts exist yet. This is why this function has its funny
- * arguments.
+ * ctk_source_context_engine_attach_buffer:
+ * @ce: #CtkSourceContextEngine.
+ * @buffer: buffer.
  *
- * Returns: resulting regex or %NULL when pcre failed to compile the regex.
+ * Detaches engine from previous buffer, and attaches to @buffer if
+ * it's not %NULL.
  */
-static CtkSourceRegex *
-create_reg_all (Context           *context,
-		ContextDefinition *definition)
+static void
+ctk_source_context_engine_attach_buffer (CtkSourceEngine *engine,
+					 CtkTextBuffer   *buffer)
 {
-	DefinitionsIter iter;
-	DefinitionChild *child_def;
-	GString *all;
-	CtkSourceRegex *regex;
-	GError *error = NULL;
-
-	g_return_val_if_fail ((context == NULL && definition != NULL) ||
-			      (context != NULL && definition == NULL), NULL);
+	CtkSourceContextEngine *ce = CTK_SOURCE_CONTEXT_ENGINE (engine);
 
-	if (definition == NULL)
-		definition = context->definition;
+	g_return_if_fail (!buffer || CTK_IS_TEXT_BUFFER (buffer));
 
-	all = g_string_new ("(");
+	if (ce->priv->buffer == buffer)
+		return;
 
-	/* Closing regex. */
-	if (definition->type == CONTEXT_TYPE_CONTAINER &&
-	    definition->u.start_end.end != NULL)
+	/* Detach previous buffer if there is one. */
+	if (ce->priv->buffer != NULL)
 	{
-		CtkSourceRegex *end;
-
-		if (_ctk_source_regex_is_resolved (definition->u.start_end.end))
-		{
-			end = definition->u.start_end.end;
-		}
-		else
+		if (ce->priv->mirror_source != NULL)
 		{
-			g_return_val_if_fail (context && context->end, NULL);
-			end = context->end;
-		}
-
-		g_string_append (all, _ctk_source_regex_get_pattern (end));
-		g_string_append (all, "|");
-	}
+			CtkTextIter start, end;
+			GSList *l;
 
-	/* Ancestors. */
-	if (context != NULL)
-	{
-		Context *tmp = context;
+			/* The tags of the source stay in the tag table. */
+			ctk_text_buffer_get_bounds (ce->priv->buffer, &start, &end);
+			unhighlight_region (ce, &start, &end);
 
-		while (ANCESTOR_CAN_END_CONTEXT (tmp))
-		{
-			if (!CONTEXT_EXTENDS_PARENT (tmp))
+			for (l = ce->priv->mirror_source->priv->context_classes; l != NULL; l = l->next)
 			{
-				gboolean append = TRUE;
-
-				/* Code as it is seems to be right, and seems working right.
-				 * Remove FIXME's below if everything is fine. */
-
-				if (tmp->parent->end != NULL)
-					g_string_append (all, _ctk_source_regex_get_pattern (tmp->parent->end));
-				/* FIXME ?
-				 * The old code insisted on having tmp->parent->end != NULL here,
-				 * though e.g. in case line-comment -> email-address it's not the case.
-				 * Apparently using $ fixes the problem. */
-				else if (CONTEXT_END_AT_LINE_END (tmp->parent))
-					g_string_append (all, "$");
-				/* FIXME it's not clear whether it can happen, maybe we need assert here
-				 * or parser need to check it */
-				else
-				{
-					/* g_critical ("%s: oops", G_STRLOC); */
-					append = FALSE;
-				}
-
-				if (append)
-					g_string_append (all, "|");
+				ctk_text_buffer_remove_tag (ce->priv->buffer, l->data, &start, &end);
 			}
-
-			tmp = tmp->parent;
 		}
-	}
-
-	/* Children. */
-	definition_iter_init (&iter, definition);
-	while ((child_def = definition_iter_next (&iter)) != NULL)
-	{
-		CtkSourceRegex *child_regex = NULL;
 
-		g_return_val_if_fail (child_def->resolved, NULL);
+		g_signal_handlers_disconnect_by_func (ce->priv->buffer,
+						      (gpointer) buffer_notify_highlight_syntax_cb,
+						      ce);
+		g_signal_handlers_disconnect_by_func (ce->priv->buffer,
+						      (gpointer) buffer_notify_highlight_on_draw_cb,
+						      ce);
 
-		switch (child_def->u.definition->type)
-		{
-			case CONTEXT_TYPE_CONTAINER:
-				child_regex = child_def->u.definition->u.start_end.start;
-				break;
-			case CONTEXT_TYPE_SIMPLE:
-				child_regex = child_def->u.definition->u.match;
-				break;
-			default:
-				g_return_val_if_reached (NULL);
-		}
+		if (ce->priv->first_update != 0)
+			g_source_remove (ce->priv->first_update);
+		if (ce->priv->incremental_update != 0)
+			g_source_remove (ce->priv->incremental_update);
+		ce->priv->first_update = 0;
+		ce->priv->incremental_update = 0;
 
-		if (child_regex != NULL)
-		{
-			g_string_append (all, _ctk_source_regex_get_pattern (child_regex));
-			g_string_append (all, "|");
-		}
-	}
-	definition_iter_destroy (&iter);
+		if (ce->priv->root_segment != NULL)
+			segment_destroy (ce, ce->priv->root_segment);
+		if (ce->priv->root_context != NULL)
+			context_unref (ce->priv->root_context);
+		g_assert (!ce->priv->invalid);
+		g_slist_free (ce->priv->invalid);
+		ce->priv->root_segment = NULL;
+		ce->priv->root_context = NULL;
+		ce->priv->invalid = NULL;
 
-	if (all->len > 1)
-		g_string_truncate (all, all->len - 1);
-	g_string_append (all, ")");
+		node_pool_clear (&ce->priv->segment_pool);
+		node_pool_clear (&ce->priv->sub_pattern_pool);
+		node_pool_clear (&ce->priv->index_pool);
 
-	regex = _ctk_source_regex_new (all->str, 0, &error);
+		if (ce->priv->invalid_region.start != NULL)
+			ctk_text_buffer_delete_mark (ce->priv->buffer,
+						     ce->priv->invalid_region.start);
+		if (ce->priv->invalid_region.end != NULL)
+			ctk_text_buffer_delete_mark (ce->priv->buffer,
+						     ce->priv->invalid_region.end);
+		ce->priv->invalid_region.start = NULL;
+		ce->priv->invalid_region.end = NULL;
 
-	if (regex == NULL)
-	{
-		/* regex_new could fail, for instance if there are different
-		 * named sub-patterns with the same name or if resulting regex is
-		 * too long. In this case fixing lang file helps (e.g. renaming
-		 * subpatterns, making huge keywords use bigger prefixes, etc.) */
-		g_warning (_("Cannot create a regex for all the transitions, "
-			     "the syntax highlighting process will be slower "
-			     "than usual.\nThe error was: %s"), error->message);
-		g_clear_error (&error);
-	}
+		/* this deletes tags from the tag table, therefore there is no need
+		 * in removing tags from the text (it may be very slow).
+		 * FIXME: don't we want to just destroy and forget everything when
+		 * the buffer is destroyed? Removing tags is still slower than doing
+		 * nothing. Caveat: if tag table is shared with other buffer, we do
+		 * need to remove tags. */
+		if (ce->priv->tags != NULL)
+			destroy_tags_hash (ce);
+		ce->priv->n_tags = 0;
 
-	g_string_free (all, TRUE);
-	return regex;
-}
+		destroy_context_classes_list (ce);
 
-static Context *
-context_ref (Context *context)
-{
-	if (context != NULL)
-		context->ref_count++;
-	return context;
-}
+		g_clear_object (&ce->priv->refresh_region);
+		g_clear_object (&ce->priv->sync_point_region);
+		g_clear_object (&ce->priv->tagged_region);
+		ce->priv->highlight_on_draw = FALSE;
+		forget_highlight_cache (ce);
+		forget_background_analysis (ce);
+		forget_long_line (ce);
+	}
 
-/* does not copy style */
-static Context *
-context_new (Context           *parent,
-	     ContextDefinition *definition,
-	     const gchar       *line_text,
-	     const gchar       *style,
-	     gboolean           ignore_children_style)
-{
-	Context *context;
+	ce->priv->buffer = buffer;
 
-	context = g_slice_new0 (Context);
-	context->ref_count = 1;
-	context->definition = definition;
-	context->parent = parent;
+	/* A mirror only needs to know what it has to tag again. */
+	if (buffer != NULL && ce->priv->mirror_source != NULL)
+	{
+		CtkTextIter start, end;
 
-	context->style = style;
-	context->ignore_children_style = ignore_children_style;
+		g_object_get (buffer, "highlight-syntax", &ce->priv->highlight, NULL);
+		g_signal_connect_swapped (buffer,
+					  "notify::highlight-syntax",
+					  G_CALLBACK (buffer_notify_highlight_syntax_cb),
+					  ce);
 
-	if (parent != NULL && parent->ignore_children_style)
-	{
-		context->ignore_children_style = TRUE;
-		context->style = NULL;
+		ctk_text_buffer_get_bounds (buffer, &start, &end);
+		ce->priv->refresh_region = ctk_source_region_new (buffer);
+		ctk_source_region_add_subregion (ce->priv->refresh_region, &start, &end);
 	}
-
-	if (!parent || (parent->all_ancestors_extend && CONTEXT_EXTENDS_PARENT (parent)))
+	else if (buffer != NULL)
 	{
-		context->all_ancestors_extend = TRUE;
-	}
+		ContextDefinition *main_definition;
+		CtkTextIter start, end;
 
-	if (line_text &&
-	    definition->type == CONTEXT_TYPE_CONTAINER &&
-	    definition->u.start_end.end)
-	{
-		context->end = _ctk_source_regex_resolve (definition->u.start_end.end,
-							  definition->u.start_end.start,
-							  line_text);
-	}
+		main_definition = ctk_source_context_data_lookup_root (ce->priv->ctx_data);
 
-	/* Create reg_all. If it is possibile we share the same reg_all
-	 * for more contexts storing it in the definition. */
-	if (ANCESTOR_CAN_END_CONTEXT (context) ||
-	    (definition->type == CONTEXT_TYPE_CONTAINER &&
-	     definition->u.start_end.end != NULL &&
-	     !_ctk_source_regex_is_resolved (definition->u.start_end.end)))
-	{
-		context->reg_all = create_reg_all (context, NULL);
-	}
-	else
-	{
-		if (!definition->reg_all)
-			definition->reg_all = create_reg_all (NULL, definition);
-		context->reg_all = _ctk_source_regex_ref (definition->reg_all);
-	}
+		/* If we don't abort here, we will crash later (#485661). But it should
+		 * never happen, _ctk_source_context_data_finish_parse checks main context. */
+		g_assert (main_definition != NULL);
 
-#ifdef ENABLE_DEBUG
-	{
-		GString *str = g_string_new (definition->id);
-		Context *tmp = context->parent;
-		while (tmp != NULL)
+		ce->priv->root_context = context_new (NULL, main_definition, NULL, NULL, NULL, FALSE);
+		ce->priv->root_segment = create_segment (ce, NULL, ce->priv->root_context, 0, 0, TRUE, NULL);
+
+		ce->priv->tags = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+		ce->priv->context_classes = NULL;
+
+		ctk_text_buffer_get_bounds (buffer, &start, &end);
+		ce->priv->invalid_region.start = ctk_text_buffer_create_mark (buffer, NULL,
+									      &start, TRUE);
+		ce->priv->invalid_region.end = ctk_text_buffer_create_mark (buffer, NULL,
+									    &end, FALSE);
+
+		if (ctk_text_buffer_get_char_count (buffer) != 0)
 		{
-			g_string_prepend (str, "/");
-			g_string_prepend (str, tmp->definition->id);
-			tmp = tmp->parent;
+			ce->priv->invalid_region.empty = FALSE;
+			ce->priv->invalid_region.delta = ctk_text_buffer_get_char_count (buffer);
+		}
+		else
+		{
+			ce->priv->invalid_region.empty = TRUE;
+			ce->priv->invalid_region.delta = 0;
 		}
-		g_print ("created context %s: %s\n", definition->id, str->str);
-		g_string_free (str, TRUE);
-	}
-#endif
 
-	return context;
+		g_object_get (buffer, "highlight-syntax", &ce->priv->highlight, NULL);
+		ce->priv->refresh_region = ctk_source_region_new (buffer);
+
+		g_signal_connect_swapped (buffer,
+					  "notify::highlight-syntax",
+					  G_CALLBACK (buffer_notify_highlight_syntax_cb),
+					  ce);
+
+		if (CTK_SOURCE_IS_BUFFER (buffer))
+		{
+			ce->priv->highlight_on_draw =
+				ctk_source_buffer_get_highlight_on_draw (CTK_SOURCE_BUFFER (buffer));
+
+			if (ce->priv->highlight_on_draw)
+				ce->priv->tagged_region = ctk_source_region_new (buffer);
+
+			g_signal_connect_swapped (buffer,
+						  "notify::highlight-on-draw",
+						  G_CALLBACK (buffer_notify_highlight_on_draw_cb),
+						  ce);
+		}
+
+		install_first_update (ce);
+		schedule_background_analysis (ce, TRUE);
+	}
 }
 
+/**
+ * disable_syntax_analysis:
+ * @ce: #CtkSourceContextEngine.
+ *
+ * Dsiables highlighting in case of errors (currently if highlighting
+ * a single line took too long, so that highlighting doesn't freeze
+ * text editor).
+ */
 static void
-context_unref_hash_cb (gpointer  text,
-		       Context  *context,
-		       gpointer  user_data)
+disable_syntax_analysis (CtkSourceContextEngine *ce)
 {
-	context->parent = NULL;
-	context_unref (context);
+	if (!ce->priv->disabled)
+	{
+		ce->priv->disabled = TRUE;
+
+		/* highlight_from_sync_point() detaches the buffer itself once
+		 * its tree is destroyed. */
+		if (ce->priv->sync_point_root == NULL)
+			ctk_source_context_engine_attach_buffer (CTK_SOURCE_ENGINE (ce), NULL);
+
+		/* FIXME maybe emit some signal here? */
+	}
 }
 
-static gboolean
-remove_context_cb (G_GNUC_UNUSED gpointer  text,
-		   Context                *context,
-		   Context                *target)
+static void
+set_tag_style_hash_cb (const char             *style,
+		       GSList                 *tags,
+		       CtkSourceContextEngine *ce)
 {
-	return context == target;
+	while (tags != NULL)
+	{
+		set_tag_style (ce, tags->data, style);
+		tags = tags->next;
+	}
 }
 
+/**
+ * ctk_source_context_engine_set_style_scheme:
+ * @engine: #CtkSourceContextEngine.
+ * @scheme: #CtkSourceStyleScheme to set.
+ *
+ * CtkSourceEngine::set_style_scheme method.
+ * Sets current style scheme, updates tag styles and everything.
+ */
 static void
-context_remove_child (Context *parent,
-		      Context *context)
+ctk_source_context_engine_set_style_scheme (CtkSourceEngine      *engine,
+					    CtkSourceStyleScheme *scheme)
 {
-	ContextPtr *ptr, *prev = NULL;
-	gboolean delete = TRUE;
+	CtkSourceContextEngine *ce;
 
-	g_assert (context->parent == parent);
+	g_return_if_fail (CTK_SOURCE_IS_CONTEXT_ENGINE (engine));
+	g_return_if_fail (CTK_SOURCE_IS_STYLE_SCHEME (scheme) || scheme == NULL);
 
-	for (ptr = parent->children; ptr; ptr = ptr->next)
+	ce = CTK_SOURCE_CONTEXT_ENGINE (engine);
+
+	/* A mirror uses the tags, so the style scheme, of its source. */
+	if (g_set_object (&ce->priv->style_scheme, scheme) && ce->priv->tags != NULL)
 	{
-		if (ptr->definition == context->definition)
-			break;
-		prev = ptr;
+		g_hash_table_foreach (ce->priv->tags, (GHFunc) set_tag_style_hash_cb, ce);
 	}
+}
 
-	g_assert (ptr != NULL);
+/**
+ * context_class_tags_apply:
+ * @tags: the tags of the enabled context classes.
+ * @context_classes: list of #ContextClassTag.
+ *
+ * Adds the enabled classes of @context_classes to @tags and removes
+ * the disabled ones, like apply_context_classes() does on text.
+ */
+static void
+context_class_tags_apply (GPtrArray *tags,
+			  GSList    *context_classes)
+{
+	GSList *item;
 
-	if (!ptr->fixed)
+	for (item = context_classes; item != NULL; item = g_slist_next (item))
 	{
-		g_hash_table_foreach_remove (ptr->u.hash,
-					     (GHRFunc) remove_context_cb,
-					     context);
+		ContextClassTag *attrtag = item->data;
+		guint i;
 
-		if (g_hash_table_size (ptr->u.hash) != 0)
-			delete = FALSE;
+		for (i = 0; i < tags->len; i++)
+		{
+			if (g_ptr_array_index (tags, i) == attrtag->tag)
+				break;
+		}
+
+		if (attrtag->enabled && i == tags->len)
+			g_ptr_array_add (tags, attrtag->tag);
+		else if (!attrtag->enabled && i < tags->len)
+			g_ptr_array_remove_index (tags, i);
 	}
+}
 
-	if (delete)
-	{
-		if (prev != NULL)
-			prev->next = ptr->next;
-		else
-			parent->children = ptr->next;
+/**
+ * get_pending_region:
+ * @ce: a #CtkSourceContextEngine.
+ * @start: (out): the beginning of the invalid region.
+ * @end: (out): the end of the invalid region.
+ *
+ * Gets the text changed by the edits the tree does not know about yet,
+ * which are kept in the invalid region until update_tree(), and for the
+ * whole freeze.
+ *
+ * Returns: %FALSE if there are no such edits, in which case the offsets
+ * in the buffer and in the tree are the same.
+ */
+static gboolean
+get_pending_region (CtkSourceContextEngine *ce,
+		    gint                   *start,
+		    gint                   *end)
+{
+	InvalidRegion *region = &ce->priv->invalid_region;
+	CtkTextIter iter;
 
-		if (!ptr->fixed)
-			g_hash_table_destroy (ptr->u.hash);
+	if (region->empty)
+		return FALSE;
 
-#ifdef ENABLE_DEBUG
-		memset (ptr, 1, sizeof (ContextPtr));
-#else
-		g_slice_free (ContextPtr, ptr);
-#endif
-	}
+	ctk_text_buffer_get_iter_at_mark (ce->priv->buffer, &iter, region->start);
+	*start = ctk_text_iter_get_offset (&iter);
+	ctk_text_buffer_get_iter_at_mark (ce->priv->buffer, &iter, region->end);
+	*end = ctk_text_iter_get_offset (&iter);
+
+	return TRUE;
 }
 
 /**
- * context_unref:
- * @context: the context.
+ * get_context_class_tags_at_offset:
+ * @ce: a #CtkSourceContextEngine.
+ * @offset: the offset in the buffer.
  *
- * Decreases reference count and removes @context
- * from the tree when it drops to zero.
+ * Finds the context classes of the character at @offset, walking the
+ * segments containing it from the root, as add_region_context_classes()
+ * would apply them. The text changed since the last update of the tree
+ * has no context classes, the same way it has no tags until it is
+ * highlighted again.
+ *
+ * Returns: (transfer container): the tags of the context classes.
  */
-static void
-context_unref (Context *context)
+static GPtrArray *
+get_context_class_tags_at_offset (CtkSourceContextEngine *ce,
+				  gint                    offset)
 {
-	ContextPtr *children;
-	guint i;
+	GPtrArray *tags = g_ptr_array_new ();
+	Segment *segment = ce->priv->root_segment;
+	gint pending_start, pending_end;
 
-	if (context == NULL || --context->ref_count != 0)
-		return;
+	if (get_pending_region (ce, &pending_start, &pending_end) &&
+	    offset >= pending_start)
+	{
+		if (offset < pending_end)
+			return tags;
 
-	DEBUG (g_print ("destroying context %s\n", context->definition->id));
+		offset -= ce->priv->invalid_region.delta;
+	}
 
-	children = context->children;
-	context->children = NULL;
+	if (segment == NULL || offset < segment_start (ce, segment) || offset >= segment_end (ce, segment))
+		return tags;
 
-	while (children != NULL)
+	while (!SEGMENT_IS_INVALID (segment))
 	{
-		ContextPtr *ptr = children;
+		SubPattern *sp;
+		Segment *child;
 
-		children = children->next;
+		context_class_tags_apply (tags, get_context_classes (ce, segment->context));
 
-		if (ptr->fixed)
-		{
-			ptr->u.context->parent = NULL;
-			context_unref (ptr->u.context);
-		}
-		else
+		for (sp = segment->sub_patterns; sp != NULL; sp = sp->next)
 		{
-			g_hash_table_foreach (ptr->u.hash,
-					      (GHFunc) context_unref_hash_cb,
-					      NULL);
-			g_hash_table_destroy (ptr->u.hash);
+			if (SUB_PATTERN_START (ce, segment, sp) <= offset &&
+			    offset < SUB_PATTERN_END (ce, segment, sp))
+			{
+				context_class_tags_apply (tags,
+							  get_subpattern_context_classes (ce,
+											  segment->context,
+											  sp->definition));
+			}
 		}
 
-#ifdef ENABLE_DEBUG
-		memset (ptr, 1, sizeof (ContextPtr));
-#else
-		g_slice_free (ContextPtr, ptr);
-#endif
-	}
-
-	if (context->parent != NULL)
-		context_remove_child (context->parent, context);
+		child = segment_find_child_ (ce, segment, offset + 1);
 
-	_ctk_source_regex_unref (context->end);
-	_ctk_source_regex_unref (context->reg_all);
+		if (child == NULL || segment_start (ce, child) > offset)
+			break;
 
-	if (context->subpattern_context_classes != NULL)
-	{
-		for (i = 0; i < context->definition->n_sub_patterns; ++i)
-		{
-			g_slist_free_full (context->subpattern_context_classes[i],
-			                   (GDestroyNotify)context_class_tag_free);
-		}
+		segment = child;
 	}
 
-	g_slist_free_full (context->context_classes, (GDestroyNotify)context_class_tag_free);
-
-	g_free (context->subpattern_context_classes);
-	g_free (context->subpattern_tags);
-
-	g_slice_free (Context, context);
+	return tags;
 }
 
-static void
-context_freeze_hash_cb (gpointer  text,
-			Context  *context,
-			gpointer  user_data)
+static gboolean
+has_context_class_tag_at_offset (CtkSourceContextEngine *ce,
+				 CtkTextTag             *tag,
+				 gint                    offset)
 {
-	context_freeze (context);
+	GPtrArray *tags;
+	gboolean ret = FALSE;
+	guint i;
+
+	tags = get_context_class_tags_at_offset (ce, offset);
+
+	for (i = 0; i < tags->len && !ret; i++)
+	{
+		ret = g_ptr_array_index (tags, i) == tag;
+	}
+
+	g_ptr_array_free (tags, TRUE);
+	return ret;
 }
 
 /**
- * context_freeze:
- * @context: the context.
- *
- * Recursively increments reference count in context and its children,
- * and marks them, so context_thaw is able to correctly decrement
- * reference count.
- * This function is for update_syntax: we want to preserve existing
- * contexts when possible, and update_syntax erases contexts from
- * reanalyzed lines; so to avoid destructing and recreating contexts
- * every time, we need to increment reference count on existing contexts,
- * and decrement it when we are done with analysis, so no more needed
- * contexts go away. Keeping a list of referenced contexts is painful
- * or slow, so we just reference all contexts present at the moment.
+ * next_tree_boundary:
+ * @ce: a #CtkSourceContextEngine.
+ * @offset: the offset in the tree.
+ * @limit: the end of the tree.
  *
- * Note this is not reentrant, context_freeze()/context_thaw() pair is called
- * only from update_syntax().
+ * Returns: the first offset after @offset where a segment or a
+ * subpattern starts or ends, i.e. where the context classes may change,
+ * or @limit.
  */
-static void
-context_freeze (Context *ctx)
+static gint
+next_tree_boundary (CtkSourceContextEngine *ce,
+		    gint                    offset,
+		    gint                    limit)
 {
-	ContextPtr *ptr;
-
-	g_assert (!ctx->frozen);
-	ctx->frozen = TRUE;
-	context_ref (ctx);
+	Segment *segment = ce->priv->root_segment;
+	gint next = limit;
 
-	for (ptr = ctx->children; ptr != NULL; ptr = ptr->next)
+	while (segment != NULL && !SEGMENT_IS_INVALID (segment))
 	{
-		if (ptr->fixed)
+		SubPattern *sp;
+		Segment *child;
+
+		if (segment_end (ce, segment) > offset)
+			next = MIN (next, segment_end (ce, segment));
+
+		for (sp = segment->sub_patterns; sp != NULL; sp = sp->next)
 		{
-			context_freeze (ptr->u.context);
+			gint sp_start = SUB_PATTERN_START (ce, segment, sp);
+			gint sp_end = SUB_PATTERN_END (ce, segment, sp);
+
+			if (sp_start > offset)
+				next = MIN (next, sp_start);
+			else if (sp_end > offset)
+				next = MIN (next, sp_end);
 		}
-		else
+
+		child = segment_find_child_ (ce, segment, offset + 1);
+
+		if (child != NULL && segment_start (ce, child) > offset)
 		{
-			g_hash_table_foreach (ptr->u.hash,
-					      (GHFunc) context_freeze_hash_cb,
-					      NULL);
+			next = MIN (next, segment_start (ce, child));
+			break;
 		}
-	}
-}
 
-static void
-get_child_contexts_hash_cb (G_GNUC_UNUSED gpointer   text,
-			    Context                 *context,
-			    GSList                 **list)
-{
-	*list = g_slist_prepend (*list, context);
-}
+		segment = child;
+	}
 
-static void
-context_thaw_cb (Context *ctx,
-		 gpointer user_data)
-{
-	context_thaw (ctx);
+	return next;
 }
 
 /**
- * context_thaw:
- * @context: the context.
+ * prev_tree_boundary:
+ * @ce: a #CtkSourceContextEngine.
+ * @offset: the offset in the tree, greater than zero.
  *
- * Recursively decrements reference count in context and its children,
- * if it was incremented by context_freeze().
+ * Same as next_tree_boundary(), but backward.
+ *
+ * Returns: the last offset before @offset where the context classes
+ * may change, or zero.
  */
-static void
-context_thaw (Context *ctx)
+static gint
+prev_tree_boundary (CtkSourceContextEngine *ce,
+		    gint                    offset)
 {
-	ContextPtr *ptr;
-
-	if (!ctx->frozen)
-		return;
+	Segment *segment = ce->priv->root_segment;
+	gint last = offset - 1;
+	gint prev = 0;
 
-	for (ptr = ctx->children; ptr != NULL; )
+	while (segment != NULL && !SEGMENT_IS_INVALID (segment))
 	{
-		ContextPtr *next = ptr->next;
+		SubPattern *sp;
+		Segment *child;
 
-		if (ptr->fixed)
+		if (segment_start (ce, segment) <= last)
+			prev = MAX (prev, segment_start (ce, segment));
+
+		for (sp = segment->sub_patterns; sp != NULL; sp = sp->next)
 		{
-			context_thaw (ptr->u.context);
+			gint sp_start = SUB_PATTERN_START (ce, segment, sp);
+			gint sp_end = SUB_PATTERN_END (ce, segment, sp);
+
+			if (sp_end <= last)
+				prev = MAX (prev, sp_end);
+			else if (sp_start <= last)
+				prev = MAX (prev, sp_start);
 		}
-		else
-		{
-			GSList *children = NULL;
 
-			g_hash_table_foreach (ptr->u.hash,
-					      (GHFunc) get_child_contexts_hash_cb,
-					      &children);
+		child = segment_find_last_child_ (ce, segment, last);
 
-			g_slist_foreach (children, (GFunc) context_thaw_cb, NULL);
-			g_slist_free (children);
+		if (child != NULL && segment_end (ce, child) <= last)
+		{
+			prev = MAX (prev, segment_end (ce, child));
+			break;
 		}
 
-		ptr = next;
+		segment = child;
 	}
 
-	ctx->frozen = FALSE;
-	context_unref (ctx);
+	return prev;
 }
 
-static Context *
-create_child_context (Context         *parent,
-		      DefinitionChild *child_def,
-		      const gchar     *line_text)
+/**
+ * next_context_class_boundary:
+ * @ce: a #CtkSourceContextEngine.
+ * @offset: the offset in the buffer.
+ * @limit: the end of the buffer.
+ *
+ * Same as next_tree_boundary(), but for offsets in the buffer: the
+ * boundaries found in the tree are moved by the pending edits, and the
+ * text changed by them is delimited by boundaries, see
+ * get_context_class_tags_at_offset(). Some boundaries may be spurious.
+ *
+ * Returns: the first offset after @offset where the context classes
+ * may change, or @limit.
+ */
+static gint
+next_context_class_boundary (CtkSourceContextEngine *ce,
+			     gint                    offset,
+			     gint                    limit)
 {
-	Context *context;
-	ContextPtr *ptr;
-	gchar *match = NULL;
-	ContextDefinition *definition = child_def->u.definition;
+	gint pending_start, pending_end;
+	gint delta;
+	gint next;
 
-	g_return_val_if_fail (parent != NULL, NULL);
+	if (!get_pending_region (ce, &pending_start, &pending_end))
+		return next_tree_boundary (ce, offset, limit);
 
-	for (ptr = parent->children;
-	     ptr != NULL && ptr->definition != definition;
-	     ptr = ptr->next) ;
+	delta = ce->priv->invalid_region.delta;
 
-	if (ptr == NULL)
-	{
-		ptr = g_slice_new0 (ContextPtr);
-		ptr->next = parent->children;
-		parent->children = ptr;
-		ptr->definition = definition;
+	if (offset >= pending_end)
+		return next_tree_boundary (ce, offset - delta, limit - delta) + delta;
 
-		if (definition->type != CONTEXT_TYPE_CONTAINER ||
-		    !definition->u.start_end.end ||
-		    _ctk_source_regex_is_resolved (definition->u.start_end.end))
-		{
-			ptr->fixed = TRUE;
-		}
+	if (offset >= pending_start)
+		return MIN (pending_end, limit);
 
-		if (!ptr->fixed)
-			ptr->u.hash = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
-	}
+	next = next_tree_boundary (ce, offset, limit - delta);
 
-	if (ptr->fixed)
-	{
-		context = ptr->u.context;
-	}
-	else
-	{
-		match = _ctk_source_regex_fetch (definition->u.start_end.start, 0);
-		g_return_val_if_fail (match != NULL, NULL);
-		context = g_hash_table_lookup (ptr->u.hash, match);
-	}
+	return MIN (next, pending_start);
+}
 
-	if (context != NULL)
+/**
+ * prev_context_class_boundary:
+ * @ce: a #CtkSourceContextEngine.
+ * @offset: the offset in the buffer, greater than zero.
+ *
+ * Same as next_context_class_boundary(), but backward.
+ *
+ * Returns: the last offset before @offset where the context classes
+ * may change, or zero.
+ */
+static gint
+prev_context_class_boundary (CtkSourceContextEngine *ce,
+			     gint                    offset)
+{
+	gint pending_start, pending_end;
+	gint delta;
+	gint prev;
+
+	if (!get_pending_region (ce, &pending_start, &pending_end) ||
+	    offset <= pending_start)
 	{
-		g_free (match);
-		return context_ref (context);
+		return prev_tree_boundary (ce, offset);
 	}
 
-	context = context_new (parent,
-			       definition,
-			       line_text,
-			       child_def->override_style ? child_def->style :
-					child_def->u.definition->default_style,
-			       child_def->override_style ? child_def->override_style_deep : FALSE);
-	g_return_val_if_fail (context != NULL, NULL);
+	if (offset <= pending_end)
+		return pending_start;
 
-	if (ptr->fixed)
-		ptr->u.context = context;
-	else
-		g_hash_table_insert (ptr->u.hash, match, context);
+	delta = ce->priv->invalid_region.delta;
+	prev = prev_tree_boundary (ce, offset - delta) + delta;
 
-	return context;
+	return MAX (prev, pending_end);
 }
 
 /**
- * segment_new:
- * @ce: the engine.
- * @parent: parent segment (%NULL for the root segment).
- * @context: context for this segment (%NULL for invalid segments).
- * @start_at: start offset in the buffer, characters.
- * @end_at: end offset in the buffer, characters.
- * @is_start: is_start flag.
+ * ctk_source_context_engine_get_context_classes:
+ * @engine: a #CtkSourceContextEngine.
+ * @iter: a #CtkTextIter.
  *
- * Creates a new segment structure. It doesn't take care about
- * parent or siblings, create_segment() is the function to
- * create new segments in the tree.
+ * CtkSourceEngine::get_context_classes method. Used with
+ * CtkSourceBuffer:highlight-on-draw, when the context class tags
+ * are not applied.
  *
- * Returns: newly created segment.
+ * Returns: the names of the context classes at @iter.
  */
-static Segment *
-segment_new (CtkSourceContextEngine *ce,
-	     Segment                *parent,
-	     Context                *context,
-	     gint                    start_at,
-	     gint                    end_at,
-	     gboolean                is_start)
-{
-	Segment *segment;
+static gchar **
+ctk_source_context_engine_get_context_classes (CtkSourceEngine   *engine,
+					       const CtkTextIter *iter)
+{
+	const gsize prefix_len = strlen ("ctksourceview:context-classes:");
+	CtkSourceContextEngine *ce = get_tree_engine (CTK_SOURCE_CONTEXT_ENGINE (engine));
+	GPtrArray *tags;
+	gchar **ret;
+	guint i;
 
-#ifdef ENABLE_CHECK_TREE
-	g_assert (!is_start || context != NULL);
-#endif
+	if (ce->priv->buffer == NULL)
+		return g_new0 (gchar *, 1);
 
-	segment = g_slice_new0 (Segment);
-	segment->parent = parent;
-	segment->context = context_ref (context);
-	segment->start_at = start_at;
-	segment->end_at = end_at;
-	segment->is_start = is_start;
+	tags = get_context_class_tags_at_offset (ce, ctk_text_iter_get_offset (iter));
+	ret = g_new0 (gchar *, tags->len + 1);
 
-	if (context == NULL)
-		add_invalid (ce, segment);
+	for (i = 0; i < tags->len; i++)
+	{
+		gchar *tag_name;
 
-	return segment;
+		g_object_get (g_ptr_array_index (tags, i), "name", &tag_name, NULL);
+		ret[i] = g_strdup (tag_name + prefix_len);
+		g_free (tag_name);
+	}
+
+	g_ptr_array_free (tags, TRUE);
+	return ret;
 }
 
-static void
-find_segment_position_forward_ (Segment  *segment,
-				gint      start_at,
-				gint      end_at,
-				Segment **prev,
-				Segment **next)
+static gboolean
+ctk_source_context_engine_has_context_class (CtkSourceEngine   *engine,
+					     const CtkTextIter *iter,
+					     const gchar       *context_class)
 {
-	g_assert (segment->start_at <= start_at);
+	CtkSourceContextEngine *ce = get_tree_engine (CTK_SOURCE_CONTEXT_ENGINE (engine));
 
-	while (segment != NULL)
-	{
-		if (segment->end_at == start_at)
-		{
-			while (segment->next != NULL && segment->next->start_at == start_at)
-				segment = segment->next;
+	if (ce->priv->buffer == NULL)
+		return FALSE;
 
-			*prev = segment;
-			*next = segment->next;
+	return has_context_class_tag_at_offset (ce,
+						get_context_class_tag (ce, context_class),
+						ctk_text_iter_get_offset (iter));
+}
 
-			break;
-		}
+static gboolean
+ctk_source_context_engine_forward_to_context_class_toggle (CtkSourceEngine *engine,
+							   CtkTextIter     *iter,
+							   const gchar     *context_class)
+{
+	CtkSourceContextEngine *ce = get_tree_engine (CTK_SOURCE_CONTEXT_ENGINE (engine));
+	CtkTextTag *tag;
+	gboolean has_class;
+	gint offset;
+	gint limit;
 
-		if (segment->start_at == end_at)
-		{
-			*next = segment;
-			*prev = segment->prev;
-			break;
-		}
+	if (ce->priv->buffer == NULL || ctk_text_iter_is_end (iter))
+		return FALSE;
 
-		if (segment->start_at > end_at)
+	tag = get_context_class_tag (ce, context_class);
+	offset = ctk_text_iter_get_offset (iter);
+	limit = ctk_text_buffer_get_char_count (ce->priv->buffer);
+	has_class = has_context_class_tag_at_offset (ce, tag, offset);
+
+	while (offset < limit)
+	{
+		offset = next_context_class_boundary (ce, offset, limit);
+
+		/* There is no class after the last character. */
+		if (!has_class != !(offset < limit &&
+				    has_context_class_tag_at_offset (ce, tag, offset)))
 		{
-			*next = segment;
-			break;
+			ctk_text_iter_set_offset (iter, offset);
+			return TRUE;
 		}
+	}
 
-		if (segment->end_at < start_at)
-			*prev = segment;
+	ctk_text_iter_forward_to_end (iter);
+	return FALSE;
+}
 
-		segment = segment->next;
+static gboolean
+ctk_source_context_engine_backward_to_context_class_toggle (CtkSourceEngine *engine,
+							    CtkTextIter     *iter,
+							    const gchar     *context_class)
+{
+	CtkSourceContextEngine *ce = get_tree_engine (CTK_SOURCE_CONTEXT_ENGINE (engine));
+	CtkTextTag *tag;
+	gboolean has_class;
+	gint offset;
+
+	if (ce->priv->buffer == NULL || ctk_text_iter_is_start (iter))
+		return FALSE;
+
+	tag = get_context_class_tag (ce, context_class);
+	offset = ctk_text_iter_get_offset (iter);
+	has_class = has_context_class_tag_at_offset (ce, tag, offset - 1);
+
+	while (offset > 0)
+	{
+		offset = prev_context_class_boundary (ce, offset);
+
+		if (!has_class != !(offset > 0 &&
+				    has_context_class_tag_at_offset (ce, tag, offset - 1)))
+		{
+			ctk_text_iter_set_offset (iter, offset);
+			return TRUE;
+		}
 	}
+
+	ctk_text_iter_set_offset (iter, 0);
+	return FALSE;
 }
 
 static void
-find_segment_position_backward_ (Segment  *segment,
-				 gint      start_at,
-				 gint      end_at,
-				 Segment **prev,
-				 Segment **next)
+ctk_source_context_engine_finalize (GObject *object)
 {
-	g_assert (start_at < segment->end_at);
+	CtkSourceContextEngine *ce = CTK_SOURCE_CONTEXT_ENGINE (object);
 
-	while (segment != NULL)
+	if (ce->priv->buffer != NULL)
 	{
-		if (segment->end_at <= start_at)
-		{
-			*prev = segment;
-			break;
-		}
+		g_critical ("finalizing engine with attached buffer");
+		/* Disconnect the buffer (if there is one), which destroys almost
+		 * everything. */
+		ctk_source_context_engine_attach_buffer (CTK_SOURCE_ENGINE (ce), NULL);
+	}
 
-		g_assert (segment->start_at >= end_at);
+	g_assert (!ce->priv->tags);
+	g_assert (!ce->priv->root_context);
+	g_assert (!ce->priv->root_segment);
 
-		*next = segment;
-		segment = segment->prev;
+	if (ce->priv->first_update != 0)
+	{
+		g_source_remove (ce->priv->first_update);
+		ce->priv->first_update = 0;
+	}
+
+	if (ce->priv->incremental_update != 0)
+	{
+		g_source_remove (ce->priv->incremental_update);
+		ce->priv->incremental_update = 0;
+	}
+
+	_ctk_source_context_data_unref (ce->priv->ctx_data);
+
+	if (ce->priv->sync_point_regex != NULL)
+		g_regex_unref (ce->priv->sync_point_regex);
+
+	if (ce->priv->style_scheme != NULL)
+		g_object_unref (ce->priv->style_scheme);
+
+	if (ce->priv->mirror_source != NULL)
+	{
+		CtkSourceContextEnginePrivate *source_priv = ce->priv->mirror_source->priv;
+
+		source_priv->mirrors = g_slist_remove (source_priv->mirrors, ce);
+		g_object_unref (ce->priv->mirror_source);
 	}
+
+	/* The mirrors keep a reference to their source. */
+	g_assert (ce->priv->mirrors == NULL);
+
+	G_OBJECT_CLASS (_ctk_source_context_engine_parent_class)->finalize (object);
 }
 
-/**
- * find_segment_position:
- * @parent: parent segment (not %NULL).
- * @hint: segment somewhere near new segment position.
- * @start_at: start offset.
- * @end_at: end offset.
- * @prev: location to return previous sibling.
- * @next: location to return next sibling.
- *
- * Finds siblings of a new segment to be created at interval
- * (start_at, end_at). It uses hint to avoid walking whole
- * parent->children list.
- */
 static void
-find_segment_position (Segment  *parent,
-		       Segment  *hint,
-		       gint      start_at,
-		       gint      end_at,
-		       Segment **prev,
-		       Segment **next)
+_ctk_source_engine_interface_init (CtkSourceEngineInterface *iface)
 {
-	Segment *tmp;
+	iface->attach_buffer = ctk_source_context_engine_attach_buffer;
+	iface->text_inserted = ctk_source_context_engine_text_inserted;
+	iface->text_deleted = ctk_source_context_engine_text_deleted;
+	iface->update_highlight = ctk_source_context_engine_update_highlight;
+	iface->set_style_scheme = ctk_source_context_engine_set_style_scheme;
+	iface->text_loaded = ctk_source_context_engine_text_loaded;
+	iface->freeze = ctk_source_context_engine_freeze;
+	iface->thaw = ctk_source_context_engine_thaw;
+	iface->get_context_classes = ctk_source_context_engine_get_context_classes;
+	iface->has_context_class = ctk_source_context_engine_has_context_class;
+	iface->forward_to_context_class_toggle = ctk_source_context_engine_forward_to_context_class_toggle;
+	iface->backward_to_context_class_toggle = ctk_source_context_engine_backward_to_context_class_toggle;
+}
 
-	g_assert (parent->start_at <= start_at && end_at <= parent->end_at);
-	g_assert (!hint || hint->parent == parent);
+static void
+_ctk_source_context_engine_class_init (CtkSourceContextEngineClass *klass)
+{
+	GObjectClass *object_class = G_OBJECT_CLASS (klass);
 
-	*prev = *next = NULL;
+	object_class->finalize = ctk_source_context_engine_finalize;
+}
 
-	if (parent->children == NULL)
-		return;
+static void
+_ctk_source_context_engine_init (CtkSourceContextEngine *ce)
+{
+	ce->priv = _ctk_source_context_engine_get_instance_private (ce);
 
-	if (parent->children->next == NULL)
-	{
-		tmp = parent->children;
+	node_pool_init (&ce->priv->segment_pool, sizeof (Segment));
+	node_pool_init (&ce->priv->sub_pattern_pool, sizeof (SubPattern));
+	node_pool_init (&ce->priv->index_pool, sizeof (SegmentIndex));
 
-		if (start_at >= tmp->end_at)
-			*prev = tmp;
-		else
-			*next = tmp;
+	/* Segments from the pool have stamp 0. */
+	ce->priv->tree_stamp = 1;
+}
 
-		return;
-	}
+CtkSourceContextEngine *
+_ctk_source_context_engine_new (CtkSourceContextData *ctx_data)
+{
+	CtkSourceContextEngine *ce;
 
-	if (hint == NULL)
-		hint = parent->children;
+	g_return_val_if_fail (ctx_data != NULL, NULL);
+	g_return_val_if_fail (ctx_data->lang != NULL, NULL);
 
-	if (hint->end_at <= start_at)
-		find_segment_position_forward_ (hint, start_at, end_at, prev, next);
-	else
-		find_segment_position_backward_ (hint, start_at, end_at, prev, next);
+	ce = g_object_new (CTK_SOURCE_TYPE_CONTEXT_ENGINE, NULL);
+	ce->priv->ctx_data = _ctk_source_context_data_ref (ctx_data);
+
+	return ce;
 }
 
 /**
- * create_segment:
- * @ce: the engine.
- * @parent: parent segment (%NULL for the root segment).
- * @context: context for this segment (%NULL for invalid segments).
- * @start_at: start offset, characters.
- * @end_at: end offset, characters.
- * @is_start: is_start flag.
- * @hint: a segment somewhere near new one, to omtimize search.
+ * _ctk_source_context_engine_new_mirror:
+ * @source: a #CtkSourceContextEngine.
  *
- * Creates a new segment and inserts it into the tree.
+ * Creates an engine for a buffer with the same text and the same tag
+ * table as the buffer of @source. It does not analyze anything: it
+ * applies the tags of @source from the syntax tree of @source. The text
+ * is analyzed by @source when the mirror needs it, and the mirror tags
+ * the text again wherever @source updates the tree.
  *
- * Returns: newly created segment.
+ * Returns: (transfer full): a new #CtkSourceContextEngine.
  */
-static Segment *
-create_segment (CtkSourceContextEngine *ce,
-		Segment                *parent,
-		Context                *context,
-		gint                    start_at,
-		gint                    end_at,
-		gboolean                is_start,
-		Segment                *hint)
+CtkSourceContextEngine *
+_ctk_source_context_engine_new_mirror (CtkSourceContextEngine *source)
 {
-	Segment *segment;
-
-	g_assert (!parent || (parent->start_at <= start_at && end_at <= parent->end_at));
-
-	segment = segment_new (ce, parent, context, start_at, end_at, is_start);
+	CtkSourceContextEngine *ce;
 
-	if (parent != NULL)
-	{
-		Segment *prev, *next;
+	g_return_val_if_fail (CTK_SOURCE_IS_CONTEXT_ENGINE (source), NULL);
 
-		if (hint == NULL)
-		{
-			hint = ce->priv->hint;
-			while (hint != NULL && hint->parent != parent)
-				hint = hint->parent;
-		}
+	source = get_tree_engine (source);
 
-		find_segment_position (parent, hint,
-				       start_at, end_at,
-				       &prev, &next);
+	ce = _ctk_source_context_engine_new (source->priv->ctx_data);
+	ce->priv->mirror_source = g_object_ref (source);
+	source->priv->mirrors = g_slist_prepend (source->priv->mirrors, ce);
 
-		g_assert ((!parent->children && !prev && !next) ||
-			  (parent->children && (prev || next)));
-		g_assert (!prev || prev->next == next);
-		g_assert (!next || next->prev == prev);
+	return ce;
+}
 
-		segment->next = next;
-		segment->prev = prev;
+/**
+ * _ctk_source_context_engine_get_stats:
+ * @ce: a #CtkSourceContextEngine.
+ * @stats: (out): where to store the statistics.
+ *
+ * Gets the memory statistics of the syntax tree of @ce, for the
+ * benchmarks.
+ */
+void
+_ctk_source_context_engine_get_stats (CtkSourceContextEngine      *ce,
+				      CtkSourceContextEngineStats *stats)
+{
+	g_return_if_fail (CTK_SOURCE_IS_CONTEXT_ENGINE (ce));
+	g_return_if_fail (stats != NULL);
+
+	stats->n_segments = ce->priv->segment_pool.n_used;
+	stats->peak_segments = ce->priv->segment_pool.n_peak;
+	stats->n_sub_patterns = ce->priv->sub_pattern_pool.n_used;
+	stats->peak_sub_patterns = ce->priv->sub_pattern_pool.n_peak;
+	stats->n_node_allocations = ce->priv->segment_pool.n_allocated +
+				    ce->priv->sub_pattern_pool.n_allocated +
+				    ce->priv->index_pool.n_allocated;
+	stats->n_chunk_allocations = ce->priv->segment_pool.n_chunks_allocated +
+				     ce->priv->sub_pattern_pool.n_chunks_allocated +
+				     ce->priv->index_pool.n_chunks_allocated;
+	stats->n_cache_hits = ce->priv->n_cache_hits;
+	stats->n_cache_misses = ce->priv->n_cache_misses;
+	stats->n_thread_analyses = ce->priv->n_thread_analyses;
+	stats->thread_analysis_pending = ce->priv->analysis_cancellable != NULL ||
+					 ce->priv->analysis_timeout != 0;
+	stats->long_line_pending = ce->priv->long_line_state != NULL;
+	stats->n_long_line_resumes = ce->priv->n_long_line_resumes;
+
+	stats->n_resolved_end_hits = 0;
+	stats->n_resolved_end_misses = 0;
+
+	if (ce->priv->ctx_data != NULL)
+	{
+		GHashTableIter iter;
+		ContextDefinition *definition;
 
-		if (next != NULL)
-			next->prev = segment;
-		else
-			parent->last_child = segment;
+		g_mutex_lock (&definition_cache_mutex);
 
-		if (prev != NULL)
-			prev->next = segment;
-		else
-			parent->children = segment;
+		g_hash_table_iter_init (&iter, ce->priv->ctx_data->definitions);
+		while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &definition))
+		{
+			if (definition->resolved_ends != NULL)
+			{
+				stats->n_resolved_end_hits += definition->resolved_ends->hits;
+				stats->n_resolved_end_misses += definition->resolved_ends->misses;
+			}
+		}
 
-		CHECK_SEGMENT_LIST (parent);
-		CHECK_TREE (ce);
+		g_mutex_unlock (&definition_cache_mutex);
 	}
-
-	return segment;
 }
 
 /**
- * segment_extend:
- * @state: the semgent.
- * @end_at: new end offset, characters.
+ * _ctk_source_context_engine_dump_profile:
+ * @ce: a #CtkSourceContextEngine.
  *
- * Updates end offset in the segment and its ancestors.
+ * When the CTKSOURCEVIEW_HIGHLIGHT_PROFILE environment variable is set,
+ * prints the profile of the language of @ce since the last dump, for all
+ * the buffers using it, and starts a new one. Does nothing otherwise.
  */
-static void
-segment_extend (Segment *state,
-		gint     end_at)
+void
+_ctk_source_context_engine_dump_profile (CtkSourceContextEngine *ce)
 {
-	while (state != NULL && state->end_at < end_at)
-	{
-		state->end_at = end_at;
-		state = state->parent;
-	}
-	CHECK_SEGMENT_LIST (state->parent);
-}
-
-static void
-segment_destroy_children (CtkSourceContextEngine *ce,
-			  Segment                *segment)
-{
-	Segment *child;
-	SubPattern *sp;
-
-	g_return_if_fail (segment != NULL);
-
-	child = segment->children;
-	segment->children = NULL;
-	segment->last_child = NULL;
-
-	while (child != NULL)
-	{
-		Segment *next = child->next;
-		segment_destroy (ce, child);
-		child = next;
-	}
-
-	sp = segment->sub_patterns;
-	segment->sub_patterns = NULL;
-
-	while (sp != NULL)
-	{
-		SubPattern *next = sp->next;
-		sub_pattern_free (sp);
-		sp = next;
-	}
+	g_return_if_fail (CTK_SOURCE_IS_CONTEXT_ENGINE (ce));
+
+	if (highlight_profile_enabled ())
+		highlight_profile_dump (ce->priv->ctx_data);
 }
 
 /**
- * segment_destroy:
- * @ce: the engine.
- * @context: the segment to destroy.
+ * _ctk_source_context_data_new:
+ * @lang: #CtkSourceLanguage.
  *
- * Recursively frees given segment. It removes the segment
- * from ce structure, but it doesn't update parent and
- * siblings. segment_remove() is the function that takes
- * care of everything.
+ * Creates new context definition set. It does not set lang->priv->ctx_data,
+ * that's lang business.
  */
-static void
-segment_destroy (CtkSourceContextEngine *ce,
-		 Segment                *segment)
+CtkSourceContextData *
+_ctk_source_context_data_new (CtkSourceLanguage *lang)
 {
-	g_return_if_fail (segment != NULL);
-
-	segment_destroy_children (ce, segment);
+	CtkSourceContextData *ctx_data;
 
-	/* segment neighbours and parent may be invalid here,
-	 * so we only can unset the hint */
-	if (ce->priv->hint == segment)
-		ce->priv->hint = NULL;
-        if (ce->priv->hint2 == segment)
-                ce->priv->hint2 = NULL;
+	g_return_val_if_fail (CTK_SOURCE_IS_LANGUAGE (lang), NULL);
 
-	if (SEGMENT_IS_INVALID (segment))
-		remove_invalid (ce, segment);
+	ctx_data = g_slice_new (CtkSourceContextData);
+	ctx_data->ref_count = 1;
+	ctx_data->lang = lang;
+	ctx_data->definitions = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+						       (GDestroyNotify) context_definition_unref);
+	ctx_data->files_key = NULL;
+	memset (&ctx_data->profile, 0, sizeof (HighlightProfile));
 
-	context_unref (segment->context);
+	return ctx_data;
+}
 
-#ifdef ENABLE_DEBUG
-	g_assert (!g_slist_find (ce->priv->invalid, segment));
-	memset (segment, 1, sizeof (Segment));
-#else
-	g_slice_free (Segment, segment);
-#endif
+CtkSourceContextData *
+_ctk_source_context_data_ref (CtkSourceContextData *ctx_data)
+{
+	g_return_val_if_fail (ctx_data != NULL, NULL);
+	ctx_data->ref_count++;
+	return ctx_data;
 }
 
 /**
- * container_context_starts_here:
+ * _ctk_source_context_data_unref:
+ * @ctx_data: #CtkSourceContextData.
  *
- * See child_starts_here().
+ * Decreases reference count in ctx_data. When reference count
+ * drops to zero, ctx_data is freed, and ctx_data->lang->priv->ctx_data
+ * is unset.
  */
-static gboolean
-container_context_starts_here (CtkSourceContextEngine  *ce,
-			       Segment                 *state,
-			       DefinitionChild         *child_def,
-			       LineInfo                *line,
-			       gint                    *line_pos, /* bytes */
-			       Segment                **new_state)
+void
+_ctk_source_context_data_unref (CtkSourceContextData *ctx_data)
 {
-	Context *new_context;
-	Segment *new_segment;
-	gint match_end;
-	ContextDefinition *definition = child_def->u.definition;
-
-	g_assert (*line_pos <= line->byte_length);
-
-	/* We can have a container context definition (i.e. the main
-	 * language definition) without start_end.start. */
-	if (definition->u.start_end.start == NULL)
-		return FALSE;
+	g_return_if_fail (ctx_data != NULL);
 
-	if (!_ctk_source_regex_match (definition->u.start_end.start,
-				      line->text, line->byte_length, *line_pos))
+	if (--ctx_data->ref_count == 0)
 	{
-		return FALSE;
-	}
-
-	new_context = create_child_context (state->context, child_def, line->text);
-	g_return_val_if_fail (new_context != NULL, FALSE);
+		if (highlight_profile_enabled ())
+			highlight_profile_dump (ctx_data);
 
-	if (!can_apply_match (new_context, line, *line_pos, &match_end,
-			      definition->u.start_end.start))
-	{
-		context_unref (new_context);
-		return FALSE;
+		if (ctx_data->lang != NULL && ctx_data->lang->priv != NULL &&
+		    ctx_data->lang->priv->ctx_data == ctx_data)
+			ctx_data->lang->priv->ctx_data = NULL;
+		g_hash_table_destroy (ctx_data->definitions);
+		g_free (ctx_data->files_key);
+		g_slice_free (CtkSourceContextData, ctx_data);
 	}
+}
 
-	g_assert (match_end <= line->byte_length);
+/**
+ * _ctk_source_context_data_set_files:
+ * @ctx_data: #CtkSourceContextData.
+ * @files: the files parsed to build @ctx_data, as an array of
+ *   (path, modification time, size).
+ *
+ * Sets what identifies the definitions in the highlight cache.
+ */
+void
+_ctk_source_context_data_set_files (CtkSourceContextData *ctx_data,
+				    GVariant             *files)
+{
+	GString *key;
+	GVariantIter iter;
+	const gchar *filename;
+	gint64 mtime;
+	gint64 size;
 
-        segment_extend (state, line_pos_to_offset (line, match_end));
-        new_segment = create_segment (ce, state, new_context,
-				      line_pos_to_offset (line, *line_pos),
-				      line_pos_to_offset (line, match_end),
-				      TRUE,
-				      ce->priv->hint2);
+	g_return_if_fail (ctx_data != NULL);
+	g_return_if_fail (g_variant_is_of_type (files, G_VARIANT_TYPE ("a(sxx)")));
 
-	/* This new context could end at the same position (i.e. have zero length),
-	 * and then we get an infinite loop. We can't possibly know about it at this point
-	 * (since we need to know that the context indeed *ends* here, and that's
-	 * discovered only later) so we look at the previous sibling: if it's the same,
-	 * and has zero length then we remove the segment. We do it this way instead of
-	 * checking before creating the segment because it's more convenient. */
-	if (*line_pos == match_end &&
-	    new_segment->prev != NULL &&
-	    new_segment->prev->context == new_segment->context &&
-	    new_segment->prev->start_at == new_segment->prev->end_at &&
-	    new_segment->prev->start_at == line_pos_to_offset (line, *line_pos))
+	key = g_string_new (NULL);
+
+	g_variant_iter_init (&iter, files);
+	while (g_variant_iter_next (&iter, "(&sxx)", &filename, &mtime, &size))
 	{
-		segment_remove (ce, new_segment);
-		return FALSE;
+		g_string_append_printf (key, "%s:%" G_GINT64_FORMAT ":%" G_GINT64_FORMAT "\n",
+					filename, mtime, size);
 	}
 
-	apply_sub_patterns (new_segment, line,
-			    definition->u.start_end.start,
-			    SUB_PATTERN_WHERE_START);
-	*line_pos = match_end;
-	*new_state = new_segment;
-	ce->priv->hint2 = NULL;
-	context_unref (new_context);
-	return TRUE;
+	g_free (ctx_data->files_key);
+	ctx_data->files_key = g_string_free (key, FALSE);
 }
 
+/* SYNTAX TREE ------------------------------------------------------------ */
+
 /**
- * simple_context_starts_here:
+ * line_pos_to_offset:
+ * @line: a #LineInfo.
+ * @pos: a position in @line, bytes.
  *
- * See child_starts_here().
+ * Converts @pos to an offset in the buffer. For long non-ASCII lines, an
+ * index of the characters of the line is built first, so that converting
+ * any position only decodes less than CHAR_INDEX_STEP bytes.
+ *
+ * Returns: the character offset of @pos in the buffer.
  */
-static gboolean
-simple_context_starts_here (CtkSourceContextEngine *ce,
-			    Segment                *state,
-			    DefinitionChild        *child_def,
-			    LineInfo               *line,
-			    gint                   *line_pos, /* bytes */
-			    Segment               **new_state)
+static gint
+line_pos_to_offset (LineInfo *line,
+		    gint      pos)
 {
-	gint match_end;
-	Context *new_context;
-	ContextDefinition *definition = child_def->u.definition;
+	LineChunk *chunk = line->chunk;
+	gint chars;
+	gint i;
 
-	g_return_val_if_fail (definition->u.match != NULL, FALSE);
+	if (LINE_IS_ASCII (line))
+		return line->start_at + pos;
 
-	g_assert (*line_pos <= line->byte_length);
+	if (line->byte_length < CHAR_INDEX_MIN_LENGTH)
+		return line->start_at + g_utf8_pointer_to_offset (line->text, line->text + pos);
 
-	if (!_ctk_source_regex_match (definition->u.match,
-				      line->text,
-				      line->byte_length,
-				      *line_pos))
-	{
-		return FALSE;
-	}
+	if (pos == line->byte_length)
+		return line->start_at + line->char_length;
 
-	new_context = create_child_context (state->context, child_def, line->text);
-	g_return_val_if_fail (new_context != NULL, FALSE);
+	if (chunk->char_index == NULL)
+		chunk->char_index = g_array_new (FALSE, FALSE, sizeof (gint));
 
-	if (!can_apply_match (new_context, line, *line_pos, &match_end, definition->u.match))
+	if (chunk->char_index_stamp != line->stamp)
 	{
-		context_unref (new_context);
-		return FALSE;
-	}
+		g_array_set_size (chunk->char_index, 0);
+		chars = 0;
 
-	/* If length of the match is zero, then we get zero-length segment and return to
-	 * the same state, so it's an infinite loop. But, if this child ends parent, we
-	 * do want to terminate parent. Still, if match is at the beginning of the parent
-	 * then we get an infinite loop again, so we check that (NOTE it really should destroy
-	 * parent context then, but then we again can get parent context be recreated here and
-	 * so on). */
-	if (*line_pos == match_end &&
-	    (!CONTEXT_ENDS_PARENT (new_context) ||
-		line_pos_to_offset (line, *line_pos) == state->start_at))
-	{
-		context_unref (new_context);
-		return FALSE;
-	}
+		for (i = 0; i < line->byte_length; i++)
+		{
+			if (i % CHAR_INDEX_STEP == 0)
+				g_array_append_val (chunk->char_index, chars);
 
-	g_assert (match_end <= line->byte_length);
-	segment_extend (state, line_pos_to_offset (line, match_end));
+			/* Count the bytes which are not continuation bytes. */
+			if (((guchar) line->text[i] & 0xc0) != 0x80)
+				chars++;
+		}
 
-	if (*line_pos != match_end)
-	{
-		/* Normal non-zero-length match, create a child segment */
-		Segment *new_segment;
-		new_segment = create_segment (ce, state, new_context,
-					      line_pos_to_offset (line, *line_pos),
-					      line_pos_to_offset (line, match_end),
-					      TRUE,
-					      ce->priv->hint2);
-		apply_sub_patterns (new_segment, line, definition->u.match, SUB_PATTERN_WHERE_DEFAULT);
-		ce->priv->hint2 = new_segment;
+		chunk->char_index_stamp = line->stamp;
 	}
 
-	/* Terminate parent if needed */
-	if (CONTEXT_ENDS_PARENT (new_context))
+	chars = g_array_index (chunk->char_index, gint, pos / CHAR_INDEX_STEP);
+
+	for (i = pos - pos % CHAR_INDEX_STEP; i < pos; i++)
 	{
-		do
-		{
-			ce->priv->hint2 = state;
-			state = state->parent;
-		}
-		while (SEGMENT_ENDS_PARENT (state));
+		if (((guchar) line->text[i] & 0xc0) != 0x80)
+			chars++;
 	}
 
-	*line_pos = match_end;
-	*new_state = state;
-	context_unref (new_context);
-	return TRUE;
+	return line->start_at + chars;
 }
 
 /**
- * child_starts_here:
- * @ce: the engine.
- * @state: current state.
- * @child_def: the child.
- * @line: line to analyze.
- * @line_pos: the position inside @line, bytes.
- * @new_state: where to store the new state.
- *
- * Verifies if a context of the type in @curr_definition starts at
- * @line_pos in @line. If the contexts start here @new_state and
- * @line_pos are updated.
+ * line_chunk_clear:
+ * @chunk: a #LineChunk.
  *
- * Returns: %TRUE if the context starts here.
+ * Frees what @chunk holds.
  */
-static gboolean
-child_starts_here (CtkSourceContextEngine  *ce,
-		   Segment                 *state,
-		   DefinitionChild         *child_def,
-		   LineInfo                *line,
-		   gint                    *line_pos,
-		   Segment                **new_state)
+static void
+line_chunk_clear (LineChunk *chunk)
 {
-	g_return_val_if_fail (child_def->resolved, FALSE);
+	g_free (chunk->text);
+	chunk->text = NULL;
 
-	switch (child_def->u.definition->type)
+	if (chunk->char_index != NULL)
 	{
-		case CONTEXT_TYPE_SIMPLE:
-			return simple_context_starts_here (ce,
-							   state,
-							   child_def,
-							   line,
-							   line_pos,
-							   new_state);
-		case CONTEXT_TYPE_CONTAINER:
-			return container_context_starts_here (ce,
-							      state,
-							      child_def,
-							      line,
-							      line_pos,
-							      new_state);
-		default:
-			g_return_val_if_reached (FALSE);
+		g_array_unref (chunk->char_index);
+		chunk->char_index = NULL;
 	}
 }
 
 /**
- * segment_ends_here:
- * @state: the segment.
- * @line: analyzed line.
- * @pos: the position inside @line, bytes.
- *
- * Checks whether given segment ends at pos. Unlike
- * child_starts_here() it doesn't modify tree, it merely
- * calls regex_match() for the end regex.
- */
-static gboolean
-segment_ends_here (Segment  *state,
-		   LineInfo *line,
-		   gint      pos)
-{
-	g_assert (SEGMENT_IS_CONTAINER (state));
-
-	return state->context->definition->u.start_end.end &&
-		_ctk_source_regex_match (state->context->end,
-					 line->text,
-					 line->byte_length,
-					 pos);
-}
-
-/**
- * ancestor_context_ends_here:
- * @state: current context.
+ * apply_sub_patterns:
+ * @ce: the engine.
+ * @contextstate: a #Context.
+ * @line_starts_at: beginning offset of the line.
  * @line: the line to analyze.
- * @line_pos: the position inside @line, bytes.
- *
- * Verifies if some ancestor context ends at the current position.
- * This function only checks conetxts and does not modify the tree,
- * it's used by ancestor_ends_here().
+ * @line_pos: the position inside @line.
+ * @line_length: the length of @line.
+ * @regex: regex that matched.
+ * @where: kind of sub patterns to apply.
  *
- * Returns: the ancestor context that terminates here or %NULL.
+ * Applies sub patterns of kind @where to the matched text.
  */
-static Context *
-ancestor_context_ends_here (Context  *state,
-			    LineInfo *line,
-			    gint      line_pos)
+static void
+apply_sub_patterns (CtkSourceContextEngine *ce,
+		    Segment                *state,
+		    LineInfo               *line,
+		    CtkSourceRegex         *regex,
+		    SubPatternWhere         where)
 {
-	Context *current_context;
-	GSList *current_context_list;
-	GSList *check_ancestors;
-	Context *terminating_context;
+	GSList *sub_pattern_list = state->context->definition->sub_patterns;
 
-	/* A context can be terminated by the parent if extend_parent is
-	 * FALSE, so we need to verify the end of all the parents of
-	 * not-extending contexts. The list is ordered by ascending
-	 * depth. */
-	check_ancestors = NULL;
-	current_context = state;
-	while (ANCESTOR_CAN_END_CONTEXT (current_context))
+	if (SEGMENT_IS_CONTAINER (state))
 	{
-		if (!CONTEXT_EXTENDS_PARENT (current_context))
-			check_ancestors = g_slist_prepend (check_ancestors,
-							   current_context->parent);
-		current_context = current_context->parent;
+		gint start_pos;
+		gint end_pos;
+
+		_ctk_source_regex_fetch_pos_bytes (regex, 0, &start_pos, &end_pos);
+		start_pos = line_pos_to_offset (line, start_pos) - line->start_at;
+		end_pos = line_pos_to_offset (line, end_pos) - line->start_at;
+
+		if (where == SUB_PATTERN_WHERE_START)
+		{
+			if (line->start_at + start_pos != segment_start (ce, state))
+				g_critical ("%s: oops", G_STRLOC);
+			else if (line->start_at + end_pos > segment_end (ce, state))
+				g_critical ("%s: oops", G_STRLOC);
+			else
+				state->start_len = line->start_at + end_pos - segment_start (ce, state);
+		}
+		else
+		{
+			if (line->start_at + start_pos < segment_start (ce, state))
+				g_critical ("%s: oops", G_STRLOC);
+			else if (line->start_at + end_pos != segment_end (ce, state))
+				g_critical ("%s: oops", G_STRLOC);
+			else
+				state->end_len = segment_end (ce, state) - line->start_at - start_pos;
+		}
 	}
 
-	/* The first context that ends here terminates its descendants. */
-	terminating_context = NULL;
-	current_context_list = check_ancestors;
-	while (current_context_list != NULL)
+	while (sub_pattern_list != NULL)
 	{
-		current_context = current_context_list->data;
+		SubPatternDefinition *sp_def = sub_pattern_list->data;
 
-		if (current_context->end &&
-		    _ctk_source_regex_is_resolved (current_context->end) &&
-		    _ctk_source_regex_match (current_context->end,
-					     line->text,
-					     line->byte_length,
-					     line_pos))
+		if (sp_def->where == where)
 		{
-			terminating_context = current_context;
-			break;
+			gint start_pos;
+			gint end_pos;
+
+			if (sp_def->is_named)
+			{
+				_ctk_source_regex_fetch_named_pos_bytes (regex,
+									 sp_def->u.name,
+									 &start_pos,
+									 &end_pos);
+			}
+			else
+			{
+				_ctk_source_regex_fetch_pos_bytes (regex,
+								   sp_def->u.num,
+								   &start_pos,
+								   &end_pos);
+			}
+
+			if (start_pos >= 0 && start_pos != end_pos)
+			{
+				sub_pattern_new (ce,
+						 state,
+						 line_pos_to_offset (line, start_pos),
+						 line_pos_to_offset (line, end_pos),
+						 sp_def);
+			}
 		}
 
-		current_context_list = current_context_list->next;
+		sub_pattern_list = sub_pattern_list->next;
 	}
-	g_slist_free (check_ancestors);
-
-	return terminating_context;
 }
 
 /**
- * ancestor_ends_here:
- * @state: current state.
+ * can_apply_match:
+ * @state: the current state of the parser.
  * @line: the line to analyze.
- * @line_pos: the position inside @line, bytes.
- * @new_state: where to store the new state.
+ * @match_start: start position of match, bytes.
+ * @match_end: where to put end of match, bytes.
+ * @where: kind of sub patterns to apply.
  *
- * Verifies if some ancestor context ends at given position. If
- * state changed and @new_state is not %NULL, then the new state is stored
- * in @new_state, and descendants of @new_state are closed, so the
- * terminating segment becomes current state.
+ * See apply_match(), this function is a helper function
+ * called from where, it doesn't modify syntax tree.
  *
- * Returns: %TRUE if an ancestor ends at the given position.
+ * Returns: %TRUE if the match can be applied.
  */
 static gboolean
-ancestor_ends_here (Segment   *state,
-		    LineInfo  *line,
-		    gint       line_pos,
-		    Segment  **new_state)
+can_apply_match (Context        *state,
+		 LineInfo       *line,
+		 gint            match_start,
+		 gint           *match_end,
+		 CtkSourceRegex *regex)
 {
-	Context *terminating_context;
+	gint end_match_pos;
+	gboolean ancestor_ends;
+	gint pos;
 
-	terminating_context = ancestor_context_ends_here (state->context, line, line_pos);
+	ancestor_ends = FALSE;
 
-	if (new_state != NULL && terminating_context != NULL)
+	/* end_match_pos is the position of the end of the matched regex. */
+	_ctk_source_regex_fetch_pos_bytes (regex, 0, NULL, &end_match_pos);
+
+	g_assert (end_match_pos <= line->byte_length);
+
+	/* Verify if an ancestor ends in the matched text. */
+	if (ANCESTOR_CAN_END_CONTEXT (state) &&
+	    /* there is no middle of zero-length match */
+	    match_start < end_match_pos)
 	{
-		/* We have found a context that ends here, so we close
-		 * all the descendants. terminating_segment will be
-		 * closed by next next_segment() call from analyze_line. */
-		Segment *current_segment = state;
+		pos = match_start + 1;
 
-		while (current_segment->context != terminating_context)
-			current_segment = current_segment->parent;
+		while (pos < end_match_pos)
+		{
+			if (ancestor_context_ends_here (state, line, pos))
+			{
+				ancestor_ends = TRUE;
+				break;
+			}
 
-		*new_state = current_segment;
-		g_assert (*new_state != NULL);
+			pos = g_utf8_next_char (line->text + pos) - line->text;
+		}
+	}
+	else
+	{
+		pos = end_match_pos;
 	}
 
-	return terminating_context != NULL;
+	if (ancestor_ends)
+	{
+		/* An ancestor ends in the middle of the match, we verify
+		 * if the regex matches against the available string before
+		 * the end of the ancestor.
+		 * For instance in C a net-address context matches even if
+		 * it contains the end of a multi-line comment. */
+		if (!_ctk_source_regex_match (regex, line->text, pos, match_start))
+		{
+			/* This match is not valid, so we can try to match
+			 * the next definition, so the position should not
+			 * change. */
+			return FALSE;
+		}
+	}
+
+	*match_end = pos;
+	return TRUE;
 }
 
+
 /**
- * next_segment:
- * @ce: #CtkSourceContextEngine.
- * @state: current state.
- * @line: analyzed line.
- * @line_pos: position inside @line, bytes.
- * @new_state: where to store the new state.
- * @had_bom: if a BOM was found in the buffer
+ * apply_match:
+ * @ce: the engine.
+ * @state: the current state of the parser.
+ * @line: the line to analyze.
+ * @line_pos: position in the line, bytes.
+ * @regex: regex that matched.
+ * @where: kind of sub patterns to apply.
  *
- * Verifies if a context starts or ends in @line at @line_pos of after it.
- * If the contexts starts or ends here @new_state and @line_pos are updated.
+ * Moves @line_pos after the matched text. @line_pos is not
+ * updated and the function returns %FALSE if the match cannot be
+ * applied because an ancestor ends in the middle of the matched
+ * text.
  *
- * Returns: %FALSE is there are no more contexts in @line.
+ * If the match can be applied the function applies the appropriate
+ * sub patterns.
+ *
+ * Returns: %TRUE if the match can be applied.
  */
 static gboolean
-next_segment (CtkSourceContextEngine  *ce,
-	      Segment                 *state,
-	      LineInfo                *line,
-	      gint                    *line_pos,
-	      Segment                **new_state,
-	      gboolean                 had_bom)
+apply_match (CtkSourceContextEngine *ce,
+	     Segment                *state,
+	     LineInfo               *line,
+	     gint                   *line_pos,
+	     CtkSourceRegex         *regex,
+	     SubPatternWhere         where)
 {
-	gint pos = *line_pos;
-
-	g_assert (!ce->priv->hint2 || ce->priv->hint2->parent == state);
-	g_assert (pos <= line->byte_length);
-
-	while (pos <= line->byte_length)
-	{
-		DefinitionsIter def_iter;
-		gboolean context_end_found;
-		DefinitionChild *child_def;
+	gint match_end;
 
-		if (state->context->reg_all)
-		{
-			if (!_ctk_source_regex_match (state->context->reg_all,
-						      line->text,
-						      line->byte_length,
-						      pos))
-			{
-				return FALSE;
-			}
+	if (!can_apply_match (state->context, line, *line_pos, &match_end, regex))
+		return FALSE;
 
-			_ctk_source_regex_fetch_pos_bytes (state->context->reg_all,
-							   0, &pos, NULL);
-		}
+	segment_extend (ce, state, line_pos_to_offset (line, match_end));
+	apply_sub_patterns (ce, state, line, regex, where);
+	*line_pos = match_end;
 
-		/* Does an ancestor end here? */
-		if (ANCESTOR_CAN_END_CONTEXT (state->context) &&
-		    ancestor_ends_here (state, line, pos, new_state))
-		{
-			g_assert (pos <= line->byte_length);
-			segment_extend (state, line_pos_to_offset (line, pos));
-			*line_pos = pos;
-			return TRUE;
-		}
+	return TRUE;
+}
 
-		/* Does the current context end here? */
-		context_end_found = segment_ends_here (state, line, pos);
+/**
+ * create_reg_all:
+ * @context: context.
+ * @definition: context definition.
+ *
+ * Creates regular expression for all possible transitions: it
+ * combines terminating regex, terminating regexes of parent
+ * contexts if those can terminate this one, and start regexes
+ * of child contexts.
+ *
+ * It takes as an argument actual context or a context definition. In
+ * case when context end depends on start (\%{foo@start} references),
+ * it must use the context, definition is not enough. If there are no
+ * those references, then the reg_all is created right in the definition
+ * when no contexts exist yet. This is why this function has its funny
+ * arguments.
+ *
+ * Returns: resulting regex or %NULL when pcre failed to compile the regex.
+ */
+static CtkSourceRegex *
+create_reg_all (Context           *context,
+		ContextDefinition *definition)
+{
+	DefinitionsIter iter;
+	DefinitionChild *child_def;
+	GString *all;
+	CtkSourceRegex *regex;
+	GError *error = NULL;
+
+	g_return_val_if_fail ((context == NULL && definition != NULL) ||
+			      (context != NULL && definition == NULL), NULL);
+
+	if (definition == NULL)
+		definition = context->definition;
+
+	all = g_string_new ("(");
+
+	/* Closing regex. */
+	if (definition->type == CONTEXT_TYPE_CONTAINER &&
+	    definition->u.start_end.end != NULL)
+	{
+		CtkSourceRegex *end;
+
+		if (_ctk_source_regex_is_resolved (definition->u.start_end.end))
+		{
+			end = definition->u.start_end.end;
+		}
+		else
+		{
+			g_return_val_if_fail (context && context->end, NULL);
+			end = context->end;
+		}
+
+		g_string_append (all, _ctk_source_regex_get_pattern (end));
+		g_string_append (all, "|");
+	}
+
+	/* Ancestors. */
+	if (context != NULL)
+	{
+		Context *tmp = context;
+
+		while (ANCESTOR_CAN_END_CONTEXT (tmp))
+		{
+			if (!CONTEXT_EXTENDS_PARENT (tmp))
+			{
+				gboolean append = TRUE;
+
+				/* Code as it is seems to be right, and seems working right.
+				 * Remove FIXME's below if everything is fine. */
+
+				if (tmp->parent->end != NULL)
+					g_string_append (all, _ctk_source_regex_get_pattern (tmp->parent->end));
+				/* FIXME ?
+				 * The old code insisted on having tmp->parent->end != NULL here,
+				 * though e.g. in case line-comment -> email-address it's not the case.
+				 * Apparently using $ fixes the problem. */
+				else if (CONTEXT_END_AT_LINE_END (tmp->parent))
+					g_string_append (all, "$");
+				/* FIXME it's not clear whether it can happen, maybe we need assert here
+				 * or parser need to check it */
+				else
+				{
+					/* g_critical ("%s: oops", G_STRLOC); */
+					append = FALSE;
+				}
+
+				if (append)
+					g_string_append (all, "|");
+			}
+
+			tmp = tmp->parent;
+		}
+	}
+
+	/* Children. */
+	definition_iter_init (&iter, definition);
+	while ((child_def = definition_iter_next (&iter)) != NULL)
+	{
+		CtkSourceRegex *child_regex = NULL;
+
+		g_return_val_if_fail (child_def->resolved, NULL);
+
+		switch (child_def->u.definition->type)
+		{
+			case CONTEXT_TYPE_CONTAINER:
+				child_regex = child_def->u.definition->u.start_end.start;
+				break;
+			case CONTEXT_TYPE_SIMPLE:
+				child_regex = child_def->u.definition->u.match;
+				break;
+			default:
+				g_return_val_if_reached (NULL);
+		}
+
+		if (child_regex != NULL)
+		{
+			g_string_append (all, _ctk_source_regex_get_pattern (child_regex));
+			g_string_append (all, "|");
+		}
+	}
+	definition_iter_destroy (&iter);
+
+	if (all->len > 1)
+		g_string_truncate (all, all->len - 1);
+	g_string_append (all, ")");
+
+	regex = _ctk_source_regex_new (all->str, 0, &error);
+
+	if (regex == NULL)
+	{
+		/* regex_new could fail, for instance if there are different
+		 * named sub-patterns with the same name or if resulting regex is
+		 * too long. In this case fixing lang file helps (e.g. renaming
+		 * subpatterns, making huge keywords use bigger prefixes, etc.) */
+		g_warning (_("Cannot create a regex for all the transitions, "
+			     "the syntax highlighting process will be slower "
+			     "than usual.\nThe error was: %s"), error->message);
+		g_clear_error (&error);
+	}
+
+	g_string_free (all, TRUE);
+	return regex;
+}
+
+static Context *
+context_ref (Context *context)
+{
+	if (context != NULL)
+		context->ref_count++;
+	return context;
+}
+
+static void
+resolved_end_free (ResolvedEnd *resolved_end)
+{
+	g_free (resolved_end->resolve_key);
+	_ctk_source_regex_unref (resolved_end->end);
+	_ctk_source_regex_unref (resolved_end->reg_all);
+	g_slice_free (ResolvedEnd, resolved_end);
+}
+
+static void
+resolved_end_cache_free (ResolvedEndCache *cache)
+{
+	if (cache == NULL)
+		return;
+
+	/* The queue links are embedded in the entries, which are destroyed
+	 * together with the hash table. */
+	g_hash_table_destroy (cache->entries);
+	g_slice_free (ResolvedEndCache, cache);
+}
+
+/**
+ * resolved_end_lookup:
+ * @definition: container definition whose end regex refers to the start.
+ * @resolve_key: the key of the current match of the start regex, see
+ * _ctk_source_regex_resolve_key().
+ *
+ * Looks up the end regex resolved from the current match of the start
+ * regex, resolving it if it is not in the cache. Contexts for the same
+ * delimiter (e.g. heredocs terminated by the same word) are created over
+ * and over again while editing, in different parents and in different
+ * buffers; this saves compiling the same end regex and reg_all every
+ * time. Only the last RESOLVED_END_CACHE_SIZE delimiters are kept.
+ *
+ * Returns: the cache entry, owned by @definition.
+ */
+static ResolvedEnd *
+resolved_end_lookup (ContextDefinition *definition,
+		     const gchar       *resolve_key)
+{
+	ResolvedEndCache *cache;
+	ResolvedEnd *resolved_end;
+
+	g_assert (definition->type == CONTEXT_TYPE_CONTAINER);
+	g_assert (!_ctk_source_regex_is_resolved (definition->u.start_end.end));
+
+	cache = definition->resolved_ends;
+
+	if (cache == NULL)
+	{
+		cache = g_slice_new0 (ResolvedEndCache);
+		cache->entries = g_hash_table_new_full (g_str_hash, g_str_equal, NULL,
+							(GDestroyNotify) resolved_end_free);
+		g_queue_init (&cache->lru);
+		definition->resolved_ends = cache;
+	}
+
+	resolved_end = g_hash_table_lookup (cache->entries, resolve_key);
+
+	if (resolved_end != NULL)
+	{
+		cache->hits++;
+
+		g_queue_unlink (&cache->lru, &resolved_end->link);
+		g_queue_push_head_link (&cache->lru, &resolved_end->link);
+
+		return resolved_end;
+	}
+
+	cache->misses++;
+
+	resolved_end = g_slice_new0 (ResolvedEnd);
+	resolved_end->resolve_key = g_strdup (resolve_key);
+	resolved_end->end = _ctk_source_regex_resolve (definition->u.start_end.end,
+						       definition->u.start_end.start,
+						       NULL);
+	resolved_end->link.data = resolved_end;
+
+	g_hash_table_insert (cache->entries, resolved_end->resolve_key, resolved_end);
+	g_queue_push_head_link (&cache->lru, &resolved_end->link);
+
+	if (cache->lru.length > RESOLVED_END_CACHE_SIZE)
+	{
+		GList *oldest = g_queue_pop_tail_link (&cache->lru);
+		ResolvedEnd *evicted = oldest->data;
+
+		g_hash_table_remove (cache->entries, evicted->resolve_key);
+	}
+
+	return resolved_end;
+}
+
+/* does not copy style */
+static Context *
+context_new (Context           *parent,
+	     ContextDefinition *definition,
+	     const gchar       *line_text,
+	     const gchar       *resolve_key,
+	     const gchar       *style,
+	     gboolean           ignore_children_style)
+{
+	Context *context;
+	ResolvedEnd *resolved_end = NULL;
+
+	context = g_slice_new0 (Context);
+	context->ref_count = 1;
+	context->definition = definition;
+	context->parent = parent;
+
+	context->style = style;
+	context->ignore_children_style = ignore_children_style;
+
+	if (parent != NULL && parent->ignore_children_style)
+	{
+		context->ignore_children_style = TRUE;
+		context->style = NULL;
+	}
+
+	if (!parent || (parent->all_ancestors_extend && CONTEXT_EXTENDS_PARENT (parent)))
+	{
+		context->all_ancestors_extend = TRUE;
+	}
+
+	if (line_text &&
+	    definition->type == CONTEXT_TYPE_CONTAINER &&
+	    definition->u.start_end.end)
+	{
+		if (resolve_key != NULL &&
+		    !_ctk_source_regex_is_resolved (definition->u.start_end.end))
+		{
+			/* Held until reg_all is taken from @resolved_end,
+			 * which another thread could evict. */
+			g_mutex_lock (&definition_cache_mutex);
+			resolved_end = resolved_end_lookup (definition, resolve_key);
+			context->end = _ctk_source_regex_ref (resolved_end->end);
+		}
+		else
+		{
+			context->end = _ctk_source_regex_resolve (definition->u.start_end.end,
+								  definition->u.start_end.start,
+								  line_text);
+		}
+	}
+
+	/* Create reg_all. If it is possibile we share the same reg_all
+	 * for more contexts storing it in the definition, or in the
+	 * resolved end cache when it depends on the start match. */
+	if (ANCESTOR_CAN_END_CONTEXT (context))
+	{
+		context->reg_all = create_reg_all (context, NULL);
+	}
+	else if (resolved_end != NULL)
+	{
+		if (resolved_end->reg_all == NULL)
+			resolved_end->reg_all = create_reg_all (context, NULL);
+		context->reg_all = _ctk_source_regex_ref (resolved_end->reg_all);
+	}
+	else if (definition->type == CONTEXT_TYPE_CONTAINER &&
+		 definition->u.start_end.end != NULL &&
+		 !_ctk_source_regex_is_resolved (definition->u.start_end.end))
+	{
+		context->reg_all = create_reg_all (context, NULL);
+	}
+	else
+	{
+		g_mutex_lock (&definition_cache_mutex);
+		if (!definition->reg_all)
+			definition->reg_all = create_reg_all (NULL, definition);
+		context->reg_all = _ctk_source_regex_ref (definition->reg_all);
+		g_mutex_unlock (&definition_cache_mutex);
+	}
+
+	if (resolved_end != NULL)
+		g_mutex_unlock (&definition_cache_mutex);
+
+#ifdef ENABLE_DEBUG
+	{
+		GString *str = g_string_new (definition->id);
+		Context *tmp = context->parent;
+		while (tmp != NULL)
+		{
+			g_string_prepend (str, "/");
+			g_string_prepend (str, tmp->definition->id);
+			tmp = tmp->parent;
+		}
+		g_print ("created context %s: %s\n", definition->id, str->str);
+		g_string_free (str, TRUE);
+	}
+#endif
+
+	return context;
+}
+
+static void
+context_unref_hash_cb (gpointer  text,
+		       Context  *context,
+		       gpointer  user_data)
+{
+	context->parent = NULL;
+	context_unref (context);
+}
+
+static gboolean
+remove_context_cb (G_GNUC_UNUSED gpointer  text,
+		   Context                *context,
+		   Context                *target)
+{
+	return context == target;
+}
+
+static void
+context_remove_child (Context *parent,
+		      Context *context)
+{
+	ContextPtr *ptr, *prev = NULL;
+	gboolean delete = TRUE;
+
+	g_assert (context->parent == parent);
+
+	for (ptr = parent->children; ptr; ptr = ptr->next)
+	{
+		if (ptr->definition == context->definition)
+			break;
+		prev = ptr;
+	}
+
+	g_assert (ptr != NULL);
+
+	if (!ptr->fixed)
+	{
+		g_hash_table_foreach_remove (ptr->u.hash,
+					     (GHRFunc) remove_context_cb,
+					     context);
+
+		if (g_hash_table_size (ptr->u.hash) != 0)
+			delete = FALSE;
+	}
+
+	if (delete)
+	{
+		if (prev != NULL)
+			prev->next = ptr->next;
+		else
+			parent->children = ptr->next;
+
+		if (!ptr->fixed)
+			g_hash_table_destroy (ptr->u.hash);
+
+#ifdef ENABLE_DEBUG
+		memset (ptr, 1, sizeof (ContextPtr));
+#else
+		g_slice_free (ContextPtr, ptr);
+#endif
+	}
+}
+
+/**
+ * context_unref:
+ * @context: the context.
+ *
+ * Decreases reference count and removes @context
+ * from the tree when it drops to zero.
+ */
+static void
+context_unref (Context *context)
+{
+	ContextPtr *children;
+	guint i;
+
+	if (context == NULL || --context->ref_count != 0)
+		return;
+
+	DEBUG (g_print ("destroying context %s\n", context->definition->id));
+
+	children = context->children;
+	context->children = NULL;
+
+	while (children != NULL)
+	{
+		ContextPtr *ptr = children;
+
+		children = children->next;
+
+		if (ptr->fixed)
+		{
+			ptr->u.context->parent = NULL;
+			context_unref (ptr->u.context);
+		}
+		else
+		{
+			g_hash_table_foreach (ptr->u.hash,
+					      (GHFunc) context_unref_hash_cb,
+					      NULL);
+			g_hash_table_destroy (ptr->u.hash);
+		}
+
+#ifdef ENABLE_DEBUG
+		memset (ptr, 1, sizeof (ContextPtr));
+#else
+		g_slice_free (ContextPtr, ptr);
+#endif
+	}
+
+	if (context->parent != NULL)
+		context_remove_child (context->parent, context);
+
+	_ctk_source_regex_unref (context->end);
+	_ctk_source_regex_unref (context->reg_all);
+
+	if (context->subpattern_context_classes != NULL)
+	{
+		for (i = 0; i < context->definition->n_sub_patterns; ++i)
+		{
+			g_slist_free_full (context->subpattern_context_classes[i],
+			                   (GDestroyNotify)context_class_tag_free);
+		}
+	}
+
+	g_slist_free_full (context->context_classes, (GDestroyNotify)context_class_tag_free);
+
+	g_free (context->subpattern_context_classes);
+	g_free (context->subpattern_tags);
+
+	g_slice_free (Context, context);
+}
+
+static void
+context_freeze_hash_cb (gpointer  text,
+			Context  *context,
+			gpointer  user_data)
+{
+	context_freeze (context);
+}
+
+/**
+ * context_freeze:
+ * @context: the context.
+ *
+ * Recursively increments reference count in context and its children,
+ * and marks them, so context_thaw is able to correctly decrement
+ * reference count.
+ * This function is for update_syntax: we want to preserve existing
+ * contexts when possible, and update_syntax erases contexts from
+ * reanalyzed lines; so to avoid destructing and recreating contexts
+ * every time, we need to increment reference count on existing contexts,
+ * and decrement it when we are done with analysis, so no more needed
+ * contexts go away. Keeping a list of referenced contexts is painful
+ * or slow, so we just reference all contexts present at the moment.
+ *
+ * Note this is not reentrant, context_freeze()/context_thaw() pair is called
+ * only from update_syntax().
+ */
+static void
+context_freeze (Context *ctx)
+{
+	ContextPtr *ptr;
+
+	g_assert (!ctx->frozen);
+	ctx->frozen = TRUE;
+	context_ref (ctx);
+
+	for (ptr = ctx->children; ptr != NULL; ptr = ptr->next)
+	{
+		if (ptr->fixed)
+		{
+			context_freeze (ptr->u.context);
+		}
+		else
+		{
+			g_hash_table_foreach (ptr->u.hash,
+					      (GHFunc) context_freeze_hash_cb,
+					      NULL);
+		}
+	}
+}
+
+static void
+get_child_contexts_hash_cb (G_GNUC_UNUSED gpointer   text,
+			    Context                 *context,
+			    GSList                 **list)
+{
+	*list = g_slist_prepend (*list, context);
+}
+
+static void
+context_thaw_cb (Context *ctx,
+		 gpointer user_data)
+{
+	context_thaw (ctx);
+}
+
+/**
+ * context_thaw:
+ * @context: the context.
+ *
+ * Recursively decrements reference count in context and its children,
+ * if it was incremented by context_freeze().
+ */
+static void
+context_thaw (Context *ctx)
+{
+	ContextPtr *ptr;
+
+	if (!ctx->frozen)
+		return;
+
+	for (ptr = ctx->children; ptr != NULL; )
+	{
+		ContextPtr *next = ptr->next;
+
+		if (ptr->fixed)
+		{
+			context_thaw (ptr->u.context);
+		}
+		else
+		{
+			GSList *children = NULL;
+
+			g_hash_table_foreach (ptr->u.hash,
+					      (GHFunc) get_child_contexts_hash_cb,
+					      &children);
+
+			g_slist_foreach (children, (GFunc) context_thaw_cb, NULL);
+			g_slist_free (children);
+		}
+
+		ptr = next;
+	}
+
+	ctx->frozen = FALSE;
+	context_unref (ctx);
+}
+
+static Context *
+create_child_context (Context         *parent,
+		      DefinitionChild *child_def,
+		      const gchar     *line_text)
+{
+	Context *context;
+	ContextPtr *ptr;
+	gchar *resolve_key = NULL;
+	ContextDefinition *definition = child_def->u.definition;
+
+	g_return_val_if_fail (parent != NULL, NULL);
+
+	for (ptr = parent->children;
+	     ptr != NULL && ptr->definition != definition;
+	     ptr = ptr->next) ;
+
+	if (ptr == NULL)
+	{
+		ptr = g_slice_new0 (ContextPtr);
+		ptr->next = parent->children;
+		parent->children = ptr;
+		ptr->definition = definition;
+
+		if (definition->type != CONTEXT_TYPE_CONTAINER ||
+		    !definition->u.start_end.end ||
+		    _ctk_source_regex_is_resolved (definition->u.start_end.end))
+		{
+			ptr->fixed = TRUE;
+		}
+
+		if (!ptr->fixed)
+			ptr->u.hash = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+	}
+
+	if (ptr->fixed)
+	{
+		context = ptr->u.context;
+	}
+	else
+	{
+		/* Not the matched text: a subpattern in a lookaround can
+		 * capture text around it. */
+		resolve_key = _ctk_source_regex_resolve_key (definition->u.start_end.end,
+							     definition->u.start_end.start);
+		g_return_val_if_fail (resolve_key != NULL, NULL);
+		context = g_hash_table_lookup (ptr->u.hash, resolve_key);
+	}
+
+	if (context != NULL)
+	{
+		g_free (resolve_key);
+		return context_ref (context);
+	}
+
+	context = context_new (parent,
+			       definition,
+			       line_text,
+			       resolve_key,
+			       child_def->override_style ? child_def->style :
+					child_def->u.definition->default_style,
+			       child_def->override_style ? child_def->override_style_deep : FALSE);
+	g_return_val_if_fail (context != NULL, NULL);
+
+	if (ptr->fixed)
+		ptr->u.context = context;
+	else
+		g_hash_table_insert (ptr->u.hash, resolve_key, context);
+
+	return context;
+}
+
+/**
+ * segment_new:
+ * @ce: the engine.
+ * @parent: parent segment (%NULL for the root segment).
+ * @context: context for this segment (%NULL for invalid segments).
+ * @start_at: start offset in the buffer, characters.
+ * @end_at: end offset in the buffer, characters.
+ * @is_start: is_start flag.
+ *
+ * Creates a new segment structure. It doesn't take care about
+ * parent or siblings, create_segment() is the function to
+ * create new segments in the tree.
+ *
+ * Returns: newly created segment.
+ */
+static Segment *
+segment_new (CtkSourceContextEngine *ce,
+	     Segment                *parent,
+	     Context                *context,
+	     gint                    start_at,
+	     gint                    end_at,
+	     gboolean                is_start)
+{
+	Segment *segment;
+
+#ifdef ENABLE_CHECK_TREE
+	g_assert (!is_start || context != NULL);
+#endif
+
+	segment = node_pool_alloc0 (&ce->priv->segment_pool);
+	segment->parent = parent;
+	segment->context = context_ref (context);
+	segment->rel_start = start_at;
+	segment->length = end_at - start_at;
+	segment->abs_start = start_at;
+	segment->abs_stamp = ce->priv->tree_stamp;
+	segment->is_start = is_start;
+
+	/* The offsets are made relative to the parent here, and to the
+	 * other segments in the index by segment_index_insert(). */
+	if (parent != NULL)
+		segment->rel_start -= segment_start (ce, parent);
+
+	if (context == NULL)
+		add_invalid (ce, segment);
+	else if (G_UNLIKELY (highlight_profile_enabled ()))
+		highlight_profile_get (context->definition)->n_segments++;
+
+	return segment;
+}
+
+static void
+find_segment_position_forward_ (CtkSourceContextEngine  *ce,
+				Segment                 *segment,
+				gint                     start_at,
+				gint                     end_at,
+				Segment                **prev,
+				Segment                **next)
+{
+	Segment *parent = segment->parent;
+	guint steps = 0;
+
+	g_assert (segment_start (ce, segment) <= start_at);
+
+	while (segment != NULL)
+	{
+		if (++steps == SEGMENT_INDEX_MIN_WALK)
+		{
+			segment = segment_find_child_ (ce, parent, start_at);
+
+			if (segment == NULL)
+			{
+				*prev = parent->last_child;
+				break;
+			}
+
+			*prev = segment->prev;
+		}
+
+		if (segment_end (ce, segment) == start_at)
+		{
+			while (segment->next != NULL && segment_start (ce, segment->next) == start_at)
+				segment = segment->next;
+
+			*prev = segment;
+			*next = segment->next;
+
+			break;
+		}
+
+		if (segment_start (ce, segment) == end_at)
+		{
+			*next = segment;
+			*prev = segment->prev;
+			break;
+		}
+
+		if (segment_start (ce, segment) > end_at)
+		{
+			*next = segment;
+			break;
+		}
+
+		if (segment_end (ce, segment) < start_at)
+			*prev = segment;
+
+		segment = segment->next;
+	}
+}
+
+static void
+find_segment_position_backward_ (CtkSourceContextEngine  *ce,
+				 Segment                 *segment,
+				 gint                     start_at,
+				 gint                     end_at,
+				 Segment                **prev,
+				 Segment                **next)
+{
+	Segment *parent = segment->parent;
+	guint steps = 0;
+
+	g_assert (start_at < segment_end (ce, segment));
+
+	while (segment != NULL)
+	{
+		if (++steps == SEGMENT_INDEX_MIN_WALK)
+		{
+			/* The first child ending after start_at. */
+			segment = segment_find_child_ (ce, parent, start_at + 1);
+			g_assert (segment != NULL);
+
+			*next = segment;
+			*prev = segment->prev;
+			break;
+		}
+
+		if (segment_end (ce, segment) <= start_at)
+		{
+			*prev = segment;
+			break;
+		}
+
+		g_assert (segment_start (ce, segment) >= end_at);
+
+		*next = segment;
+		segment = segment->prev;
+	}
+}
+
+/**
+ * find_segment_position:
+ * @parent: parent segment (not %NULL).
+ * @hint: segment somewhere near new segment position.
+ * @start_at: start offset.
+ * @end_at: end offset.
+ * @prev: location to return previous sibling.
+ * @next: location to return next sibling.
+ *
+ * Finds siblings of a new segment to be created at interval
+ * (start_at, end_at). It uses hint to avoid walking whole
+ * parent->children list.
+ */
+static void
+find_segment_position (CtkSourceContextEngine  *ce,
+		       Segment                 *parent,
+		       Segment                 *hint,
+		       gint                     start_at,
+		       gint                     end_at,
+		       Segment                **prev,
+		       Segment                **next)
+{
+	Segment *tmp;
+
+	g_assert (segment_start (ce, parent) <= start_at && end_at <= segment_end (ce, parent));
+	g_assert (!hint || hint->parent == parent);
+
+	*prev = *next = NULL;
+
+	if (parent->children == NULL)
+		return;
+
+	if (parent->children->next == NULL)
+	{
+		tmp = parent->children;
+
+		if (start_at >= segment_end (ce, tmp))
+			*prev = tmp;
+		else
+			*next = tmp;
+
+		return;
+	}
+
+	if (hint == NULL)
+		hint = parent->children;
+
+	if (segment_end (ce, hint) <= start_at)
+		find_segment_position_forward_ (ce, hint, start_at, end_at, prev, next);
+	else
+		find_segment_position_backward_ (ce, hint, start_at, end_at, prev, next);
+}
+
+/**
+ * create_segment:
+ * @ce: the engine.
+ * @parent: parent segment (%NULL for the root segment).
+ * @context: context for this segment (%NULL for invalid segments).
+ * @start_at: start offset, characters.
+ * @end_at: end offset, characters.
+ * @is_start: is_start flag.
+ * @hint: a segment somewhere near new one, to omtimize search.
+ *
+ * Creates a new segment and inserts it into the tree.
+ *
+ * Returns: newly created segment.
+ */
+static Segment *
+create_segment (CtkSourceContextEngine *ce,
+		Segment                *parent,
+		Context                *context,
+		gint                    start_at,
+		gint                    end_at,
+		gboolean                is_start,
+		Segment                *hint)
+{
+	Segment *segment;
+
+	g_assert (!parent || (segment_start (ce, parent) <= start_at && end_at <= segment_end (ce, parent)));
+
+	segment = segment_new (ce, parent, context, start_at, end_at, is_start);
+
+	if (parent != NULL)
+	{
+		Segment *prev, *next;
+
+		if (hint == NULL)
+		{
+			hint = ce->priv->hint;
+			while (hint != NULL && hint->parent != parent)
+				hint = hint->parent;
+		}
+
+		find_segment_position (ce, parent, hint,
+				       start_at, end_at,
+				       &prev, &next);
+
+		g_assert ((!parent->children && !prev && !next) ||
+			  (parent->children && (prev || next)));
+		g_assert (!prev || prev->next == next);
+		g_assert (!next || next->prev == prev);
+
+		segment->next = next;
+		segment->prev = prev;
+
+		if (next != NULL)
+			next->prev = segment;
+		else
+			parent->last_child = segment;
+
+		if (prev != NULL)
+			prev->next = segment;
+		else
+			parent->children = segment;
+
+		segment_index_insert (ce, segment);
+
+		CHECK_SEGMENT_LIST (ce, parent);
+		CHECK_TREE (ce);
+	}
+
+	return segment;
+}
+
+/**
+ * segment_extend:
+ * @state: the semgent.
+ * @end_at: new end offset, characters.
+ *
+ * Updates end offset in the segment and its ancestors.
+ */
+static void
+segment_extend (CtkSourceContextEngine *ce,
+		Segment                *state,
+		gint                    end_at)
+{
+	while (state != NULL && segment_end (ce, state) < end_at)
+	{
+		segment_set_end (ce, state, end_at);
+		state = state->parent;
+	}
+	CHECK_SEGMENT_LIST (ce, state->parent);
+}
+
+static void
+segment_destroy_children (CtkSourceContextEngine *ce,
+			  Segment                *segment)
+{
+	Segment *child;
+	SubPattern *sp;
+
+	g_return_if_fail (segment != NULL);
+
+	child = segment->children;
+	segment->children = NULL;
+	segment->last_child = NULL;
+
+	/* The nodes of the children are freed with them. */
+	if (segment->index != NULL)
+		segment->index->root = NULL;
+
+	while (child != NULL)
+	{
+		Segment *next = child->next;
+		segment_destroy (ce, child);
+		child = next;
+	}
+
+	sp = segment->sub_patterns;
+	segment->sub_patterns = NULL;
+
+	while (sp != NULL)
+	{
+		SubPattern *next = sp->next;
+		sub_pattern_free (ce, sp);
+		sp = next;
+	}
+}
+
+/**
+ * segment_destroy:
+ * @ce: the engine.
+ * @context: the segment to destroy.
+ *
+ * Recursively frees given segment. It removes the segment
+ * from ce structure, but it doesn't update parent and
+ * siblings. segment_remove() is the function that takes
+ * care of everything.
+ */
+static void
+segment_destroy (CtkSourceContextEngine *ce,
+		 Segment                *segment)
+{
+	g_return_if_fail (segment != NULL);
+
+	segment_destroy_children (ce, segment);
+
+	/* segment neighbours and parent may be invalid here,
+	 * so we only can unset the hint */
+	if (ce->priv->hint == segment)
+		ce->priv->hint = NULL;
+        if (ce->priv->hint2 == segment)
+                ce->priv->hint2 = NULL;
+
+	if (SEGMENT_IS_INVALID (segment))
+		remove_invalid (ce, segment);
+
+	context_unref (segment->context);
+
+	if (segment->index != NULL)
+		node_pool_free (&ce->priv->index_pool, segment->index);
+
+#ifdef ENABLE_DEBUG
+	g_assert (!g_slist_find (ce->priv->invalid, segment));
+#endif
+
+	node_pool_free (&ce->priv->segment_pool, segment);
+}
+
+/**
+ * container_context_starts_here:
+ *
+ * See child_starts_here().
+ */
+static gboolean
+container_context_starts_here (CtkSourceContextEngine  *ce,
+			       Segment                 *state,
+			       DefinitionChild         *child_def,
+			       LineInfo                *line,
+			       gint                    *line_pos, /* bytes */
+			       Segment                **new_state)
+{
+	Context *new_context;
+	Segment *new_segment;
+	gint match_end;
+	ContextDefinition *definition = child_def->u.definition;
+
+	g_assert (*line_pos <= line->byte_length);
+
+	/* We can have a container context definition (i.e. the main
+	 * language definition) without start_end.start. */
+	if (definition->u.start_end.start == NULL)
+		return FALSE;
+
+	if (!definition_regex_match (definition,
+				     definition->u.start_end.start,
+				     line, *line_pos, NULL))
+	{
+		return FALSE;
+	}
+
+	new_context = create_child_context (state->context, child_def, line->text);
+	g_return_val_if_fail (new_context != NULL, FALSE);
+
+	if (!can_apply_match (new_context, line, *line_pos, &match_end,
+			      definition->u.start_end.start))
+	{
+		context_unref (new_context);
+		return FALSE;
+	}
+
+	g_assert (match_end <= line->byte_length);
+
+        segment_extend (ce, state, line_pos_to_offset (line, match_end));
+        new_segment = create_segment (ce, state, new_context,
+				      line_pos_to_offset (line, *line_pos),
+				      line_pos_to_offset (line, match_end),
+				      TRUE,
+				      ce->priv->hint2);
+
+	/* This new context could end at the same position (i.e. have zero length),
+	 * and then we get an infinite loop. We can't possibly know about it at this point
+	 * (since we need to know that the context indeed *ends* here, and that's
+	 * discovered only later) so we look at the previous sibling: if it's the same,
+	 * and has zero length then we remove the segment. We do it this way instead of
+	 * checking before creating the segment because it's more convenient. */
+	if (*line_pos == match_end &&
+	    new_segment->prev != NULL &&
+	    new_segment->prev->context == new_segment->context &&
+	    segment_start (ce, new_segment->prev) == segment_end (ce, new_segment->prev) &&
+	    segment_start (ce, new_segment->prev) == line_pos_to_offset (line, *line_pos))
+	{
+		segment_remove (ce, new_segment);
+		return FALSE;
+	}
+
+	apply_sub_patterns (ce, new_segment, line,
+			    definition->u.start_end.start,
+			    SUB_PATTERN_WHERE_START);
+	*line_pos = match_end;
+	*new_state = new_segment;
+	ce->priv->hint2 = NULL;
+	context_unref (new_context);
+	return TRUE;
+}
+
+/**
+ * simple_context_starts_here:
+ *
+ * See child_starts_here().
+ */
+static gboolean
+simple_context_starts_here (CtkSourceContextEngine *ce,
+			    Segment                *state,
+			    DefinitionChild        *child_def,
+			    LineInfo               *line,
+			    gint                   *line_pos, /* bytes */
+			    Segment               **new_state)
+{
+	gint match_end;
+	Context *new_context;
+	ContextDefinition *definition = child_def->u.definition;
+
+	g_return_val_if_fail (definition->u.match != NULL, FALSE);
+
+	g_assert (*line_pos <= line->byte_length);
+
+	if (!definition_regex_match (definition,
+				     definition->u.match,
+				     line, *line_pos, NULL))
+	{
+		return FALSE;
+	}
+
+	new_context = create_child_context (state->context, child_def, line->text);
+	g_return_val_if_fail (new_context != NULL, FALSE);
+
+	if (!can_apply_match (new_context, line, *line_pos, &match_end, definition->u.match))
+	{
+		context_unref (new_context);
+		return FALSE;
+	}
+
+	/* If length of the match is zero, then we get zero-length segment and return to
+	 * the same state, so it's an infinite loop. But, if this child ends parent, we
+	 * do want to terminate parent. Still, if match is at the beginning of the parent
+	 * then we get an infinite loop again, so we check that (NOTE it really should destroy
+	 * parent context then, but then we again can get parent context be recreated here and
+	 * so on). */
+	if (*line_pos == match_end &&
+	    (!CONTEXT_ENDS_PARENT (new_context) ||
+		line_pos_to_offset (line, *line_pos) == segment_start (ce, state)))
+	{
+		context_unref (new_context);
+		return FALSE;
+	}
+
+	g_assert (match_end <= line->byte_length);
+	segment_extend (ce, state, line_pos_to_offset (line, match_end));
+
+	if (*line_pos != match_end)
+	{
+		/* Normal non-zero-length match, create a child segment */
+		Segment *new_segment;
+		new_segment = create_segment (ce, state, new_context,
+					      line_pos_to_offset (line, *line_pos),
+					      line_pos_to_offset (line, match_end),
+					      TRUE,
+					      ce->priv->hint2);
+		apply_sub_patterns (ce, new_segment, line, definition->u.match, SUB_PATTERN_WHERE_DEFAULT);
+		ce->priv->hint2 = new_segment;
+	}
+
+	/* Terminate parent if needed */
+	if (CONTEXT_ENDS_PARENT (new_context))
+	{
+		do
+		{
+			ce->priv->hint2 = state;
+			state = state->parent;
+		}
+		while (SEGMENT_ENDS_PARENT (state));
+	}
+
+	*line_pos = match_end;
+	*new_state = state;
+	context_unref (new_context);
+	return TRUE;
+}
+
+/**
+ * child_starts_here:
+ * @ce: the engine.
+ * @state: current state.
+ * @child_def: the child.
+ * @line: line to analyze.
+ * @line_pos: the position inside @line, bytes.
+ * @new_state: where to store the new state.
+ *
+ * Verifies if a context of the type in @curr_definition starts at
+ * @line_pos in @line. If the contexts start here @new_state and
+ * @line_pos are updated.
+ *
+ * Returns: %TRUE if the context starts here.
+ */
+static gboolean
+child_starts_here (CtkSourceContextEngine  *ce,
+		   Segment                 *state,
+		   DefinitionChild         *child_def,
+		   LineInfo                *line,
+		   gint                    *line_pos,
+		   Segment                **new_state)
+{
+	g_return_val_if_fail (child_def->resolved, FALSE);
+
+	switch (child_def->u.definition->type)
+	{
+		case CONTEXT_TYPE_SIMPLE:
+			return simple_context_starts_here (ce,
+							   state,
+							   child_def,
+							   line,
+							   line_pos,
+							   new_state);
+		case CONTEXT_TYPE_CONTAINER:
+			return container_context_starts_here (ce,
+							      state,
+							      child_def,
+							      line,
+							      line_pos,
+							      new_state);
+		default:
+			g_return_val_if_reached (FALSE);
+	}
+}
+
+/**
+ * segment_ends_here:
+ * @state: the segment.
+ * @line: analyzed line.
+ * @pos: the position inside @line, bytes.
+ *
+ * Checks whether given segment ends at pos. Unlike
+ * child_starts_here() it doesn't modify tree, it merely
+ * calls regex_match() for the end regex.
+ */
+static gboolean
+segment_ends_here (Segment  *state,
+		   LineInfo *line,
+		   gint      pos)
+{
+	g_assert (SEGMENT_IS_CONTAINER (state));
+
+	return state->context->definition->u.start_end.end &&
+		definition_regex_match (state->context->definition,
+					state->context->end,
+					line, pos, NULL);
+}
+
+/**
+ * ancestor_context_ends_here:
+ * @state: current context.
+ * @line: the line to analyze.
+ * @line_pos: the position inside @line, bytes.
+ *
+ * Verifies if some ancestor context ends at the current position.
+ * This function only checks conetxts and does not modify the tree,
+ * it's used by ancestor_ends_here().
+ *
+ * Returns: the ancestor context that terminates here or %NULL.
+ */
+static Context *
+ancestor_context_ends_here (Context  *state,
+			    LineInfo *line,
+			    gint      line_pos)
+{
+	Context *current_context;
+	GSList *current_context_list;
+	GSList *check_ancestors;
+	Context *terminating_context;
+
+	/* A context can be terminated by the parent if extend_parent is
+	 * FALSE, so we need to verify the end of all the parents of
+	 * not-extending contexts. The list is ordered by ascending
+	 * depth. */
+	check_ancestors = NULL;
+	current_context = state;
+	while (ANCESTOR_CAN_END_CONTEXT (current_context))
+	{
+		if (!CONTEXT_EXTENDS_PARENT (current_context))
+			check_ancestors = g_slist_prepend (check_ancestors,
+							   current_context->parent);
+		current_context = current_context->parent;
+	}
+
+	/* The first context that ends here terminates its descendants. */
+	terminating_context = NULL;
+	current_context_list = check_ancestors;
+	while (current_context_list != NULL)
+	{
+		current_context = current_context_list->data;
+
+		if (current_context->end &&
+		    _ctk_source_regex_is_resolved (current_context->end) &&
+		    definition_regex_match (current_context->definition,
+					    current_context->end,
+					    line, line_pos, NULL))
+		{
+			terminating_context = current_context;
+			break;
+		}
+
+		current_context_list = current_context_list->next;
+	}
+	g_slist_free (check_ancestors);
+
+	return terminating_context;
+}
+
+/**
+ * ancestor_ends_here:
+ * @state: current state.
+ * @line: the line to analyze.
+ * @line_pos: the position inside @line, bytes.
+ * @new_state: where to store the new state.
+ *
+ * Verifies if some ancestor context ends at given position. If
+ * state changed and @new_state is not %NULL, then the new state is stored
+ * in @new_state, and descendants of @new_state are closed, so the
+ * terminating segment becomes current state.
+ *
+ * Returns: %TRUE if an ancestor ends at the given position.
+ */
+static gboolean
+ancestor_ends_here (Segment   *state,
+		    LineInfo  *line,
+		    gint       line_pos,
+		    Segment  **new_state)
+{
+	Context *terminating_context;
+
+	terminating_context = ancestor_context_ends_here (state->context, line, line_pos);
+
+	if (new_state != NULL && terminating_context != NULL)
+	{
+		/* We have found a context that ends here, so we close
+		 * all the descendants. terminating_segment will be
+		 * closed by next next_segment() call from analyze_line. */
+		Segment *current_segment = state;
+
+		while (current_segment->context != terminating_context)
+			current_segment = current_segment->parent;
+
+		*new_state = current_segment;
+		g_assert (*new_state != NULL);
+	}
+
+	return terminating_context != NULL;
+}
+
+/**
+ * next_segment:
+ * @ce: #CtkSourceContextEngine.
+ * @state: current state.
+ * @line: analyzed line.
+ * @line_pos: position inside @line, bytes.
+ * @new_state: where to store the new state.
+ * @had_bom: if a BOM was found in the buffer
+ *
+ * Verifies if a context starts or ends in @line at @line_pos of after it.
+ * If the contexts starts or ends here @new_state and @line_pos are updated.
+ *
+ * Returns: %FALSE is there are no more contexts in @line.
+ */
+static gboolean
+next_segment (CtkSourceContextEngine  *ce,
+	      Segment                 *state,
+	      LineInfo                *line,
+	      gint                    *line_pos,
+	      Segment                **new_state,
+	      gboolean                 had_bom)
+{
+	gint pos = *line_pos;
+
+	g_assert (!ce->priv->hint2 || ce->priv->hint2->parent == state);
+	g_assert (pos <= line->byte_length);
+
+	while (pos <= line->byte_length)
+	{
+		DefinitionsIter def_iter;
+		gboolean context_end_found;
+		DefinitionChild *child_def;
+
+		if (state->context->reg_all)
+		{
+			if (!definition_regex_match (state->context->definition,
+						     state->context->reg_all,
+						     line, pos, &pos))
+			{
+				return FALSE;
+			}
+		}
+
+		/* Does an ancestor end here? */
+		if (ANCESTOR_CAN_END_CONTEXT (state->context) &&
+		    ancestor_ends_here (state, line, pos, new_state))
+		{
+			g_assert (pos <= line->byte_length);
+			segment_extend (ce, state, line_pos_to_offset (line, pos));
+			*line_pos = pos;
+			return TRUE;
+		}
+
+		/* Does the current context end here? */
+		context_end_found = segment_ends_here (state, line, pos);
+
+		/* Iter over the definitions we can find in the current
+		 * context. */
+		definition_iter_init (&def_iter, state->context->definition);
+		while ((child_def = definition_iter_next (&def_iter)) != NULL)
+		{
+			gboolean try_this = TRUE;
+
+			g_return_val_if_fail (child_def->resolved, FALSE);
+
+			/* If the child definition does not extend the parent
+			 * and the current context could end here we do not
+			 * need to examine this child. */
+			if (!HAS_OPTION (child_def->u.definition, EXTEND_PARENT) && context_end_found)
+				try_this = FALSE;
+
+			if (HAS_OPTION (child_def->u.definition, FIRST_LINE_ONLY) && line->start_at != had_bom)
+				try_this = FALSE;
+
+			if (HAS_OPTION (child_def->u.definition, ONCE_ONLY))
+			{
+				Segment *prev;
+
+				for (prev = state->children; prev != NULL; prev = prev->next)
+				{
+					if (prev->context != NULL &&
+					    prev->context->definition == child_def->u.definition)
+					{
+						try_this = FALSE;
+						break;
+					}
+				}
+			}
+
+			if (try_this)
+			{
+				/* Does this child definition start a new
+				 * context at the current position? */
+				if (child_starts_here (ce, state, child_def,
+						       line, &pos, new_state))
+				{
+					g_assert (pos <= line->byte_length);
+					*line_pos = pos;
+					definition_iter_destroy (&def_iter);
+					return TRUE;
+				}
+			}
+
+			/* This child does not start here, so we analyze
+			 * another definition. */
+		}
+		definition_iter_destroy (&def_iter);
+
+		if (context_end_found)
+		{
+			/* We have found that the current context could end
+			 * here and that it cannot be extended by a child.
+			 * Still, it may happen that parent context ends in
+			 * the middle of the end regex match, apply_match()
+			 * checks this. */
+			if (apply_match (ce, state, line, &pos, state->context->end, SUB_PATTERN_WHERE_END))
+			{
+				g_assert (pos <= line->byte_length);
+
+				while (SEGMENT_ENDS_PARENT (state))
+					state = state->parent;
+
+				*new_state = state->parent;
+				ce->priv->hint2 = state;
+				*line_pos = pos;
+				return TRUE;
+			}
+		}
+
+		/* Nothing new at this position, go to next char. */
+		pos = g_utf8_next_char (line->text + pos) - line->text;
+	}
+
+	return FALSE;
+}
+
+/**
+ * check_line_end:
+ * @state: current state.
+ * @hint: child of @state used in analyze_line() and next_segment().
+ *
+ * Closes the contexts that cannot contain end of lines if needed.
+ * Updates hint if new state is different from @state.
+ *
+ * Returns: the new state.
+ */
+static Segment *
+check_line_end (CtkSourceContextEngine *ce,
+		Segment                *state)
+{
+	Segment *current_segment;
+	Segment *terminating_segment;
+
+	g_assert (!ce->priv->hint2 || ce->priv->hint2->parent == state);
+
+	/* A context can be terminated by the parent if extend_parent is
+	 * FALSE, so we need to verify the end of all the parents of
+	 * not-extending contexts. */
+	terminating_segment = NULL;
+	current_segment = state;
+
+	while (current_segment != NULL)
+	{
+		if (SEGMENT_END_AT_LINE_END (current_segment))
+			terminating_segment = current_segment;
+		else if (!ANCESTOR_CAN_END_CONTEXT(current_segment->context))
+			break;
+		current_segment = current_segment->parent;
+	}
+
+	if (terminating_segment != NULL)
+	{
+		ce->priv->hint2 = terminating_segment;
+		return terminating_segment->parent;
+	}
+	else
+	{
+		return state;
+	}
+}
+
+static void
+delete_zero_length_segments (CtkSourceContextEngine *ce,
+			     GList                  *list)
+{
+	while (list != NULL)
+	{
+		Segment *s = list->data;
+
+		if (segment_start (ce, s) == segment_end (ce, s))
+		{
+			GList *l;
+
+			for (l = list->next; l != NULL; )
+			{
+				GList *next = l->next;
+				Segment *s2 = l->data;
+				gboolean child = FALSE;
+
+				while (s2 != NULL)
+				{
+					if (s2 == s)
+					{
+						child = TRUE;
+						break;
+					}
+
+					s2 = s2->parent;
+				}
+
+				if (child)
+					list = g_list_delete_link (list, l);
+
+				l = next;
+			}
+
+			if (ce->priv->hint2 != NULL)
+			{
+				Segment *s2 = ce->priv->hint2;
+				gboolean child = FALSE;
+
+				while (s2 != NULL)
+				{
+					if (s2 == s)
+					{
+						child = TRUE;
+						break;
+					}
+
+					s2 = s2->parent;
+				}
+
+				if (child)
+					ce->priv->hint2 = s->parent;
+			}
+
+			segment_remove (ce, s);
+		}
+
+		list = g_list_delete_link (list, list);
+	}
+}
+
+/**
+ * analyze_line_from:
+ * @ce: #CtkSourceContextEngine.
+ * @state: the state at @line_pos.
+ * @line: the line.
+ * @line_pos: (inout): position in @line where to start, bytes.
+ * @had_bom: if the buffer had a BOM
+ * @slice_timer: (nullable): timer of the current time slice.
+ * @time: length of the time slice in milliseconds, or 0.
+ * @done: (out): whether the end of @line was reached.
+ *
+ * Finds contexts at the line from @line_pos and updates the syntax
+ * tree on it. If @line is longer than LONG_LINE_LENGTH and the time
+ * slice is over, it stops after the last context found, @line_pos
+ * being moved there and @done set to %FALSE, so that the analysis
+ * can go on from there later.
+ *
+ * Returns: starting state at the next line, or the state at @line_pos
+ * if @done is %FALSE.
+ */
+static Segment *
+analyze_line_from (CtkSourceContextEngine *ce,
+		   Segment                *state,
+		   LineInfo               *line,
+		   gint                   *line_pos,
+		   gboolean                had_bom,
+		   GTimer                 *slice_timer,
+		   gint                    time,
+		   gboolean               *done)
+{
+	GList *end_segments = NULL;
+	GTimer *timer;
+	gboolean long_line;
+
+	g_assert (SEGMENT_IS_CONTAINER (state));
+
+        if (ce->priv->hint2 == NULL || ce->priv->hint2->parent != state)
+                ce->priv->hint2 = state->last_child;
+        g_assert (!ce->priv->hint2 || ce->priv->hint2->parent == state);
+
+	long_line = line->byte_length > LONG_LINE_LENGTH;
+	*done = TRUE;
+
+	timer = g_timer_new ();
+
+	/* Find the contexts in the line. */
+	while (*line_pos <= line->byte_length)
+	{
+		Segment *new_state = NULL;
+
+		if (long_line)
+			g_timer_start (timer);
+
+		if (!next_segment (ce, state, line, line_pos, &new_state, had_bom))
+			break;
+
+		if (g_timer_elapsed (timer, NULL) * 1000 > MAX_TIME_FOR_ONE_LINE)
+		{
+			g_critical ("%s",
+			            _("Highlighting a single line took too much time, "
+				      "syntax highlighting will be disabled"));
+			disable_syntax_analysis (ce);
+			break;
+		}
+
+		g_assert (new_state != NULL);
+		g_assert (SEGMENT_IS_CONTAINER (new_state));
+
+		state = new_state;
+
+                if (ce->priv->hint2 == NULL || ce->priv->hint2->parent != state)
+                        ce->priv->hint2 = state->last_child;
+                g_assert (!ce->priv->hint2 || ce->priv->hint2->parent == state);
+
+		/* XXX this a temporary workaround for zero-length segments in the end
+		 * of line. there are no zero-length segments in the middle because it goes
+		 * into infinite loop in that case. */
+		/* state may be extended later, so not all elements of new_segments
+		 * really have zero length */
+		if (segment_start (ce, state) == line->char_length)
+			end_segments = g_list_prepend (end_segments, state);
+
+		if (long_line && time != 0 &&
+		    g_timer_elapsed (slice_timer, NULL) * 1000 > time &&
+		    *line_pos < line->byte_length)
+		{
+			*done = FALSE;
+			break;
+		}
+	}
+
+	g_timer_destroy (timer);
+	if (ce->priv->disabled)
+	{
+		g_list_free (end_segments);
+		return NULL;
+	}
+
+	if (!*done)
+	{
+		g_list_free (end_segments);
+		return state;
+	}
+
+	/* Extend current state to the end of line. */
+	segment_extend (ce, state, line->start_at + line->char_length);
+	g_assert (*line_pos <= line->byte_length);
+
+	/* Verify if we need to close the context because we are at
+	 * the end of the line. */
+	if (ANCESTOR_CAN_END_CONTEXT (state->context) ||
+	    SEGMENT_END_AT_LINE_END (state))
+	{
+		state = check_line_end (ce, state);
+	}
+
+	/* Extend the segment to the beginning of next line. */
+	g_assert (SEGMENT_IS_CONTAINER (state));
+	segment_extend (ce, state, NEXT_LINE_OFFSET (line));
+
+	/* if it's the last line, don't bother with zero length segments */
+	if (!line->eol_length)
+		g_list_free (end_segments);
+	else
+		delete_zero_length_segments (ce, end_segments);
+
+	CHECK_TREE (ce);
+
+	return state;
+}
+
+/**
+ * analyze_line:
+ * @ce: #CtkSourceContextEngine.
+ * @state: the state at the beginning of line.
+ * @line: the line.
+ * @had_bom: if the buffer had a BOM
+ *
+ * Finds contexts at the line and updates the syntax tree on it.
+ *
+ * Returns: starting state at the next line.
+ */
+static Segment *
+analyze_line (CtkSourceContextEngine *ce,
+	      Segment                *state,
+	      LineInfo               *line,
+	      gboolean                had_bom)
+{
+	gint line_pos = 0;
+	gboolean done;
+
+	return analyze_line_from (ce, state, line, &line_pos, had_bom, NULL, 0, &done);
+}
+
+/**
+ * utf8_strlen_fast:
+ * @text: the text.
+ * @byte_length: length of @text in bytes.
+ *
+ * Same as g_utf8_strlen(), but skips the leading ASCII bytes without
+ * decoding them, so that it's a plain scan for ASCII text.
+ *
+ * Returns: number of characters in @text.
+ */
+static gint
+utf8_strlen_fast (const gchar *text,
+		  gint         byte_length)
+{
+	gint i;
+
+	for (i = 0; i < byte_length; i++)
+	{
+		if ((guchar) text[i] >= 0x80)
+			return i + g_utf8_strlen (text + i, byte_length - i);
+	}
+
+	return byte_length;
+}
+
+/**
+ * get_line_info:
+ * @buffer: #CtkTextBuffer.
+ * @chunk: #LineChunk holding text of the lines around @line_start.
+ * @line_start: iterator pointing to the beginning of line.
+ * @line_end: iterator pointing to the beginning of next line or to the end
+ * of this line if it's the last line in @buffer.
+ * @line: #LineInfo structure to be filled.
+ *
+ * Finds line terminator and fills @line structure. The line text is
+ * not copied: it points into @chunk, which is refilled when it does not
+ * start at @line_start, so that the buffer is not asked for a new string
+ * for every analyzed line. It is filled up to @chunk->limit_offset, or,
+ * once the analysis goes past it because the following lines changed
+ * too, with twice as much text as the previous time; never with more
+ * than LINE_CHUNK_SIZE characters, rounded up to the end of a line.
+ * Note that @line->text is not nul-terminated after the line end.
+ */
+static void
+get_line_info (CtkTextBuffer     *buffer,
+	       LineChunk         *chunk,
+	       const CtkTextIter *line_start,
+	       const CtkTextIter *line_end,
+	       LineInfo          *line)
+{
+	gint eol_index, next_line_index;
+	gint length;
+	gint n_chars;
+
+	g_assert (!ctk_text_iter_equal (line_start, line_end));
+
+	line->start_at = ctk_text_iter_get_offset (line_start);
+
+	if (chunk->text == NULL ||
+	    chunk->next_offset != line->start_at ||
+	    ctk_text_iter_compare (line_end, &chunk->end) > 0)
+	{
+		g_free (chunk->text);
+
+		n_chars = chunk->limit_offset - line->start_at;
+		if (n_chars <= 0)
+			n_chars = chunk->n_chars * 2;
+		n_chars = MIN (n_chars, LINE_CHUNK_SIZE);
+
+		chunk->end = *line_start;
+		ctk_text_iter_forward_chars (&chunk->end, n_chars);
+		if (!ctk_text_iter_starts_line (&chunk->end))
+			ctk_text_iter_forward_line (&chunk->end);
+		if (ctk_text_iter_compare (line_end, &chunk->end) > 0)
+			chunk->end = *line_end;
+
+		chunk->n_chars = ctk_text_iter_get_offset (&chunk->end) - line->start_at;
+
+		chunk->text = ctk_text_buffer_get_slice (buffer, line_start, &chunk->end, TRUE);
+		chunk->text_end = chunk->text + strlen (chunk->text);
+		chunk->next = chunk->text;
+	}
+
+	line->text = (gchar *) chunk->next;
+	line->chunk = chunk;
+	length = chunk->text_end - chunk->next;
+
+	if (!ctk_text_iter_starts_line (line_end))
+	{
+		eol_index = next_line_index = length;
+	}
+	else
+	{
+		pango_find_paragraph_boundary (line->text, length,
+					       &eol_index,
+					       &next_line_index);
+
+		g_assert (eol_index < next_line_index);
+	}
+
+	line->byte_length = eol_index;
+	line->stamp = _ctk_source_regex_new_line_stamp ();
+	line->char_length = utf8_strlen_fast (line->text, eol_index);
+	line->eol_length = g_utf8_strlen (line->text + eol_index, next_line_index - eol_index);
+
+	chunk->next = line->text + next_line_index;
+	chunk->next_offset = line->start_at + line->char_length + line->eol_length;
+
+	g_assert (ctk_text_iter_get_offset (line_end) == chunk->next_offset);
+}
+
+/**
+ * segment_tree_zero_len:
+ * @ce: #CtkSoucreContextEngine.
+ *
+ * Erases syntax tree and sets root segment length to zero.
+ * It's a shortcut for case when all the text is deleted from
+ * the buffer.
+ */
+static void
+segment_tree_zero_len (CtkSourceContextEngine *ce)
+{
+	Segment *root = ce->priv->root_segment;
+	segment_destroy_children (ce, root);
+	segment_set_start (ce, root, 0);
+	segment_set_end (ce, root, 0);
+	CHECK_TREE (ce);
+}
+
+#ifdef ENABLE_CHECK_TREE
+static Segment *
+get_segment_at_offset_slow_ (CtkSourceContextEngine *ce,
+			     Segment                *segment,
+			     gint                    offset)
+{
+	Segment *child;
+
+start:
+	if (segment->parent == NULL && offset == segment_end (ce, segment))
+		return segment;
+
+	if (segment_start (ce, segment) > offset)
+	{
+		g_assert (segment->parent != NULL);
+		segment = segment->parent;
+		goto start;
+	}
+
+	if (segment_start (ce, segment) == offset)
+	{
+		if (segment->children != NULL && segment_start (ce, segment->children) == offset)
+		{
+			segment = segment->children;
+			goto start;
+		}
+
+		return segment;
+	}
+
+        if (segment_end (ce, segment) <= offset && segment->parent != NULL)
+	{
+		if (segment->next != NULL)
+		{
+			if (segment_start (ce, segment->next) > offset)
+				return segment->parent;
+
+			segment = segment->next;
+		}
+		else
+		{
+			segment = segment->parent;
+		}
+
+		goto start;
+	}
+
+	for (child = segment->children; child != NULL; child = child->next)
+	{
+		if (segment_start (ce, child) == offset)
+		{
+			segment = child;
+			goto start;
+		}
+
+		if (segment_end (ce, child) <= offset)
+			continue;
+
+		if (segment_start (ce, child) > offset)
+			break;
+
+		segment = child;
+		goto start;
+	}
+
+	return segment;
+}
+#endif /* ENABLE_CHECK_TREE */
+
+#define SEGMENT_IS_ZERO_LEN_AT(ce,s,o) (segment_start (ce, (s)) == (o) && segment_end (ce, (s)) == (o))
+#define SEGMENT_CONTAINS(ce,s,o) (segment_start (ce, (s)) <= (o) && segment_end (ce, (s)) > (o))
+#define SEGMENT_DISTANCE(ce,s,o) (MIN (ABS (segment_start (ce, (s)) - (o)), ABS (segment_end (ce, (s)) - (o))))
+static Segment *get_segment_in_ (CtkSourceContextEngine *ce,
+				 Segment                *segment,
+				 gint                    offset);
+
+/* Same as the walk in get_segment_in_(), but starting from the
+ * child found by segment_find_child_(). */
+static Segment *
+get_segment_in_indexed_ (CtkSourceContextEngine *ce,
+			 Segment                *segment,
+			 gint                    offset)
+{
+	Segment *child;
+
+	for (child = segment_find_child_ (ce, segment, offset); child != NULL; child = child->next)
+	{
+		if (segment_start (ce, child) > offset)
+			return segment;
+
+		if (SEGMENT_IS_ZERO_LEN_AT (ce, child, offset))
+			return child;
+
+		if (SEGMENT_CONTAINS (ce, child, offset))
+			return get_segment_in_ (ce, child, offset);
+	}
+
+	return segment;
+}
+
+static Segment *
+get_segment_in_ (CtkSourceContextEngine *ce,
+		 Segment                *segment,
+		 gint                    offset)
+{
+	Segment *child;
+	guint steps = 0;
+
+	g_assert (segment_start (ce, segment) <= offset && segment_end (ce, segment) > offset);
+
+	if (segment->children == NULL)
+		return segment;
+
+	if (segment->children == segment->last_child)
+	{
+		if (SEGMENT_IS_ZERO_LEN_AT (ce, segment->children, offset))
+			return segment->children;
+
+		if (SEGMENT_CONTAINS (ce, segment->children, offset))
+			return get_segment_in_ (ce, segment->children, offset);
+
+		return segment;
+	}
+
+	if (segment_start (ce, segment->children) > offset || segment_end (ce, segment->last_child) < offset)
+		return segment;
+
+	if (SEGMENT_DISTANCE (ce, segment->children, offset) >= SEGMENT_DISTANCE (ce, segment->last_child, offset))
+	{
+		for (child = segment->children; child; child = child->next)
+		{
+			if (++steps == SEGMENT_INDEX_MIN_WALK)
+				return get_segment_in_indexed_ (ce, segment, offset);
+
+			if (segment_start (ce, child) > offset)
+				return segment;
+
+			if (SEGMENT_IS_ZERO_LEN_AT (ce, child, offset))
+				return child;
+
+			if (SEGMENT_CONTAINS (ce, child, offset))
+				return get_segment_in_ (ce, child, offset);
+		}
+	}
+	else
+	{
+		for (child = segment->last_child; child; child = child->prev)
+		{
+			if (++steps == SEGMENT_INDEX_MIN_WALK)
+				return get_segment_in_indexed_ (ce, segment, offset);
+
+			if (SEGMENT_IS_ZERO_LEN_AT (ce, child, offset))
+			{
+				while (child->prev != NULL && SEGMENT_IS_ZERO_LEN_AT (ce, child->prev, offset))
+					child = child->prev;
+				return child;
+			}
+
+			if (segment_end (ce, child) <= offset)
+				return segment;
+
+			if (SEGMENT_CONTAINS (ce, child, offset))
+				return get_segment_in_ (ce, child, offset);
+		}
+	}
+
+	return segment;
+}
+
+/* assumes zero-length segments can't have children */
+static Segment *
+get_segment_ (CtkSourceContextEngine *ce,
+	      Segment                *segment,
+	      gint                    offset)
+{
+	guint steps;
+
+	if (segment->parent != NULL)
+	{
+		if (!SEGMENT_CONTAINS (ce, segment->parent, offset))
+			return get_segment_ (ce, segment->parent, offset);
+	}
+	else
+	{
+		g_assert (offset >= segment_start (ce, segment));
+		g_assert (offset <= segment_end (ce, segment));
+	}
+
+	if (SEGMENT_CONTAINS (ce, segment, offset))
+		return get_segment_in_ (ce, segment, offset);
+
+	if (SEGMENT_IS_ZERO_LEN_AT (ce, segment, offset))
+	{
+		while (segment->prev != NULL && SEGMENT_IS_ZERO_LEN_AT (ce, segment->prev, offset))
+			segment = segment->prev;
+		return segment;
+	}
+
+	if (offset < segment_start (ce, segment))
+	{
+		steps = 0;
+
+		while (segment->prev != NULL && segment_start (ce, segment->prev) > offset)
+		{
+			if (++steps == SEGMENT_INDEX_MIN_WALK)
+				return get_segment_in_indexed_ (ce, segment->parent, offset);
+
+			segment = segment->prev;
+		}
+
+		g_assert (!segment->prev || segment_start (ce, segment->prev) <= offset);
+
+		if (segment->prev == NULL)
+			return segment->parent;
+
+		if (segment_end (ce, segment->prev) > offset)
+			return get_segment_in_ (ce, segment->prev, offset);
+
+		if (segment_end (ce, segment->prev) == offset)
+		{
+			if (SEGMENT_IS_ZERO_LEN_AT (ce, segment->prev, offset))
+			{
+				segment = segment->prev;
+				while (segment->prev != NULL && SEGMENT_IS_ZERO_LEN_AT (ce, segment->prev, offset))
+					segment = segment->prev;
+				return segment;
+			}
+
+			return segment->parent;
+		}
+
+		/* segment->prev->end_at < offset */
+		return segment->parent;
+	}
+
+	/* offset >= segment->end_at, not zero-length */
+
+	for (steps = 0; segment->next != NULL; steps++)
+	{
+		if (steps == SEGMENT_INDEX_MIN_WALK)
+			return get_segment_in_indexed_ (ce, segment->parent, offset);
+
+		if (SEGMENT_IS_ZERO_LEN_AT (ce, segment->next, offset))
+			return segment->next;
+
+		if (segment_end (ce, segment->next) > offset)
+		{
+			if (segment_start (ce, segment->next) <= offset)
+				return get_segment_in_ (ce, segment->next, offset);
+			else
+				return segment->parent;
+		}
+
+		segment = segment->next;
+	}
+
+	return segment->parent;
+}
+#undef SEGMENT_IS_ZERO_LEN_AT
+#undef SEGMENT_CONTAINS
+#undef SEGMENT_DISTANCE
+
+/**
+ * get_segment_at_offset:
+ * @ce: #CtkSoucreContextEngine.
+ * @hint: segment to start search from or %NULL.
+ * @offset: the offset, characters.
+ *
+ * Finds the deepest segment "at @offset".
+ * More precisely, it returns toplevel segment if
+ * @offset is equal to length of buffer; or non-zero-length
+ * segment which contains character at @offset; or zero-length
+ * segment at @offset. In case when there are several zero-length
+ * segments, it returns the first one.
+ */
+static Segment *
+get_segment_at_offset (CtkSourceContextEngine *ce,
+		       Segment                *hint,
+		       gint                    offset)
+{
+	Segment *result;
+
+	if (offset == segment_end (ce, ce->priv->root_segment))
+		return ce->priv->root_segment;
+
+#ifdef ENABLE_DEBUG
+	/* if you see this message (often), then something is
+	 * wrong with the hints business, i.e. optimizations
+	 * do not work quite like they should */
+	if (hint == NULL || hint == ce->priv->root_segment)
+	{
+		static int c;
+		g_print ("searching from root %d\n", ++c);
+	}
+#endif
+
+	result = get_segment_ (ce, hint ? hint : ce->priv->root_segment, offset);
+
+#ifdef ENABLE_CHECK_TREE
+	g_assert (result == get_segment_at_offset_slow_ (ce, hint, offset));
+#endif
+
+	return result;
+}
+
+/**
+ * segment_remove:
+ * @ce: #CtkSoucreContextEngine.
+ * @segment: segment to remove.
+ *
+ * Removes the segment from syntax tree and frees it.
+ * It correctly updates parent's children list, not
+ * like segment_destroy() where caller has to take care
+ * of tree integrity.
+ */
+static void
+segment_remove (CtkSourceContextEngine *ce,
+		Segment                *segment)
+{
+	segment_index_remove (ce, segment);
+
+	if (segment->next != NULL)
+		segment->next->prev = segment->prev;
+	else
+		segment->parent->last_child = segment->prev;
+
+	if (segment->prev != NULL)
+		segment->prev->next = segment->next;
+	else
+		segment->parent->children = segment->next;
+
+	/* if ce->priv->hint is being deleted, set it to some
+	 * neighbour segment */
+	if (ce->priv->hint == segment)
+	{
+		if (segment->next != NULL)
+			ce->priv->hint = segment->next;
+		else if (segment->prev != NULL)
+			ce->priv->hint = segment->prev;
+		else
+			ce->priv->hint = segment->parent;
+	}
+
+        /* if ce->priv->hint2 is being deleted, set it to some
+         * neighbour segment */
+        if (ce->priv->hint2 == segment)
+        {
+                if (segment->next != NULL)
+                        ce->priv->hint2 = segment->next;
+                else if (segment->prev != NULL)
+                        ce->priv->hint2 = segment->prev;
+                else
+                        ce->priv->hint2 = segment->parent;
+        }
+
+	segment_destroy (ce, segment);
+}
+
+static void
+segment_erase_middle_ (CtkSourceContextEngine *ce,
+		       Segment                *segment,
+		       gint                    start,
+		       gint                    end)
+{
+	Segment *new_segment, *child;
+	SubPattern *sp;
+	gint start_at = segment_start (ce, segment);
+
+	new_segment = segment_new (ce,
+				   segment->parent,
+				   segment->context,
+				   end,
+				   segment_end (ce, segment),
+				   FALSE);
+	segment_set_end (ce, segment, start);
+
+	new_segment->next = segment->next;
+	segment->next = new_segment;
+	new_segment->prev = segment;
+
+	if (new_segment->next != NULL)
+		new_segment->next->prev = new_segment;
+	else
+		new_segment->parent->last_child = new_segment;
+
+	segment_index_insert (ce, new_segment);
+
+	/* The children are relative to @segment after this, and are
+	 * rebased when they move to @new_segment. */
+	segment_index_clear_ (ce, segment);
+
+	child = segment->children;
+	segment->children = NULL;
+	segment->last_child = NULL;
+
+	while (child != NULL)
+	{
+		Segment *append_to;
+		Segment *next = child->next;
+
+		if (start_at + child->rel_start < start)
+		{
+			g_assert (start_at + child->rel_start + child->length <= start);
+			append_to = segment;
+		}
+		else
+		{
+			g_assert (start_at + child->rel_start >= end);
+			child->rel_start += start_at - end;
+			append_to = new_segment;
+		}
+
+		child->parent = append_to;
+
+		if (append_to->last_child != NULL)
+		{
+			append_to->last_child->next = child;
+			child->prev = append_to->last_child;
+			child->next = NULL;
+			append_to->last_child = child;
+		}
+		else
+		{
+			child->next = child->prev = NULL;
+			append_to->last_child = child;
+			append_to->children = child;
+		}
+
+		segment_index_insert (ce, child);
+
+		child = next;
+	}
+
+	sp = segment->sub_patterns;
+	segment->sub_patterns = NULL;
+
+	while (sp != NULL)
+	{
+		SubPattern *next = sp->next;
+		Segment *append_to;
+
+		if (SUB_PATTERN_START (ce, segment, sp) < start)
+		{
+			sp->end_at = MIN (SUB_PATTERN_END (ce, segment, sp), start) - segment_start (ce, segment);
+			append_to = segment;
+		}
+		else
+		{
+			g_assert (SUB_PATTERN_END (ce, segment, sp) > end);
+			sp->start_at = MAX (SUB_PATTERN_START (ce, segment, sp), end) - end;
+			sp->end_at = SUB_PATTERN_END (ce, segment, sp) - end;
+			append_to = new_segment;
+		}
+
+		sp->next = append_to->sub_patterns;
+		append_to->sub_patterns = sp;
+
+		sp = next;
+	}
+
+	CHECK_SEGMENT_CHILDREN (ce, segment);
+	CHECK_SEGMENT_CHILDREN (ce, new_segment);
+}
+
+/**
+ * segment_erase_range_:
+ * @ce: #CtkSourceContextEngine.
+ * @segment: the segment.
+ * @start: start offset of range to erase, characters.
+ * @end: end offset of range to erase, characters.
+ *
+ * Recurisvely removes segments from [@start, @end] interval
+ * starting from @segment. If @segment belongs to the range,
+ * or it's a zero-length segment at @end offset, and it's not
+ * the toplevel segment, then it's removed from the tree.
+ * If @segment intersects with the range (unless it's the toplevel
+ * segment), then its ends are adjusted appropriately, and it's
+ * split into two if it completely contains the range.
+ */
+static void
+segment_erase_range_ (CtkSourceContextEngine *ce,
+		      Segment                *segment,
+		      gint                    start,
+		      gint                    end)
+{
+	g_assert (start < end);
+
+	if (segment_start (ce, segment) == segment_end (ce, segment))
+	{
+		if (segment_start (ce, segment) >= start && segment_start (ce, segment) <= end)
+			segment_remove (ce, segment);
+		return;
+	}
+
+	if (segment_start (ce, segment) > end || segment_end (ce, segment) < start)
+		return;
+
+	if (segment_start (ce, segment) >= start && segment_end (ce, segment) <= end && segment->parent)
+	{
+		segment_remove (ce, segment);
+		return;
+	}
+
+	if (segment_start (ce, segment) == end)
+	{
+		Segment *child = segment->children;
+
+		while (child != NULL && segment_start (ce, child) == end)
+		{
+			Segment *next = child->next;
+			segment_erase_range_ (ce, child, start, end);
+			child = next;
+		}
+	}
+	else if (segment_end (ce, segment) == start)
+	{
+		Segment *child = segment->last_child;
+
+		while (child != NULL && segment_end (ce, child) == start)
+		{
+			Segment *prev = child->prev;
+			segment_erase_range_ (ce, child, start, end);
+			child = prev;
+		}
+	}
+	else
+	{
+		Segment *child = segment->children;
+
+		while (child != NULL)
+		{
+			Segment *next = child->next;
+			segment_erase_range_ (ce, child, start, end);
+			child = next;
+		}
+	}
+
+	if (segment->sub_patterns != NULL)
+	{
+		SubPattern *sp;
+
+		sp = segment->sub_patterns;
+		segment->sub_patterns = NULL;
+
+		while (sp != NULL)
+		{
+			SubPattern *next = sp->next;
+
+			if (SUB_PATTERN_START (ce, segment, sp) >= start &&
+			    SUB_PATTERN_END (ce, segment, sp) <= end)
+				sub_pattern_free (ce, sp);
+			else
+				segment_add_subpattern (segment, sp);
+
+			sp = next;
+		}
+	}
+
+	if (segment->parent != NULL)
+	{
+		/* Now all children and subpatterns are cleaned up,
+		 * so we only need to split segment properly if its middle
+		 * was erased. Otherwise, only ends need to be adjusted. */
+		if (segment_start (ce, segment) < start && segment_end (ce, segment) > end)
+		{
+			segment_erase_middle_ (ce, segment, start, end);
+		}
+		else
+		{
+			g_assert ((segment_start (ce, segment) >= start && segment_end (ce, segment) > end) ||
+				  (segment_start (ce, segment) < start && segment_end (ce, segment) <= end));
+
+			if (segment_end (ce, segment) > end)
+			{
+				SubPattern *sp;
+
+				/* Subpatterns keep their place in the buffer. */
+				for (sp = segment->sub_patterns; sp != NULL; sp = sp->next)
+				{
+					sp->start_at -= end - segment_start (ce, segment);
+					sp->end_at -= end - segment_start (ce, segment);
+				}
+
+				/* If we erase the beginning, we need to clear
+				 * is_start flag. */
+				segment_set_start (ce, segment, end);
+				segment->is_start = FALSE;
+			}
+			else
+			{
+				segment_set_end (ce, segment, start);
+			}
+		}
+	}
+}
+
+/**
+ * segment_merge:
+ * @ce: #CtkSourceContextEngine.
+ * @first: first segment.
+ * @second: second segment.
+ *
+ * Merges adjacent segments @first and @second given
+ * their contexts are equal.
+ */
+static void
+segment_merge (CtkSourceContextEngine *ce,
+	       Segment                *first,
+	       Segment                *second)
+{
+	Segment *parent;
+	gint first_start, second_start, second_end;
+
+	if (first == second)
+		return;
+
+	g_assert (!SEGMENT_IS_INVALID (first));
+	g_assert (first->context == second->context);
+	g_assert (segment_end (ce, first) == segment_start (ce, second));
+
+	if (first->parent != second->parent)
+		segment_merge (ce, first->parent, second->parent);
+
+	parent = first->parent;
+
+	g_assert (first->next == second);
+	g_assert (first->parent == second->parent);
+	g_assert (second != parent->children);
+
+	/* Resolve offsets while @second is still in the index. */
+	first_start = segment_start (ce, first);
+	second_start = segment_start (ce, second);
+	second_end = segment_end (ce, second);
+	segment_index_clear_ (ce, second);
+
+	segment_index_remove (ce, second);
+
+	if (second == parent->last_child)
+		parent->last_child = first;
+	first->next = second->next;
+	if (second->next != NULL)
+		second->next->prev = first;
+
+	segment_set_end (ce, first, second_end);
+
+	if (second->children != NULL)
+	{
+		Segment *child, *moved = second->children;
+
+		if (first->children == NULL)
+		{
+			g_assert (!first->last_child);
+			first->children = second->children;
+			first->last_child = second->last_child;
+		}
+		else
+		{
+			first->last_child->next = second->children;
+			second->children->prev = first->last_child;
+			first->last_child = second->last_child;
+		}
+
+		for (child = moved; child != NULL; child = child->next)
+		{
+			child->parent = first;
+			child->rel_start += second_start - first_start;
+		}
+
+		/* The moved children follow all the children of @first,
+		 * they can only be added to its index in order, and only
+		 * once they are all rebased if it's built here. */
+		if (SEGMENT_CHILDREN_INDEXED (first))
+		{
+			for (child = moved; child != NULL; child = child->next)
+				segment_index_link_ (ce, child);
+		}
+		else
+		{
+			segment_index_build_ (ce, first);
+		}
+	}
+
+	if (second->sub_patterns != NULL)
+	{
+		SubPattern *sp;
+
+		for (sp = second->sub_patterns; sp != NULL; sp = sp->next)
+		{
+			sp->start_at += second_start - first_start;
+			sp->end_at += second_start - first_start;
+		}
+
+		if (first->sub_patterns == NULL)
+		{
+			first->sub_patterns = second->sub_patterns;
+		}
+		else
+		{
+			while (second->sub_patterns != NULL)
+			{
+				SubPattern *sp = second->sub_patterns;
+				second->sub_patterns = sp->next;
+				sp->next = first->sub_patterns;
+				first->sub_patterns = sp;
+			}
+		}
+	}
+
+	second->children = NULL;
+	second->last_child = NULL;
+	second->sub_patterns = NULL;
+
+	segment_destroy (ce, second);
+}
+
+/**
+ * erase_segments:
+ * @ce: #CtkSourceContextEngine.
+ * @start: start offset of region to erase, characters.
+ * @end: end offset of region to erase, characters.
+ * @hint: segment around @start to make it faster.
+ *
+ * Erases all non-toplevel segments in the interval
+ * [@start, @end]. Its action on the tree is roughly
+ * equivalent to segment_erase_range_(ce->priv->root_segment, start, end)
+ * (but that does not accept toplevel segment).
+ */
+static void
+erase_segments (CtkSourceContextEngine *ce,
+		gint                    start,
+		gint                    end,
+		Segment                *hint)
+{
+	Segment *root = ce->priv->root_segment;
+	Segment *child, *hint_prev;
+
+	if (root->children == NULL)
+		return;
+
+	if (hint == NULL)
+		hint = ce->priv->hint;
+
+	if (hint != NULL)
+		while (hint != NULL && hint->parent != ce->priv->root_segment)
+			hint = hint->parent;
+
+	if (hint == NULL)
+		hint = root->children;
+
+	hint_prev = hint->prev;
+
+	child = hint;
+	while (child != NULL)
+	{
+		Segment *next = child->next;
+
+		if (segment_end (ce, child) < start)
+		{
+			child = next;
+
+			if (next != NULL)
+				ce->priv->hint = next;
+
+			continue;
+		}
+
+		if (segment_start (ce, child) > end)
+		{
+			ce->priv->hint = child;
+			break;
+		}
+
+		segment_erase_range_ (ce, child, start, end);
+		child = next;
+	}
+
+	child = hint_prev;
+	while (child != NULL)
+	{
+		Segment *prev = child->prev;
+
+		if (ce->priv->hint == NULL)
+			ce->priv->hint = child;
+
+		if (segment_start (ce, child) > end)
+		{
+			child = prev;
+			continue;
+		}
+
+		if (segment_end (ce, child) < start)
+		{
+			break;
+		}
+
+		segment_erase_range_ (ce, child, start, end);
+		child = prev;
+	}
+
+	CHECK_TREE (ce);
+}
+
+#define IS_BOM(c) (c == 0xFEFF)
+
+/**
+ * update_syntax:
+ * @ce: #CtkSourceContextEngine.
+ * @end: desired end of region to analyze or %NULL.
+ * @time: maximal amount of time in milliseconds allowed to spend here
+ * or 0 for 'unlimited'.
+ *
+ * Updates syntax tree. If @end is not %NULL, then it analyzes
+ * (reanalyzes invalid areas in) region from start of buffer
+ * to @end. Otherwise, it analyzes batch of text starting at
+ * first invalid line.
+ * In order to avoid blocking ui it uses a timer and stops
+ * when time elapsed is greater than @time, so analyzed region is
+ * not necessarily what's requested (unless @time is 0).
+ */
+/* TODO it must be refactored. */
+static void
+update_syntax (CtkSourceContextEngine *ce,
+	       const CtkTextIter      *end,
+	       gint                    time)
+{
+	CtkTextBuffer *buffer;
+	CtkTextIter start_iter, end_iter;
+	CtkTextIter line_start, line_end;
+	CtkTextIter refresh_start;
+	Segment *state;
+	Segment *invalid;
+	gint start_offset, end_offset;
+	gint line_start_offset, line_end_offset;
+	gint analyzed_end;
+	gboolean first_line = FALSE;
+	gboolean had_bom = FALSE;
+	GTimer *timer;
+	LineChunk chunk = { NULL, };
+	gint64 profile_start;
+
+	buffer = ce->priv->buffer;
+	state = ce->priv->root_segment;
+	profile_start = highlight_profile_start ();
+
+	context_freeze (ce->priv->root_context);
+	update_tree (ce);
+
+	if (!ctk_text_buffer_get_char_count (buffer))
+	{
+		segment_tree_zero_len (ce);
+		goto out;
+	}
+
+	invalid = get_invalid_segment (ce);
+
+	if (invalid == NULL)
+		goto out;
+
+	if (end != NULL && segment_start (ce, invalid) >= ctk_text_iter_get_offset (end))
+		goto out;
+
+	if (end != NULL)
+	{
+		end_offset = ctk_text_iter_get_offset (end);
+		start_offset = MIN (end_offset, segment_start (ce, invalid));
+	}
+	else
+	{
+		start_offset = segment_start (ce, invalid);
+		end_offset = ctk_text_buffer_get_char_count (buffer);
+	}
+
+	ctk_text_buffer_get_iter_at_offset (buffer, &start_iter, start_offset);
+	ctk_text_buffer_get_iter_at_offset (buffer, &end_iter, end_offset);
+
+	if (!ctk_text_iter_starts_line (&start_iter))
+	{
+		ctk_text_iter_set_line_offset (&start_iter, 0);
+		start_offset = ctk_text_iter_get_offset (&start_iter);
+	}
+
+	if (!ctk_text_iter_starts_line (&end_iter))
+	{
+		ctk_text_iter_forward_line (&end_iter);
+		end_offset = ctk_text_iter_get_offset (&end_iter);
+	}
+
+	if (0 == start_offset)
+	{
+		gunichar c;
+
+		first_line = TRUE;
+
+		/* If it is the first line and it starts with BOM, skip it
+		 * since regexes in lang files do not take it into account */
+		c = ctk_text_iter_get_char (&start_iter);
+		if (IS_BOM (c))
+		{
+			had_bom = TRUE;
+			ctk_text_iter_forward_char (&start_iter);
+			start_offset = ctk_text_iter_get_offset (&start_iter);
+		}
+	}
+
+	/* This happens after deleting all text on last line. */
+	if (start_offset == end_offset)
+	{
+		g_assert (end_offset == ctk_text_buffer_get_char_count (buffer));
+		g_assert (g_slist_length (ce->priv->invalid) == 1);
+		segment_remove (ce, invalid);
+		CHECK_TREE (ce);
+		goto out;
+	}
+
+
+	/* Main loop */
+
+	line_start = start_iter;
+	line_start_offset = start_offset;
+	line_end = line_start;
+	ctk_text_iter_forward_line (&line_end);
+	line_end_offset = ctk_text_iter_get_offset (&line_end);
+	analyzed_end = line_end_offset;
+	refresh_start = start_iter;
+	chunk.limit_offset = end_offset;
+
+	timer = g_timer_new ();
+
+	while (TRUE)
+	{
+		LineInfo line;
+		gboolean next_line_invalid = FALSE;
+		gboolean need_invalidate_next = FALSE;
+		gboolean line_done;
+		gint line_pos = 0;
+
+		/* Last buffer line. */
+		if (line_start_offset == line_end_offset)
+		{
+			g_assert (line_start_offset == ctk_text_buffer_get_char_count (buffer));
+			break;
+		}
+
+		if (ce->priv->long_line_state != NULL &&
+		    ce->priv->long_line_start == line_start_offset)
+		{
+			/* Go on where the analysis of this line stopped, the
+			 * text before that is already refreshed. */
+			if (ctk_text_iter_equal (&line_start, &start_iter))
+				ctk_text_buffer_get_iter_at_offset (buffer, &refresh_start,
+								    segment_start (ce, ce->priv->long_line_marker));
+
+			state = ce->priv->long_line_state;
+			line_pos = ce->priv->long_line_pos;
+			segment_remove (ce, ce->priv->long_line_marker);
+
+			/* The text did not change, so the line is neither
+			 * fetched nor scanned again. Only the iterator is
+			 * not valid anymore, tags were applied since then. */
+			line_chunk_clear (&chunk);
+			chunk = ce->priv->long_line_chunk;
+			chunk.limit_offset = end_offset;
+			ctk_text_buffer_get_iter_at_offset (buffer, &chunk.end,
+							    ce->priv->long_line_chunk_end);
+			line = ce->priv->long_line;
+			line.chunk = &chunk;
+
+			ce->priv->long_line_chunk.text = NULL;
+			ce->priv->long_line_chunk.char_index = NULL;
+			ce->priv->n_long_line_resumes++;
+			forget_long_line (ce);
+		}
+		else
+		{
+			/* Analyze the line */
+			erase_segments (ce, line_start_offset, line_end_offset, ce->priv->hint);
+			get_line_info (buffer, &chunk, &line_start, &line_end, &line);
+
+#ifdef ENABLE_CHECK_TREE
+			{
+				Segment *inv = get_invalid_segment (ce);
+				g_assert (inv == NULL || segment_start (ce, inv) >= line_end_offset);
+			}
+#endif
+
+			if (first_line)
+			{
+				state = ce->priv->root_segment;
+			}
+			else
+			{
+				state = get_segment_at_offset (ce,
+							       ce->priv->hint ? ce->priv->hint : state,
+							       line_start_offset - 1);
+			}
+		}
+
+		g_assert (state->context != NULL);
+
+		ce->priv->hint2 = ce->priv->hint;
+
+		if (ce->priv->hint2 != NULL && ce->priv->hint2->parent != state)
+			ce->priv->hint2 = NULL;
+
+		state = analyze_line_from (ce, state, &line, &line_pos, had_bom,
+					   timer, time, &line_done);
+
+		/* At this point analyze_line() could have disabled highlighting */
+		if (ce->priv->disabled)
+		{
+			line_chunk_clear (&chunk);
+			return;
+		}
+
+		if (!line_done)
+		{
+			/* The time slice is over in the middle of a long line:
+			 * the rest of it is marked invalid, and the analysis
+			 * goes on from there next time. */
+			CtkTextIter iter;
+			gint offset = line_pos_to_offset (&line, line_pos);
+
+			segment_extend (ce, state, offset);
+			ce->priv->long_line_marker = create_segment (ce, state, NULL,
+								     offset, offset,
+								     FALSE, NULL);
+			ce->priv->long_line_state = state;
+			ce->priv->long_line_start = line_start_offset;
+			ce->priv->long_line_pos = line_pos;
+			ce->priv->hint = state;
+
+			ce->priv->long_line_chunk = chunk;
+			ce->priv->long_line_chunk_end = ctk_text_iter_get_offset (&chunk.end);
+			ce->priv->long_line = line;
+			ce->priv->long_line.chunk = &ce->priv->long_line_chunk;
+			chunk.text = NULL;
+			chunk.char_index = NULL;
+
+			ctk_text_buffer_get_iter_at_offset (buffer, &iter, offset);
+			ctk_source_region_add_subregion (ce->priv->refresh_region, &line_start, &iter);
+			analyzed_end = offset;
+			break;
+		}
+
+#ifdef ENABLE_CHECK_TREE
+		{
+			Segment *inv = get_invalid_segment (ce);
+			g_assert (inv == NULL || segment_start (ce, inv) >= line_end_offset);
+		}
+#endif
+
+		/* XXX this is wrong */
+		/* I don't know anymore why it's wrong, I guess it means
+		 * "may be inefficient" */
+		if (ce->priv->hint2 != NULL)
+			ce->priv->hint = ce->priv->hint2;
+		else
+			ce->priv->hint = state;
 
-		/* Iter over the definitions we can find in the current
-		 * context. */
-		definition_iter_init (&def_iter, state->context->definition);
-		while ((child_def = definition_iter_next (&def_iter)) != NULL)
+		ctk_source_region_add_subregion (ce->priv->refresh_region, &line_start, &line_end);
+		analyzed_end = line_end_offset;
+		invalid = get_invalid_segment (ce);
+
+		if (invalid != NULL)
 		{
-			gboolean try_this = TRUE;
+			CtkTextIter iter;
 
-			g_return_val_if_fail (child_def->resolved, FALSE);
+			ctk_text_buffer_get_iter_at_offset (buffer, &iter, segment_start (ce, invalid));
+			ctk_text_iter_set_line_offset (&iter, 0);
 
-			/* If the child definition does not extend the parent
-			 * and the current context could end here we do not
-			 * need to examine this child. */
-			if (!HAS_OPTION (child_def->u.definition, EXTEND_PARENT) && context_end_found)
-				try_this = FALSE;
+			if (ctk_text_iter_get_offset (&iter) == line_end_offset)
+				next_line_invalid = TRUE;
+		}
 
-			if (HAS_OPTION (child_def->u.definition, FIRST_LINE_ONLY) && line->start_at != had_bom)
-				try_this = FALSE;
+		if (!next_line_invalid)
+		{
+			Segment *old_state, *hint;
 
-			if (HAS_OPTION (child_def->u.definition, ONCE_ONLY))
-			{
-				Segment *prev;
+			hint = ce->priv->hint ? ce->priv->hint : state;
+			old_state = get_segment_at_offset (ce, hint, line_end_offset);
 
-				for (prev = state->children; prev != NULL; prev = prev->next)
-				{
-					if (prev->context != NULL &&
-					    prev->context->definition == child_def->u.definition)
-					{
-						try_this = FALSE;
-						break;
-					}
-				}
+			/* We can merge old and new stuff if: contexts are the same,
+			 * and the segment on the next line is continuation of the
+			 * segment from previous line. It does not matter whether
+			 * @state itself was started on this line: the old segment
+			 * was analyzed with the same context stack (contexts are
+			 * shared between segments with the same ancestry), so the
+			 * rest of it is still valid. This is what keeps edits
+			 * inside a long multi-line comment or string from
+			 * re-analyzing everything until its end. */
+			if (old_state != state &&
+			    (old_state->context != state->context || old_state->is_start))
+			{
+				need_invalidate_next = TRUE;
+				next_line_invalid = TRUE;
 			}
-
-			if (try_this)
+			else
 			{
-				/* Does this child definition start a new
-				 * context at the current position? */
-				if (child_starts_here (ce, state, child_def,
-						       line, &pos, new_state))
-				{
-					g_assert (pos <= line->byte_length);
-					*line_pos = pos;
-					definition_iter_destroy (&def_iter);
-					return TRUE;
-				}
+				segment_merge (ce, state, old_state);
+				CHECK_TREE (ce);
 			}
-
-			/* This child does not start here, so we analyze
-			 * another definition. */
 		}
-		definition_iter_destroy (&def_iter);
 
-		if (context_end_found)
+		if ((time != 0 && g_timer_elapsed (timer, NULL) * 1000 > time) ||
+		    line_end_offset >= end_offset ||
+		    (invalid == NULL && !next_line_invalid))
 		{
-			/* We have found that the current context could end
-			 * here and that it cannot be extended by a child.
-			 * Still, it may happen that parent context ends in
-			 * the middle of the end regex match, apply_match()
-			 * checks this. */
-			if (apply_match (state, line, &pos, state->context->end, SUB_PATTERN_WHERE_END))
-			{
-				g_assert (pos <= line->byte_length);
-
-				while (SEGMENT_ENDS_PARENT (state))
-					state = state->parent;
+			if (need_invalidate_next)
+				insert_range (ce, line_end_offset, 0);
+			break;
+		}
 
-				*new_state = state->parent;
-				ce->priv->hint2 = state;
-				*line_pos = pos;
-				return TRUE;
-			}
+		if (next_line_invalid)
+		{
+			line_start_offset = line_end_offset;
+			line_start = line_end;
+			ctk_text_iter_forward_line (&line_end);
+			line_end_offset = ctk_text_iter_get_offset (&line_end);
+		}
+		else
+		{
+			ctk_text_buffer_get_iter_at_offset (buffer, &line_start, segment_start (ce, invalid));
+			ctk_text_iter_set_line_offset (&line_start, 0);
+			line_start_offset = ctk_text_iter_get_offset (&line_start);
+			line_end = line_start;
+			ctk_text_iter_forward_line (&line_end);
+			line_end_offset = ctk_text_iter_get_offset (&line_end);
 		}
 
-		/* Nothing new at this position, go to next char. */
-		pos = g_utf8_next_char (line->text + pos) - line->text;
+		first_line = (start_offset - had_bom) == line_start_offset;
 	}
 
-	return FALSE;
-}
-
-/**
- * check_line_end:
- * @state: current state.
- * @hint: child of @state used in analyze_line() and next_segment().
- *
- * Closes the contexts that cannot contain end of lines if needed.
- * Updates hint if new state is different from @state.
- *
- * Returns: the new state.
- */
-static Segment *
-check_line_end (CtkSourceContextEngine *ce,
-		Segment                *state)
-{
-	Segment *current_segment;
-	Segment *terminating_segment;
-
-	g_assert (!ce->priv->hint2 || ce->priv->hint2->parent == state);
-
-	/* A context can be terminated by the parent if extend_parent is
-	 * FALSE, so we need to verify the end of all the parents of
-	 * not-extending contexts. */
-	terminating_segment = NULL;
-	current_segment = state;
-
-	while (current_segment != NULL)
+	if (analyzed_end == ctk_text_buffer_get_char_count (buffer))
 	{
-		if (SEGMENT_END_AT_LINE_END (current_segment))
-			terminating_segment = current_segment;
-		else if (!ANCESTOR_CAN_END_CONTEXT(current_segment->context))
-			break;
-		current_segment = current_segment->parent;
+		g_assert (g_slist_length (ce->priv->invalid) <= 1);
+
+		if (ce->priv->invalid != NULL)
+		{
+			invalid = get_invalid_segment (ce);
+			segment_remove (ce, invalid);
+			CHECK_TREE (ce);
+		}
 	}
 
-	if (terminating_segment != NULL)
+	if (!all_analyzed (ce))
 	{
-		ce->priv->hint2 = terminating_segment;
-		return terminating_segment->parent;
+		install_idle_worker (ce);
 	}
 	else
 	{
-		return state;
+		node_pool_trim (&ce->priv->segment_pool);
+		node_pool_trim (&ce->priv->sub_pattern_pool);
+		node_pool_trim (&ce->priv->index_pool);
+
+		if (ce->priv->cache_key != NULL)
+			save_highlight_cache (ce);
 	}
+
+	ctk_text_iter_set_offset (&end_iter, analyzed_end);
+
+	refresh_range (ce, &refresh_start, &end_iter);
+
+	PROFILE (g_print ("analyzed %d chars from %d to %d in %fms\n",
+			  analyzed_end - start_offset, start_offset, analyzed_end,
+			  g_timer_elapsed (timer, NULL) * 1000));
+
+	g_timer_destroy (timer);
+	line_chunk_clear (&chunk);
+
+out:
+	/* must call context_thaw, so this is the only return point */
+	context_thaw (ce->priv->root_context);
+
+	highlight_profile_stop (&ce->priv->ctx_data->profile.analysis_time, profile_start);
 }
 
-static void
-delete_zero_length_segments (CtkSourceContextEngine *ce,
-			     GList                  *list)
+/**
+ * get_sync_point_regex:
+ * @ce: #CtkSourceContextEngine.
+ *
+ * Returns: the compiled "sync-point-pattern" metadata of the language,
+ * or %NULL if the language does not have it.
+ */
+static GRegex *
+get_sync_point_regex (CtkSourceContextEngine *ce)
 {
-	while (list != NULL)
+	if (!ce->priv->sync_point_regex_loaded)
 	{
-		Segment *s = list->data;
+		const gchar *pattern;
+
+		ce->priv->sync_point_regex_loaded = TRUE;
+
+		pattern = ctk_source_language_get_metadata (ce->priv->ctx_data->lang,
+							    "sync-point-pattern");
 
-		if (s->start_at == s->end_at)
+		if (pattern != NULL)
 		{
-			GList *l;
+			GError *error = NULL;
 
-			for (l = list->next; l != NULL; )
+			ce->priv->sync_point_regex = g_regex_new (pattern, G_REGEX_OPTIMIZE, 0, &error);
+
+			if (error != NULL)
 			{
-				GList *next = l->next;
-				Segment *s2 = l->data;
-				gboolean child = FALSE;
+				g_warning ("invalid sync-point-pattern in language '%s': %s",
+					   ctk_source_language_get_id (ce->priv->ctx_data->lang),
+					   error->message);
+				g_error_free (error);
+			}
+		}
+	}
 
-				while (s2 != NULL)
-				{
-					if (s2 == s)
-					{
-						child = TRUE;
-						break;
-					}
+	return ce->priv->sync_point_regex;
+}
 
-					s2 = s2->parent;
-				}
+/**
+ * find_sync_point:
+ * @ce: #CtkSourceContextEngine.
+ * @line: a line number.
+ *
+ * Looks for the closest line at or above @line which matches the
+ * "sync-point-pattern" of the language, at most SYNC_POINT_LINES lines
+ * above @line.
+ *
+ * Returns: the line found, or the line SYNC_POINT_LINES lines above @line.
+ */
+static gint
+find_sync_point (CtkSourceContextEngine *ce,
+		 gint                    line)
+{
+	GRegex *regex;
+	gint first;
 
-				if (child)
-					list = g_list_delete_link (list, l);
+	first = MAX (0, line - SYNC_POINT_LINES);
+	regex = get_sync_point_regex (ce);
 
-				l = next;
-			}
+	if (regex != NULL)
+	{
+		gint i;
 
-			if (ce->priv->hint2 != NULL)
-			{
-				Segment *s2 = ce->priv->hint2;
-				gboolean child = FALSE;
+		for (i = line; i > first; i--)
+		{
+			CtkTextIter line_start, line_end;
+			gchar *text;
+			gboolean found;
 
-				while (s2 != NULL)
-				{
-					if (s2 == s)
-					{
-						child = TRUE;
-						break;
-					}
+			ctk_text_buffer_get_iter_at_line (ce->priv->buffer, &line_start, i);
+			line_end = line_start;
 
-					s2 = s2->parent;
-				}
+			if (!ctk_text_iter_ends_line (&line_end))
+				ctk_text_iter_forward_to_line_end (&line_end);
 
-				if (child)
-					ce->priv->hint2 = s->parent;
-			}
+			text = ctk_text_iter_get_slice (&line_start, &line_end);
+			found = g_regex_match (regex, text, 0, NULL);
+			g_free (text);
 
-			segment_remove (ce, s);
+			if (found)
+				return i;
 		}
-
-		list = g_list_delete_link (list, list);
 	}
+
+	return first;
 }
 
 /**
- * analyze_line:
+ * highlight_from_sync_point:
  * @ce: #CtkSourceContextEngine.
- * @state: the state at the beginning of line.
- * @line: the line.
- * @had_bom: if the buffer had a BOM
- *
- * Finds contexts at the line and updates the syntax tree on it.
+ * @start: the beginning of the visible text.
+ * @end: the end of the visible text.
  *
- * Returns: starting state at the next line.
+ * Highlights the text between @start and @end, far below the analyzed
+ * part of the buffer, as if the context at a sync point above it (see
+ * find_sync_point()) was the main one. The lines from the sync point to
+ * @end are analyzed into a temporary tree, which is destroyed once its
+ * tags are applied. The syntax tree and the refresh region are left
+ * untouched, so the guessed highlighting is replaced by the normal one
+ * when update_syntax() gets there.
  */
-static Segment *
-analyze_line (CtkSourceContextEngine *ce,
-	      Segment                *state,
-	      LineInfo               *line,
-	      gboolean                had_bom)
+static void
+highlight_from_sync_point (CtkSourceContextEngine *ce,
+			   const CtkTextIter      *start,
+			   const CtkTextIter      *end)
 {
-	gint line_pos = 0;
-	GList *end_segments = NULL;
-	GTimer *timer;
+	CtkTextBuffer *buffer;
+	CtkTextIter line_start, line_end;
+	CtkTextIter hl_end;
+	Segment *root, *state;
+	Segment *saved_hint, *saved_hint2;
+	gint end_offset;
+	gboolean had_bom = FALSE;
+	LineChunk chunk = { NULL, };
+
+	buffer = ce->priv->buffer;
+
+	if (ce->priv->sync_point_region != NULL)
+	{
+		CtkSourceRegion *region;
+		gboolean done;
 
-	g_assert (SEGMENT_IS_CONTAINER (state));
+		region = ctk_source_region_new (buffer);
+		ctk_source_region_add_subregion (region, start, end);
+		ctk_source_region_subtract_region (region, ce->priv->sync_point_region);
+		done = ctk_source_region_is_empty (region);
+		g_object_unref (region);
 
-        if (ce->priv->hint2 == NULL || ce->priv->hint2->parent != state)
-                ce->priv->hint2 = state->last_child;
-        g_assert (!ce->priv->hint2 || ce->priv->hint2->parent == state);
+		if (done)
+			return;
+	}
 
-	timer = g_timer_new ();
+	ctk_text_buffer_get_iter_at_line (buffer, &line_start,
+					  find_sync_point (ce, ctk_text_iter_get_line (start)));
 
-	/* Find the contexts in the line. */
-	while (line_pos <= line->byte_length)
+	if (ctk_text_iter_is_start (&line_start) && IS_BOM (ctk_text_iter_get_char (&line_start)))
 	{
-		Segment *new_state = NULL;
+		had_bom = TRUE;
+		ctk_text_iter_forward_char (&line_start);
+	}
 
-		if (!next_segment (ce, state, line, &line_pos, &new_state, had_bom))
-			break;
+	hl_end = *end;
+	if (!ctk_text_iter_starts_line (&hl_end))
+		ctk_text_iter_forward_line (&hl_end);
+	end_offset = ctk_text_iter_get_offset (&hl_end);
 
-		if (g_timer_elapsed (timer, NULL) * 1000 > MAX_TIME_FOR_ONE_LINE)
-		{
-			g_critical ("%s",
-			            _("Highlighting a single line took too much time, "
-				      "syntax highlighting will be disabled"));
-			disable_syntax_analysis (ce);
-			break;
-		}
+	/* The hints point into the real tree. */
+	saved_hint = ce->priv->hint;
+	saved_hint2 = ce->priv->hint2;
+	ce->priv->hint = NULL;
+	ce->priv->hint2 = NULL;
 
-		g_assert (new_state != NULL);
-		g_assert (SEGMENT_IS_CONTAINER (new_state));
+	context_freeze (ce->priv->root_context);
 
-		state = new_state;
+	root = create_segment (ce, NULL, ce->priv->root_context,
+			       ctk_text_iter_get_offset (&line_start),
+			       ctk_text_iter_get_offset (&line_start),
+			       TRUE, NULL);
+	ce->priv->sync_point_root = root;
+	state = root;
 
-                if (ce->priv->hint2 == NULL || ce->priv->hint2->parent != state)
-                        ce->priv->hint2 = state->last_child;
-                g_assert (!ce->priv->hint2 || ce->priv->hint2->parent == state);
+	line_end = line_start;
+	ctk_text_iter_forward_line (&line_end);
+	chunk.limit_offset = end_offset;
 
-		/* XXX this a temporary workaround for zero-length segments in the end
-		 * of line. there are no zero-length segments in the middle because it goes
-		 * into infinite loop in that case. */
-		/* state may be extended later, so not all elements of new_segments
-		 * really have zero length */
-		if (state->start_at == line->char_length)
-			end_segments = g_list_prepend (end_segments, state);
-	}
+	while (ctk_text_iter_get_offset (&line_start) < end_offset)
+	{
+		LineInfo line;
 
-	g_timer_destroy (timer);
-	if (ce->priv->disabled)
-		return NULL;
+		get_line_info (buffer, &chunk, &line_start, &line_end, &line);
+		state = analyze_line (ce, state, &line, had_bom);
 
-	/* Extend current state to the end of line. */
-	segment_extend (state, line->start_at + line->char_length);
-	g_assert (line_pos <= line->byte_length);
+		/* analyze_line() could have disabled highlighting */
+		if (ce->priv->disabled)
+			break;
 
-	/* Verify if we need to close the context because we are at
-	 * the end of the line. */
-	if (ANCESTOR_CAN_END_CONTEXT (state->context) ||
-	    SEGMENT_END_AT_LINE_END (state))
+		had_bom = FALSE;
+		line_start = line_end;
+		ctk_text_iter_forward_line (&line_end);
+	}
+
+	if (!ce->priv->disabled)
 	{
-		state = check_line_end (ce, state);
+		CtkTextIter hl_start = *start;
+
+		hl_end = *end;
+		if (ctk_text_iter_starts_line (&hl_end))
+			ctk_text_iter_backward_char (&hl_end);
+
+		if (ctk_text_iter_compare (&hl_start, &hl_end) < 0)
+		{
+			update_syntax_tags (ce, root, &hl_start, &hl_end);
+
+			if (!ce->priv->highlight_on_draw)
+				update_context_class_tags (ce, root, &hl_start, &hl_end);
+		}
+
+		if (ce->priv->sync_point_region == NULL)
+			ce->priv->sync_point_region = ctk_source_region_new (buffer);
+
+		ctk_source_region_add_subregion (ce->priv->sync_point_region, start, end);
+
+		PROFILE (g_print ("highlighted %d to %d from sync point at %d\n",
+				  ctk_text_iter_get_offset (start),
+				  ctk_text_iter_get_offset (end),
+				  segment_start (ce, root)));
 	}
 
-	/* Extend the segment to the beginning of next line. */
-	g_assert (SEGMENT_IS_CONTAINER (state));
-	segment_extend (state, NEXT_LINE_OFFSET (line));
+	ce->priv->sync_point_root = NULL;
+	segment_destroy (ce, root);
+	line_chunk_clear (&chunk);
 
-	/* if it's the last line, don't bother with zero length segments */
-	if (!line->eol_length)
-		g_list_free (end_segments);
-	else
-		delete_zero_length_segments (ce, end_segments);
+	ce->priv->hint = saved_hint;
+	ce->priv->hint2 = saved_hint2;
 
-	CHECK_TREE (ce);
+	context_thaw (ce->priv->root_context);
 
-	return state;
+	if (ce->priv->disabled)
+		ctk_source_context_engine_attach_buffer (CTK_SOURCE_ENGINE (ce), NULL);
 }
 
-/**
- * get_line_info:
- * @buffer: #CtkTextBuffer.
- * @line_start: iterator pointing to the beginning of line.
- * @line_end: iterator pointing to the beginning of next line or to the end
- * of this line if it's the last line in @buffer.
- * @line: #LineInfo structure to be filled.
+
+/* HIGHLIGHT CACHE -------------------------------------------------------- */
+
+/*
+ * The highlight cache keeps the syntax tree of buffers loaded from files,
+ * so that it does not need to be built again when the same file is loaded
+ * later. Every file in the cache directory holds one tree, and is named
+ * after the checksum of the definitions key (library version, language id
+ * and every .lang file the definitions were parsed from, see
+ * _ctk_source_context_data_set_files()) and of the checksum of the text.
  *
- * Retrieves line text from the buffer, finds line terminator and fills
- * @line structure.
+ * The tree is stored in preorder as an array of HIGHLIGHT_CACHE_SEGMENT_FORMAT
+ * entries: index of the parent segment (0 is the root segment, i is the
+ * i-th entry of the array), index of the context definition among the
+ * children of the parent context definition, as returned by
+ * definition_iter_next(), start and end offsets, start_len, end_len,
+ * is_start and the sub patterns as (index of the sub pattern definition,
+ * start and end relative to the segment start).
+ *
+ * Contexts with an end regex depending on the start match (see
+ * context_new()) cannot be created without matching the start regex again,
+ * trees containing them are not saved.
+ *
+ * Checksumming the text, building the variant and reading or writing the
+ * file are done in a thread. The main one only copies the text, copies the
+ * tree into flat arrays (see save_highlight_cache()), and restores it.
  */
-static void
-get_line_info (CtkTextBuffer     *buffer,
-	       const CtkTextIter *line_start,
-	       const CtkTextIter *line_end,
-	       LineInfo          *line)
+
+struct _HighlightCacheKey
 {
-	g_assert (!ctk_text_iter_equal (line_start, line_end));
+	/* What the tree depends on besides the text. */
+	gchar *definitions_key;
 
-	line->text = ctk_text_buffer_get_slice (buffer, line_start, line_end, TRUE);
-	line->start_at = ctk_text_iter_get_offset (line_start);
+	/* Computed in the lookup thread. */
+	gchar *text_checksum;
+	gchar *name;
 
-	if (!ctk_text_iter_starts_line (line_end))
-	{
-		line->eol_length = 0;
-		line->char_length = g_utf8_strlen (line->text, -1);
-		line->byte_length = strlen (line->text);
-	}
-	else
-	{
-		gint eol_index, next_line_index;
+	gint char_count;
+};
 
-		pango_find_paragraph_boundary (line->text, -1,
-					       &eol_index,
-					       &next_line_index);
+/* Data of the lookup thread. */
+typedef struct
+{
+	HighlightCacheKey *key;
+	gchar *text;
+} HighlightCacheLookup;
+
+/* A segment of the tree as saved by save_segment_children(): the fields
+ * of HIGHLIGHT_CACHE_SEGMENT_FORMAT, its sub patterns being the
+ * @n_sub_patterns entries from @first_sub_pattern. */
+typedef struct
+{
+	guint32 parent_index;
+	guint32 child_index;
+	gint32 start;
+	gint32 end;
+	gint32 start_len;
+	gint32 end_len;
+	gboolean is_start;
+	guint first_sub_pattern;
+	guint n_sub_patterns;
+} SavedSegment;
 
-		g_assert (eol_index < next_line_index);
+typedef struct
+{
+	guint32 index;
+	gint32 start;
+	gint32 end;
+} SavedSubPattern;
 
-		line->char_length = g_utf8_strlen (line->text, eol_index);
-		line->eol_length = g_utf8_strlen (line->text + eol_index, -1);
-		line->byte_length = eol_index;
-	}
+/* Data of the thread writing a file. */
+typedef struct
+{
+	gchar *filename;
+	HighlightCacheKey *key;
+
+	/* Arrays of SavedSegment and SavedSubPattern. */
+	GArray *segments;
+	GArray *sub_patterns;
+} HighlightCacheWrite;
+
+/* A file of the cache directory, see prune_highlight_cache(). */
+typedef struct
+{
+	gchar *path;
+	gint64 mtime;
+	goffset size;
+} HighlightCacheFile;
+
+static gchar *
+get_highlight_cache_dir (void)
+{
+	return g_build_filename (g_get_user_cache_dir (),
+				 "ctksourceview-" GSV_API_VERSION_S,
+				 "highlight",
+				 NULL);
+}
 
-	g_assert (ctk_text_iter_get_offset (line_end) ==
-			line->start_at + line->char_length + line->eol_length);
+static void
+highlight_cache_key_free (HighlightCacheKey *key)
+{
+	if (key != NULL)
+	{
+		g_free (key->definitions_key);
+		g_free (key->text_checksum);
+		g_free (key->name);
+		g_slice_free (HighlightCacheKey, key);
+	}
 }
 
 /**
- * line_info_destroy:
- * @line: #LineInfo.
+ * highlight_cache_key_new:
+ * @ce: #CtkSourceContextEngine.
  *
- * Destroys data allocated by get_line_info().
+ * Returns: the key of the definitions of @ce, or %NULL if they cannot
+ * be identified.
  */
-static void
-line_info_destroy (LineInfo *line)
+static HighlightCacheKey *
+highlight_cache_key_new (CtkSourceContextEngine *ce)
 {
-	g_free (line->text);
+	HighlightCacheKey *key;
+
+	if (ce->priv->ctx_data->files_key == NULL)
+		return NULL;
+
+	key = g_slice_new0 (HighlightCacheKey);
+	key->definitions_key = g_strdup_printf ("%d.%d.%d\n%s\n%s",
+						CTK_SOURCE_MAJOR_VERSION,
+						CTK_SOURCE_MINOR_VERSION,
+						CTK_SOURCE_MICRO_VERSION,
+						ctk_source_language_get_id (ce->priv->ctx_data->lang),
+						ce->priv->ctx_data->files_key);
+	key->char_count = ctk_text_buffer_get_char_count (ce->priv->buffer);
+
+	return key;
 }
 
 /**
- * segment_tree_zero_len:
- * @ce: #CtkSoucreContextEngine.
+ * forget_highlight_cache:
+ * @ce: #CtkSourceContextEngine.
  *
- * Erases syntax tree and sets root segment length to zero.
- * It's a shortcut for case when all the text is deleted from
- * the buffer.
+ * Cancels the lookup in the highlight cache and forgets the key of the
+ * text, when the text is modified.
  */
 static void
-segment_tree_zero_len (CtkSourceContextEngine *ce)
+forget_highlight_cache (CtkSourceContextEngine *ce)
 {
-	Segment *root = ce->priv->root_segment;
-	segment_destroy_children (ce, root);
-	root->start_at = root->end_at = 0;
-	CHECK_TREE (ce);
+	if (ce->priv->cache_cancellable != NULL)
+	{
+		g_cancellable_cancel (ce->priv->cache_cancellable);
+		g_clear_object (&ce->priv->cache_cancellable);
+	}
+
+	g_clear_pointer (&ce->priv->cache_key, highlight_cache_key_free);
 }
 
-#ifdef ENABLE_CHECK_TREE
-static Segment *
-get_segment_at_offset_slow_ (Segment *segment,
-			     gint     offset)
+static gboolean
+definition_has_dynamic_end (ContextDefinition *definition)
 {
-	Segment *child;
+	return definition->type == CONTEXT_TYPE_CONTAINER &&
+	       definition->u.start_end.end != NULL &&
+	       !_ctk_source_regex_is_resolved (definition->u.start_end.end);
+}
 
-start:
-	if (segment->parent == NULL && offset == segment->end_at)
-		return segment;
+/**
+ * find_child_definition:
+ * @context: a context which is not the root one.
+ * @child_index: (out): index of the definition of @context among the
+ * children of the parent definition.
+ *
+ * Finds the child of the definition of the parent of @context which
+ * @context was created from in create_child_context().
+ *
+ * Returns: whether it was found.
+ */
+static gboolean
+find_child_definition (Context *context,
+		       guint   *child_index)
+{
+	DefinitionsIter def_iter;
+	DefinitionChild *child_def;
+	guint i = 0;
 
-	if (segment->start_at > offset)
-	{
-		g_assert (segment->parent != NULL);
-		segment = segment->parent;
-		goto start;
-	}
+	definition_iter_init (&def_iter, context->parent->definition);
 
-	if (segment->start_at == offset)
+	while ((child_def = definition_iter_next (&def_iter)) != NULL)
 	{
-		if (segment->children != NULL && segment->children->start_at == offset)
-		{
-			segment = segment->children;
-			goto start;
-		}
-
-		return segment;
-	}
+		const gchar *style;
 
-        if (segment->end_at <= offset && segment->parent != NULL)
-	{
-		if (segment->next != NULL)
-		{
-			if (segment->next->start_at > offset)
-				return segment->parent;
+		style = child_def->override_style ? child_def->style :
+						    child_def->u.definition->default_style;
 
-			segment = segment->next;
-		}
-		else
+		if (child_def->u.definition == context->definition &&
+		    (context->parent->ignore_children_style || context->style == style))
 		{
-			segment = segment->parent;
+			break;
 		}
 
-		goto start;
+		i++;
 	}
 
-	for (child = segment->children; child != NULL; child = child->next)
-	{
-		if (child->start_at == offset)
-		{
-			segment = child;
-			goto start;
-		}
-
-		if (child->end_at <= offset)
-			continue;
-
-		if (child->start_at > offset)
-			break;
-
-		segment = child;
-		goto start;
-	}
+	definition_iter_destroy (&def_iter);
 
-	return segment;
+	*child_index = i;
+	return child_def != NULL;
 }
-#endif /* ENABLE_CHECK_TREE */
 
-#define SEGMENT_IS_ZERO_LEN_AT(s,o) ((s)->start_at == (o) && (s)->end_at == (o))
-#define SEGMENT_CONTAINS(s,o) ((s)->start_at <= (o) && (s)->end_at > (o))
-#define SEGMENT_DISTANCE(s,o) (MIN (ABS ((s)->start_at - (o)), ABS ((s)->end_at - (o))))
-static Segment *
-get_segment_in_ (Segment *segment,
-		 gint     offset)
+static Context *
+restore_child_context (Context *parent,
+		       guint    child_index)
 {
-	Segment *child;
+	DefinitionsIter def_iter;
+	DefinitionChild *child_def;
+	guint i;
 
-	g_assert (segment->start_at <= offset && segment->end_at > offset);
+	definition_iter_init (&def_iter, parent->definition);
 
-	if (segment->children == NULL)
-		return segment;
+	for (i = 0, child_def = definition_iter_next (&def_iter);
+	     child_def != NULL && i < child_index;
+	     i++, child_def = definition_iter_next (&def_iter)) ;
 
-	if (segment->children == segment->last_child)
-	{
-		if (SEGMENT_IS_ZERO_LEN_AT (segment->children, offset))
-			return segment->children;
+	definition_iter_destroy (&def_iter);
 
-		if (SEGMENT_CONTAINS (segment->children, offset))
-			return get_segment_in_ (segment->children, offset);
+	if (child_def == NULL || definition_has_dynamic_end (child_def->u.definition))
+		return NULL;
 
-		return segment;
-	}
+	/* The text is only used to resolve the end regex. */
+	return create_child_context (parent, child_def, "");
+}
 
-	if (segment->children->start_at > offset || segment->last_child->end_at < offset)
-		return segment;
+/* Copies the children of @segment into @write, in preorder. The index in
+ * the definitions of the contexts, shared by many segments, is looked up
+ * once for each context, and kept in @child_indexes. */
+static gboolean
+save_segment_children (CtkSourceContextEngine *ce,
+		       HighlightCacheWrite    *write,
+		       GHashTable             *child_indexes,
+		       Segment                *segment,
+		       guint                   parent_index)
+{
+	Segment *child;
 
-	if (SEGMENT_DISTANCE (segment->children, offset) >= SEGMENT_DISTANCE (segment->last_child, offset))
+	for (child = segment->children; child != NULL; child = child->next)
 	{
-		for (child = segment->children; child; child = child->next)
-		{
-			if (child->start_at > offset)
-				return segment;
+		SavedSegment saved;
+		SubPattern *sp;
+		gpointer value;
 
-			if (SEGMENT_IS_ZERO_LEN_AT (child, offset))
-				return child;
+		if (SEGMENT_IS_INVALID (child) ||
+		    child->context->parent != segment->context)
+		{
+			return FALSE;
+		}
 
-			if (SEGMENT_CONTAINS (child, offset))
-				return get_segment_in_ (child, offset);
+		if (g_hash_table_lookup_extended (child_indexes, child->context, NULL, &value))
+		{
+			saved.child_index = GPOINTER_TO_UINT (value);
 		}
-	}
-	else
-	{
-		for (child = segment->last_child; child; child = child->prev)
+		else
 		{
-			if (SEGMENT_IS_ZERO_LEN_AT (child, offset))
+			guint child_index;
+
+			if (definition_has_dynamic_end (child->context->definition) ||
+			    !find_child_definition (child->context, &child_index))
 			{
-				while (child->prev != NULL && SEGMENT_IS_ZERO_LEN_AT (child->prev, offset))
-					child = child->prev;
-				return child;
+				return FALSE;
 			}
 
-			if (child->end_at <= offset)
-				return segment;
+			g_hash_table_insert (child_indexes, child->context, GUINT_TO_POINTER (child_index));
+			saved.child_index = child_index;
+		}
+
+		saved.parent_index = parent_index;
+		saved.start = segment_start (ce, child);
+		saved.end = segment_end (ce, child);
+		saved.start_len = child->start_len;
+		saved.end_len = child->end_len;
+		saved.is_start = child->is_start;
+		saved.first_sub_pattern = write->sub_patterns->len;
+		saved.n_sub_patterns = 0;
 
-			if (SEGMENT_CONTAINS (child, offset))
-				return get_segment_in_ (child, offset);
+		for (sp = child->sub_patterns; sp != NULL; sp = sp->next)
+		{
+			SavedSubPattern saved_sp;
+
+			saved_sp.index = sp->definition->index;
+			saved_sp.start = sp->start_at;
+			saved_sp.end = sp->end_at;
+			g_array_append_val (write->sub_patterns, saved_sp);
+			saved.n_sub_patterns++;
 		}
+
+		g_array_append_val (write->segments, saved);
+
+		if (!save_segment_children (ce, write, child_indexes, child, write->segments->len))
+			return FALSE;
 	}
 
-	return segment;
+	return TRUE;
 }
 
-/* assumes zero-length segments can't have children */
-static Segment *
-get_segment_ (Segment *segment,
-	      gint     offset)
+static gint
+compare_highlight_cache_files (gconstpointer a,
+			       gconstpointer b)
 {
-	if (segment->parent != NULL)
-	{
-		if (!SEGMENT_CONTAINS (segment->parent, offset))
-			return get_segment_ (segment->parent, offset);
-	}
-	else
-	{
-		g_assert (offset >= segment->start_at);
-		g_assert (offset <= segment->end_at);
-	}
+	const HighlightCacheFile *file_a = a;
+	const HighlightCacheFile *file_b = b;
+
+	/* Newest first. */
+	return (file_a->mtime < file_b->mtime) - (file_a->mtime > file_b->mtime);
+}
+
+/* Deletes the oldest files if there are too many of them, or if they
+ * take too much space: the trees of big files are big too. */
+static void
+prune_highlight_cache (const gchar *dir_name)
+{
+	GDir *dir;
+	const gchar *name;
+	GArray *files;
+	goffset total_size = 0;
+	guint i;
+
+	dir = g_dir_open (dir_name, 0, NULL);
+	if (dir == NULL)
+		return;
 
-	if (SEGMENT_CONTAINS (segment, offset))
-		return get_segment_in_ (segment, offset);
+	files = g_array_new (FALSE, FALSE, sizeof (HighlightCacheFile));
 
-	if (SEGMENT_IS_ZERO_LEN_AT (segment, offset))
+	while ((name = g_dir_read_name (dir)) != NULL)
 	{
-		while (segment->prev != NULL && SEGMENT_IS_ZERO_LEN_AT (segment->prev, offset))
-			segment = segment->prev;
-		return segment;
+		HighlightCacheFile file;
+		GStatBuf buf;
+
+		file.path = g_build_filename (dir_name, name, NULL);
+
+		if (g_stat (file.path, &buf) != 0)
+		{
+			g_free (file.path);
+			continue;
+		}
+
+		file.mtime = buf.st_mtime;
+		file.size = buf.st_size;
+		g_array_append_val (files, file);
 	}
 
-	if (offset < segment->start_at)
+	g_dir_close (dir);
+
+	g_array_sort (files, compare_highlight_cache_files);
+
+	for (i = 0; i < files->len; i++)
 	{
-		while (segment->prev != NULL && segment->prev->start_at > offset)
-			segment = segment->prev;
+		HighlightCacheFile *file = &g_array_index (files, HighlightCacheFile, i);
 
-		g_assert (!segment->prev || segment->prev->start_at <= offset);
+		total_size += file->size;
 
-		if (segment->prev == NULL)
-			return segment->parent;
+		if (i >= HIGHLIGHT_CACHE_MAX_FILES || total_size > HIGHLIGHT_CACHE_MAX_SIZE)
+			g_unlink (file->path);
 
-		if (segment->prev->end_at > offset)
-			return get_segment_in_ (segment->prev, offset);
+		g_free (file->path);
+	}
 
-		if (segment->prev->end_at == offset)
-		{
-			if (SEGMENT_IS_ZERO_LEN_AT (segment->prev, offset))
-			{
-				segment = segment->prev;
-				while (segment->prev != NULL && SEGMENT_IS_ZERO_LEN_AT (segment->prev, offset))
-					segment = segment->prev;
-				return segment;
-			}
+	g_array_free (files, TRUE);
+}
 
-			return segment->parent;
-		}
+static void
+highlight_cache_write_free (HighlightCacheWrite *write)
+{
+	g_free (write->filename);
+	highlight_cache_key_free (write->key);
+	g_array_unref (write->segments);
+	g_array_unref (write->sub_patterns);
+	g_slice_free (HighlightCacheWrite, write);
+}
 
-		/* segment->prev->end_at < offset */
-		return segment->parent;
-	}
+/* Builds the content of the file from the arrays of @write. */
+static GVariant *
+highlight_cache_write_build (HighlightCacheWrite *write)
+{
+	GVariantBuilder segments;
+	guint i;
 
-	/* offset >= segment->end_at, not zero-length */
+	g_variant_builder_init (&segments, G_VARIANT_TYPE ("a" HIGHLIGHT_CACHE_SEGMENT_FORMAT));
 
-	while (segment->next != NULL)
+	for (i = 0; i < write->segments->len; i++)
 	{
-		if (SEGMENT_IS_ZERO_LEN_AT (segment->next, offset))
-			return segment->next;
+		SavedSegment *saved = &g_array_index (write->segments, SavedSegment, i);
+		GVariantBuilder sub_patterns;
+		guint j;
+
+		g_variant_builder_init (&sub_patterns, G_VARIANT_TYPE ("a(uii)"));
 
-		if (segment->next->end_at > offset)
+		for (j = 0; j < saved->n_sub_patterns; j++)
 		{
-			if (segment->next->start_at <= offset)
-				return get_segment_in_ (segment->next, offset);
-			else
-				return segment->parent;
+			SavedSubPattern *sp = &g_array_index (write->sub_patterns, SavedSubPattern,
+							      saved->first_sub_pattern + j);
+
+			g_variant_builder_add (&sub_patterns, "(uii)", sp->index, sp->start, sp->end);
 		}
 
-		segment = segment->next;
+		g_variant_builder_add (&segments, HIGHLIGHT_CACHE_SEGMENT_FORMAT,
+				       saved->parent_index,
+				       saved->child_index,
+				       saved->start,
+				       saved->end,
+				       saved->start_len,
+				       saved->end_len,
+				       saved->is_start,
+				       &sub_patterns);
 	}
 
-	return segment->parent;
+	return g_variant_ref_sink (g_variant_new (HIGHLIGHT_CACHE_FORMAT,
+						  HIGHLIGHT_CACHE_VERSION,
+						  write->key->definitions_key,
+						  write->key->text_checksum,
+						  write->key->char_count,
+						  &segments));
 }
-#undef SEGMENT_IS_ZERO_LEN_AT
-#undef SEGMENT_CONTAINS
-#undef SEGMENT_DISTANCE
 
-/**
- * get_segment_at_offset:
- * @ce: #CtkSoucreContextEngine.
- * @hint: segment to start search from or %NULL.
- * @offset: the offset, characters.
- *
- * Finds the deepest segment "at @offset".
- * More precisely, it returns toplevel segment if
- * @offset is equal to length of buffer; or non-zero-length
- * segment which contains character at @offset; or zero-length
- * segment at @offset. In case when there are several zero-length
- * segments, it returns the first one.
- */
-static Segment *
-get_segment_at_offset (CtkSourceContextEngine *ce,
-		       Segment                *hint,
-		       gint                    offset)
-{
-	Segment *result;
+static void
+highlight_cache_write_thread (GTask        *task,
+			      gpointer      source_object,
+			      gpointer      task_data,
+			      GCancellable *cancellable)
+{
+	HighlightCacheWrite *write = task_data;
+	GVariant *variant;
+	gchar *dir;
+	GError *error = NULL;
 
-	if (offset == ce->priv->root_segment->end_at)
-		return ce->priv->root_segment;
+	variant = highlight_cache_write_build (write);
 
-#ifdef ENABLE_DEBUG
-	/* if you see this message (often), then something is
-	 * wrong with the hints business, i.e. optimizations
-	 * do not work quite like they should */
-	if (hint == NULL || hint == ce->priv->root_segment)
+	/* It would only push everything else out of the cache. */
+	if (g_variant_get_size (variant) > HIGHLIGHT_CACHE_MAX_SIZE)
 	{
-		static int c;
-		g_print ("searching from root %d\n", ++c);
+		g_debug ("highlight cache file '%s' too big: %" G_GSIZE_FORMAT " bytes",
+			 write->filename,
+			 g_variant_get_size (variant));
+		g_variant_unref (variant);
+		g_task_return_boolean (task, TRUE);
+		return;
 	}
-#endif
 
-	result = get_segment_ (hint ? hint : ce->priv->root_segment, offset);
+	dir = g_path_get_dirname (write->filename);
 
-#ifdef ENABLE_CHECK_TREE
-	g_assert (result == get_segment_at_offset_slow_ (hint, offset));
-#endif
+	if (g_mkdir_with_parents (dir, 0700) != 0 ||
+	    !g_file_set_contents (write->filename,
+				  g_variant_get_data (variant),
+				  g_variant_get_size (variant),
+				  &error))
+	{
+		g_debug ("could not write the highlight cache file '%s': %s",
+			 write->filename,
+			 error != NULL ? error->message : g_strerror (errno));
+		g_clear_error (&error);
+	}
+	else
+	{
+		prune_highlight_cache (dir);
+	}
 
-	return result;
+	g_variant_unref (variant);
+	g_free (dir);
+	g_task_return_boolean (task, TRUE);
 }
 
 /**
- * segment_remove:
- * @ce: #CtkSoucreContextEngine.
- * @segment: segment to remove.
+ * save_highlight_cache:
+ * @ce: #CtkSourceContextEngine.
  *
- * Removes the segment from syntax tree and frees it.
- * It correctly updates parent's children list, not
- * like segment_destroy() where caller has to take care
- * of tree integrity.
+ * Writes the tree to the highlight cache, in a thread. Called by
+ * update_syntax() when the whole buffer has been analyzed after a cache
+ * miss in lookup_highlight_cache().
  */
 static void
-segment_remove (CtkSourceContextEngine *ce,
-		Segment                *segment)
+save_highlight_cache (CtkSourceContextEngine *ce)
 {
-	if (segment->next != NULL)
-		segment->next->prev = segment->prev;
-	else
-		segment->parent->last_child = segment->prev;
+	HighlightCacheWrite *write;
+	GHashTable *child_indexes;
+	gboolean saved;
+	GTask *task;
+	gchar *dir;
 
-	if (segment->prev != NULL)
-		segment->prev->next = segment->next;
-	else
-		segment->parent->children = segment->next;
+	write = g_slice_new (HighlightCacheWrite);
+	write->key = ce->priv->cache_key;
+	write->segments = g_array_new (FALSE, FALSE, sizeof (SavedSegment));
+	write->sub_patterns = g_array_new (FALSE, FALSE, sizeof (SavedSubPattern));
+	ce->priv->cache_key = NULL;
 
-	/* if ce->priv->hint is being deleted, set it to some
-	 * neighbour segment */
-	if (ce->priv->hint == segment)
+	dir = get_highlight_cache_dir ();
+	write->filename = g_build_filename (dir, write->key->name, NULL);
+	g_free (dir);
+
+	/* Only the copy of the tree is done here, the variant is built
+	 * by the thread. */
+	child_indexes = g_hash_table_new (NULL, NULL);
+	saved = save_segment_children (ce, write, child_indexes, ce->priv->root_segment, 0);
+	g_hash_table_destroy (child_indexes);
+
+	if (!saved)
 	{
-		if (segment->next != NULL)
-			ce->priv->hint = segment->next;
-		else if (segment->prev != NULL)
-			ce->priv->hint = segment->prev;
-		else
-			ce->priv->hint = segment->parent;
+		highlight_cache_write_free (write);
+		return;
 	}
 
-        /* if ce->priv->hint2 is being deleted, set it to some
-         * neighbour segment */
-        if (ce->priv->hint2 == segment)
-        {
-                if (segment->next != NULL)
-                        ce->priv->hint2 = segment->next;
-                else if (segment->prev != NULL)
-                        ce->priv->hint2 = segment->prev;
-                else
-                        ce->priv->hint2 = segment->parent;
-        }
+	PROFILE (g_print ("saving %u segments to the highlight cache\n", write->segments->len));
 
-	segment_destroy (ce, segment);
+	task = g_task_new (NULL, NULL, NULL, NULL);
+	g_task_set_source_tag (task, save_highlight_cache);
+	g_task_set_task_data (task, write, (GDestroyNotify) highlight_cache_write_free);
+	g_task_run_in_thread (task, highlight_cache_write_thread);
+	g_object_unref (task);
 }
 
-static void
-segment_erase_middle_ (CtkSourceContextEngine *ce,
-		       Segment                *segment,
-		       gint                    start,
-		       gint                    end)
+/**
+ * restore_segments:
+ * @ce: #CtkSourceContextEngine.
+ * @segments: array of HIGHLIGHT_CACHE_SEGMENT_FORMAT.
+ *
+ * Replaces children of the root segment with @segments. The cache file
+ * may be broken, so everything is checked.
+ *
+ * Returns: whether the tree was restored. If not, the root segment is
+ * left with a single invalid child.
+ */
+static gboolean
+restore_segments (CtkSourceContextEngine *ce,
+		  GVariant               *segments)
 {
-	Segment *new_segment, *child;
-	SubPattern *sp;
-
-	new_segment = segment_new (ce,
-				   segment->parent,
-				   segment->context,
-				   end,
-				   segment->end_at,
-				   FALSE);
-	segment->end_at = start;
+	Segment *root = ce->priv->root_segment;
+	GPtrArray *restored;
+	GVariantIter iter;
+	GVariantIter *sub_patterns;
+	guint32 parent_index, child_index;
+	gint32 start_at, end_at, start_len, end_len;
+	gboolean is_start;
+	gboolean ok = TRUE;
 
-	new_segment->next = segment->next;
-	segment->next = new_segment;
-	new_segment->prev = segment;
+	update_tree (ce);
+	segment_destroy_children (ce, root);
+	segment_set_start (ce, root, 0);
+	segment_set_end (ce, root, ctk_text_buffer_get_char_count (ce->priv->buffer));
 
-	if (new_segment->next != NULL)
-		new_segment->next->prev = new_segment;
-	else
-		new_segment->parent->last_child = new_segment;
+	restored = g_ptr_array_new ();
+	g_ptr_array_add (restored, root);
 
-	child = segment->children;
-	segment->children = NULL;
-	segment->last_child = NULL;
+	g_variant_iter_init (&iter, segments);
 
-	while (child != NULL)
+	while (ok && g_variant_iter_next (&iter, HIGHLIGHT_CACHE_SEGMENT_FORMAT,
+					  &parent_index, &child_index,
+					  &start_at, &end_at,
+					  &start_len, &end_len,
+					  &is_start, &sub_patterns))
 	{
-		Segment *append_to;
-		Segment *next = child->next;
+		Segment *parent, *segment;
+		Context *context = NULL;
+		guint32 sp_index;
+		gint32 sp_start, sp_end;
 
-		if (child->start_at < start)
-		{
-			g_assert (child->end_at <= start);
-			append_to = segment;
-		}
-		else
-		{
-			g_assert (child->start_at >= end);
-			append_to = new_segment;
-		}
+		parent = parent_index < restored->len ? restored->pdata[parent_index] : NULL;
 
-		child->parent = append_to;
+		ok = parent != NULL &&
+		     SEGMENT_IS_CONTAINER (parent) &&
+		     segment_start (ce, parent) <= start_at &&
+		     start_at <= end_at &&
+		     end_at <= segment_end (ce, parent) &&
+		     (parent->last_child == NULL || segment_end (ce, parent->last_child) <= start_at) &&
+		     start_len >= 0 && end_len >= 0 &&
+		     start_len + end_len <= end_at - start_at;
 
-		if (append_to->last_child != NULL)
+		if (ok)
 		{
-			append_to->last_child->next = child;
-			child->prev = append_to->last_child;
-			child->next = NULL;
-			append_to->last_child = child;
+			context = restore_child_context (parent->context, child_index);
+			ok = context != NULL;
 		}
-		else
+
+		if (!ok)
 		{
-			child->next = child->prev = NULL;
-			append_to->last_child = child;
-			append_to->children = child;
+			g_variant_iter_free (sub_patterns);
+			break;
 		}
 
-		child = next;
-	}
-
-	sp = segment->sub_patterns;
-	segment->sub_patterns = NULL;
-
-	while (sp != NULL)
-	{
-		SubPattern *next = sp->next;
-		Segment *append_to;
+		segment = create_segment (ce, parent, context, start_at, end_at,
+					  is_start, parent->last_child);
+		context_unref (context);
+		segment->start_len = start_len;
+		segment->end_len = end_len;
+		g_ptr_array_add (restored, segment);
 
-		if (sp->start_at < start)
-		{
-			sp->end_at = MIN (sp->end_at, start);
-			append_to = segment;
-		}
-		else
+		while (ok && g_variant_iter_next (sub_patterns, "(uii)",
+						  &sp_index, &sp_start, &sp_end))
 		{
-			g_assert (sp->end_at > end);
-			sp->start_at = MAX (sp->start_at, end);
-			append_to = new_segment;
-		}
-
-		sp->next = append_to->sub_patterns;
-		append_to->sub_patterns = sp;
+			SubPatternDefinition *sp_def;
 
-		sp = next;
-	}
+			sp_def = g_slist_nth_data (context->definition->sub_patterns, sp_index);
 
-	CHECK_SEGMENT_CHILDREN (segment);
-	CHECK_SEGMENT_CHILDREN (new_segment);
-}
+			ok = sp_def != NULL &&
+			     0 <= sp_start && sp_start <= sp_end &&
+			     sp_end <= end_at - start_at;
 
-/**
- * segment_erase_range_:
- * @ce: #CtkSourceContextEngine.
- * @segment: the segment.
- * @start: start offset of range to erase, characters.
- * @end: end offset of range to erase, characters.
- *
- * Recurisvely removes segments from [@start, @end] interval
- * starting from @segment. If @segment belongs to the range,
- * or it's a zero-length segment at @end offset, and it's not
- * the toplevel segment, then it's removed from the tree.
- * If @segment intersects with the range (unless it's the toplevel
- * segment), then its ends are adjusted appropriately, and it's
- * split into two if it completely contains the range.
- */
-static void
-segment_erase_range_ (CtkSourceContextEngine *ce,
-		      Segment                *segment,
-		      gint                    start,
-		      gint                    end)
-{
-	g_assert (start < end);
+			if (ok)
+				sub_pattern_new (ce, segment, start_at + sp_start, start_at + sp_end, sp_def);
+		}
 
-	if (segment->start_at == segment->end_at)
-	{
-		if (segment->start_at >= start && segment->start_at <= end)
-			segment_remove (ce, segment);
-		return;
+		g_variant_iter_free (sub_patterns);
 	}
 
-	if (segment->start_at > end || segment->end_at < start)
-		return;
+	g_ptr_array_free (restored, TRUE);
 
-	if (segment->start_at >= start && segment->end_at <= end && segment->parent)
+	if (!ok)
 	{
-		segment_remove (ce, segment);
-		return;
+		segment_destroy_children (ce, root);
+		create_segment (ce, root, NULL, segment_start (ce, root), segment_end (ce, root), FALSE, NULL);
 	}
 
-	if (segment->start_at == end)
-	{
-		Segment *child = segment->children;
+	CHECK_TREE (ce);
 
-		while (child != NULL && child->start_at == end)
-		{
-			Segment *next = child->next;
-			segment_erase_range_ (ce, child, start, end);
-			child = next;
-		}
-	}
-	else if (segment->end_at == start)
-	{
-		Segment *child = segment->last_child;
+	return ok;
+}
 
-		while (child != NULL && child->end_at == start)
-		{
-			Segment *prev = child->prev;
-			segment_erase_range_ (ce, child, start, end);
-			child = prev;
-		}
-	}
-	else
-	{
-		Segment *child = segment->children;
+static void
+highlight_cache_lookup_free (HighlightCacheLookup *lookup)
+{
+	highlight_cache_key_free (lookup->key);
+	g_free (lookup->text);
+	g_slice_free (HighlightCacheLookup, lookup);
+}
+
+/* Computes the name of the file from the text, and returns the segments
+ * it contains if it matches the key, or %NULL. */
+static void
+highlight_cache_lookup_thread (GTask        *task,
+			       gpointer      source_object,
+			       gpointer      task_data,
+			       GCancellable *cancellable)
+{
+	HighlightCacheLookup *lookup = task_data;
+	HighlightCacheKey *key = lookup->key;
+	GChecksum *checksum;
+	GVariant *segments = NULL;
+	gchar *contents;
+	gsize length;
+	gsize done;
+	gchar *name;
+	gchar *dir;
+	gchar *filename;
 
-		while (child != NULL)
+	checksum = g_checksum_new (G_CHECKSUM_SHA256);
+	length = strlen (lookup->text);
+
+	for (done = 0; done < length; done += HIGHLIGHT_CACHE_CHECKSUM_CHUNK)
+	{
+		if (g_task_return_error_if_cancelled (task))
 		{
-			Segment *next = child->next;
-			segment_erase_range_ (ce, child, start, end);
-			child = next;
+			g_checksum_free (checksum);
+			return;
 		}
-	}
 
-	if (segment->sub_patterns != NULL)
-	{
-		SubPattern *sp;
+		g_checksum_update (checksum,
+				   (const guchar *) lookup->text + done,
+				   MIN (length - done, HIGHLIGHT_CACHE_CHECKSUM_CHUNK));
+	}
 
-		sp = segment->sub_patterns;
-		segment->sub_patterns = NULL;
+	g_clear_pointer (&lookup->text, g_free);
 
-		while (sp != NULL)
-		{
-			SubPattern *next = sp->next;
+	key->text_checksum = g_strdup (g_checksum_get_string (checksum));
+	g_checksum_free (checksum);
 
-			if (sp->start_at >= start && sp->end_at <= end)
-				sub_pattern_free (sp);
-			else
-				segment_add_subpattern (segment, sp);
+	name = g_strdup_printf ("%s\n%s", key->definitions_key, key->text_checksum);
+	key->name = g_compute_checksum_for_string (G_CHECKSUM_SHA256, name, -1);
+	g_free (name);
 
-			sp = next;
-		}
-	}
+	dir = get_highlight_cache_dir ();
+	filename = g_build_filename (dir, key->name, NULL);
 
-	if (segment->parent != NULL)
+	if (g_file_get_contents (filename, &contents, &length, NULL))
 	{
-		/* Now all children and subpatterns are cleaned up,
-		 * so we only need to split segment properly if its middle
-		 * was erased. Otherwise, only ends need to be adjusted. */
-		if (segment->start_at < start && segment->end_at > end)
+		GVariant *variant;
+		GBytes *bytes;
+		guint32 version;
+		const gchar *definitions_key;
+		const gchar *text_checksum;
+		gint32 char_count;
+
+		bytes = g_bytes_new_take (contents, length);
+		variant = g_variant_new_from_bytes (G_VARIANT_TYPE (HIGHLIGHT_CACHE_FORMAT),
+						    bytes, FALSE);
+		g_variant_ref_sink (variant);
+		g_bytes_unref (bytes);
+
+		g_variant_get (variant, "(u&s&si@a" HIGHLIGHT_CACHE_SEGMENT_FORMAT ")",
+			       &version, &definitions_key, &text_checksum,
+			       &char_count, &segments);
+
+		if (version != HIGHLIGHT_CACHE_VERSION ||
+		    g_strcmp0 (definitions_key, key->definitions_key) != 0 ||
+		    g_strcmp0 (text_checksum, key->text_checksum) != 0 ||
+		    char_count != key->char_count)
 		{
-			segment_erase_middle_ (ce, segment, start, end);
+			g_debug ("stale highlight cache file '%s'", filename);
+			g_clear_pointer (&segments, g_variant_unref);
 		}
-		else
-		{
-			g_assert ((segment->start_at >= start && segment->end_at > end) ||
-				  (segment->start_at < start && segment->end_at <= end));
 
-			if (segment->end_at > end)
-			{
-				/* If we erase the beginning, we need to clear
-				 * is_start flag. */
-				segment->start_at = end;
-				segment->is_start = FALSE;
-			}
-			else
-			{
-				segment->end_at = start;
-			}
-		}
+		g_variant_unref (variant);
 	}
+
+	g_free (filename);
+	g_free (dir);
+
+	g_task_return_pointer (task, segments, (GDestroyNotify) g_variant_unref);
 }
 
-/**
- * segment_merge:
- * @ce: #CtkSourceContextEngine.
- * @first: first segment.
- * @second: second segment.
- *
- * Merges adjacent segments @first and @second given
- * their contexts are equal.
- */
 static void
-segment_merge (CtkSourceContextEngine *ce,
-	       Segment                *first,
-	       Segment                *second)
-{
-	Segment *parent;
-
-	if (first == second)
-		return;
+highlight_cache_lookup_done (GObject      *source_object,
+			     GAsyncResult *result,
+			     gpointer      user_data)
+{
+	CtkSourceContextEngine *ce = CTK_SOURCE_CONTEXT_ENGINE (source_object);
+	HighlightCacheLookup *lookup;
+	GVariant *segments;
+	gboolean restored = FALSE;
+	GError *error = NULL;
 
-	g_assert (!SEGMENT_IS_INVALID (first));
-	g_assert (first->context == second->context);
-	g_assert (first->end_at == second->start_at);
+	segments = g_task_propagate_pointer (G_TASK (result), &error);
 
-	if (first->parent != second->parent)
-		segment_merge (ce, first->parent, second->parent);
+	/* The text was modified or the buffer detached, see
+	 * forget_highlight_cache(). */
+	if (error != NULL)
+	{
+		g_error_free (error);
+		return;
+	}
 
-	parent = first->parent;
+	g_clear_object (&ce->priv->cache_cancellable);
+	lookup = g_task_get_task_data (G_TASK (result));
 
-	g_assert (first->next == second);
-	g_assert (first->parent == second->parent);
-	g_assert (second != parent->children);
+	/* The first update may have analyzed the buffer in the meantime,
+	 * which gives the same tree: restoring it anyway only costs what
+	 * reading it did. */
+	if (segments != NULL)
+	{
+		forget_long_line (ce);
+		restored = restore_segments (ce, segments);
+	}
 
-	if (second == parent->last_child)
-		parent->last_child = first;
-	first->next = second->next;
-	if (second->next != NULL)
-		second->next->prev = first;
+	if (restored)
+	{
+		CtkTextIter start, end;
 
-	first->end_at = second->end_at;
+		PROFILE (g_print ("restored the tree from %s\n", lookup->key->name));
 
-	if (second->children != NULL)
-	{
-		Segment *child;
+		ce->priv->n_cache_hits++;
+		ce->priv->hint = NULL;
+		ce->priv->hint2 = NULL;
 
-		for (child = second->children; child != NULL; child = child->next)
-			child->parent = first;
+		/* Nothing left for the thread to do. */
+		forget_background_analysis (ce);
 
-		if (first->children == NULL)
-		{
-			g_assert (!first->last_child);
-			first->children = second->children;
-			first->last_child = second->last_child;
-		}
-		else
-		{
-			first->last_child->next = second->children;
-			second->children->prev = first->last_child;
-			first->last_child = second->last_child;
-		}
+		ctk_text_buffer_get_bounds (ce->priv->buffer, &start, &end);
+		ctk_source_region_add_subregion (ce->priv->refresh_region, &start, &end);
+		refresh_range (ce, &start, &end);
 	}
-
-	if (second->sub_patterns != NULL)
+	else
 	{
-		if (first->sub_patterns == NULL)
-		{
-			first->sub_patterns = second->sub_patterns;
-		}
+		ce->priv->n_cache_misses++;
+		ce->priv->cache_key = lookup->key;
+		lookup->key = NULL;
+
+		/* A broken file leaves the root segment invalid. */
+		if (all_analyzed (ce))
+			save_highlight_cache (ce);
 		else
-		{
-			while (second->sub_patterns != NULL)
-			{
-				SubPattern *sp = second->sub_patterns;
-				second->sub_patterns = sp->next;
-				sp->next = first->sub_patterns;
-				first->sub_patterns = sp;
-			}
-		}
+			install_first_update (ce);
 	}
 
-	second->children = NULL;
-	second->last_child = NULL;
-	second->sub_patterns = NULL;
-
-	segment_destroy (ce, second);
+	if (segments != NULL)
+		g_variant_unref (segments);
 }
 
 /**
- * erase_segments:
+ * lookup_highlight_cache:
  * @ce: #CtkSourceContextEngine.
- * @start: start offset of region to erase, characters.
- * @end: end offset of region to erase, characters.
- * @hint: segment around @start to make it faster.
  *
- * Erases all non-toplevel segments in the interval
- * [@start, @end]. Its action on the tree is roughly
- * equivalent to segment_erase_range_(ce->priv->root_segment, start, end)
- * (but that does not accept toplevel segment).
+ * Looks the text up in the highlight cache in a thread; meanwhile the
+ * buffer is analyzed as usual. The tree is restored from the cache if it
+ * is there, otherwise the engine saves it when the whole buffer is
+ * analyzed.
  */
 static void
-erase_segments (CtkSourceContextEngine *ce,
-		gint                    start,
-		gint                    end,
-		Segment                *hint)
+lookup_highlight_cache (CtkSourceContextEngine *ce)
 {
-	Segment *root = ce->priv->root_segment;
-	Segment *child, *hint_prev;
+	HighlightCacheLookup *lookup;
+	HighlightCacheKey *key;
+	CtkTextIter start, end;
+	GTask *task;
 
-	if (root->children == NULL)
+	key = highlight_cache_key_new (ce);
+	if (key == NULL)
 		return;
 
-	if (hint == NULL)
-		hint = ce->priv->hint;
-
-	if (hint != NULL)
-		while (hint != NULL && hint->parent != ce->priv->root_segment)
-			hint = hint->parent;
-
-	if (hint == NULL)
-		hint = root->children;
-
-	hint_prev = hint->prev;
-
-	child = hint;
-	while (child != NULL)
-	{
-		Segment *next = child->next;
+	forget_highlight_cache (ce);
+	ce->priv->cache_cancellable = g_cancellable_new ();
 
-		if (child->end_at < start)
-		{
-			child = next;
+	lookup = g_slice_new (HighlightCacheLookup);
+	lookup->key = key;
 
-			if (next != NULL)
-				ce->priv->hint = next;
+	ctk_text_buffer_get_bounds (ce->priv->buffer, &start, &end);
+	lookup->text = ctk_text_iter_get_slice (&start, &end);
 
-			continue;
-		}
+	task = g_task_new (ce, ce->priv->cache_cancellable,
+			   highlight_cache_lookup_done, NULL);
+	g_task_set_source_tag (task, lookup_highlight_cache);
+	g_task_set_task_data (task, lookup, (GDestroyNotify) highlight_cache_lookup_free);
+	g_task_run_in_thread (task, highlight_cache_lookup_thread);
+	g_object_unref (task);
+}
 
-		if (child->start_at > end)
-		{
-			ce->priv->hint = child;
-			break;
-		}
+/* BACKGROUND ANALYSIS ---------------------------------------------------- */
 
-		segment_erase_range_ (ce, child, start, end);
-		child = next;
-	}
+/*
+ * With CtkSourceBuffer:highlight-in-thread, a big text is analyzed in a
+ * thread by a separate engine without a buffer, from a copy of the text;
+ * the main engine adopts its tree once it is done, see
+ * background_analysis_done(). Meanwhile the main engine only analyzes
+ * what is drawn and the first update; its idle worker does not run.
+ *
+ * The thread starts when a text is loaded from a file, set, or inserted
+ * in one go, and when the language changes, see
+ * schedule_background_analysis(). Any edit cancels it, since it works on
+ * a copy of the text, and it starts again from a new copy once the text
+ * is left unchanged for a while, if much of it is left to analyze; the
+ * idle worker analyzes the text meanwhile.
+ *
+ * The context definitions, the regexes and the context data are shared
+ * by the two engines: the regexes keep a match state per thread (see
+ * _ctk_source_regex_begin_thread_matches()), context_new() locks the
+ * caches of the definitions, and the engine of the thread is created and
+ * freed on the main thread, which owns the context data. The definitions
+ * are not profiled, so a thread is not used while profiling.
+ */
 
-	child = hint_prev;
-	while (child != NULL)
-	{
-		Segment *prev = child->prev;
+/* Data of the analysis thread. */
+typedef struct
+{
+	CtkSourceContextEngine *engine;
+	gchar *text;
+} BackgroundAnalysis;
 
-		if (ce->priv->hint == NULL)
-			ce->priv->hint = child;
+/* Frees the engine of an analysis thread, with its tree if any. */
+static void
+background_engine_free (CtkSourceContextEngine *engine)
+{
+	if (engine->priv->root_segment != NULL)
+		segment_destroy (engine, engine->priv->root_segment);
+	if (engine->priv->root_context != NULL)
+		context_unref (engine->priv->root_context);
+	engine->priv->root_segment = NULL;
+	engine->priv->root_context = NULL;
 
-		if (child->start_at > end)
-		{
-			child = prev;
-			continue;
-		}
+	node_pool_clear (&engine->priv->segment_pool);
+	node_pool_clear (&engine->priv->sub_pattern_pool);
+	node_pool_clear (&engine->priv->index_pool);
 
-		if (child->end_at < start)
-		{
-			break;
-		}
+	g_object_unref (engine);
+}
 
-		segment_erase_range_ (ce, child, start, end);
-		child = prev;
-	}
+static void
+background_analysis_free (BackgroundAnalysis *analysis)
+{
+	/* The engine is freed on the main thread, by
+	 * background_analysis_done(). */
+	g_assert (analysis->engine == NULL);
 
-	CHECK_TREE (ce);
+	g_free (analysis->text);
+	g_slice_free (BackgroundAnalysis, analysis);
 }
 
-#define IS_BOM(c) (c == 0xFEFF)
-
 /**
- * update_syntax:
- * @ce: #CtkSourceContextEngine.
- * @end: desired end of region to analyze or %NULL.
- * @time: maximal amount of time in milliseconds allowed to spend here
- * or 0 for 'unlimited'.
+ * get_text_line_info:
+ * @chunk: #LineChunk holding the whole text.
+ * @line: #LineInfo structure to be filled.
  *
- * Updates syntax tree. If @end is not %NULL, then it analyzes
- * (reanalyzes invalid areas in) region from start of buffer
- * to @end. Otherwise, it analyzes batch of text starting at
- * first invalid line.
- * In order to avoid blocking ui it uses a timer and stops
- * when time elapsed is greater than @time, so analyzed region is
- * not necessarily what's requested (unless @time is 0).
+ * Same as get_line_info(), for a text which is not in a buffer: fills
+ * @line with the line starting at @chunk->next.
  */
-/* TODO it must be refactored. */
 static void
-update_syntax (CtkSourceContextEngine *ce,
-	       const CtkTextIter      *end,
-	       gint                    time)
+get_text_line_info (LineChunk *chunk,
+		    LineInfo  *line)
 {
-	CtkTextBuffer *buffer;
-	CtkTextIter start_iter, end_iter;
-	CtkTextIter line_start, line_end;
-	Segment *state;
-	Segment *invalid;
-	gint start_offset, end_offset;
-	gint line_start_offset, line_end_offset;
-	gint analyzed_end;
-	gboolean first_line = FALSE;
-	gboolean had_bom = FALSE;
-	GTimer *timer;
+	gint eol_index, next_line_index;
 
-	buffer = ce->priv->buffer;
-	state = ce->priv->root_segment;
+	line->start_at = chunk->next_offset;
+	line->text = (gchar *) chunk->next;
+	line->chunk = chunk;
 
-	context_freeze (ce->priv->root_context);
-	update_tree (ce);
+	pango_find_paragraph_boundary (line->text, chunk->text_end - chunk->next,
+				       &eol_index,
+				       &next_line_index);
 
-	if (!ctk_text_buffer_get_char_count (buffer))
-	{
-		segment_tree_zero_len (ce);
-		goto out;
-	}
+	line->byte_length = eol_index;
+	line->stamp = _ctk_source_regex_new_line_stamp ();
+	line->char_length = utf8_strlen_fast (line->text, eol_index);
+	line->eol_length = g_utf8_strlen (line->text + eol_index, next_line_index - eol_index);
 
-	invalid = get_invalid_segment (ce);
+	chunk->next = line->text + next_line_index;
+	chunk->next_offset = line->start_at + line->char_length + line->eol_length;
+}
 
-	if (invalid == NULL)
-		goto out;
+/* Builds the tree of the whole text in the engine of the analysis, the
+ * same way highlight_from_sync_point() builds its temporary tree. */
+static void
+background_analysis_thread (GTask        *task,
+			    gpointer      source_object,
+			    gpointer      task_data,
+			    GCancellable *cancellable)
+{
+	BackgroundAnalysis *analysis = task_data;
+	CtkSourceContextEngine *ce = analysis->engine;
+	ContextDefinition *main_definition;
+	LineChunk chunk = { NULL, };
+	Segment *state;
+	gboolean had_bom = FALSE;
+	gboolean done = TRUE;
 
-	if (end != NULL && invalid->start_at >= ctk_text_iter_get_offset (end))
-		goto out;
+	_ctk_source_regex_begin_thread_matches ();
 
-	if (end != NULL)
-	{
-		end_offset = ctk_text_iter_get_offset (end);
-		start_offset = MIN (end_offset, invalid->start_at);
-	}
-	else
-	{
-		start_offset = invalid->start_at;
-		end_offset = ctk_text_buffer_get_char_count (buffer);
-	}
+	main_definition = ctk_source_context_data_lookup_root (ce->priv->ctx_data);
+	ce->priv->root_context = context_new (NULL, main_definition, NULL, NULL, NULL, FALSE);
+	ce->priv->root_segment = create_segment (ce, NULL, ce->priv->root_context, 0, 0, TRUE, NULL);
 
-	ctk_text_buffer_get_iter_at_offset (buffer, &start_iter, start_offset);
-	ctk_text_buffer_get_iter_at_offset (buffer, &end_iter, end_offset);
+	context_freeze (ce->priv->root_context);
 
-	if (!ctk_text_iter_starts_line (&start_iter))
-	{
-		ctk_text_iter_set_line_offset (&start_iter, 0);
-		start_offset = ctk_text_iter_get_offset (&start_iter);
-	}
+	chunk.text = analysis->text;
+	chunk.text_end = chunk.text + strlen (chunk.text);
+	chunk.next = chunk.text;
+	analysis->text = NULL;
 
-	if (!ctk_text_iter_starts_line (&end_iter))
+	/* Skip the BOM, see update_syntax(). */
+	if (IS_BOM (g_utf8_get_char (chunk.text)))
 	{
-		ctk_text_iter_forward_line (&end_iter);
-		end_offset = ctk_text_iter_get_offset (&end_iter);
+		had_bom = TRUE;
+		chunk.next = g_utf8_next_char (chunk.text);
+		chunk.next_offset = 1;
 	}
 
-	if (0 == start_offset)
+	state = ce->priv->root_segment;
+
+	while (chunk.next < chunk.text_end)
 	{
-		gunichar c;
+		LineInfo line;
 
-		first_line = TRUE;
+		if (g_cancellable_is_cancelled (cancellable))
+		{
+			done = FALSE;
+			break;
+		}
 
-		/* If it is the first line and it starts with BOM, skip it
-		 * since regexes in lang files do not take it into account */
-		c = ctk_text_iter_get_char (&start_iter);
-		if (IS_BOM (c))
+		get_text_line_info (&chunk, &line);
+		state = analyze_line (ce, state, &line, had_bom);
+
+		/* analyze_line() could have disabled highlighting */
+		if (ce->priv->disabled)
 		{
-			had_bom = TRUE;
-			ctk_text_iter_forward_char (&start_iter);
-			start_offset = ctk_text_iter_get_offset (&start_iter);
+			done = FALSE;
+			break;
 		}
+
+		had_bom = FALSE;
 	}
 
-	/* This happens after deleting all text on last line. */
-	if (start_offset == end_offset)
+	if (done)
+		segment_set_end (ce, ce->priv->root_segment, chunk.next_offset);
+
+	context_thaw (ce->priv->root_context);
+	line_chunk_clear (&chunk);
+
+	/* The tree is not needed, spare the main thread. */
+	if (!done)
 	{
-		g_assert (end_offset == ctk_text_buffer_get_char_count (buffer));
-		g_assert (g_slist_length (ce->priv->invalid) == 1);
-		segment_remove (ce, invalid);
-		CHECK_TREE (ce);
-		goto out;
+		segment_destroy (ce, ce->priv->root_segment);
+		context_unref (ce->priv->root_context);
+		ce->priv->root_segment = NULL;
+		ce->priv->root_context = NULL;
 	}
 
+	_ctk_source_regex_end_thread_matches ();
 
-	/* Main loop */
+	g_task_return_boolean (task, done);
+}
 
-	line_start = start_iter;
-	line_start_offset = start_offset;
-	line_end = line_start;
-	ctk_text_iter_forward_line (&line_end);
-	line_end_offset = ctk_text_iter_get_offset (&line_end);
-	analyzed_end = line_end_offset;
+/* Replaces the tree of @ce by the tree built by @analysis. The text was
+ * not modified since it was copied, but what the main thread analyzed
+ * meanwhile, the first update and the drawn text, is dropped with the old
+ * tree rather than merged: the thread analyzed it too, and all the text
+ * is refreshed anyway. */
+static void
+adopt_background_tree (CtkSourceContextEngine *ce,
+		       CtkSourceContextEngine *analysis)
+{
+	NodePool pool;
 
-	timer = g_timer_new ();
+	forget_long_line (ce);
 
-	while (TRUE)
-	{
-		LineInfo line;
-		gboolean next_line_invalid = FALSE;
-		gboolean need_invalidate_next = FALSE;
+	segment_destroy (ce, ce->priv->root_segment);
+	context_unref (ce->priv->root_context);
+	g_assert (ce->priv->invalid == NULL);
 
-		/* Last buffer line. */
-		if (line_start_offset == line_end_offset)
-		{
-			g_assert (line_start_offset == ctk_text_buffer_get_char_count (buffer));
-			break;
-		}
+	ce->priv->root_segment = analysis->priv->root_segment;
+	ce->priv->root_context = analysis->priv->root_context;
+	ce->priv->tree_stamp = analysis->priv->tree_stamp;
+	analysis->priv->root_segment = NULL;
+	analysis->priv->root_context = NULL;
 
-		/* Analyze the line */
-		erase_segments (ce, line_start_offset, line_end_offset, ce->priv->hint);
-		get_line_info (buffer, &line_start, &line_end, &line);
+	/* The nodes of the tree belong to the pools of @analysis, and
+	 * the nodes of the old tree, all freed, to the pools of @ce. */
+	pool = ce->priv->segment_pool;
+	ce->priv->segment_pool = analysis->priv->segment_pool;
+	analysis->priv->segment_pool = pool;
 
-#ifdef ENABLE_CHECK_TREE
-		{
-			Segment *inv = get_invalid_segment (ce);
-			g_assert (inv == NULL || inv->start_at >= line_end_offset);
-		}
-#endif
+	pool = ce->priv->sub_pattern_pool;
+	ce->priv->sub_pattern_pool = analysis->priv->sub_pattern_pool;
+	analysis->priv->sub_pattern_pool = pool;
 
-		if (first_line)
-		{
-			state = ce->priv->root_segment;
-		}
-		else
-		{
-			state = get_segment_at_offset (ce,
-						       ce->priv->hint ? ce->priv->hint : state,
-						       line_start_offset - 1);
-		}
+	pool = ce->priv->index_pool;
+	ce->priv->index_pool = analysis->priv->index_pool;
+	analysis->priv->index_pool = pool;
 
-		g_assert (state->context != NULL);
+	ce->priv->hint = NULL;
+	ce->priv->hint2 = NULL;
+	ce->priv->invalid_region.empty = TRUE;
+	ce->priv->invalid_region.delta = 0;
 
-		ce->priv->hint2 = ce->priv->hint;
+	CHECK_TREE (ce);
+}
 
-		if (ce->priv->hint2 != NULL && ce->priv->hint2->parent != state)
-			ce->priv->hint2 = NULL;
+static void
+background_analysis_done (GObject      *source_object,
+			  GAsyncResult *result,
+			  gpointer      user_data)
+{
+	CtkSourceContextEngine *ce = CTK_SOURCE_CONTEXT_ENGINE (source_object);
+	BackgroundAnalysis *analysis;
+	gboolean done;
+	GError *error = NULL;
 
-		state = analyze_line (ce, state, &line, had_bom);
+	analysis = g_task_get_task_data (G_TASK (result));
+	done = g_task_propagate_boolean (G_TASK (result), &error);
 
-		/* At this point analyze_line() could have disabled highlighting */
-		if (ce->priv->disabled)
-			return;
+	/* The text was modified or the buffer detached, see
+	 * forget_background_analysis(). */
+	if (error != NULL)
+	{
+		g_clear_pointer (&analysis->engine, background_engine_free);
+		g_error_free (error);
+		return;
+	}
 
-#ifdef ENABLE_CHECK_TREE
-		{
-			Segment *inv = get_invalid_segment (ce);
-			g_assert (inv == NULL || inv->start_at >= line_end_offset);
-		}
-#endif
+	g_clear_object (&ce->priv->analysis_cancellable);
 
-		/* XXX this is wrong */
-		/* I don't know anymore why it's wrong, I guess it means
-		 * "may be inefficient" */
-		if (ce->priv->hint2 != NULL)
-			ce->priv->hint = ce->priv->hint2;
-		else
-			ce->priv->hint = state;
+	/* The views may have had the whole buffer analyzed meanwhile. */
+	if (done && !all_analyzed (ce))
+	{
+		CtkTextIter start, end;
 
-		line_info_destroy (&line);
+		adopt_background_tree (ce, analysis->engine);
 
-		ctk_source_region_add_subregion (ce->priv->refresh_region, &line_start, &line_end);
-		analyzed_end = line_end_offset;
-		invalid = get_invalid_segment (ce);
+		PROFILE (g_print ("adopted the tree built in a thread\n"));
 
-		if (invalid != NULL)
-		{
-			CtkTextIter iter;
+		ce->priv->n_thread_analyses++;
 
-			ctk_text_buffer_get_iter_at_offset (buffer, &iter, invalid->start_at);
-			ctk_text_iter_set_line_offset (&iter, 0);
+		ctk_text_buffer_get_bounds (ce->priv->buffer, &start, &end);
+		ctk_source_region_add_subregion (ce->priv->refresh_region, &start, &end);
+		refresh_range (ce, &start, &end);
+	}
 
-			if (ctk_text_iter_get_offset (&iter) == line_end_offset)
-				next_line_invalid = TRUE;
-		}
+	g_clear_pointer (&analysis->engine, background_engine_free);
 
-		if (!next_line_invalid)
-		{
-			Segment *old_state, *hint;
+	if (!all_analyzed (ce))
+		install_idle_worker (ce);
+	else if (ce->priv->cache_key != NULL)
+		save_highlight_cache (ce);
+}
 
-			hint = ce->priv->hint ? ce->priv->hint : state;
-			old_state = get_segment_at_offset (ce, hint, line_end_offset);
+/**
+ * start_background_analysis:
+ * @ce: #CtkSourceContextEngine.
+ *
+ * Analyzes the whole text in a thread, if it is big enough and
+ * CtkSourceBuffer:highlight-in-thread is set. The tree built so far is
+ * not used, the thread starts from the beginning of the text.
+ */
+static void
+start_background_analysis (CtkSourceContextEngine *ce)
+{
+	BackgroundAnalysis *analysis;
+	CtkTextIter start, end;
+	GTask *task;
 
-			/* We can merge old and new stuff if: contexts are the same,
-			 * and the segment on the next line is continuation of the
-			 * segment from previous line. */
-			if (old_state != state &&
-			    (old_state->context != state->context || state->is_start))
-			{
-				need_invalidate_next = TRUE;
-				next_line_invalid = TRUE;
-			}
-			else
-			{
-				segment_merge (ce, state, old_state);
-				CHECK_TREE (ce);
-			}
-		}
+	if (!ctk_source_buffer_get_highlight_in_thread (CTK_SOURCE_BUFFER (ce->priv->buffer)) ||
+	    highlight_profile_enabled () ||
+	    ctk_text_buffer_get_char_count (ce->priv->buffer) < BACKGROUND_ANALYSIS_MIN_CHARS)
+	{
+		return;
+	}
 
-		if ((time != 0 && g_timer_elapsed (timer, NULL) * 1000 > time) ||
-		    line_end_offset >= end_offset ||
-		    (invalid == NULL && !next_line_invalid))
-		{
-			if (need_invalidate_next)
-				insert_range (ce, line_end_offset, 0);
-			break;
-		}
+	forget_background_analysis (ce);
+	ce->priv->analysis_cancellable = g_cancellable_new ();
 
-		if (next_line_invalid)
-		{
-			line_start_offset = line_end_offset;
-			line_start = line_end;
-			ctk_text_iter_forward_line (&line_end);
-			line_end_offset = ctk_text_iter_get_offset (&line_end);
-		}
-		else
-		{
-			ctk_text_buffer_get_iter_at_offset (buffer, &line_start, invalid->start_at);
-			ctk_text_iter_set_line_offset (&line_start, 0);
-			line_start_offset = ctk_text_iter_get_offset (&line_start);
-			line_end = line_start;
-			ctk_text_iter_forward_line (&line_end);
-			line_end_offset = ctk_text_iter_get_offset (&line_end);
-		}
+	if (ce->priv->incremental_update != 0)
+	{
+		g_source_remove (ce->priv->incremental_update);
+		ce->priv->incremental_update = 0;
+	}
 
-		first_line = (start_offset - had_bom) == line_start_offset;
+	analysis = g_slice_new (BackgroundAnalysis);
+	analysis->engine = _ctk_source_context_engine_new (ce->priv->ctx_data);
+
+	ctk_text_buffer_get_bounds (ce->priv->buffer, &start, &end);
+	analysis->text = ctk_text_iter_get_slice (&start, &end);
+
+	task = g_task_new (ce, ce->priv->analysis_cancellable,
+			   background_analysis_done, NULL);
+	g_task_set_source_tag (task, start_background_analysis);
+	g_task_set_task_data (task, analysis, (GDestroyNotify) background_analysis_free);
+	g_task_run_in_thread (task, background_analysis_thread);
+	g_object_unref (task);
+}
+
+/**
+ * forget_background_analysis:
+ * @ce: #CtkSourceContextEngine.
+ *
+ * Cancels the analysis in a thread, and the scheduled one, when the text
+ * is modified.
+ */
+static void
+forget_background_analysis (CtkSourceContextEngine *ce)
+{
+	if (ce->priv->analysis_cancellable != NULL)
+	{
+		g_cancellable_cancel (ce->priv->analysis_cancellable);
+		g_clear_object (&ce->priv->analysis_cancellable);
 	}
 
-	if (analyzed_end == ctk_text_buffer_get_char_count (buffer))
+	if (ce->priv->analysis_timeout != 0)
 	{
-		g_assert (g_slist_length (ce->priv->invalid) <= 1);
+		g_source_remove (ce->priv->analysis_timeout);
+		ce->priv->analysis_timeout = 0;
+	}
+}
 
-		if (ce->priv->invalid != NULL)
-		{
-			invalid = get_invalid_segment (ce);
-			segment_remove (ce, invalid);
-			CHECK_TREE (ce);
-		}
+static gboolean
+background_analysis_timeout_cb (CtkSourceContextEngine *ce)
+{
+	Segment *invalid;
+
+	ce->priv->analysis_timeout = 0;
+
+	if (ce->priv->disabled || ce->priv->freeze_count > 0)
+		return G_SOURCE_REMOVE;
+
+	/* After most edits, the idle worker is done by now, or nearly. */
+	update_tree (ce);
+	invalid = get_invalid_segment (ce);
+
+	if (invalid != NULL &&
+	    ctk_text_buffer_get_char_count (ce->priv->buffer) - segment_start (ce, invalid) >=
+	    BACKGROUND_ANALYSIS_MIN_CHARS)
+	{
+		start_background_analysis (ce);
 	}
 
-	if (!all_analyzed (ce))
-		install_idle_worker (ce);
+	return G_SOURCE_REMOVE;
+}
 
-	ctk_text_iter_set_offset (&end_iter, analyzed_end);
+/**
+ * schedule_background_analysis:
+ * @ce: #CtkSourceContextEngine.
+ * @now: whether to start it in the next main loop iteration.
+ *
+ * Cancels the analysis in a thread, if any, and starts it again once
+ * the text is left unchanged for BACKGROUND_ANALYSIS_DELAY milliseconds,
+ * or right away if @now is %TRUE, when the whole text is to be analyzed.
+ * Called whenever the text or the tree is invalidated.
+ */
+static void
+schedule_background_analysis (CtkSourceContextEngine *ce,
+			      gboolean                now)
+{
+	forget_background_analysis (ce);
 
-	refresh_range (ce, &start_iter, &end_iter);
+	if (!CTK_SOURCE_IS_BUFFER (ce->priv->buffer) ||
+	    !ctk_source_buffer_get_highlight_in_thread (CTK_SOURCE_BUFFER (ce->priv->buffer)) ||
+	    ce->priv->mirror_source != NULL ||
+	    ctk_text_buffer_get_char_count (ce->priv->buffer) < BACKGROUND_ANALYSIS_MIN_CHARS)
+	{
+		return;
+	}
 
-	PROFILE (g_print ("analyzed %d chars from %d to %d in %fms\n",
-			  analyzed_end - start_offset, start_offset, analyzed_end,
-			  g_timer_elapsed (timer, NULL) * 1000));
+	ce->priv->analysis_timeout =
+		cdk_threads_add_timeout (now ? 0 : BACKGROUND_ANALYSIS_DELAY,
+					 (GSourceFunc) background_analysis_timeout_cb,
+					 ce);
+}
 
-	g_timer_destroy (timer);
+/**
+ * ctk_source_context_engine_text_loaded:
+ * @engine: #CtkSourceContextEngine.
+ *
+ * CtkSourceEngine::text_loaded method.
+ *
+ * Called when the buffer text has been loaded from a file, with
+ * CtkSourceBuffer:highlight-cache or CtkSourceBuffer:highlight-in-thread.
+ * Looks the text up in the highlight cache, and analyzes it in a thread,
+ * whichever is enabled; the cache wins if both are and the text is in it.
+ */
+static void
+ctk_source_context_engine_text_loaded (CtkSourceEngine *engine)
+{
+	CtkSourceContextEngine *ce = CTK_SOURCE_CONTEXT_ENGINE (engine);
 
-out:
-	/* must call context_thaw, so this is the only return point */
-	context_thaw (ce->priv->root_context);
+	/* Nothing to gain if the first update already did the job, and a
+	 * mirror has no tree of its own. */
+	if (ce->priv->buffer == NULL || ce->priv->disabled ||
+	    ce->priv->mirror_source != NULL || ce->priv->freeze_count > 0 ||
+	    all_analyzed (ce))
+	{
+		return;
+	}
+
+	if (ctk_source_buffer_get_highlight_cache (CTK_SOURCE_BUFFER (ce->priv->buffer)))
+		lookup_highlight_cache (ce);
+
+	start_background_analysis (ce);
 }
 
 
@@ -5794,9 +10682,19 @@ context_definition_unref (ContextDefinition *definition)
 	}
 	g_slist_free (definition->sub_patterns);
 
+#ifdef ENABLE_PROFILE
+	if (definition->resolved_ends != NULL)
+		g_print ("resolved end regexes for %s: %u hits, %u misses\n",
+			 definition->id,
+			 definition->resolved_ends->hits,
+			 definition->resolved_ends->misses);
+#endif
+
 	g_free (definition->id);
 	g_free (definition->default_style);
 	_ctk_source_regex_unref (definition->reg_all);
+	resolved_end_cache_free (definition->resolved_ends);
+	g_free (definition->profile);
 
 	g_slist_free_full (definition->context_classes,
 	                   (GDestroyNotify)ctk_source_context_class_free);
@@ -6397,6 +11295,29 @@ out:
 /* DEBUG CODE ------------------------------------------------------------- */
 
 #ifdef ENABLE_CHECK_TREE
+/* Checks the treap rooted at @node, and returns the sibling expected
+ * after its last node. */
+static Segment *
+check_segment_index (Segment      *parent,
+		     SegmentIndex *node,
+		     Segment      *expected)
+{
+	if (node == NULL)
+		return expected;
+
+	g_assert (node->segment->parent == parent);
+	g_assert (node->segment->index == node);
+	g_assert (!node->left || node->left->up == node);
+	g_assert (!node->right || node->right->up == node);
+	g_assert (!node->up ||
+		  segment_index_priority_ (node) <= segment_index_priority_ (node->up));
+
+	expected = check_segment_index (parent, node->left, expected);
+	g_assert (node->segment == expected);
+
+	return check_segment_index (parent, node->right, node->segment->next);
+}
+
 static void
 check_segment (CtkSourceContextEngine *ce,
 	       Segment                *segment)
@@ -6404,8 +11325,8 @@ check_segment (CtkSourceContextEngine *ce,
 	Segment *child;
 
 	g_assert (segment != NULL);
-	g_assert (segment->start_at <= segment->end_at);
-	g_assert (!segment->next || segment->next->start_at >= segment->end_at);
+	g_assert (segment_start (ce, segment) <= segment_end (ce, segment));
+	g_assert (!segment->next || segment_start (ce, segment->next) >= segment_end (ce, segment));
 
 	if (SEGMENT_IS_INVALID (segment))
 		g_assert (g_slist_find (ce->priv->invalid, segment) != NULL);
@@ -6415,11 +11336,18 @@ check_segment (CtkSourceContextEngine *ce,
 	if (segment->children != NULL)
 		g_assert (!SEGMENT_IS_INVALID (segment) && SEGMENT_IS_CONTAINER (segment));
 
+	if (SEGMENT_CHILDREN_INDEXED (segment))
+	{
+		g_assert (segment->index->segment == segment);
+		g_assert (!segment->index->root->up);
+		g_assert (check_segment_index (segment, segment->index->root, segment->children) == NULL);
+	}
+
 	for (child = segment->children; child != NULL; child = child->next)
 	{
 		g_assert (child->parent == segment);
-		g_assert (child->start_at >= segment->start_at);
-		g_assert (child->end_at <= segment->end_at);
+		g_assert (segment_start (ce, child) >= segment_start (ce, segment));
+		g_assert (segment_end (ce, child) <= segment_end (ce, segment));
 		g_assert (child->prev || child == segment->children);
 		g_assert (child->next || child == segment->last_child);
 		check_segment (ce, child);
@@ -6476,10 +11404,10 @@ check_tree (CtkSourceContextEngine *ce)
 
 	check_regex ();
 
-	g_assert (root->start_at == 0);
+	g_assert (segment_start (ce, root) == 0);
 
 	if (ce->priv->invalid_region.empty)
-		g_assert (root->end_at == ctk_text_buffer_get_char_count (ce->priv->buffer));
+		g_assert (segment_end (ce, root) == ctk_text_buffer_get_char_count (ce->priv->buffer));
 
 	g_assert (!root->parent);
 	check_segment (ce, root);
@@ -6490,27 +11418,29 @@ check_tree (CtkSourceContextEngine *ce)
 }
 
 static void
-check_segment_children (Segment *segment)
+check_segment_children (CtkSourceContextEngine *ce,
+			Segment                *segment)
 {
 	Segment *ch;
 
 	g_assert (segment != NULL);
-	check_segment_list (segment->parent);
+	check_segment_list (ce, segment->parent);
 
 	for (ch = segment->children; ch != NULL; ch = ch->next)
 	{
 		g_assert (ch->parent == segment);
-		g_assert (ch->start_at <= ch->end_at);
-		g_assert (!ch->next || ch->next->start_at >= ch->end_at);
-		g_assert (ch->start_at >= segment->start_at);
-		g_assert (ch->end_at <= segment->end_at);
+		g_assert (segment_start (ce, ch) <= segment_end (ce, ch));
+		g_assert (!ch->next || segment_start (ce, ch->next) >= segment_end (ce, ch));
+		g_assert (segment_start (ce, ch) >= segment_start (ce, segment));
+		g_assert (segment_end (ce, ch) <= segment_end (ce, segment));
 		g_assert (ch->prev || ch == segment->children);
 		g_assert (ch->next || ch == segment->last_child);
 	}
 }
 
 static void
-check_segment_list (Segment *segment)
+check_segment_list (CtkSourceContextEngine *ce,
+		    Segment                *segment)
 {
 	Segment *ch;
 
@@ -6520,8 +11450,8 @@ check_segment_list (Segment *segment)
 	for (ch = segment->children; ch != NULL; ch = ch->next)
 	{
 		g_assert (ch->parent == segment);
-		g_assert (ch->start_at <= ch->end_at);
-		g_assert (!ch->next || ch->next->start_at >= ch->end_at);
+		g_assert (segment_start (ce, ch) <= segment_end (ce, ch));
+		g_assert (!ch->next || segment_start (ce, ch->next) >= segment_end (ce, ch));
 		g_assert (ch->prev || ch == segment->children);
 		g_assert (ch->next || ch == segment->last_child);
 	}
@@ -40,6 +40,7 @@ typedef struct _CtkSourceContextReplace       CtkSourceContextReplace;
 typedef struct _CtkSourceContextClass         CtkSourceContextClass;
 typedef struct _CtkSourceContextEngineClass   CtkSourceContextEngineClass;
 typedef struct _CtkSourceContextEnginePrivate CtkSourceContextEnginePrivate;
+typedef struct _CtkSourceContextEngineStats   CtkSourceContextEngineStats;
 
 struct _CtkSourceContextEngine
 {
@@ -54,6 +55,50 @@ struct _CtkSourceContextEngineClass
 	GObjectClass parent_class;
 };
 
+/* Visible to the language parser, which saves the classes in the
+ * compiled language cache. */
+struct _CtkSourceContextClass
+{
+	gchar *name;
+	gboolean enabled;
+};
+
+struct _CtkSourceContextEngineStats
+{
+	/* Nodes of the syntax tree in use, and at most in use. */
+	guint n_segments;
+	guint peak_segments;
+	guint n_sub_patterns;
+	guint peak_sub_patterns;
+
+	/* Nodes taken from the node pools, and chunks of nodes taken
+	 * from the system allocator by the pools. */
+	guint64 n_node_allocations;
+	guint n_chunk_allocations;
+
+	/* Lookups in the highlight cache which restored the tree, and
+	 * which did not find it. */
+	guint n_cache_hits;
+	guint n_cache_misses;
+
+	/* Trees built in a thread which replaced the tree of the buffer,
+	 * see CtkSourceBuffer:highlight-in-thread, and whether such an
+	 * analysis is running or scheduled. */
+	guint n_thread_analyses;
+	gboolean thread_analysis_pending;
+
+	/* Whether the analysis stopped in the middle of a long line, and
+	 * how many times it went on with the line kept from the previous
+	 * time slice. */
+	gboolean long_line_pending;
+	guint n_long_line_resumes;
+
+	/* Lookups of end regexes resolved from start matches, shared by
+	 * all the buffers using the language, see resolved_end_lookup(). */
+	guint n_resolved_end_hits;
+	guint n_resolved_end_misses;
+};
+
 typedef enum _CtkSourceContextFlags {
 	CTK_SOURCE_CONTEXT_EXTEND_PARENT	= 1 << 0,
 	CTK_SOURCE_CONTEXT_END_PARENT		= 1 << 1,
@@ -91,6 +136,16 @@ void			 ctk_source_context_class_free			(CtkSourceContextClass	 *cclass);
 G_GNUC_INTERNAL
 CtkSourceContextEngine	*_ctk_source_context_engine_new			(CtkSourceContextData	 *data);
 
+G_GNUC_INTERNAL
+CtkSourceContextEngine	*_ctk_source_context_engine_new_mirror		(CtkSourceContextEngine	 *source);
+
+G_GNUC_INTERNAL
+void			 _ctk_source_context_engine_get_stats		(CtkSourceContextEngine	 *ce,
+									 CtkSourceContextEngineStats *stats);
+
+G_GNUC_INTERNAL
+void			 _ctk_source_context_engine_dump_profile	(CtkSourceContextEngine	 *ce);
+
 G_GNUC_INTERNAL
 gboolean		 _ctk_source_context_data_define_context	(CtkSourceContextData	 *data,
 									 const gchar		 *id,
@@ -134,6 +189,10 @@ gboolean		 _ctk_source_context_data_finish_parse		(CtkSourceContextData	 *data,
 									 GList                   *overrides,
 									 GError			**error);
 
+G_GNUC_INTERNAL
+void			 _ctk_source_context_data_set_files		(CtkSourceContextData	 *data,
+									 GVariant		 *files);
+
 /* Only for lang files version 1, do not use it */
 G_GNUC_INTERNAL
 void			 _ctk_source_context_data_set_escape_char	(CtkSourceContextData	 *data,
@@ -96,3 +96,86 @@ _ctk_source_engine_set_style_scheme (CtkSourceEngine      *engine,
 
 	CTK_SOURCE_ENGINE_GET_INTERFACE (engine)->set_style_scheme (engine, scheme);
 }
+
+void
+_ctk_source_engine_text_loaded (CtkSourceEngine *engine)
+{
+	g_return_if_fail (CTK_SOURCE_IS_ENGINE (engine));
+
+	if (CTK_SOURCE_ENGINE_GET_INTERFACE (engine)->text_loaded != NULL)
+	{
+		CTK_SOURCE_ENGINE_GET_INTERFACE (engine)->text_loaded (engine);
+	}
+}
+
+void
+_ctk_source_engine_freeze (CtkSourceEngine *engine)
+{
+	g_return_if_fail (CTK_SOURCE_IS_ENGINE (engine));
+
+	if (CTK_SOURCE_ENGINE_GET_INTERFACE (engine)->freeze != NULL)
+	{
+		CTK_SOURCE_ENGINE_GET_INTERFACE (engine)->freeze (engine);
+	}
+}
+
+void
+_ctk_source_engine_thaw (CtkSourceEngine *engine)
+{
+	g_return_if_fail (CTK_SOURCE_IS_ENGINE (engine));
+
+	if (CTK_SOURCE_ENGINE_GET_INTERFACE (engine)->thaw != NULL)
+	{
+		CTK_SOURCE_ENGINE_GET_INTERFACE (engine)->thaw (engine);
+	}
+}
+
+gchar **
+_ctk_source_engine_get_context_classes (CtkSourceEngine   *engine,
+					const CtkTextIter *iter)
+{
+	g_return_val_if_fail (CTK_SOURCE_IS_ENGINE (engine), NULL);
+	g_return_val_if_fail (iter != NULL, NULL);
+	g_return_val_if_fail (CTK_SOURCE_ENGINE_GET_INTERFACE (engine)->get_context_classes != NULL, NULL);
+
+	return CTK_SOURCE_ENGINE_GET_INTERFACE (engine)->get_context_classes (engine, iter);
+}
+
+gboolean
+_ctk_source_engine_has_context_class (CtkSourceEngine   *engine,
+				      const CtkTextIter *iter,
+				      const gchar       *context_class)
+{
+	g_return_val_if_fail (CTK_SOURCE_IS_ENGINE (engine), FALSE);
+	g_return_val_if_fail (iter != NULL, FALSE);
+	g_return_val_if_fail (context_class != NULL, FALSE);
+	g_return_val_if_fail (CTK_SOURCE_ENGINE_GET_INTERFACE (engine)->has_context_class != NULL, FALSE);
+
+	return CTK_SOURCE_ENGINE_GET_INTERFACE (engine)->has_context_class (engine, iter, context_class);
+}
+
+gboolean
+_ctk_source_engine_forward_to_context_class_toggle (CtkSourceEngine *engine,
+						    CtkTextIter     *iter,
+						    const gchar     *context_class)
+{
+	g_return_val_if_fail (CTK_SOURCE_IS_ENGINE (engine), FALSE);
+	g_return_val_if_fail (iter != NULL, FALSE);
+	g_return_val_if_fail (context_class != NULL, FALSE);
+	g_return_val_if_fail (CTK_SOURCE_ENGINE_GET_INTERFACE (engine)->forward_to_context_class_toggle != NULL, FALSE);
+
+	return CTK_SOURCE_ENGINE_GET_INTERFACE (engine)->forward_to_context_class_toggle (engine, iter, context_class);
+}
+
+gboolean
+_ctk_source_engine_backward_to_context_class_toggle (CtkSourceEngine *engine,
+						     CtkTextIter     *iter,
+						     const gchar     *context_class)
+{
+	g_return_val_if_fail (CTK_SOURCE_IS_ENGINE (engine), FALSE);
+	g_return_val_if_fail (iter != NULL, FALSE);
+	g_return_val_if_fail (context_class != NULL, FALSE);
+	g_return_val_if_fail (CTK_SOURCE_ENGINE_GET_INTERFACE (engine)->backward_to_context_class_toggle != NULL, FALSE);
+
+	return CTK_SOURCE_ENGINE_GET_INTERFACE (engine)->backward_to_context_class_toggle (engine, iter, context_class);
+}
@@ -55,6 +55,27 @@ struct _CtkSourceEngineInterface
 
 	void     (* set_style_scheme) (CtkSourceEngine      *engine,
 				       CtkSourceStyleScheme *scheme);
+
+	void     (* text_loaded)      (CtkSourceEngine      *engine);
+
+	void     (* freeze)           (CtkSourceEngine      *engine);
+	void     (* thaw)             (CtkSourceEngine      *engine);
+
+	gchar ** (* get_context_classes)
+				      (CtkSourceEngine      *engine,
+				       const CtkTextIter    *iter);
+	gboolean (* has_context_class)
+				      (CtkSourceEngine      *engine,
+				       const CtkTextIter    *iter,
+				       const gchar          *context_class);
+	gboolean (* forward_to_context_class_toggle)
+				      (CtkSourceEngine      *engine,
+				       CtkTextIter          *iter,
+				       const gchar          *context_class);
+	gboolean (* backward_to_context_class_toggle)
+				      (CtkSourceEngine      *engine,
+				       CtkTextIter          *iter,
+				       const gchar          *context_class);
 };
 
 G_GNUC_INTERNAL
@@ -84,6 +105,38 @@ G_GNUC_INTERNAL
 void        _ctk_source_engine_set_style_scheme	(CtkSourceEngine      *engine,
 						 CtkSourceStyleScheme *scheme);
 
+G_GNUC_INTERNAL
+void        _ctk_source_engine_text_loaded	(CtkSourceEngine      *engine);
+
+G_GNUC_INTERNAL
+void        _ctk_source_engine_freeze		(CtkSourceEngine      *engine);
+
+G_GNUC_INTERNAL
+void        _ctk_source_engine_thaw		(CtkSourceEngine      *engine);
+
+G_GNUC_INTERNAL
+gchar     **_ctk_source_engine_get_context_classes
+						(CtkSourceEngine      *engine,
+						 const CtkTextIter    *iter);
+
+G_GNUC_INTERNAL
+gboolean    _ctk_source_engine_has_context_class
+						(CtkSourceEngine      *engine,
+						 const CtkTextIter    *iter,
+						 const gchar          *context_class);
+
+G_GNUC_INTERNAL
+gboolean    _ctk_source_engine_forward_to_context_class_toggle
+						(CtkSourceEngine      *engine,
+						 CtkTextIter          *iter,
+						 const gchar          *context_class);
+
+G_GNUC_INTERNAL
+gboolean    _ctk_source_engine_backward_to_context_class_toggle
+						(CtkSourceEngine      *engine,
+						 CtkTextIter          *iter,
+						 const gchar          *context_class);
+
 G_END_DECLS
 
 #endif /* CTK_SOURCE_ENGINE_H */
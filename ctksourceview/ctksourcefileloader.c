@@ -28,6 +28,7 @@
 #include "ctksourcefileloader.h"
 #include <glib/gi18n-lib.h>
 #include "ctksourcebuffer.h"
+#include "ctksourcebuffer-private.h"
 #include "ctksourcefile.h"
 #include "ctksourcebufferoutputstream.h"
 #include "ctksourceencoding.h"
@@ -1272,6 +1273,11 @@ ctk_source_file_loader_load_finish (CtkSourceFileLoader  *loader,
 		}
 	}
 
+	if (ok && loader->priv->source_buffer != NULL)
+	{
+		_ctk_source_buffer_text_loaded (loader->priv->source_buffer);
+	}
+
 	g_clear_object (&loader->priv->task);
 
 	if (real_error != NULL)
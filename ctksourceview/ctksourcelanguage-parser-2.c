@@ -36,11 +36,13 @@
 #include "ctksourcelanguage.h"
 #include "ctksourcelanguage-private.h"
 #include "ctksourcecontextengine.h"
+#include "ctksourceversion.h"
 
 #include <glib.h>
 #include <glib/gstdio.h>
 #include <glib/gi18n-lib.h>
 
+#include <errno.h>
 #include <string.h>
 #include <fcntl.h>
 #ifdef HAVE_UNISTD_H
@@ -54,6 +56,35 @@
 #define PARSER_ERROR (parser_error_quark ())
 #define ATTR_NO_STYLE ""
 
+/* The compiled language cache stores what the parser gave to the
+ * CtkSourceContextData, once the regexes are expanded, so that a
+ * language can be loaded again without libxml2. A file contains the
+ * version, the key of the language, the parsed files with their
+ * modification time and size, the styles, the replacements, and the
+ * calls to the CtkSourceContextData in the order they were made.
+ * An operation is: kind, id, parent id, three regexes (match, start
+ * and end for a context, name and where for a sub-pattern), style,
+ * context classes, flags (or options for a reference), and whether a
+ * reference includes all the children of the context.
+ */
+#define COMPILED_VERSION	1
+#define COMPILED_OP_FORMAT	"(ymsmsmsmsmsmsa(sb)ub)"
+#define COMPILED_FORMAT		"(usa(sxx)a(smsms)a(ss)a" COMPILED_OP_FORMAT ")"
+
+typedef enum _CompiledOp {
+	COMPILED_OP_DEFINE_CONTEXT,
+	COMPILED_OP_ADD_SUB_PATTERN,
+	COMPILED_OP_ADD_REF
+} CompiledOp;
+
+/* What is recorded while parsing, to write the compiled cache. */
+typedef struct _CompiledRecorder
+{
+	GVariantBuilder files;
+	GVariantBuilder replacements;
+	GVariantBuilder ops;
+} CompiledRecorder;
+
 typedef enum _ParserError {
 	PARSER_ERROR_CANNOT_OPEN     = 0,
 	PARSER_ERROR_CANNOT_VALIDATE,
@@ -104,6 +135,9 @@ struct _ParserState
 	 * so parser_state only adds stuff to it */
 	GQueue *replacements;
 
+	/* Shared by all the files parsed for the language */
+	CompiledRecorder *recorder;
+
 	/* A serial number incremented to get unique generated names */
 	guint id_cookie;
 
@@ -113,6 +147,10 @@ struct _ParserState
 	gchar *opening_delimiter;
 	gchar *closing_delimiter;
 
+	/* The content of <keyword-char-class>, or NULL if the default
+	 * delimiters (\b) are used. */
+	gchar *keyword_char_class;
+
 	GError *error;
 };
 
@@ -132,6 +170,7 @@ static ParserState *parser_state_new           (CtkSourceLanguage      *language
                                                 GHashTable             *defined_regexes,
                                                 GHashTable             *styles_mapping,
 						GQueue                 *replacements,
+						CompiledRecorder       *recorder,
                                                 xmlTextReader          *reader,
 						const char             *filename,
                                                 GHashTable             *loaded_lang_ids);
@@ -144,6 +183,7 @@ static gboolean   file_parse                   (gchar                  *filename
                                                 GHashTable             *styles,
                                                 GHashTable             *loaded_lang_ids,
 						GQueue                 *replacements,
+						CompiledRecorder       *recorder,
                                                 GError                **error);
 
 static GRegexCompileFlags
@@ -351,6 +391,325 @@ parse_classes (ParserState *parser_state)
 	return ret;
 }
 
+/* Whether @keyword is a plain word, which does not need to be escaped
+ * and can be put in a keyword trie.
+ */
+static gboolean
+keyword_is_plain_word (const gchar *keyword)
+{
+	const gchar *p;
+
+	if (*keyword == '\0')
+		return FALSE;
+
+	for (p = keyword; *p != '\0'; p++)
+	{
+		if (!g_ascii_isalnum (*p) && *p != '_')
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
+static gint
+compare_keywords (gconstpointer a,
+		  gconstpointer b)
+{
+	return strcmp (*(const gchar **) a, *(const gchar **) b);
+}
+
+/* Appends to @regex a pattern matching the sorted @keywords, which share
+ * their first @depth characters, factoring out the common prefixes.
+ * E.g. "char", "const", "continue" become "c(?:har|on(?:st|tinue))".
+ */
+static void
+append_keyword_trie (GString      *regex,
+		     const gchar **keywords,
+		     guint         n_keywords,
+		     guint         depth)
+{
+	gboolean terminal = FALSE;
+	guint n_branches = 0;
+	guint first;
+	guint start;
+	guint end;
+
+	/* Since the keywords are sorted, the ones ending here come first. */
+	for (first = 0; first < n_keywords && keywords[first][depth] == '\0'; first++)
+		terminal = TRUE;
+
+	if (first == n_keywords)
+		return;
+
+	for (start = first; start < n_keywords; start = end)
+	{
+		for (end = start + 1;
+		     end < n_keywords && keywords[end][depth] == keywords[start][depth];
+		     end++) ;
+
+		n_branches++;
+	}
+
+	if (!terminal && n_branches == 1)
+	{
+		g_string_append_c (regex, keywords[first][depth]);
+		append_keyword_trie (regex, keywords + first, n_keywords - first, depth + 1);
+		return;
+	}
+
+	g_string_append (regex, "(?:");
+
+	for (start = first; start < n_keywords; start = end)
+	{
+		for (end = start + 1;
+		     end < n_keywords && keywords[end][depth] == keywords[start][depth];
+		     end++) ;
+
+		if (start != first)
+			g_string_append_c (regex, '|');
+
+		g_string_append_c (regex, keywords[start][depth]);
+		append_keyword_trie (regex, keywords + start, end - start, depth + 1);
+	}
+
+	g_string_append (regex, terminal ? ")?" : ")");
+}
+
+/* Whether the <keyword> list can be matched with a trie instead of an
+ * alternation in the order of the file. The order of the alternatives
+ * matters only if a keyword can match where a longer one starting with
+ * it also matches; that cannot happen when the keywords are plain words
+ * made of keyword characters followed by the default closing delimiter.
+ */
+static gboolean
+keywords_can_use_trie (ParserState  *parser_state,
+		       const gchar  *suffix,
+		       GPtrArray    *keywords)
+{
+	GString *all_chars;
+	gboolean ret = TRUE;
+	guint i;
+
+	if (suffix != NULL)
+		return FALSE;
+
+	all_chars = g_string_new (NULL);
+
+	for (i = 0; i < keywords->len; i++)
+	{
+		const gchar *keyword = g_ptr_array_index (keywords, i);
+
+		if (!keyword_is_plain_word (keyword))
+		{
+			ret = FALSE;
+			break;
+		}
+
+		g_string_append (all_chars, keyword);
+	}
+
+	/* With the default delimiters the keyword characters are \w, which
+	 * includes all the plain word characters. */
+	if (ret && parser_state->keyword_char_class != NULL)
+	{
+		gchar *pattern;
+
+		pattern = g_strdup_printf ("^(?:%s)+$", parser_state->keyword_char_class);
+		ret = g_regex_match_simple (pattern, all_chars->str, 0, 0);
+		g_free (pattern);
+	}
+
+	g_string_free (all_chars, TRUE);
+
+	return ret;
+}
+
+static gchar *
+create_keywords_regex (ParserState *parser_state,
+		       const gchar *prefix,
+		       const gchar *suffix,
+		       GPtrArray   *keywords)
+{
+	GString *all_items;
+
+	all_items = g_string_new (prefix != NULL ? prefix : parser_state->opening_delimiter);
+	g_string_append (all_items, "(");
+
+	if (keywords_can_use_trie (parser_state, suffix, keywords))
+	{
+		/* Long keyword lists (C types, SQL, PHP functions...) are much
+		 * faster to match when pcre does not have to try every
+		 * alternative in turn. */
+		g_ptr_array_sort (keywords, compare_keywords);
+		append_keyword_trie (all_items,
+				     (const gchar **) keywords->pdata,
+				     keywords->len,
+				     0);
+	}
+	else
+	{
+		guint i;
+
+		for (i = 0; i < keywords->len; i++)
+		{
+			if (i > 0)
+				g_string_append (all_items, "|");
+			g_string_append (all_items, g_ptr_array_index (keywords, i));
+		}
+	}
+
+	g_string_append (all_items, ")");
+	g_string_append (all_items, suffix != NULL ? suffix : parser_state->closing_delimiter);
+
+	return g_string_free (all_items, FALSE);
+}
+
+static GVariant *
+context_classes_to_variant (GSList *context_classes)
+{
+	GVariantBuilder builder;
+	GSList *l;
+
+	g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(sb)"));
+
+	for (l = context_classes; l != NULL; l = l->next)
+	{
+		CtkSourceContextClass *cclass = l->data;
+
+		g_variant_builder_add (&builder, "(sb)", cclass->name, cclass->enabled);
+	}
+
+	return g_variant_builder_end (&builder);
+}
+
+/* define_context(), add_sub_pattern() and add_context_ref() forward to
+ * the CtkSourceContextData and record what they did in the compiled
+ * cache. */
+static gboolean
+define_context (ParserState            *parser_state,
+		const gchar            *id,
+		const gchar            *parent_id,
+		const gchar            *match_regex,
+		const gchar            *start_regex,
+		const gchar            *end_regex,
+		const gchar            *style,
+		GSList                 *context_classes,
+		CtkSourceContextFlags   flags,
+		GError                **error)
+{
+	if (!_ctk_source_context_data_define_context (parser_state->ctx_data,
+						      id,
+						      parent_id,
+						      match_regex,
+						      start_regex,
+						      end_regex,
+						      style,
+						      context_classes,
+						      flags,
+						      error))
+	{
+		return FALSE;
+	}
+
+	if (parser_state->recorder != NULL)
+	{
+		g_variant_builder_add (&parser_state->recorder->ops,
+				       "(ymsmsmsmsmsms@a(sb)ub)",
+				       COMPILED_OP_DEFINE_CONTEXT,
+				       id,
+				       parent_id,
+				       match_regex,
+				       start_regex,
+				       end_regex,
+				       style,
+				       context_classes_to_variant (context_classes),
+				       (guint32) flags,
+				       FALSE);
+	}
+
+	return TRUE;
+}
+
+static gboolean
+add_sub_pattern (ParserState  *parser_state,
+		 const gchar  *id,
+		 const gchar  *parent_id,
+		 const gchar  *name,
+		 const gchar  *where,
+		 const gchar  *style,
+		 GSList       *context_classes,
+		 GError      **error)
+{
+	if (!_ctk_source_context_data_add_sub_pattern (parser_state->ctx_data,
+						       id,
+						       parent_id,
+						       name,
+						       where,
+						       style,
+						       context_classes,
+						       error))
+	{
+		return FALSE;
+	}
+
+	if (parser_state->recorder != NULL)
+	{
+		g_variant_builder_add (&parser_state->recorder->ops,
+				       "(ymsmsmsmsmsms@a(sb)ub)",
+				       COMPILED_OP_ADD_SUB_PATTERN,
+				       id,
+				       parent_id,
+				       name,
+				       where,
+				       NULL,
+				       style,
+				       context_classes_to_variant (context_classes),
+				       0,
+				       FALSE);
+	}
+
+	return TRUE;
+}
+
+static gboolean
+add_context_ref (ParserState                 *parser_state,
+		 const gchar                 *parent_id,
+		 const gchar                 *ref_id,
+		 CtkSourceContextRefOptions   options,
+		 const gchar                 *style,
+		 gboolean                     all,
+		 GError                     **error)
+{
+	if (!_ctk_source_context_data_add_ref (parser_state->ctx_data,
+					       parent_id,
+					       ref_id,
+					       options,
+					       style,
+					       all,
+					       error))
+	{
+		return FALSE;
+	}
+
+	if (parser_state->recorder != NULL)
+	{
+		g_variant_builder_add (&parser_state->recorder->ops,
+				       "(ymsmsmsmsmsms@a(sb)ub)",
+				       COMPILED_OP_ADD_REF,
+				       ref_id,
+				       parent_id,
+				       NULL,
+				       NULL,
+				       NULL,
+				       style,
+				       context_classes_to_variant (NULL),
+				       (guint32) options,
+				       all);
+	}
+
+	return TRUE;
+}
+
 static gboolean
 create_definition (ParserState *parser_state,
 		   gchar       *id,
@@ -365,7 +724,7 @@ create_definition (ParserState *parser_state,
 
 	xmlNode *context_node, *child;
 
-	GString *all_items = NULL;
+	GPtrArray *keywords = NULL;
 
 	GRegexCompileFlags match_flags = 0, start_flags = 0, end_flags = 0;
 
@@ -454,39 +813,19 @@ create_definition (ParserState *parser_state,
 			 * important, but would be nice (case-sensitive). */
 
 			/* <keyword> */
-			if (all_items == NULL)
-			{
-				all_items = g_string_new (NULL);
-
-				if (prefix != NULL)
-					g_string_append (all_items, prefix);
-				else
-					g_string_append (all_items,
-							 parser_state->opening_delimiter);
+			if (keywords == NULL)
+				keywords = g_ptr_array_new ();
 
-				g_string_append (all_items, "(");
-				g_string_append (all_items, (gchar*) child->children->content);
-			}
-			else
-			{
-				g_string_append (all_items, "|");
-				g_string_append (all_items, (gchar*) child->children->content);
-			}
+			g_ptr_array_add (keywords, child->children->content);
 		}
 	}
 
-	if (all_items != NULL)
+	if (keywords != NULL)
 	{
-		g_string_append (all_items, ")");
-
-		if (suffix != NULL)
-			g_string_append (all_items, suffix);
-		else
-			g_string_append (all_items,
-					 parser_state->closing_delimiter);
-
-		match = g_string_free (all_items, FALSE);
+		match = create_keywords_regex (parser_state, prefix, suffix, keywords);
 		match_flags = parser_state->regex_compile_flags;
+
+		g_ptr_array_free (keywords, TRUE);
 	}
 
 	DEBUG (g_message ("start: '%s'", start ? start : "(null)"));
@@ -518,16 +857,16 @@ create_definition (ParserState *parser_state,
 
 	if (tmp_error == NULL)
 	{
-		_ctk_source_context_data_define_context (parser_state->ctx_data,
-							 id,
-							 parent_id,
-							 match,
-							 start,
-							 end,
-							 style,
-							 context_classes,
-							 flags,
-							 &tmp_error);
+		define_context (parser_state,
+				id,
+				parent_id,
+				match,
+				start,
+				end,
+				style,
+				context_classes,
+				flags,
+				&tmp_error);
 	}
 
 	g_free (match);
@@ -587,6 +926,7 @@ add_ref (ParserState               *parser_state,
 					    parser_state->styles_mapping,
 					    parser_state->loaded_lang_ids,
 					    parser_state->replacements,
+					    parser_state->recorder,
 					    &tmp_error);
 
 				if (tmp_error != NULL)
@@ -636,13 +976,13 @@ add_ref (ParserState               *parser_state,
 		/* If the document is validated container_id is never NULL */
 		g_assert (container_id);
 
-		_ctk_source_context_data_add_ref (parser_state->ctx_data,
-						  container_id,
-						  ref_id,
-						  options,
-						  style,
-						  all,
-						  &tmp_error);
+		add_context_ref (parser_state,
+				 container_id,
+				 ref_id,
+				 options,
+				 style,
+				 all,
+				 &tmp_error);
 
 		DEBUG (g_message ("appended %s in %s", ref_id, container_id));
 	}
@@ -681,14 +1021,14 @@ create_sub_pattern (ParserState  *parser_state,
 
 	where = xmlTextReaderGetAttribute (parser_state->reader, BAD_CAST "where");
 
-	_ctk_source_context_data_add_sub_pattern (parser_state->ctx_data,
-						  id,
-						  container_id,
-						  sub_pattern,
-						  (gchar*) where,
-						  style,
-						  context_classes,
-						  &tmp_error);
+	add_sub_pattern (parser_state,
+			 id,
+			 container_id,
+			 sub_pattern,
+			 (gchar*) where,
+			 style,
+			 context_classes,
+			 &tmp_error);
 
 	xmlFree (where);
 
@@ -819,16 +1159,16 @@ handle_context_element (ParserState *parser_state)
 						parser_state->reader);
 
 				if (is_empty)
-					success = _ctk_source_context_data_define_context (parser_state->ctx_data,
-											   id,
-											   parent_id,
-											   "$^",
-											   NULL,
-											   NULL,
-											   NULL,
-											   NULL,
-											   0,
-											   &tmp_error);
+					success = define_context (parser_state,
+								  id,
+								  parent_id,
+								  "$^",
+								  NULL,
+								  NULL,
+								  NULL,
+								  NULL,
+								  0,
+								  &tmp_error);
 				else
 					success = create_definition (parser_state,
 					                             id,
@@ -879,6 +1219,12 @@ handle_replace_element (ParserState *parser_state)
 	repl = _ctk_source_context_replace_new ((const gchar *) id, replace_with);
 	g_queue_push_tail (parser_state->replacements, repl);
 
+	if (parser_state->recorder != NULL)
+	{
+		g_variant_builder_add (&parser_state->recorder->replacements, "(ss)",
+				       (const gchar *) id, replace_with);
+	}
+
 	g_free (replace_with);
 	xmlFree (ref);
 	xmlFree (id);
@@ -1369,6 +1715,7 @@ parse_language_with_id (ParserState *parser_state,
 			    parser_state->styles_mapping,
 			    parser_state->loaded_lang_ids,
 			    parser_state->replacements,
+			    parser_state->recorder,
 			    &parser_state->error);
 	}
 }
@@ -1500,6 +1847,9 @@ handle_keyword_char_class_element (ParserState *parser_state)
 	parser_state->closing_delimiter = g_strdup_printf ("(?<=%s)(?!%s)",
 							   char_class, char_class);
 
+	g_free (parser_state->keyword_char_class);
+	parser_state->keyword_char_class = g_strdup ((gchar *) char_class);
+
 	xmlFree (char_class);
 }
 
@@ -1608,6 +1958,7 @@ file_parse (gchar                     *filename,
 	    GHashTable                *styles,
 	    GHashTable                *loaded_lang_ids,
 	    GQueue                    *replacements,
+	    CompiledRecorder          *recorder,
 	    GError                   **error)
 {
 	ParserState *parser_state;
@@ -1638,6 +1989,19 @@ file_parse (gchar                     *filename,
 		goto error;
 	}
 
+	if (recorder != NULL)
+	{
+		GStatBuf buf;
+
+		if (g_stat (filename, &buf) == 0)
+		{
+			g_variant_builder_add (&recorder->files, "(sxx)",
+					       filename,
+					       (gint64) buf.st_mtime,
+					       (gint64) buf.st_size);
+		}
+	}
+
 	lm = _ctk_source_language_get_language_manager (language);
 	rng_lang_schema = _ctk_source_language_manager_get_rng_file (lm);
 
@@ -1662,7 +2026,7 @@ file_parse (gchar                     *filename,
 
 	parser_state = parser_state_new (language, ctx_data,
 					 defined_regexes, styles,
-					 replacements, reader,
+					 replacements, recorder, reader,
 					 filename, loaded_lang_ids);
 	xmlTextReaderSetStructuredErrorHandler (reader,
 						(xmlStructuredErrorFunc) text_reader_structured_error_func,
@@ -1722,6 +2086,7 @@ parser_state_new (CtkSourceLanguage       *language,
 		  GHashTable              *defined_regexes,
 		  GHashTable              *styles_mapping,
 		  GQueue                  *replacements,
+		  CompiledRecorder        *recorder,
 		  xmlTextReader	          *reader,
 		  const char              *filename,
 		  GHashTable              *loaded_lang_ids)
@@ -1747,6 +2112,7 @@ parser_state_new (CtkSourceLanguage       *language,
 	parser_state->defined_regexes = defined_regexes;
 	parser_state->styles_mapping = styles_mapping;
 	parser_state->replacements = replacements;
+	parser_state->recorder = recorder;
 
 	parser_state->loaded_lang_ids = loaded_lang_ids;
 
@@ -1771,6 +2137,7 @@ parser_state_destroy (ParserState *parser_state)
 
 	g_free (parser_state->opening_delimiter);
 	g_free (parser_state->closing_delimiter);
+	g_free (parser_state->keyword_char_class);
 
 	g_free (parser_state->language_decoration);
 	g_free (parser_state->filename);
@@ -1787,6 +2154,409 @@ steal_styles_mapping (gchar              *style_id,
 	return TRUE;
 }
 
+static gchar *
+get_compiled_dir (void)
+{
+	return g_build_filename (g_get_user_cache_dir (),
+				 "ctksourceview-" GSV_API_VERSION_S,
+				 "languages",
+				 NULL);
+}
+
+/* Everything the result of the parsing depends on, besides the content
+ * of the parsed files: the library, the language manager search path and
+ * the file it found for each language id (where the referenced languages
+ * are found, a file added to a directory of the search path can shadow
+ * one which was parsed), and the locale (the style names are translated).
+ */
+static gchar *
+get_compiled_key (CtkSourceLanguage *language)
+{
+	CtkSourceLanguageManager *lm;
+	const gchar * const *search_path;
+	const gchar * const *ids;
+	gchar *joined_search_path;
+	gchar *joined_languages;
+	GString *lang_files;
+	gchar *key;
+	gint i;
+
+	lm = _ctk_source_language_get_language_manager (language);
+	search_path = ctk_source_language_manager_get_search_path (lm);
+	ids = ctk_source_language_manager_get_language_ids (lm);
+
+	joined_search_path = g_strjoinv (":", (gchar **) search_path);
+	joined_languages = g_strjoinv (":", (gchar **) g_get_language_names ());
+
+	lang_files = g_string_new (NULL);
+
+	for (i = 0; ids != NULL && ids[i] != NULL; i++)
+	{
+		CtkSourceLanguage *other;
+
+		other = ctk_source_language_manager_get_language (lm, ids[i]);
+
+		g_string_append_printf (lang_files, "%s=%s\n",
+					ids[i],
+					other != NULL && other->priv->lang_file_name != NULL ?
+					other->priv->lang_file_name : "");
+	}
+
+	key = g_strdup_printf ("%d.%d.%d\n%s\n%s\n%s\n%s\n%s",
+			       CTK_SOURCE_MAJOR_VERSION,
+			       CTK_SOURCE_MINOR_VERSION,
+			       CTK_SOURCE_MICRO_VERSION,
+			       language->priv->id,
+			       language->priv->lang_file_name,
+			       joined_search_path,
+			       joined_languages,
+			       lang_files->str);
+
+	g_string_free (lang_files, TRUE);
+	g_free (joined_search_path);
+	g_free (joined_languages);
+
+	return key;
+}
+
+static gchar *
+get_compiled_filename (const gchar *key)
+{
+	gchar *dir;
+	gchar *name;
+	gchar *filename;
+
+	dir = get_compiled_dir ();
+	name = g_compute_checksum_for_string (G_CHECKSUM_SHA256, key, -1);
+	filename = g_build_filename (dir, name, NULL);
+
+	g_free (name);
+	g_free (dir);
+
+	return filename;
+}
+
+static void
+save_compiled (CtkSourceLanguage *language,
+	       CompiledRecorder  *recorder,
+	       GVariant          *files,
+	       GHashTable        *styles)
+{
+	GVariantBuilder styles_builder;
+	GHashTableIter iter;
+	gpointer key, value;
+	GVariant *variant;
+	gchar *compiled_key;
+	gchar *filename;
+	gchar *dir;
+	GError *error = NULL;
+
+	g_variant_builder_init (&styles_builder, G_VARIANT_TYPE ("a(smsms)"));
+
+	g_hash_table_iter_init (&iter, styles);
+	while (g_hash_table_iter_next (&iter, &key, &value))
+	{
+		CtkSourceStyleInfo *info = value;
+
+		g_variant_builder_add (&styles_builder, "(smsms)",
+				       key,
+				       info->name,
+				       info->map_to);
+	}
+
+	compiled_key = get_compiled_key (language);
+
+	variant = g_variant_new ("(us@a(sxx)a(smsms)a(ss)a" COMPILED_OP_FORMAT ")",
+				 COMPILED_VERSION,
+				 compiled_key,
+				 files,
+				 &styles_builder,
+				 &recorder->replacements,
+				 &recorder->ops);
+	g_variant_ref_sink (variant);
+
+	dir = get_compiled_dir ();
+	filename = get_compiled_filename (compiled_key);
+
+	if (g_mkdir_with_parents (dir, 0700) != 0 ||
+	    !g_file_set_contents (filename,
+				  g_variant_get_data (variant),
+				  g_variant_get_size (variant),
+				  &error))
+	{
+		g_debug ("could not write the compiled language file '%s': %s",
+			 filename,
+			 error != NULL ? error->message : g_strerror (errno));
+		g_clear_error (&error);
+	}
+
+	g_variant_unref (variant);
+	g_free (filename);
+	g_free (dir);
+	g_free (compiled_key);
+}
+
+/* Whether none of the files parsed to build the cache has changed. */
+static gboolean
+compiled_files_are_current (GVariant *files)
+{
+	GVariantIter iter;
+	const gchar *filename;
+	gint64 mtime;
+	gint64 size;
+
+	if (g_variant_n_children (files) == 0)
+		return FALSE;
+
+	g_variant_iter_init (&iter, files);
+	while (g_variant_iter_next (&iter, "(&sxx)", &filename, &mtime, &size))
+	{
+		GStatBuf buf;
+
+		if (g_stat (filename, &buf) != 0 ||
+		    (gint64) buf.st_mtime != mtime ||
+		    (gint64) buf.st_size != size)
+		{
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+static GSList *
+context_classes_from_variant (GVariant *variant)
+{
+	GSList *context_classes = NULL;
+	GVariantIter iter;
+	const gchar *name;
+	gboolean enabled;
+
+	g_variant_iter_init (&iter, variant);
+	while (g_variant_iter_next (&iter, "(&sb)", &name, &enabled))
+	{
+		context_classes = g_slist_prepend (context_classes,
+						   ctk_source_context_class_new (name, enabled));
+	}
+
+	return g_slist_reverse (context_classes);
+}
+
+/* Replays the recorded operations on @ctx_data. */
+static gboolean
+replay_compiled_ops (CtkSourceContextData  *ctx_data,
+		     GVariant              *ops,
+		     GError               **error)
+{
+	GVariantIter iter;
+	guchar kind;
+	const gchar *id, *parent_id, *regex1, *regex2, *regex3, *style;
+	GVariant *classes;
+	guint32 flags;
+	gboolean all;
+	gboolean success = TRUE;
+
+	g_variant_iter_init (&iter, ops);
+	while (success &&
+	       g_variant_iter_next (&iter, "(ym&sm&sm&sm&sm&sm&s@a(sb)ub)",
+				    &kind, &id, &parent_id, &regex1, &regex2,
+				    &regex3, &style, &classes, &flags, &all))
+	{
+		GSList *context_classes;
+
+		context_classes = context_classes_from_variant (classes);
+		g_variant_unref (classes);
+
+		if (id == NULL)
+		{
+			kind = G_MAXUINT8;
+		}
+
+		switch (kind)
+		{
+			case COMPILED_OP_DEFINE_CONTEXT:
+				success = _ctk_source_context_data_define_context (ctx_data,
+										   id,
+										   parent_id,
+										   regex1,
+										   regex2,
+										   regex3,
+										   style,
+										   context_classes,
+										   flags,
+										   error);
+				break;
+
+			case COMPILED_OP_ADD_SUB_PATTERN:
+			case COMPILED_OP_ADD_REF:
+				if (parent_id == NULL)
+				{
+					success = FALSE;
+				}
+				else if (kind == COMPILED_OP_ADD_SUB_PATTERN)
+				{
+					success = _ctk_source_context_data_add_sub_pattern (ctx_data,
+											    id,
+											    parent_id,
+											    regex1,
+											    regex2,
+											    style,
+											    context_classes,
+											    error);
+				}
+				else
+				{
+					success = _ctk_source_context_data_add_ref (ctx_data,
+										    parent_id,
+										    id,
+										    flags,
+										    style,
+										    all,
+										    error);
+				}
+				break;
+
+			default:
+				success = FALSE;
+				break;
+		}
+
+		g_slist_free_full (context_classes, (GDestroyNotify) ctk_source_context_class_free);
+
+		if (!success && error != NULL && *error == NULL)
+		{
+			g_set_error (error,
+				     PARSER_ERROR,
+				     PARSER_ERROR_INVALID_DOC,
+				     "invalid operation in the compiled language file");
+		}
+	}
+
+	return success;
+}
+
+/**
+ * _ctk_source_language_file_load_compiled:
+ * @language: a #CtkSourceLanguage.
+ * @ctx_data: a new #CtkSourceContextData for @language.
+ *
+ * Loads @language from the compiled cache written by
+ * _ctk_source_language_file_parse_version2(), if it is there and none
+ * of the language files it was built from has changed.
+ *
+ * If %FALSE is returned, @ctx_data may contain part of the definitions
+ * and must not be used for parsing.
+ *
+ * Returns: whether @language was loaded.
+ */
+gboolean
+_ctk_source_language_file_load_compiled (CtkSourceLanguage    *language,
+					 CtkSourceContextData *ctx_data)
+{
+	GMappedFile *mapped_file;
+	GBytes *bytes;
+	GVariant *variant;
+	GVariant *files = NULL;
+	GVariant *styles = NULL;
+	GVariant *replacements_variant = NULL;
+	GVariant *ops = NULL;
+	guint32 version;
+	const gchar *file_key;
+	gchar *key;
+	gchar *filename;
+	gboolean success = FALSE;
+	GError *error = NULL;
+
+	g_return_val_if_fail (ctx_data != NULL, FALSE);
+
+	if (language->priv->lang_file_name == NULL)
+		return FALSE;
+
+	key = get_compiled_key (language);
+	filename = get_compiled_filename (key);
+
+	mapped_file = g_mapped_file_new (filename, FALSE, NULL);
+
+	if (mapped_file == NULL)
+	{
+		g_free (filename);
+		g_free (key);
+		return FALSE;
+	}
+
+	bytes = g_mapped_file_get_bytes (mapped_file);
+	g_mapped_file_unref (mapped_file);
+
+	variant = g_variant_new_from_bytes (G_VARIANT_TYPE (COMPILED_FORMAT), bytes, FALSE);
+	g_variant_ref_sink (variant);
+	g_bytes_unref (bytes);
+
+	g_variant_get (variant, "(u&s@a(sxx)@a(smsms)@a(ss)@a" COMPILED_OP_FORMAT ")",
+		       &version, &file_key, &files, &styles,
+		       &replacements_variant, &ops);
+
+	if (version == COMPILED_VERSION &&
+	    g_str_equal (file_key, key) &&
+	    compiled_files_are_current (files))
+	{
+		GQueue *replacements;
+		GVariantIter iter;
+		const gchar *id;
+		const gchar *replace_with;
+
+		replacements = g_queue_new ();
+
+		g_variant_iter_init (&iter, replacements_variant);
+		while (g_variant_iter_next (&iter, "(&s&s)", &id, &replace_with))
+		{
+			g_queue_push_tail (replacements,
+					   _ctk_source_context_replace_new (id, replace_with));
+		}
+
+		success = replay_compiled_ops (ctx_data, ops, &error) &&
+			  _ctk_source_context_data_finish_parse (ctx_data, replacements->head, &error);
+
+		if (success)
+			_ctk_source_context_data_set_files (ctx_data, files);
+
+		g_queue_free_full (replacements, (GDestroyNotify) _ctk_source_context_replace_free);
+
+		if (error != NULL)
+		{
+			g_debug ("Failed to load the compiled language file '%s': %s",
+				 filename, error->message);
+			g_clear_error (&error);
+			g_unlink (filename);
+		}
+	}
+
+	if (success)
+	{
+		GVariantIter iter;
+		const gchar *style_id;
+		const gchar *name;
+		const gchar *map_to;
+
+		g_variant_iter_init (&iter, styles);
+		while (g_variant_iter_next (&iter, "(&sm&sm&s)", &style_id, &name, &map_to))
+		{
+			g_hash_table_insert (language->priv->styles,
+					     g_strdup (style_id),
+					     _ctk_source_style_info_new (name, map_to));
+		}
+	}
+
+	g_variant_unref (files);
+	g_variant_unref (styles);
+	g_variant_unref (replacements_variant);
+	g_variant_unref (ops);
+	g_variant_unref (variant);
+	g_free (filename);
+	g_free (key);
+
+	return success;
+}
+
 gboolean
 _ctk_source_language_file_parse_version2 (CtkSourceLanguage       *language,
 					  CtkSourceContextData    *ctx_data)
@@ -1797,6 +2567,7 @@ _ctk_source_language_file_parse_version2 (CtkSourceLanguage       *language,
 	gchar *filename;
 	GHashTable *loaded_lang_ids;
 	GQueue *replacements;
+	CompiledRecorder recorder;
 
 	g_return_val_if_fail (ctx_data != NULL, FALSE);
 
@@ -1822,18 +2593,39 @@ _ctk_source_language_file_parse_version2 (CtkSourceLanguage       *language,
 						 NULL);
 	replacements = g_queue_new ();
 
+	g_variant_builder_init (&recorder.files, G_VARIANT_TYPE ("a(sxx)"));
+	g_variant_builder_init (&recorder.replacements, G_VARIANT_TYPE ("a(ss)"));
+	g_variant_builder_init (&recorder.ops, G_VARIANT_TYPE ("a" COMPILED_OP_FORMAT));
+
 	success = file_parse (filename, language, ctx_data,
 			      defined_regexes, styles,
 			      loaded_lang_ids, replacements,
+			      &recorder,
 			      &error);
 
 	if (success)
 		success = _ctk_source_context_data_finish_parse (ctx_data, replacements->head, &error);
 
 	if (success)
+	{
+		GVariant *files;
+
+		files = g_variant_ref_sink (g_variant_builder_end (&recorder.files));
+
+		_ctk_source_context_data_set_files (ctx_data, files);
+		save_compiled (language, &recorder, files, styles);
+		g_variant_unref (files);
+
 		g_hash_table_foreach_steal (styles,
 					    (GHRFunc) steal_styles_mapping,
 					    language->priv->styles);
+	}
+	else
+	{
+		g_variant_builder_clear (&recorder.files);
+		g_variant_builder_clear (&recorder.replacements);
+		g_variant_builder_clear (&recorder.ops);
+	}
 
 	g_queue_free_full (replacements, (GDestroyNotify) _ctk_source_context_replace_free);
 	g_hash_table_destroy (loaded_lang_ids);
@@ -83,6 +83,10 @@ G_GNUC_INTERNAL
 gboolean 		  _ctk_source_language_file_parse_version2	(CtkSourceLanguage        *language,
 									 CtkSourceContextData     *ctx_data);
 
+G_GNUC_INTERNAL
+gboolean 		  _ctk_source_language_file_load_compiled	(CtkSourceLanguage        *language,
+									 CtkSourceContextData     *ctx_data);
+
 G_GNUC_INTERNAL
 CtkSourceEngine 	 *_ctk_source_language_create_engine		(CtkSourceLanguage	  *language);
 
@@ -732,7 +732,16 @@ ctk_source_language_parse_file (CtkSourceLanguage *language)
 					break;
 
 				case CTK_SOURCE_LANGUAGE_VERSION_2_0:
-					success = _ctk_source_language_file_parse_version2 (language, ctx_data);
+					success = _ctk_source_language_file_load_compiled (language, ctx_data);
+
+					if (!success)
+					{
+						/* A broken cache may have added some definitions. */
+						_ctk_source_context_data_unref (ctx_data);
+						ctx_data = _ctk_source_context_data_new (language);
+
+						success = _ctk_source_language_file_parse_version2 (language, ctx_data);
+					}
 					break;
 
 				default:
@@ -34,21 +34,45 @@
  * in particular resolving "\%{...@start}" and forbidding the use of \C.
  */
 
-/* Regex used to match "\%{...@start}". */
+/* Regex used to match "\%{...@start}".
+ * Initialized with g_once_init_enter() so that regexes can be
+ * compiled from a thread other than the main one.
+ */
 static GRegex *
 get_start_ref_regex (void)
 {
 	static GRegex *start_ref_regex = NULL;
 
-	if (start_ref_regex == NULL)
+	if (g_once_init_enter (&start_ref_regex))
 	{
-		start_ref_regex = g_regex_new ("(?<!\\\\)(\\\\\\\\)*\\\\%\\{(.*?)@start\\}",
-					       G_REGEX_OPTIMIZE, 0, NULL);
+		GRegex *regex;
+
+		regex = g_regex_new ("(?<!\\\\)(\\\\\\\\)*\\\\%\\{(.*?)@start\\}",
+				     G_REGEX_OPTIMIZE, 0, NULL);
+
+		g_once_init_leave (&start_ref_regex, regex);
 	}
 
 	return start_ref_regex;
 }
 
+/* The state of the matches of a regex in one thread: the compiled
+ * regex it uses, the last match and the last attempt of
+ * _ctk_source_regex_match_line(), on the line identified by
+ * @last_stamp, or 0.
+ */
+typedef struct _RegexMatch
+{
+	GRegex *regex;
+	GMatchInfo *match;
+
+	guint last_stamp;
+	gint last_pos;
+	gint last_start;
+	gint last_end;
+	gboolean last_result;
+} RegexMatch;
+
 struct _CtkSourceRegex
 {
 	union {
@@ -57,15 +81,78 @@ struct _CtkSourceRegex
 			GRegexCompileFlags flags;
 		} info;
 		struct {
-			GRegex *regex;
-			GMatchInfo *match;
+			/* Used by the threads which did not call
+			 * _ctk_source_regex_begin_thread_matches(),
+			 * see get_match(). Only these threads change
+			 * @own.regex, @n_matches and @optimized. */
+			RegexMatch own;
+
+			/* Where @own.regex comes from, or %NULL. */
+			struct _RegexCacheEntry *cache_entry;
+
+			/* Number of matches before @own.regex is
+			 * optimized, and what it needs to be compiled
+			 * again. */
+			guint n_matches;
+			GRegexCompileFlags flags;
+			gboolean optimized;
+
+			/* Bytes which can start a match, valid if
+			 * has_first_bytes is set. */
+			guint32 first_bytes[8];
 		} regex;
 	} u;
 
-	guint ref_count;
+	gint ref_count;
 	guint resolved : 1;
+	guint anchored : 1;
+	guint has_first_bytes : 1;
+
+	/* Whether the pattern uses \G, so that its matches depend on
+	 * where the search starts, and not only on the text. */
+	guint uses_start_anchor : 1;
 };
 
+/* Compiled regexes shared by all the regexes with the same pattern and
+ * flags, e.g. the ones of def.lang used by many languages, for as long as
+ * one of them exists. The regexes expanded by _ctk_source_regex_resolve()
+ * do not go through the cache, their patterns depend on the text.
+ */
+typedef struct _RegexCacheEntry
+{
+	gchar *pattern;
+	GRegexCompileFlags flags;
+
+	GRegex *regex;
+	guint32 first_bytes[8];
+	guint has_first_bytes : 1;
+	guint optimized : 1;
+
+	guint n_users;
+} RegexCacheEntry;
+
+/* With CTK_SOURCE_REGEX_JIT_LAZY, the number of matches after which a
+ * regex is compiled again with G_REGEX_OPTIMIZE, which enables the JIT
+ * compiler of PCRE. Most of the regexes of a language are never or
+ * seldom used, and optimizing them costs more than it saves.
+ */
+#define JIT_THRESHOLD 64
+
+static gint jit_mode = -1;
+
+static GMutex regex_cache_mutex;
+static GHashTable *regex_cache;
+static guint regex_cache_hits;
+static guint regex_cache_misses;
+
+/* The RegexMatch of each regex used by the current thread, between
+ * _ctk_source_regex_begin_thread_matches() and
+ * _ctk_source_regex_end_thread_matches(). */
+static GPrivate thread_matches = G_PRIVATE_INIT ((GDestroyNotify) g_hash_table_unref);
+
+#define BYTE_SET_ADD(set,c)	((set)[(guchar)(c) >> 5] |= 1u << ((guchar)(c) & 31))
+#define BYTE_SET_HAS(set,c)	(((set)[(guchar)(c) >> 5] & (1u << ((guchar)(c) & 31))) != 0)
+
 /* Check whether pattern contains \C escape sequence,
  * which means "single byte" in pcre and naturally leads
  * to crash if used for highlighting.
@@ -101,20 +188,748 @@ find_single_byte_escape (const gchar *string)
 	return FALSE;
 }
 
+/*
+ * First bytes of a match.
+ *
+ * To avoid calling into pcre at every position of a line where nothing can
+ * match (e.g. the body of a comment or a string), we compute from the
+ * pattern the set of bytes a match can start with. The analysis is
+ * conservative: as soon as the pattern uses something not understood
+ * below, or can match an empty string, no set is computed and pcre is
+ * always called.
+ */
+
+typedef struct
+{
+	const gchar *p;
+	guint32 *set;
+	gboolean caseless;
+} FirstBytesScan;
+
+static void
+byte_set_add_range (guint32 *set,
+		    guchar   first,
+		    guchar   last)
+{
+	guint c;
+
+	for (c = first; c <= last; c++)
+		BYTE_SET_ADD (set, c);
+}
+
+/* Lead bytes of the non-ASCII characters, which \w, \d, \s and caseless
+ * letters may match in unicode mode. */
+static void
+byte_set_add_non_ascii (guint32 *set)
+{
+	byte_set_add_range (set, 0xC0, 0xFF);
+}
+
+/* @p points after the opening parenthesis, returns the position after the
+ * matching closing one. */
+static const gchar *
+skip_group (const gchar *p)
+{
+	gint depth = 1;
+
+	while (*p != '\0')
+	{
+		switch (*p)
+		{
+			case '\\':
+				if (p[1] == '\0')
+					return NULL;
+				p += 2;
+				continue;
+			case '[':
+				p++;
+				if (*p == '^')
+					p++;
+				if (*p == ']')
+					p++;
+				while (*p != '\0' && *p != ']')
+				{
+					if (*p == '\\' && p[1] != '\0')
+						p++;
+					p++;
+				}
+				if (*p == '\0')
+					return NULL;
+				break;
+			case '(':
+				depth++;
+				break;
+			case ')':
+				if (--depth == 0)
+					return p + 1;
+				break;
+			default:
+				break;
+		}
+
+		p++;
+	}
+
+	return NULL;
+}
+
+/* Adds the bytes matched by the escape sequence at @p (after the backslash)
+ * and returns the position after it, or %NULL if not supported. */
+static const gchar *
+scan_escape (const gchar *p,
+	     guint32     *set,
+	     gboolean    *zero_width)
+{
+	*zero_width = FALSE;
+
+	switch (*p)
+	{
+		case 'b':
+		case 'B':
+		case 'A':
+			*zero_width = TRUE;
+			break;
+		case 'd':
+			byte_set_add_range (set, '0', '9');
+			byte_set_add_non_ascii (set);
+			break;
+		case 'w':
+			byte_set_add_range (set, '0', '9');
+			byte_set_add_range (set, 'a', 'z');
+			byte_set_add_range (set, 'A', 'Z');
+			BYTE_SET_ADD (set, '_');
+			byte_set_add_non_ascii (set);
+			break;
+		case 's':
+			byte_set_add_range (set, '\t', '\r');
+			BYTE_SET_ADD (set, ' ');
+			byte_set_add_non_ascii (set);
+			break;
+		case 't':
+			BYTE_SET_ADD (set, '\t');
+			break;
+		case 'n':
+			BYTE_SET_ADD (set, '\n');
+			break;
+		case 'r':
+			BYTE_SET_ADD (set, '\r');
+			break;
+		case 'f':
+			BYTE_SET_ADD (set, '\f');
+			break;
+		case 'e':
+			BYTE_SET_ADD (set, 0x1B);
+			break;
+		default:
+			/* Escaped punctuation is a literal, anything else
+			 * (back references, \x, \p, \z, \G...) is not
+			 * handled. */
+			if ((guchar) *p >= 0x80 || *p == '\0' || g_ascii_isalnum (*p))
+				return NULL;
+			BYTE_SET_ADD (set, *p);
+			break;
+	}
+
+	return p + 1;
+}
+
+/* @p points after the opening bracket. */
+static const gchar *
+scan_class (const gchar *p,
+	    guint32     *set)
+{
+	if (*p == '^')
+		return NULL;
+
+	if (*p == ']')
+	{
+		BYTE_SET_ADD (set, ']');
+		p++;
+	}
+
+	while (*p != ']')
+	{
+		if (*p == '\0' || (guchar) *p >= 0x80 || (p[0] == '[' && p[1] == ':'))
+			return NULL;
+
+		if (*p == '\\')
+		{
+			gboolean zero_width;
+
+			/* \b means backspace in a class. */
+			if (p[1] == 'b' || p[1] == 'B' || p[1] == 'A')
+				return NULL;
+
+			p = scan_escape (p + 1, set, &zero_width);
+			if (p == NULL || *p == '-')
+				return NULL;
+			continue;
+		}
+
+		if (p[1] == '-' && p[2] != ']')
+		{
+			if (p[2] == '\\' || p[2] == '\0' || (guchar) p[2] >= 0x80 || p[2] < p[0])
+				return NULL;
+			byte_set_add_range (set, p[0], p[2]);
+			p += 3;
+			continue;
+		}
+
+		BYTE_SET_ADD (set, *p);
+		p++;
+	}
+
+	return p + 1;
+}
+
+static gboolean scan_alternatives (FirstBytesScan *scan,
+				   gboolean       *can_be_empty);
+
+/* Scans one atom and its quantifier. */
+static gboolean
+scan_atom (FirstBytesScan *scan,
+	   gboolean       *zero_width,
+	   gboolean       *can_be_empty)
+{
+	const gchar *p = scan->p;
+
+	*zero_width = FALSE;
+	*can_be_empty = FALSE;
+
+	switch (*p)
+	{
+		case '^':
+			*zero_width = TRUE;
+			p++;
+			break;
+
+		case '\\':
+			p = scan_escape (p + 1, scan->set, zero_width);
+			if (p == NULL)
+				return FALSE;
+			break;
+
+		case '[':
+			p = scan_class (p + 1, scan->set);
+			if (p == NULL)
+				return FALSE;
+			break;
+
+		case '(':
+			if (p[1] != '?')
+			{
+				p++;
+			}
+			else if (p[2] == '=' || p[2] == '!' ||
+				 (p[2] == '<' && (p[3] == '=' || p[3] == '!')))
+			{
+				/* Lookaround assertions only restrict the match. */
+				*zero_width = TRUE;
+				p = skip_group (p + 1);
+				if (p == NULL)
+					return FALSE;
+				break;
+			}
+			else if (p[2] == ':' || p[2] == '>' || p[2] == '|')
+			{
+				p += 3;
+			}
+			else if (p[2] == '<' || p[2] == '\'' || (p[2] == 'P' && p[3] == '<'))
+			{
+				/* Named group. */
+				gchar close = p[2] == '\'' ? '\'' : '>';
+
+				p = strchr (p + 3, close);
+				if (p == NULL)
+					return FALSE;
+				p++;
+			}
+			else
+			{
+				/* Option setting, "(?i)" or "(?i:...)". The options
+				 * were looked at by compute_first_bytes(). */
+				p += 2;
+				while (g_ascii_isalpha (*p) || *p == '-')
+					p++;
+
+				if (*p == ')')
+				{
+					*zero_width = TRUE;
+					p++;
+					break;
+				}
+
+				if (*p != ':')
+					return FALSE;
+				p++;
+			}
+
+			scan->p = p;
+			if (!scan_alternatives (scan, can_be_empty) || *scan->p != ')')
+				return FALSE;
+			p = scan->p + 1;
+			break;
+
+		case '.':
+		case '$':
+		case '{':
+		case '*':
+		case '+':
+		case '?':
+			return FALSE;
+
+		default:
+			if ((guchar) *p >= 0x80)
+			{
+				if (scan->caseless || (guchar) *p < 0xC0)
+					return FALSE;
+				BYTE_SET_ADD (scan->set, *p);
+				p = g_utf8_next_char (p);
+			}
+			else
+			{
+				BYTE_SET_ADD (scan->set, *p);
+				p++;
+			}
+			break;
+	}
+
+	/* Quantifier. */
+	if (*p == '?' || *p == '*' || *p == '+' || *p == '{')
+	{
+		if (*zero_width)
+			return FALSE;
+
+		if (*p == '{')
+		{
+			if (!g_ascii_isdigit (p[1]))
+				return FALSE;
+			if (p[1] == '0')
+				*can_be_empty = TRUE;
+			p++;
+			while (g_ascii_isdigit (*p) || *p == ',')
+				p++;
+			if (*p != '}')
+				return FALSE;
+		}
+		else if (*p != '+')
+		{
+			*can_be_empty = TRUE;
+		}
+
+		p++;
+
+		/* Lazy or possessive quantifier. */
+		if (*p == '?' || *p == '+')
+			p++;
+	}
+
+	scan->p = p;
+	return TRUE;
+}
+
+/* Skips the rest of an alternative whose first bytes are already known. */
+static gboolean
+skip_alternative (FirstBytesScan *scan)
+{
+	const gchar *p = scan->p;
+
+	while (*p != '\0' && *p != '|' && *p != ')')
+	{
+		if (*p == '\\')
+		{
+			if (p[1] == '\0')
+				return FALSE;
+			p += 2;
+		}
+		else if (*p == '(')
+		{
+			p = skip_group (p + 1);
+			if (p == NULL)
+				return FALSE;
+		}
+		else if (*p == '[')
+		{
+			guint32 dummy[8] = { 0 };
+
+			/* Only used to find the end of the class. */
+			p = scan_class (p + 1, dummy);
+			if (p == NULL)
+				return FALSE;
+		}
+		else
+		{
+			p++;
+		}
+	}
+
+	scan->p = p;
+	return TRUE;
+}
+
+static gboolean
+scan_sequence (FirstBytesScan *scan,
+	       gboolean       *can_be_empty)
+{
+	*can_be_empty = TRUE;
+
+	while (*scan->p != '\0' && *scan->p != '|' && *scan->p != ')')
+	{
+		gboolean zero_width;
+		gboolean atom_can_be_empty;
+
+		if (!scan_atom (scan, &zero_width, &atom_can_be_empty))
+			return FALSE;
+
+		if (!zero_width && !atom_can_be_empty)
+		{
+			*can_be_empty = FALSE;
+			return skip_alternative (scan);
+		}
+	}
+
+	return TRUE;
+}
+
+static gboolean
+scan_alternatives (FirstBytesScan *scan,
+		   gboolean       *can_be_empty)
+{
+	*can_be_empty = FALSE;
+
+	while (TRUE)
+	{
+		gboolean empty;
+
+		if (!scan_sequence (scan, &empty))
+			return FALSE;
+
+		if (empty)
+			*can_be_empty = TRUE;
+
+		if (*scan->p != '|')
+			return TRUE;
+
+		scan->p++;
+	}
+}
+
+static gboolean
+compute_first_bytes (const gchar        *pattern,
+		     GRegexCompileFlags  flags,
+		     guint32            *set)
+{
+	FirstBytesScan scan;
+	gboolean can_be_empty;
+	const gchar *p;
+
+	if ((flags & G_REGEX_EXTENDED) != 0 || strstr (pattern, "\\Q") != NULL)
+	{
+		return FALSE;
+	}
+
+	scan.p = pattern;
+	scan.set = set;
+	scan.caseless = (flags & G_REGEX_CASELESS) != 0;
+
+	/* Look at the inline options, wherever they are: setting the
+	 * caseless flag for the whole pattern only makes the set bigger. */
+	for (p = strstr (pattern, "(?"); p != NULL; p = strstr (p + 2, "(?"))
+	{
+		const gchar *opt;
+
+		for (opt = p + 2; g_ascii_isalpha (*opt) || *opt == '-'; opt++)
+		{
+			if (*opt == 'i')
+				scan.caseless = TRUE;
+			else if (*opt == 'x')
+				return FALSE;
+		}
+	}
+
+	memset (set, 0, 8 * sizeof (guint32));
+
+	if (!scan_alternatives (&scan, &can_be_empty) ||
+	    *scan.p != '\0' ||
+	    can_be_empty)
+	{
+		return FALSE;
+	}
+
+	if (scan.caseless)
+	{
+		guint c;
+
+		for (c = 'a'; c <= 'z'; c++)
+		{
+			if (BYTE_SET_HAS (set, c) || BYTE_SET_HAS (set, g_ascii_toupper (c)))
+			{
+				BYTE_SET_ADD (set, c);
+				BYTE_SET_ADD (set, g_ascii_toupper (c));
+				/* e.g. the Kelvin sign matches "k". */
+				byte_set_add_non_ascii (set);
+			}
+		}
+	}
+
+	return TRUE;
+}
+
 /**
- * ctk_source_regex_new:
- * @pattern: the regular expression.
- * @flags: compile options for @pattern.
- * @error: location to store the error occuring, or %NULL to ignore errors.
+ * _ctk_source_regex_get_jit_mode:
  *
- * Creates a new regex.
+ * Returns: when the regexes are optimized. The default is taken from the
+ * CTKSOURCEVIEW_REGEX_JIT environment variable, which can be "never",
+ * "lazy" or "always", and is "lazy" if it is not set.
+ */
+CtkSourceRegexJitMode
+_ctk_source_regex_get_jit_mode (void)
+{
+	if (G_UNLIKELY (g_atomic_int_get (&jit_mode) < 0))
+	{
+		const gchar *env = g_getenv ("CTKSOURCEVIEW_REGEX_JIT");
+		CtkSourceRegexJitMode mode = CTK_SOURCE_REGEX_JIT_LAZY;
+
+		if (g_strcmp0 (env, "never") == 0)
+			mode = CTK_SOURCE_REGEX_JIT_NEVER;
+		else if (g_strcmp0 (env, "always") == 0)
+			mode = CTK_SOURCE_REGEX_JIT_ALWAYS;
+
+		g_atomic_int_compare_and_exchange (&jit_mode, -1, mode);
+	}
+
+	return g_atomic_int_get (&jit_mode);
+}
+
+/**
+ * _ctk_source_regex_set_jit_mode:
+ * @mode: a #CtkSourceRegexJitMode.
  *
- * Returns: a newly-allocated #CtkSourceRegex.
+ * Overrides the CTKSOURCEVIEW_REGEX_JIT environment variable. The regexes
+ * which are already optimized stay so.
  */
-CtkSourceRegex *
-_ctk_source_regex_new (const gchar           *pattern,
-		       GRegexCompileFlags     flags,
-		       GError               **error)
+void
+_ctk_source_regex_set_jit_mode (CtkSourceRegexJitMode mode)
+{
+	g_atomic_int_set (&jit_mode, mode);
+}
+
+static GRegex *
+compile_regex (const gchar         *pattern,
+	       GRegexCompileFlags   flags,
+	       gboolean             optimize,
+	       GError             **error)
+{
+	flags |= G_REGEX_NEWLINE_LF;
+
+	if (optimize)
+		flags |= G_REGEX_OPTIMIZE;
+
+	return g_regex_new (pattern, flags, 0, error);
+}
+
+static guint
+regex_cache_entry_hash (gconstpointer key)
+{
+	const RegexCacheEntry *entry = key;
+
+	return g_str_hash (entry->pattern) ^ entry->flags;
+}
+
+static gboolean
+regex_cache_entry_equal (gconstpointer a,
+			 gconstpointer b)
+{
+	const RegexCacheEntry *entry_a = a;
+	const RegexCacheEntry *entry_b = b;
+
+	return entry_a->flags == entry_b->flags &&
+	       strcmp (entry_a->pattern, entry_b->pattern) == 0;
+}
+
+/* Sets the compiled regex of @regex, from the cache if @use_cache. */
+static gboolean
+regex_compile (CtkSourceRegex      *regex,
+	       const gchar         *pattern,
+	       GRegexCompileFlags   flags,
+	       gboolean             use_cache,
+	       GError             **error)
+{
+	RegexCacheEntry key;
+	RegexCacheEntry *entry;
+	GRegex *compiled;
+	gboolean optimize;
+
+	optimize = _ctk_source_regex_get_jit_mode () == CTK_SOURCE_REGEX_JIT_ALWAYS;
+	regex->u.regex.flags = flags;
+
+	if (!use_cache)
+	{
+		regex->u.regex.own.regex = compile_regex (pattern, flags, optimize, error);
+
+		if (regex->u.regex.own.regex == NULL)
+			return FALSE;
+
+		regex->u.regex.optimized = optimize;
+
+		regex->has_first_bytes = compute_first_bytes (pattern, flags,
+							      regex->u.regex.first_bytes);
+		return TRUE;
+	}
+
+	key.pattern = (gchar *) pattern;
+	key.flags = flags;
+
+	g_mutex_lock (&regex_cache_mutex);
+
+	if (regex_cache == NULL)
+	{
+		regex_cache = g_hash_table_new (regex_cache_entry_hash,
+						regex_cache_entry_equal);
+	}
+
+	entry = g_hash_table_lookup (regex_cache, &key);
+
+	if (entry != NULL)
+	{
+		regex_cache_hits++;
+	}
+	else
+	{
+		/* Compiling is slow, do it without the lock. */
+		g_mutex_unlock (&regex_cache_mutex);
+
+		compiled = compile_regex (pattern, flags, optimize, error);
+
+		if (compiled == NULL)
+			return FALSE;
+
+		g_mutex_lock (&regex_cache_mutex);
+
+		/* Another thread may have compiled it in the meantime. */
+		entry = g_hash_table_lookup (regex_cache, &key);
+
+		if (entry != NULL)
+		{
+			regex_cache_hits++;
+			g_regex_unref (compiled);
+		}
+		else
+		{
+			regex_cache_misses++;
+
+			entry = g_slice_new0 (RegexCacheEntry);
+			entry->pattern = g_strdup (pattern);
+			entry->flags = flags;
+			entry->regex = compiled;
+			entry->optimized = optimize;
+			entry->has_first_bytes = compute_first_bytes (pattern, flags,
+								      entry->first_bytes);
+			g_hash_table_add (regex_cache, entry);
+		}
+	}
+
+	entry->n_users++;
+
+	regex->u.regex.own.regex = g_regex_ref (entry->regex);
+	regex->u.regex.cache_entry = entry;
+	regex->u.regex.optimized = entry->optimized;
+	regex->has_first_bytes = entry->has_first_bytes;
+	memcpy (regex->u.regex.first_bytes, entry->first_bytes, sizeof (entry->first_bytes));
+
+	g_mutex_unlock (&regex_cache_mutex);
+
+	return TRUE;
+}
+
+/* Replaces the compiled regex of @regex by an optimized one, shared
+ * through the cache if @regex comes from there. The other threads
+ * copy the pointer with the lock held, see get_match(). */
+static void
+regex_optimize (CtkSourceRegex *regex)
+{
+	RegexCacheEntry *entry = regex->u.regex.cache_entry;
+	GRegex *optimized = NULL;
+
+	regex->u.regex.optimized = TRUE;
+
+	if (entry != NULL)
+	{
+		g_mutex_lock (&regex_cache_mutex);
+
+		if (entry->optimized)
+			optimized = g_regex_ref (entry->regex);
+
+		g_mutex_unlock (&regex_cache_mutex);
+	}
+
+	if (optimized == NULL)
+	{
+		/* Compiling is slow, do it without the lock. */
+		optimized = compile_regex (g_regex_get_pattern (regex->u.regex.own.regex),
+					   regex->u.regex.flags, TRUE, NULL);
+
+		if (optimized != NULL && entry != NULL)
+		{
+			g_mutex_lock (&regex_cache_mutex);
+
+			/* Another regex of the entry may have been
+			 * optimized in the meantime, use its result. */
+			if (entry->optimized)
+			{
+				g_regex_unref (optimized);
+				optimized = g_regex_ref (entry->regex);
+			}
+			else
+			{
+				g_regex_unref (entry->regex);
+				entry->regex = g_regex_ref (optimized);
+				entry->optimized = TRUE;
+			}
+
+			g_mutex_unlock (&regex_cache_mutex);
+		}
+	}
+
+	/* Keep the regex we have if it cannot be optimized. */
+	if (optimized != NULL)
+	{
+		GRegex *old;
+
+		g_mutex_lock (&regex_cache_mutex);
+		old = regex->u.regex.own.regex;
+		regex->u.regex.own.regex = optimized;
+		g_mutex_unlock (&regex_cache_mutex);
+
+		g_regex_unref (old);
+	}
+}
+
+static void
+regex_cache_entry_release (RegexCacheEntry *entry)
+{
+	g_mutex_lock (&regex_cache_mutex);
+
+	if (--entry->n_users > 0)
+	{
+		g_mutex_unlock (&regex_cache_mutex);
+		return;
+	}
+
+	g_hash_table_remove (regex_cache, entry);
+
+	g_mutex_unlock (&regex_cache_mutex);
+
+	g_regex_unref (entry->regex);
+	g_free (entry->pattern);
+	g_slice_free (RegexCacheEntry, entry);
+}
+
+static CtkSourceRegex *
+regex_new (const gchar         *pattern,
+	   GRegexCompileFlags   flags,
+	   gboolean             use_cache,
+	   GError             **error)
 {
 	CtkSourceRegex *regex;
 
@@ -141,38 +956,89 @@ _ctk_source_regex_new (const gchar           *pattern,
 	else
 	{
 		regex->resolved = TRUE;
-		regex->u.regex.regex = g_regex_new (pattern,
-						    flags | G_REGEX_OPTIMIZE | G_REGEX_NEWLINE_LF, 0,
-						    error);
 
-		if (regex->u.regex.regex == NULL)
+		if (!regex_compile (regex, pattern, flags, use_cache, error))
 		{
 			g_slice_free (CtkSourceRegex, regex);
 			regex = NULL;
 		}
+		else
+		{
+			regex->anchored = (flags & G_REGEX_ANCHORED) != 0;
+			regex->uses_start_anchor = strstr (pattern, "\\G") != NULL;
+		}
 	}
 
 	return regex;
 }
 
+/**
+ * ctk_source_regex_new:
+ * @pattern: the regular expression.
+ * @flags: compile options for @pattern.
+ * @error: location to store the error occuring, or %NULL to ignore errors.
+ *
+ * Creates a new regex. The compiled regular expression is shared with
+ * the other regexes created with the same @pattern and @flags.
+ *
+ * Returns: a newly-allocated #CtkSourceRegex.
+ */
+CtkSourceRegex *
+_ctk_source_regex_new (const gchar           *pattern,
+		       GRegexCompileFlags     flags,
+		       GError               **error)
+{
+	return regex_new (pattern, flags, TRUE, error);
+}
+
+/**
+ * _ctk_source_regex_get_cache_stats:
+ * @n_patterns: (out) (optional): return location for the number of
+ *   compiled regular expressions in the cache.
+ * @n_hits: (out) (optional): return location for the number of regexes
+ *   which did not need to be compiled.
+ * @n_misses: (out) (optional): return location for the number of regexes
+ *   which were compiled and added to the cache.
+ *
+ * Gets the statistics of the cache used by _ctk_source_regex_new().
+ */
+void
+_ctk_source_regex_get_cache_stats (guint *n_patterns,
+				   guint *n_hits,
+				   guint *n_misses)
+{
+	g_mutex_lock (&regex_cache_mutex);
+
+	if (n_patterns != NULL)
+		*n_patterns = regex_cache != NULL ? g_hash_table_size (regex_cache) : 0;
+	if (n_hits != NULL)
+		*n_hits = regex_cache_hits;
+	if (n_misses != NULL)
+		*n_misses = regex_cache_misses;
+
+	g_mutex_unlock (&regex_cache_mutex);
+}
+
 CtkSourceRegex *
 _ctk_source_regex_ref (CtkSourceRegex *regex)
 {
 	if (regex != NULL)
-		regex->ref_count++;
+		g_atomic_int_inc (&regex->ref_count);
 	return regex;
 }
 
 void
 _ctk_source_regex_unref (CtkSourceRegex *regex)
 {
-	if (regex != NULL && --regex->ref_count == 0)
+	if (regex != NULL && g_atomic_int_dec_and_test (&regex->ref_count))
 	{
 		if (regex->resolved)
 		{
-			g_regex_unref (regex->u.regex.regex);
-			if (regex->u.regex.match)
-				g_match_info_free (regex->u.regex.match);
+			g_regex_unref (regex->u.regex.own.regex);
+			if (regex->u.regex.cache_entry != NULL)
+				regex_cache_entry_release (regex->u.regex.cache_entry);
+			if (regex->u.regex.own.match)
+				g_match_info_free (regex->u.regex.own.match);
 		}
 		else
 		{
@@ -182,34 +1048,121 @@ _ctk_source_regex_unref (CtkSourceRegex *regex)
 	}
 }
 
+static void
+regex_match_free (RegexMatch *match)
+{
+	if (match->match != NULL)
+		g_match_info_free (match->match);
+	g_regex_unref (match->regex);
+	g_slice_free (RegexMatch, match);
+}
+
+/**
+ * _ctk_source_regex_begin_thread_matches:
+ *
+ * Gives the current thread its own match state for every regex it
+ * uses, until _ctk_source_regex_end_thread_matches(): the current
+ * match, as returned by the fetch functions, and the memo of
+ * _ctk_source_regex_match_line(). Regexes are shared, e.g. by the
+ * context definitions of a language, so a thread other than the one
+ * which owns them must call this before matching them.
+ */
+void
+_ctk_source_regex_begin_thread_matches (void)
+{
+	GHashTable *matches;
+
+	g_return_if_fail (g_private_get (&thread_matches) == NULL);
+
+	matches = g_hash_table_new_full (g_direct_hash,
+					 g_direct_equal,
+					 (GDestroyNotify) _ctk_source_regex_unref,
+					 (GDestroyNotify) regex_match_free);
+
+	g_private_set (&thread_matches, matches);
+}
+
+/**
+ * _ctk_source_regex_end_thread_matches:
+ *
+ * Frees the match states of the current thread, and the references
+ * they hold on the regexes.
+ */
+void
+_ctk_source_regex_end_thread_matches (void)
+{
+	g_private_replace (&thread_matches, NULL);
+}
+
+/* Gets the match state of @regex for the current thread. */
+static RegexMatch *
+get_match (CtkSourceRegex *regex)
+{
+	GHashTable *matches;
+	RegexMatch *match;
+
+	matches = g_private_get (&thread_matches);
+
+	if (matches == NULL)
+		return &regex->u.regex.own;
+
+	match = g_hash_table_lookup (matches, regex);
+
+	if (match == NULL)
+	{
+		match = g_slice_new0 (RegexMatch);
+
+		/* The owner of @regex may be optimizing it. */
+		g_mutex_lock (&regex_cache_mutex);
+		match->regex = g_regex_ref (regex->u.regex.own.regex);
+		g_mutex_unlock (&regex_cache_mutex);
+
+		/* With a reference, @regex cannot be freed and another
+		 * regex allocated at the same address. */
+		g_hash_table_insert (matches, _ctk_source_regex_ref (regex), match);
+	}
+
+	return match;
+}
+
 struct RegexResolveData {
 	CtkSourceRegex *start_regex;
 	const gchar *matched_text;
 };
 
-static gboolean
-replace_start_regex (const GMatchInfo *match_info,
-		     GString          *expanded_regex,
-		     gpointer          user_data)
+/* Fetches the subpattern of the current match of @start_regex referred
+ * to as "\%{@num_string@start}", by number or by name. */
+static gchar *
+fetch_start_sub_pattern (CtkSourceRegex *start_regex,
+			 const gchar    *num_string)
 {
-	gchar *num_string, *subst, *subst_escaped, *escapes;
 	gint num;
-	struct RegexResolveData *data = user_data;
 
-	escapes = g_match_info_fetch (match_info, 1);
-	num_string = g_match_info_fetch (match_info, 2);
 	num = _ctk_source_utils_string_to_int (num_string);
 
 	if (num < 0)
 	{
-		subst = g_match_info_fetch_named (data->start_regex->u.regex.match,
-						  num_string);
+		return g_match_info_fetch_named (get_match (start_regex)->match,
+						 num_string);
 	}
 	else
 	{
-		subst = g_match_info_fetch (data->start_regex->u.regex.match,
-					    num);
+		return g_match_info_fetch (get_match (start_regex)->match,
+					   num);
 	}
+}
+
+static gboolean
+replace_start_regex (const GMatchInfo *match_info,
+		     GString          *expanded_regex,
+		     gpointer          user_data)
+{
+	gchar *num_string, *subst, *subst_escaped, *escapes;
+	struct RegexResolveData *data = user_data;
+
+	escapes = g_match_info_fetch (match_info, 1);
+	num_string = g_match_info_fetch (match_info, 2);
+	subst = fetch_start_sub_pattern (data->start_regex, num_string);
 
 	if (subst != NULL)
 	{
@@ -268,7 +1221,7 @@ _ctk_source_regex_resolve (CtkSourceRegex *regex,
 					       -1, 0, 0,
 					       replace_start_regex,
 					       &data, NULL);
-	new_regex = _ctk_source_regex_new (expanded_regex, regex->u.info.flags, NULL);
+	new_regex = regex_new (expanded_regex, regex->u.info.flags, FALSE, NULL);
 	if (new_regex == NULL || !new_regex->resolved)
 	{
 		_ctk_source_regex_unref (new_regex);
@@ -283,34 +1236,235 @@ _ctk_source_regex_resolve (CtkSourceRegex *regex,
 	return new_regex;
 }
 
+/**
+ * _ctk_source_regex_resolve_key:
+ * @regex: a #CtkSourceRegex which is not resolved.
+ * @start_regex: the #CtkSourceRegex @regex refers to, which just matched.
+ *
+ * Identifies what _ctk_source_regex_resolve() returns for @regex and the
+ * current match of @start_regex: two matches give the same key if and
+ * only if the subpatterns @regex refers to have the same values. The
+ * text matched by @start_regex is not enough, since a subpattern in a
+ * lookaround can capture text outside of it.
+ *
+ * Returns: a newly-allocated string.
+ */
+gchar *
+_ctk_source_regex_resolve_key (CtkSourceRegex *regex,
+			       CtkSourceRegex *start_regex)
+{
+	GMatchInfo *match_info;
+	GString *key;
+
+	g_return_val_if_fail (regex != NULL && !regex->resolved, NULL);
+	g_return_val_if_fail (start_regex != NULL && start_regex->resolved, NULL);
+
+	key = g_string_new (NULL);
+
+	g_regex_match (get_start_ref_regex (), regex->u.info.pattern, 0, &match_info);
+
+	while (g_match_info_matches (match_info))
+	{
+		gchar *num_string;
+		gchar *subst;
+
+		num_string = g_match_info_fetch (match_info, 2);
+		subst = fetch_start_sub_pattern (start_regex, num_string);
+
+		/* With the lengths, "ab" and "c" are not confused with
+		 * "a" and "bc". */
+		if (subst != NULL)
+			g_string_append_printf (key, "%" G_GSIZE_FORMAT ":%s;", strlen (subst), subst);
+		else
+			g_string_append_c (key, ';');
+
+		g_free (num_string);
+		g_free (subst);
+
+		g_match_info_next (match_info, NULL);
+	}
+
+	g_match_info_free (match_info);
+
+	return g_string_free (key, FALSE);
+}
+
 gboolean
 _ctk_source_regex_is_resolved (CtkSourceRegex *regex)
 {
 	return regex->resolved;
 }
 
+static gboolean
+regex_match (CtkSourceRegex *regex,
+	     RegexMatch     *match,
+	     const gchar    *line,
+	     gint            byte_length,
+	     gint            byte_pos)
+{
+	gboolean result;
+
+	if (match->match)
+	{
+		g_match_info_free (match->match);
+		match->match = NULL;
+	}
+
+	if (match == &regex->u.regex.own && !regex->u.regex.optimized)
+	{
+		CtkSourceRegexJitMode mode = _ctk_source_regex_get_jit_mode ();
+
+		if (mode == CTK_SOURCE_REGEX_JIT_ALWAYS ||
+		    (mode == CTK_SOURCE_REGEX_JIT_LAZY &&
+		     ++regex->u.regex.n_matches >= JIT_THRESHOLD))
+		{
+			regex_optimize (regex);
+		}
+	}
+
+	/* Skip the bytes which cannot start a match without calling pcre. */
+	if (regex->has_first_bytes)
+	{
+		const guint32 *set = regex->u.regex.first_bytes;
+
+		if (byte_length < 0)
+			byte_length = strlen (line);
+
+		if (regex->anchored)
+		{
+			if (byte_pos >= byte_length || !BYTE_SET_HAS (set, line[byte_pos]))
+				return FALSE;
+		}
+		else
+		{
+			while (byte_pos < byte_length && !BYTE_SET_HAS (set, line[byte_pos]))
+				byte_pos++;
+
+			if (byte_pos >= byte_length)
+				return FALSE;
+		}
+	}
+
+	result = g_regex_match_full (match->regex, line,
+				     byte_length, byte_pos,
+				     0, &match->match,
+				     NULL);
+
+	return result;
+}
+
 gboolean
 _ctk_source_regex_match (CtkSourceRegex *regex,
 			 const gchar    *line,
 			 gint             byte_length,
 			 gint             byte_pos)
 {
-	gboolean result;
+	RegexMatch *match;
 
 	g_assert (regex->resolved);
 
-	if (regex->u.regex.match)
+	match = get_match (regex);
+	match->last_stamp = 0;
+
+	return regex_match (regex, match, line, byte_length, byte_pos);
+}
+
+/**
+ * _ctk_source_regex_new_line_stamp:
+ *
+ * Returns: a new identifier for a line passed to
+ * _ctk_source_regex_match_line(), never 0.
+ */
+guint
+_ctk_source_regex_new_line_stamp (void)
+{
+	static guint last_stamp = 0;
+	guint stamp;
+
+	do
+		stamp = g_atomic_int_add (&last_stamp, 1) + 1;
+	while (stamp == 0);
+
+	return stamp;
+}
+
+/**
+ * _ctk_source_regex_match_line:
+ * @regex: a #CtkSourceRegex.
+ * @line: the text.
+ * @byte_length: length of @line in bytes.
+ * @line_stamp: an identifier of @line and @byte_length, from
+ *   _ctk_source_regex_new_line_stamp().
+ * @byte_pos: where to start, bytes.
+ * @match_start: (out) (optional): return location for the start of the
+ *   match, bytes.
+ * @match_end: (out) (optional): return location for the end of the
+ *   match, bytes.
+ *
+ * Same as _ctk_source_regex_match(), but the regex remembers its last
+ * attempt on the line, and gives the same answer without running pcre,
+ * and thus without allocating a #GMatchInfo, when it cannot change:
+ * another search from the same position, or from a position between
+ * the previous start and the match which was found, or after it if
+ * nothing was found.
+ *
+ * Returns: whether the regex matched.
+ */
+gboolean
+_ctk_source_regex_match_line (CtkSourceRegex *regex,
+			      const gchar    *line,
+			      gint            byte_length,
+			      guint           line_stamp,
+			      gint            byte_pos,
+			      gint           *match_start,
+			      gint           *match_end)
+{
+	RegexMatch *match;
+	gboolean reuse = FALSE;
+
+	g_assert (regex->resolved);
+	g_assert (line_stamp != 0);
+
+	match = get_match (regex);
+
+	if (match->last_stamp == line_stamp)
 	{
-		g_match_info_free (regex->u.regex.match);
-		regex->u.regex.match = NULL;
+		if (byte_pos == match->last_pos)
+		{
+			reuse = TRUE;
+		}
+		else if (!regex->anchored &&
+			 !regex->uses_start_anchor &&
+			 byte_pos > match->last_pos)
+		{
+			reuse = !match->last_result ||
+				byte_pos <= match->last_start;
+		}
 	}
 
-	result = g_regex_match_full (regex->u.regex.regex, line,
-				     byte_length, byte_pos,
-				     0, &regex->u.regex.match,
-				     NULL);
+	if (!reuse)
+	{
+		match->last_stamp = line_stamp;
+		match->last_pos = byte_pos;
+		match->last_result = regex_match (regex, match, line, byte_length, byte_pos);
 
-	return result;
+		if (match->last_result)
+		{
+			g_match_info_fetch_pos (match->match, 0,
+						&match->last_start,
+						&match->last_end);
+		}
+	}
+
+	if (match->last_result)
+	{
+		if (match_start != NULL)
+			*match_start = match->last_start;
+		if (match_end != NULL)
+			*match_end = match->last_end;
+	}
+
+	return match->last_result;
 }
 
 gchar *
@@ -319,7 +1473,7 @@ _ctk_source_regex_fetch (CtkSourceRegex *regex,
 {
 	g_assert (regex->resolved);
 
-	return g_match_info_fetch (regex->u.regex.match, num);
+	return g_match_info_fetch (get_match (regex)->match, num);
 }
 
 void
@@ -334,7 +1488,7 @@ _ctk_source_regex_fetch_pos (CtkSourceRegex *regex,
 	g_assert (regex->resolved);
 
 	/* g_match_info_fetch_pos() can return TRUE with start_pos/end_pos set to -1 */
-	if (!g_match_info_fetch_pos (regex->u.regex.match, num, &byte_start_pos, &byte_end_pos))
+	if (!g_match_info_fetch_pos (get_match (regex)->match, num, &byte_start_pos, &byte_end_pos))
 	{
 		if (start_pos != NULL)
 			*start_pos = -1;
@@ -361,7 +1515,30 @@ _ctk_source_regex_fetch_pos_bytes (CtkSourceRegex *regex,
 
 	g_assert (regex->resolved);
 
-	if (!g_match_info_fetch_pos (regex->u.regex.match, num, &start_pos, &end_pos))
+	if (!g_match_info_fetch_pos (get_match (regex)->match, num, &start_pos, &end_pos))
+	{
+		start_pos = -1;
+		end_pos = -1;
+	}
+
+	if (start_pos_p != NULL)
+		*start_pos_p = start_pos;
+	if (end_pos_p != NULL)
+		*end_pos_p = end_pos;
+}
+
+void
+_ctk_source_regex_fetch_named_pos_bytes (CtkSourceRegex *regex,
+					 const gchar    *name,
+					 gint           *start_pos_p, /* byte offsets */
+					 gint           *end_pos_p)   /* byte offsets */
+{
+	gint start_pos;
+	gint end_pos;
+
+	g_assert (regex->resolved);
+
+	if (!g_match_info_fetch_named_pos (get_match (regex)->match, name, &start_pos, &end_pos))
 	{
 		start_pos = -1;
 		end_pos = -1;
@@ -384,7 +1561,7 @@ _ctk_source_regex_fetch_named_pos (CtkSourceRegex *regex,
 
 	g_assert (regex->resolved);
 
-	if (!g_match_info_fetch_named_pos (regex->u.regex.match, name, &byte_start_pos, &byte_end_pos))
+	if (!g_match_info_fetch_named_pos (get_match (regex)->match, name, &byte_start_pos, &byte_end_pos))
 	{
 		if (start_pos != NULL)
 			*start_pos = -1;
@@ -405,6 +1582,6 @@ _ctk_source_regex_get_pattern (CtkSourceRegex *regex)
 {
 	g_assert (regex->resolved);
 
-	return g_regex_get_pattern (regex->u.regex.regex);
+	return g_regex_get_pattern (get_match (regex)->regex);
 }
 
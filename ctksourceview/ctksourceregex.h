@@ -27,6 +27,13 @@
 
 G_BEGIN_DECLS
 
+typedef enum _CtkSourceRegexJitMode
+{
+	CTK_SOURCE_REGEX_JIT_NEVER,
+	CTK_SOURCE_REGEX_JIT_LAZY,
+	CTK_SOURCE_REGEX_JIT_ALWAYS
+} CtkSourceRegexJitMode;
+
 CTK_SOURCE_INTERNAL
 CtkSourceRegex	*_ctk_source_regex_new		(const gchar         *pattern,
 						 GRegexCompileFlags   flags,
@@ -38,11 +45,21 @@ CtkSourceRegex	*_ctk_source_regex_ref		(CtkSourceRegex *regex);
 CTK_SOURCE_INTERNAL
 void		 _ctk_source_regex_unref	(CtkSourceRegex *regex);
 
+CTK_SOURCE_INTERNAL
+void		 _ctk_source_regex_begin_thread_matches (void);
+
+CTK_SOURCE_INTERNAL
+void		 _ctk_source_regex_end_thread_matches (void);
+
 CTK_SOURCE_INTERNAL
 CtkSourceRegex	*_ctk_source_regex_resolve	(CtkSourceRegex *regex,
 						 CtkSourceRegex *start_regex,
 						 const gchar    *matched_text);
 
+CTK_SOURCE_INTERNAL
+gchar		*_ctk_source_regex_resolve_key	(CtkSourceRegex *regex,
+						 CtkSourceRegex *start_regex);
+
 CTK_SOURCE_INTERNAL
 gboolean	 _ctk_source_regex_is_resolved	(CtkSourceRegex *regex);
 
@@ -52,6 +69,18 @@ gboolean	_ctk_source_regex_match		(CtkSourceRegex *regex,
 						 gint             byte_length,
 						 gint             byte_pos);
 
+CTK_SOURCE_INTERNAL
+guint		 _ctk_source_regex_new_line_stamp (void);
+
+CTK_SOURCE_INTERNAL
+gboolean	 _ctk_source_regex_match_line	(CtkSourceRegex *regex,
+						 const gchar    *line,
+						 gint            byte_length,
+						 guint           line_stamp,
+						 gint            byte_pos,
+						 gint           *match_start, /* byte offsets */
+						 gint           *match_end);  /* byte offsets */
+
 CTK_SOURCE_INTERNAL
 gchar		*_ctk_source_regex_fetch	(CtkSourceRegex *regex,
 						 gint            num);
@@ -69,6 +98,12 @@ void		 _ctk_source_regex_fetch_pos_bytes (CtkSourceRegex *regex,
 						    gint           *start_pos_p, /* byte offsets */
 						    gint           *end_pos_p);  /* byte offsets */
 
+CTK_SOURCE_INTERNAL
+void		 _ctk_source_regex_fetch_named_pos_bytes (CtkSourceRegex *regex,
+							  const gchar    *name,
+							  gint           *start_pos_p, /* byte offsets */
+							  gint           *end_pos_p);  /* byte offsets */
+
 CTK_SOURCE_INTERNAL
 void		 _ctk_source_regex_fetch_named_pos (CtkSourceRegex *regex,
 						    const gchar    *text,
@@ -79,6 +114,18 @@ void		 _ctk_source_regex_fetch_named_pos (CtkSourceRegex *regex,
 CTK_SOURCE_INTERNAL
 const gchar	*_ctk_source_regex_get_pattern	(CtkSourceRegex *regex);
 
+CTK_SOURCE_INTERNAL
+void		 _ctk_source_regex_get_cache_stats (guint *n_patterns,
+						    guint *n_hits,
+						    guint *n_misses);
+
+CTK_SOURCE_INTERNAL
+CtkSourceRegexJitMode
+		 _ctk_source_regex_get_jit_mode	(void);
+
+CTK_SOURCE_INTERNAL
+void		 _ctk_source_regex_set_jit_mode	(CtkSourceRegexJitMode mode);
+
 G_END_DECLS
 
 #endif /* CTK_SOURCE_REGEX_H */
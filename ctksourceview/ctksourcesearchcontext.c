@@ -292,6 +292,15 @@
  */
 #define SCAN_BATCH_SIZE 100
 
+/* Minimum number of characters of the text chunks searched by
+ * literal_forward_search(). A chunk ends at a line end, so that an
+ * occurrence of a single-line search text is never split.
+ */
+#define LITERAL_CHUNK_SIZE 65536
+
+/* UTF-8 of U+FFFC, the character of the pixbufs and child anchors. */
+#define OBJECT_REPLACEMENT_CHAR "\357\277\274"
+
 enum
 {
 	PROP_0,
@@ -351,8 +360,36 @@ struct _CtkSourceSearchContextPrivate
 
 	CtkSourceStyle *match_style;
 	guint highlight : 1;
+
+	/* The text searched by literal_forward_search(), kept during
+	 * scan_subregion(), where the buffer is not modified. */
+	struct _LiteralChunk *literal_chunk;
 };
 
+/* Text of the buffer searched by literal_forward_search(). */
+typedef struct _LiteralChunk
+{
+	gchar *text;
+	gsize length;
+
+	/* Character offsets of @text in the buffer, and the limit of the
+	 * search it was fetched for, or -1. */
+	gint start_offset;
+	gint end_offset;
+	gint limit_offset;
+
+	/* A position in @text and its offset, to convert positions from
+	 * there. */
+	gsize known_pos;
+	gint known_offset;
+
+	guint ascii : 1;
+
+	/* Whether the text has no invisible text, pixbufs or child anchors,
+	 * and can be searched as it is. */
+	guint plain : 1;
+} LiteralChunk;
+
 /* Data for the asynchronous forward and backward search tasks. */
 typedef struct
 {
@@ -796,6 +833,355 @@ basic_forward_regex_search (CtkSourceSearchContext *search,
 	return found;
 }
 
+static void
+literal_chunk_clear (LiteralChunk *chunk)
+{
+	g_free (chunk->text);
+	chunk->text = NULL;
+}
+
+static void
+check_invisible_tag (CtkTextTag *tag,
+		     gpointer    data)
+{
+	gboolean *has_invisible_tags = data;
+	gboolean invisible_set;
+
+	g_object_get (tag, "invisible-set", &invisible_set, NULL);
+
+	if (invisible_set)
+	{
+		*has_invisible_tags = TRUE;
+	}
+}
+
+static void
+literal_chunk_fetch (CtkSourceSearchContext *search,
+		     LiteralChunk           *chunk,
+		     gint                    offset,
+		     gint                    limit_offset)
+{
+	CtkTextIter start;
+	CtkTextIter end;
+	gboolean has_invisible_tags = FALSE;
+	gsize i;
+
+	ctk_text_buffer_get_iter_at_offset (search->priv->buffer, &start, offset);
+
+	end = start;
+	ctk_text_iter_forward_chars (&end, LITERAL_CHUNK_SIZE);
+
+	if (!ctk_text_iter_ends_line (&end))
+	{
+		ctk_text_iter_forward_to_line_end (&end);
+	}
+
+	if (limit_offset >= 0 && ctk_text_iter_get_offset (&end) >= limit_offset)
+	{
+		ctk_text_iter_set_offset (&end, limit_offset);
+	}
+
+	chunk->limit_offset = limit_offset;
+
+	chunk->text = ctk_text_buffer_get_slice (search->priv->buffer, &start, &end, TRUE);
+	chunk->length = strlen (chunk->text);
+	chunk->start_offset = offset;
+	chunk->end_offset = ctk_text_iter_get_offset (&end);
+	chunk->known_pos = 0;
+	chunk->known_offset = offset;
+
+	chunk->ascii = TRUE;
+	for (i = 0; i < chunk->length; i++)
+	{
+		if ((guchar) chunk->text[i] >= 0x80)
+		{
+			chunk->ascii = FALSE;
+			break;
+		}
+	}
+
+	ctk_text_tag_table_foreach (ctk_text_buffer_get_tag_table (search->priv->buffer),
+				    check_invisible_tag,
+				    &has_invisible_tags);
+
+	chunk->plain = (!has_invisible_tags &&
+			(chunk->ascii || strstr (chunk->text, OBJECT_REPLACEMENT_CHAR) == NULL));
+}
+
+/* Converts a position in the chunk text to an offset in the buffer. */
+static gint
+literal_chunk_get_offset (LiteralChunk *chunk,
+			  gsize         pos)
+{
+	if (chunk->ascii)
+	{
+		return chunk->start_offset + pos;
+	}
+
+	if (pos < chunk->known_pos)
+	{
+		chunk->known_pos = 0;
+		chunk->known_offset = chunk->start_offset;
+	}
+
+	chunk->known_offset += g_utf8_strlen (chunk->text + chunk->known_pos,
+					      pos - chunk->known_pos);
+	chunk->known_pos = pos;
+
+	return chunk->known_offset;
+}
+
+/* Converts an offset in the buffer to a position in the chunk text. */
+static gsize
+literal_chunk_get_pos (LiteralChunk *chunk,
+		       gint          offset)
+{
+	const gchar *p;
+
+	if (chunk->ascii)
+	{
+		return offset - chunk->start_offset;
+	}
+
+	if (offset < chunk->known_offset)
+	{
+		chunk->known_pos = 0;
+		chunk->known_offset = chunk->start_offset;
+	}
+
+	p = g_utf8_offset_to_pointer (chunk->text + chunk->known_pos,
+				      offset - chunk->known_offset);
+
+	chunk->known_pos = p - chunk->text;
+	chunk->known_offset = offset;
+
+	return chunk->known_pos;
+}
+
+/* Returns the position of the first occurrence of @needle at or after
+ * @pos, or -1. For a case insensitive search, the chunk and @needle are
+ * ASCII. The candidates are found with memchr(), which is vectorized by
+ * the C library.
+ */
+static gssize
+literal_chunk_find (LiteralChunk *chunk,
+		    const gchar  *needle,
+		    gsize         needle_length,
+		    gboolean      case_sensitive,
+		    gsize         pos)
+{
+	const gchar *text_end = chunk->text + chunk->length;
+	const gchar *p = chunk->text + pos;
+	const gchar *lower;
+	const gchar *upper;
+	gchar first_lower;
+	gchar first_upper;
+
+	if (case_sensitive)
+	{
+		while ((gsize) (text_end - p) >= needle_length &&
+		       (p = memchr (p, needle[0], text_end - p - needle_length + 1)) != NULL)
+		{
+			if (memcmp (p, needle, needle_length) == 0)
+			{
+				return p - chunk->text;
+			}
+
+			p++;
+		}
+
+		return -1;
+	}
+
+	first_lower = g_ascii_tolower (needle[0]);
+	first_upper = g_ascii_toupper (needle[0]);
+
+	/* The next candidates of both cases, or @text_end if there are no
+	 * more, searched again only when they are passed. */
+	lower = NULL;
+	upper = NULL;
+
+	while ((gsize) (text_end - p) >= needle_length)
+	{
+		gsize n = text_end - p - needle_length + 1;
+
+		if (lower == NULL || lower < p)
+		{
+			lower = memchr (p, first_lower, n);
+			if (lower == NULL)
+				lower = text_end;
+		}
+
+		if (first_upper == first_lower)
+		{
+			upper = lower;
+		}
+		else if (upper == NULL || upper < p)
+		{
+			upper = memchr (p, first_upper, n);
+			if (upper == NULL)
+				upper = text_end;
+		}
+
+		p = MIN (lower, upper);
+
+		if (p == text_end)
+		{
+			return -1;
+		}
+
+		if (g_ascii_strncasecmp (p, needle, needle_length) == 0)
+		{
+			return p - chunk->text;
+		}
+
+		p++;
+	}
+
+	return -1;
+}
+
+/* Whether literal_forward_search() can be used, i.e. the search text is
+ * found on a single line, and needs no Unicode case folding.
+ */
+static gboolean
+can_search_literally (CtkSourceSearchContext *search,
+		      const gchar            *search_text)
+{
+	const gchar *p;
+
+	if (search_text[0] == '\0' ||
+	    ctk_source_search_settings_get_regex_enabled (search->priv->settings))
+	{
+		return FALSE;
+	}
+
+	for (p = search_text; *p != '\0'; p++)
+	{
+		if ((guchar) *p >= 0x80)
+		{
+			if (!ctk_source_search_settings_get_case_sensitive (search->priv->settings))
+			{
+				return FALSE;
+			}
+
+			/* U+2028 and U+2029, the line and paragraph separators. */
+			if (strncmp (p, "\342\200\250", 3) == 0 ||
+			    strncmp (p, "\342\200\251", 3) == 0)
+			{
+				return FALSE;
+			}
+		}
+		else if (*p == '\n' || *p == '\r')
+		{
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+/* Same as ctk_text_iter_forward_search(), but the text is searched with
+ * literal_chunk_find() in big chunks fetched at once, instead of line by
+ * line with UTF-8 decoding of every character. The chunks which cannot be
+ * searched like that, with invisible text or pixbufs, or non-ASCII text
+ * for a case insensitive search, are searched with
+ * ctk_text_iter_forward_search().
+ */
+static gboolean
+literal_forward_search (CtkSourceSearchContext *search,
+			const gchar            *search_text,
+			const CtkTextIter      *iter,
+			CtkTextIter            *match_start,
+			CtkTextIter            *match_end,
+			const CtkTextIter      *limit)
+{
+	LiteralChunk local_chunk = { NULL, };
+	LiteralChunk *chunk;
+	gboolean case_sensitive;
+	gsize search_text_length;
+	gint char_count;
+	gint limit_offset;
+	gint offset;
+	gboolean found = FALSE;
+
+	chunk = search->priv->literal_chunk != NULL ? search->priv->literal_chunk : &local_chunk;
+
+	case_sensitive = ctk_source_search_settings_get_case_sensitive (search->priv->settings);
+	search_text_length = strlen (search_text);
+	char_count = ctk_text_buffer_get_char_count (search->priv->buffer);
+	limit_offset = limit != NULL ? ctk_text_iter_get_offset (limit) : -1;
+	offset = ctk_text_iter_get_offset (iter);
+
+	while (TRUE)
+	{
+		gssize pos;
+
+		if (chunk->text == NULL ||
+		    chunk->limit_offset != limit_offset ||
+		    offset < chunk->start_offset ||
+		    offset >= chunk->end_offset)
+		{
+			if (offset >= char_count ||
+			    (limit_offset >= 0 && offset >= limit_offset))
+			{
+				break;
+			}
+
+			literal_chunk_clear (chunk);
+			literal_chunk_fetch (search, chunk, offset, limit_offset);
+		}
+
+		if (!chunk->plain || (!case_sensitive && !chunk->ascii))
+		{
+			CtkTextIter from;
+			CtkTextIter chunk_end;
+
+			ctk_text_buffer_get_iter_at_offset (search->priv->buffer, &from, offset);
+			ctk_text_buffer_get_iter_at_offset (search->priv->buffer, &chunk_end, chunk->end_offset);
+
+			if (ctk_text_iter_forward_search (&from,
+							  search_text,
+							  get_text_search_flags (search),
+							  match_start,
+							  match_end,
+							  &chunk_end))
+			{
+				found = TRUE;
+				break;
+			}
+		}
+		else
+		{
+			pos = literal_chunk_find (chunk,
+						  search_text,
+						  search_text_length,
+						  case_sensitive,
+						  literal_chunk_get_pos (chunk, offset));
+
+			if (pos >= 0)
+			{
+				gint start_offset = literal_chunk_get_offset (chunk, pos);
+				gint end_offset = literal_chunk_get_offset (chunk, pos + search_text_length);
+
+				ctk_text_buffer_get_iter_at_offset (search->priv->buffer,
+								    match_start,
+								    start_offset);
+				*match_end = *match_start;
+				ctk_text_iter_forward_chars (match_end, end_offset - start_offset);
+
+				found = TRUE;
+				break;
+			}
+		}
+
+		offset = chunk->end_offset;
+	}
+
+	literal_chunk_clear (&local_chunk);
+	return found;
+}
+
 static gboolean
 basic_forward_search (CtkSourceSearchContext *search,
 		      const CtkTextIter      *iter,
@@ -806,6 +1192,7 @@ basic_forward_search (CtkSourceSearchContext *search,
 	CtkTextIter begin_search = *iter;
 	const gchar *search_text = ctk_source_search_settings_get_search_text (search->priv->settings);
 	CtkTextSearchFlags flags;
+	gboolean literal;
 
 	if (search_text == NULL)
 	{
@@ -823,15 +1210,30 @@ basic_forward_search (CtkSourceSearchContext *search,
 	}
 
 	flags = get_text_search_flags (search);
+	literal = can_search_literally (search, search_text);
 
 	while (TRUE)
 	{
-		gboolean found = ctk_text_iter_forward_search (&begin_search,
-							       search_text,
-							       flags,
-							       match_start,
-							       match_end,
-							       limit);
+		gboolean found;
+
+		if (literal)
+		{
+			found = literal_forward_search (search,
+							search_text,
+							&begin_search,
+							match_start,
+							match_end,
+							limit);
+		}
+		else
+		{
+			found = ctk_text_iter_forward_search (&begin_search,
+							      search_text,
+							      flags,
+							      match_start,
+							      match_end,
+							      limit);
+		}
 
 		if (!found || !ctk_source_search_settings_get_at_word_boundaries (search->priv->settings))
 		{
@@ -1517,6 +1919,7 @@ scan_subregion (CtkSourceSearchContext *search,
 {
 	CtkTextIter iter;
 	CtkTextIter *limit;
+	LiteralChunk literal_chunk = { NULL, };
 	gboolean found = TRUE;
 	const gchar *search_text = ctk_source_search_settings_get_search_text (search->priv->settings);
 
@@ -1565,6 +1968,9 @@ scan_subregion (CtkSourceSearchContext *search,
 		limit = end;
 	}
 
+	/* Applying the tag does not modify the text. */
+	search->priv->literal_chunk = &literal_chunk;
+
 	do
 	{
 		CtkTextIter match_start;
@@ -1585,6 +1991,9 @@ scan_subregion (CtkSourceSearchContext *search,
 		iter = match_end;
 
 	} while (found);
+
+	search->priv->literal_chunk = NULL;
+	literal_chunk_clear (&literal_chunk);
 }
 
 static void
@@ -3799,6 +4208,9 @@ ctk_source_search_context_replace_all (CtkSourceSearchContext  *search,
 	ctk_source_buffer_set_highlight_matching_brackets (CTK_SOURCE_BUFFER (search->priv->buffer),
 							   FALSE);
 
+	/* Analyze the syntax once for all the replacements. */
+	ctk_source_buffer_freeze_highlight (CTK_SOURCE_BUFFER (search->priv->buffer));
+
 	_ctk_source_buffer_save_and_clear_selection (CTK_SOURCE_BUFFER (search->priv->buffer));
 
 	ctk_text_buffer_get_start_iter (search->priv->buffer, &iter);
@@ -3828,6 +4240,8 @@ ctk_source_search_context_replace_all (CtkSourceSearchContext  *search,
 
 	_ctk_source_buffer_restore_selection (CTK_SOURCE_BUFFER (search->priv->buffer));
 
+	ctk_source_buffer_thaw_highlight (CTK_SOURCE_BUFFER (search->priv->buffer));
+
 	ctk_source_buffer_set_highlight_matching_brackets (CTK_SOURCE_BUFFER (search->priv->buffer),
 							   highlight_matching_brackets);
 
@@ -2358,6 +2358,9 @@ ctk_source_view_ensure_redrawn_rect_is_highlighted (CtkSourceView *view,
 			 ctk_text_iter_get_line (&iter2));
 	});
 
+	_ctk_source_buffer_set_frame_clock (view->priv->source_buffer,
+					    ctk_widget_get_frame_clock (CTK_WIDGET (view)));
+
 	_ctk_source_buffer_update_syntax_highlight (view->priv->source_buffer,
 						    &iter1, &iter2, FALSE);
 	_ctk_source_buffer_update_search_highlight (view->priv->source_buffer,
@@ -0,0 +1,301 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8; coding: utf-8 -*- */
+/*
+ * This file is part of CtkSourceView
+ *
+ * CtkSourceView is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * CtkSourceView is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include <ctk/ctk.h>
+#include <ctksourceview/ctksource.h>
+#include "ctksourceview/ctksourcebuffer-private.h"
+#include "ctksourceview/ctksourcecontextengine.h"
+#include "ctksourceview/ctksourceregex.h"
+
+/* This measures the syntax highlighting of the files in
+ * tests/syntax-highlighting (or of the files given on the command line):
+ * each file is repeated up to the requested size, and the whole buffer is
+ * analyzed and highlighted at once with ctk_source_buffer_ensure_highlight().
+ * The results are printed as JSON, one object per file, so that runs can be
+ * compared, for instance with --jit=never and --jit=always to see what the
+ * JIT compilation of the regexes brings for each language. With --profile,
+ * the time spent in the regexes, the tree updates and the tags is printed
+ * on stderr for each file, summed over the runs.
+ */
+
+static gdouble size_mb = 1.0;
+static gint n_runs = 3;
+static gchar *jit = NULL;
+static gboolean profile = FALSE;
+
+static GOptionEntry entries[] =
+{
+	{ "size", 's', 0, G_OPTION_ARG_DOUBLE, &size_mb, "Size of the text of each file, in MB (default: 1)", "MB" },
+	{ "runs", 'r', 0, G_OPTION_ARG_INT, &n_runs, "Number of runs for each file, the best one is kept (default: 3)", "N" },
+	{ "jit", 'j', 0, G_OPTION_ARG_STRING, &jit, "When to optimize the regexes: never, lazy or always (default: CTKSOURCEVIEW_REGEX_JIT or lazy)", "MODE" },
+	{ "profile", 'p', 0, G_OPTION_ARG_NONE, &profile, "Print where the highlighting time is spent for each file", NULL },
+	{ NULL }
+};
+
+static void
+init_default_manager (void)
+{
+	gchar *dir;
+
+	dir = g_build_filename (TOP_SRCDIR, "data", "language-specs", NULL);
+
+	if (g_file_test (dir, G_FILE_TEST_IS_DIR))
+	{
+		CtkSourceLanguageManager *lm = ctk_source_language_manager_get_default ();
+		gchar *lang_dirs[2] = {dir, NULL};
+
+		ctk_source_language_manager_set_search_path (lm, lang_dirs);
+	}
+
+	g_free (dir);
+}
+
+static gchar *
+get_text (const gchar *contents,
+	  gsize        length)
+{
+	GString *text;
+	gsize size = size_mb * 1024 * 1024;
+
+	text = g_string_sized_new (MAX (size, length) + 1);
+
+	do
+	{
+		g_string_append_len (text, contents, length);
+
+		/* Do not glue the last line of a copy to the first line of
+		 * the next one. */
+		if (length > 0 && contents[length - 1] != '\n')
+			g_string_append_c (text, '\n');
+	}
+	while (text->len < size && length > 0);
+
+	return g_string_free (text, FALSE);
+}
+
+/* Returns whether the file was highlighted. */
+static gboolean
+bench_file (const gchar *filename,
+	    gboolean     first)
+{
+	CtkSourceLanguageManager *lm;
+	CtkSourceLanguage *language;
+	CtkSourceContextEngineStats stats = { 0, };
+	gchar *contents;
+	gsize length;
+	gchar *text;
+	gchar *basename;
+	gchar *escaped;
+	gsize n_bytes;
+	gdouble best = G_MAXDOUBLE;
+	gint run;
+
+	lm = ctk_source_language_manager_get_default ();
+	language = ctk_source_language_manager_guess_language (lm, filename, NULL);
+
+	if (language == NULL)
+		return FALSE;
+
+	if (!g_file_get_contents (filename, &contents, &length, NULL) ||
+	    !g_utf8_validate (contents, length, NULL))
+	{
+		g_free (contents);
+		return FALSE;
+	}
+
+	text = get_text (contents, length);
+	n_bytes = strlen (text);
+
+	for (run = 0; run < n_runs; run++)
+	{
+		CtkSourceBuffer *buffer;
+		CtkSourceEngine *engine;
+		CtkTextIter start, end;
+		GTimer *timer;
+		gdouble elapsed;
+
+		buffer = ctk_source_buffer_new_with_language (language);
+		ctk_text_buffer_set_text (CTK_TEXT_BUFFER (buffer), text, -1);
+		ctk_text_buffer_get_bounds (CTK_TEXT_BUFFER (buffer), &start, &end);
+
+		timer = g_timer_new ();
+		ctk_source_buffer_ensure_highlight (buffer, &start, &end);
+		elapsed = g_timer_elapsed (timer, NULL);
+		g_timer_destroy (timer);
+
+		best = MIN (best, elapsed);
+
+		engine = _ctk_source_buffer_get_highlight_engine (buffer);
+
+		if (CTK_SOURCE_IS_CONTEXT_ENGINE (engine))
+		{
+			_ctk_source_context_engine_get_stats (CTK_SOURCE_CONTEXT_ENGINE (engine), &stats);
+
+			if (run == n_runs - 1)
+				_ctk_source_context_engine_dump_profile (CTK_SOURCE_CONTEXT_ENGINE (engine));
+		}
+
+		g_object_unref (buffer);
+	}
+
+	basename = g_path_get_basename (filename);
+	escaped = g_strescape (basename, NULL);
+
+	g_print ("%s\n    {\"file\": \"%s\", \"language\": \"%s\", \"bytes\": %" G_GSIZE_FORMAT ", "
+		 "\"seconds\": %.6f, \"mb_per_s\": %.3f, "
+		 "\"peak_segments\": %u, \"peak_sub_patterns\": %u, "
+		 "\"node_allocations\": %" G_GUINT64_FORMAT ", \"chunk_allocations\": %u}",
+		 first ? "" : ",",
+		 escaped,
+		 ctk_source_language_get_id (language),
+		 n_bytes,
+		 best,
+		 best > 0 ? n_bytes / (1024.0 * 1024.0) / best : 0.0,
+		 stats.peak_segments,
+		 stats.peak_sub_patterns,
+		 stats.n_node_allocations,
+		 stats.n_chunk_allocations);
+
+	g_free (escaped);
+	g_free (basename);
+	g_free (text);
+	g_free (contents);
+	return TRUE;
+}
+
+static gint
+compare_filenames (gconstpointer a,
+		   gconstpointer b)
+{
+	return g_strcmp0 (*(const gchar * const *) a, *(const gchar * const *) b);
+}
+
+int
+main (int argc, char *argv[])
+{
+	GOptionContext *context;
+	GError *error = NULL;
+	GPtrArray *filenames;
+	gboolean first = TRUE;
+	const gchar *jit_name;
+	guint n_cache_hits;
+	guint n_cache_misses;
+	guint i;
+
+	context = g_option_context_new ("[FILE…] - benchmark the syntax highlighting");
+	g_option_context_add_main_entries (context, entries, NULL);
+	/* Without opening the default display: buffers, tags and the
+	 * engine do not need one, and the benchmark runs headless. */
+	g_option_context_add_group (context, ctk_get_option_group (FALSE));
+
+	if (!g_option_context_parse (context, &argc, &argv, &error))
+	{
+		g_printerr ("%s\n", error->message);
+		g_error_free (error);
+		return 1;
+	}
+
+	g_option_context_free (context);
+
+	/* Must be set before the first language is used. */
+	if (profile)
+		g_setenv ("CTKSOURCEVIEW_HIGHLIGHT_PROFILE", "1", TRUE);
+
+	if (g_strcmp0 (jit, "never") == 0)
+	{
+		_ctk_source_regex_set_jit_mode (CTK_SOURCE_REGEX_JIT_NEVER);
+	}
+	else if (g_strcmp0 (jit, "lazy") == 0)
+	{
+		_ctk_source_regex_set_jit_mode (CTK_SOURCE_REGEX_JIT_LAZY);
+	}
+	else if (g_strcmp0 (jit, "always") == 0)
+	{
+		_ctk_source_regex_set_jit_mode (CTK_SOURCE_REGEX_JIT_ALWAYS);
+	}
+	else if (jit != NULL)
+	{
+		g_printerr ("Unknown JIT mode: %s\n", jit);
+		return 1;
+	}
+
+	init_default_manager ();
+
+	filenames = g_ptr_array_new_with_free_func (g_free);
+
+	if (argc > 1)
+	{
+		gint arg;
+
+		for (arg = 1; arg < argc; arg++)
+			g_ptr_array_add (filenames, g_strdup (argv[arg]));
+	}
+	else
+	{
+		const gchar *dirname = TOP_SRCDIR "/tests/syntax-highlighting";
+		const gchar *name;
+		GDir *dir;
+
+		dir = g_dir_open (dirname, 0, &error);
+
+		if (dir == NULL)
+		{
+			g_printerr ("%s\n", error->message);
+			g_error_free (error);
+			return 1;
+		}
+
+		while ((name = g_dir_read_name (dir)) != NULL)
+			g_ptr_array_add (filenames, g_build_filename (dirname, name, NULL));
+
+		g_dir_close (dir);
+		g_ptr_array_sort (filenames, compare_filenames);
+	}
+
+	switch (_ctk_source_regex_get_jit_mode ())
+	{
+		case CTK_SOURCE_REGEX_JIT_NEVER:
+			jit_name = "never";
+			break;
+		case CTK_SOURCE_REGEX_JIT_ALWAYS:
+			jit_name = "always";
+			break;
+		case CTK_SOURCE_REGEX_JIT_LAZY:
+		default:
+			jit_name = "lazy";
+			break;
+	}
+
+	g_print ("{\n  \"size_mb\": %g,\n  \"runs\": %d,\n  \"jit\": \"%s\",\n  \"results\": [",
+		 size_mb, n_runs, jit_name);
+
+	for (i = 0; i < filenames->len; i++)
+	{
+		if (bench_file (g_ptr_array_index (filenames, i), first))
+			first = FALSE;
+	}
+
+	_ctk_source_regex_get_cache_stats (NULL, &n_cache_hits, &n_cache_misses);
+
+	g_print ("\n  ],\n  \"compiled_regexes\": %u,\n  \"shared_regexes\": %u\n}\n",
+		 n_cache_misses, n_cache_hits);
+
+	g_ptr_array_free (filenames, TRUE);
+	return 0;
+}
@@ -20,9 +20,15 @@
  * along with this library; if not, see <http://www.gnu.org/licenses/>.
  */
 
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
 #include <stdlib.h>
+#include <glib/gstdio.h>
 #include <ctksourceview/ctksource.h>
 #include "ctksourceview/ctksourcebuffer-private.h"
+#include "ctksourceview/ctksourcecontextengine.h"
 
 static const char *c_snippet =
 	"#include <foo.h>\n"
@@ -132,6 +138,1557 @@ test_get_context_classes (void)
 	g_object_unref (buffer);
 }
 
+static gboolean
+has_context_class_at (CtkSourceBuffer *buffer,
+		      gint             line,
+		      gint             line_offset,
+		      const gchar     *context_class)
+{
+	CtkTextIter iter;
+
+	ctk_text_buffer_get_iter_at_line_offset (CTK_TEXT_BUFFER (buffer), &iter, line, line_offset);
+	return ctk_source_buffer_iter_has_context_class (buffer, &iter, context_class);
+}
+
+static void
+ensure_highlight_all (CtkSourceBuffer *buffer)
+{
+	CtkTextIter start, end;
+
+	ctk_text_buffer_get_bounds (CTK_TEXT_BUFFER (buffer), &start, &end);
+	ctk_source_buffer_ensure_highlight (buffer, &start, &end);
+}
+
+static void
+test_incremental_highlight (void)
+{
+	CtkSourceLanguageManager *lm;
+	CtkSourceLanguage *lang;
+	CtkSourceBuffer *buffer;
+	CtkTextIter iter;
+
+	lm = ctk_source_language_manager_get_default ();
+	lang = ctk_source_language_manager_get_language (lm, "c");
+	g_assert_true (CTK_SOURCE_IS_LANGUAGE (lang));
+	buffer = ctk_source_buffer_new_with_language (lang);
+
+	ctk_text_buffer_set_text (CTK_TEXT_BUFFER (buffer),
+				  "/* first\n"
+				  " * second\n"
+				  " * third\n"
+				  " */\n"
+				  "int x;\n",
+				  -1);
+	ensure_highlight_all (buffer);
+
+	g_assert_true (has_context_class_at (buffer, 2, 3, "comment"));
+	g_assert_false (has_context_class_at (buffer, 4, 0, "comment"));
+
+	/* Editing inside the comment: the rest of the comment is reused. */
+	ctk_text_buffer_get_iter_at_line_offset (CTK_TEXT_BUFFER (buffer), &iter, 1, 3);
+	ctk_text_buffer_insert (CTK_TEXT_BUFFER (buffer), &iter, "the ", -1);
+	ensure_highlight_all (buffer);
+
+	g_assert_true (has_context_class_at (buffer, 1, 3, "comment"));
+	g_assert_true (has_context_class_at (buffer, 2, 3, "comment"));
+	g_assert_true (has_context_class_at (buffer, 3, 1, "comment"));
+	g_assert_false (has_context_class_at (buffer, 4, 0, "comment"));
+
+	/* Editing the first line of the comment. */
+	ctk_text_buffer_get_iter_at_line_offset (CTK_TEXT_BUFFER (buffer), &iter, 0, 3);
+	ctk_text_buffer_insert (CTK_TEXT_BUFFER (buffer), &iter, "the ", -1);
+	ensure_highlight_all (buffer);
+
+	g_assert_true (has_context_class_at (buffer, 2, 3, "comment"));
+	g_assert_false (has_context_class_at (buffer, 4, 0, "comment"));
+
+	/* Closing the comment early must still propagate downstream. */
+	ctk_text_buffer_get_iter_at_line_offset (CTK_TEXT_BUFFER (buffer), &iter, 1, 0);
+	ctk_text_buffer_insert (CTK_TEXT_BUFFER (buffer), &iter, "*/", -1);
+	ensure_highlight_all (buffer);
+
+	g_assert_true (has_context_class_at (buffer, 0, 3, "comment"));
+	g_assert_false (has_context_class_at (buffer, 2, 3, "comment"));
+
+	g_object_unref (buffer);
+}
+
+static void
+test_highlight_sub_patterns (void)
+{
+	CtkSourceLanguageManager *lm;
+	CtkSourceLanguage *lang;
+	CtkSourceBuffer *buffer;
+	CtkTextIter start, end;
+
+	lm = ctk_source_language_manager_get_default ();
+	lang = ctk_source_language_manager_get_language (lm, "c");
+	g_assert_true (CTK_SOURCE_IS_LANGUAGE (lang));
+	buffer = ctk_source_buffer_new_with_language (lang);
+
+	ctk_text_buffer_set_text (CTK_TEXT_BUFFER (buffer),
+				  "#include \"a.h\"\n"
+				  "#include \"b.h\"\n"
+				  "int x;\n",
+				  -1);
+	ensure_highlight_all (buffer);
+
+	g_assert_true (has_context_class_at (buffer, 1, 11, "path"));
+	g_assert_false (has_context_class_at (buffer, 1, 3, "path"));
+
+	/* Subpatterns must move along with the text before them. */
+	ctk_text_buffer_get_start_iter (CTK_TEXT_BUFFER (buffer), &start);
+	ctk_text_buffer_insert (CTK_TEXT_BUFFER (buffer), &start, "int y;\n", -1);
+	ensure_highlight_all (buffer);
+
+	g_assert_true (has_context_class_at (buffer, 2, 11, "path"));
+	g_assert_false (has_context_class_at (buffer, 2, 3, "path"));
+
+	ctk_text_buffer_get_iter_at_line (CTK_TEXT_BUFFER (buffer), &start, 0);
+	ctk_text_buffer_get_iter_at_line (CTK_TEXT_BUFFER (buffer), &end, 1);
+	ctk_text_buffer_delete (CTK_TEXT_BUFFER (buffer), &start, &end);
+	ensure_highlight_all (buffer);
+
+	g_assert_true (has_context_class_at (buffer, 0, 11, "path"));
+	g_assert_true (has_context_class_at (buffer, 1, 11, "path"));
+	g_assert_false (has_context_class_at (buffer, 1, 3, "path"));
+
+	g_object_unref (buffer);
+}
+
+static void
+test_highlight_line_terminators (void)
+{
+	CtkSourceLanguageManager *lm;
+	CtkSourceLanguage *lang;
+	CtkSourceBuffer *buffer;
+
+	lm = ctk_source_language_manager_get_default ();
+	lang = ctk_source_language_manager_get_language (lm, "c");
+	g_assert_true (CTK_SOURCE_IS_LANGUAGE (lang));
+	buffer = ctk_source_buffer_new_with_language (lang);
+
+	/* Non-ASCII text and all kinds of line terminators. */
+	ctk_text_buffer_set_text (CTK_TEXT_BUFFER (buffer),
+				  "int é; // ü\r\n"
+				  "x = \"ß\";\r"
+				  "/* ç */ y;\xe2\x80\xa9"
+				  "// last",
+				  -1);
+	ensure_highlight_all (buffer);
+
+	g_assert_false (has_context_class_at (buffer, 0, 4, "comment"));
+	g_assert_true (has_context_class_at (buffer, 0, 10, "comment"));
+	g_assert_true (has_context_class_at (buffer, 1, 5, "string"));
+	g_assert_false (has_context_class_at (buffer, 1, 7, "string"));
+	g_assert_true (has_context_class_at (buffer, 2, 3, "comment"));
+	g_assert_false (has_context_class_at (buffer, 2, 8, "comment"));
+	g_assert_true (has_context_class_at (buffer, 3, 3, "comment"));
+
+	g_object_unref (buffer);
+}
+
+static void
+test_highlight_class_disabled (void)
+{
+	CtkSourceLanguageManager *lm;
+	CtkSourceLanguage *lang;
+	CtkSourceBuffer *buffer;
+	CtkTextIter start, end;
+
+	lm = ctk_source_language_manager_get_default ();
+	lang = ctk_source_language_manager_get_language (lm, "c");
+	g_assert_true (CTK_SOURCE_IS_LANGUAGE (lang));
+	buffer = ctk_source_buffer_new_with_language (lang);
+
+	ctk_text_buffer_set_text (CTK_TEXT_BUFFER (buffer), "x = \"a b c\"; y;\n", -1);
+	ensure_highlight_all (buffer);
+
+	g_assert_true (has_context_class_at (buffer, 0, 0, "no-spell-check"));
+	g_assert_false (has_context_class_at (buffer, 0, 6, "no-spell-check"));
+	g_assert_true (has_context_class_at (buffer, 0, 12, "no-spell-check"));
+
+	/* The strings move: the tags must follow them exactly. */
+	ctk_text_buffer_get_start_iter (CTK_TEXT_BUFFER (buffer), &start);
+	ctk_text_buffer_insert (CTK_TEXT_BUFFER (buffer), &start, "\"", -1);
+	ensure_highlight_all (buffer);
+
+	g_assert_false (has_context_class_at (buffer, 0, 2, "no-spell-check"));
+	g_assert_true (has_context_class_at (buffer, 0, 2, "string"));
+	g_assert_true (has_context_class_at (buffer, 0, 7, "no-spell-check"));
+	g_assert_false (has_context_class_at (buffer, 0, 7, "string"));
+	g_assert_false (has_context_class_at (buffer, 0, 13, "no-spell-check"));
+
+	ctk_text_buffer_get_iter_at_offset (CTK_TEXT_BUFFER (buffer), &start, 0);
+	ctk_text_buffer_get_iter_at_offset (CTK_TEXT_BUFFER (buffer), &end, 1);
+	ctk_text_buffer_delete (CTK_TEXT_BUFFER (buffer), &start, &end);
+	ensure_highlight_all (buffer);
+
+	g_assert_true (has_context_class_at (buffer, 0, 0, "no-spell-check"));
+	g_assert_false (has_context_class_at (buffer, 0, 0, "string"));
+	g_assert_false (has_context_class_at (buffer, 0, 6, "no-spell-check"));
+	g_assert_true (has_context_class_at (buffer, 0, 6, "string"));
+	g_assert_true (has_context_class_at (buffer, 0, 12, "no-spell-check"));
+
+	g_object_unref (buffer);
+}
+
+static void
+test_highlight_schedule (void)
+{
+	CtkSourceBuffer *buffer;
+	CtkSourceHighlightSchedule schedule;
+
+	buffer = ctk_source_buffer_new (NULL);
+
+	g_assert_cmpint (ctk_source_buffer_get_highlight_schedule (buffer), ==,
+			 CTK_SOURCE_HIGHLIGHT_SCHEDULE_FIXED);
+
+	ctk_source_buffer_set_highlight_schedule (buffer, CTK_SOURCE_HIGHLIGHT_SCHEDULE_FRAME_CLOCK);
+	g_object_get (buffer, "highlight-schedule", &schedule, NULL);
+	g_assert_cmpint (schedule, ==, CTK_SOURCE_HIGHLIGHT_SCHEDULE_FRAME_CLOCK);
+
+	g_object_set (buffer, "highlight-schedule", CTK_SOURCE_HIGHLIGHT_SCHEDULE_FIXED, NULL);
+	g_assert_cmpint (ctk_source_buffer_get_highlight_schedule (buffer), ==,
+			 CTK_SOURCE_HIGHLIGHT_SCHEDULE_FIXED);
+
+	g_object_unref (buffer);
+}
+
+/* Whether the text at @line_offset has a tag of the syntax highlighting,
+ * which, unlike the tags of the context classes, have no name. */
+static gboolean
+has_style_tag_at (CtkSourceBuffer *buffer,
+		  gint             line,
+		  gint             line_offset)
+{
+	CtkTextIter iter;
+	GSList *tags;
+	GSList *l;
+	gboolean found = FALSE;
+
+	ctk_text_buffer_get_iter_at_line_offset (CTK_TEXT_BUFFER (buffer), &iter, line, line_offset);
+	tags = ctk_text_iter_get_tags (&iter);
+
+	for (l = tags; l != NULL && !found; l = l->next)
+	{
+		gchar *name;
+
+		g_object_get (l->data, "name", &name, NULL);
+		found = name == NULL;
+		g_free (name);
+	}
+
+	g_slist_free (tags);
+	return found;
+}
+
+/* Runs the main loop until the text at @line_offset is highlighted, or
+ * gives up after a few seconds. */
+static gboolean
+wait_for_style_tag_at (CtkSourceBuffer *buffer,
+		       gint             line,
+		       gint             line_offset)
+{
+	gint64 deadline = g_get_monotonic_time () + 10 * G_USEC_PER_SEC;
+
+	while (!has_style_tag_at (buffer, line, line_offset))
+	{
+		if (g_get_monotonic_time () > deadline)
+			return FALSE;
+
+		if (!g_main_context_iteration (NULL, FALSE))
+			g_usleep (G_USEC_PER_SEC / 1000);
+	}
+
+	return TRUE;
+}
+
+static void
+test_highlight_frame_clock (void)
+{
+	CtkSourceLanguageManager *lm;
+	CtkSourceLanguage *lang;
+	CtkSourceBuffer *buffer;
+	CtkWidget *window;
+	CtkWidget *scrolled_window;
+	CtkWidget *view;
+	CtkTextIter iter;
+	GString *text;
+	gint n_lines = 5000;
+	gint i;
+
+	lm = ctk_source_language_manager_get_default ();
+	lang = ctk_source_language_manager_get_language (lm, "c");
+	g_assert_true (CTK_SOURCE_IS_LANGUAGE (lang));
+	buffer = ctk_source_buffer_new_with_language (lang);
+	ctk_source_buffer_set_highlight_schedule (buffer, CTK_SOURCE_HIGHLIGHT_SCHEDULE_FRAME_CLOCK);
+
+	/* Too long to be analyzed in the first time slice. */
+	text = g_string_new ("/* first */\n");
+	for (i = 1; i < n_lines - 1; i++)
+		g_string_append_printf (text, "int x%d = \"%d\";\n", i, i);
+	g_string_append (text, "/* last */\n");
+	ctk_text_buffer_set_text (CTK_TEXT_BUFFER (buffer), text->str, -1);
+	g_string_free (text, TRUE);
+
+	view = ctk_source_view_new_with_buffer (buffer);
+	scrolled_window = ctk_scrolled_window_new (NULL, NULL);
+	ctk_container_add (CTK_CONTAINER (scrolled_window), view);
+	window = ctk_window_new (CTK_WINDOW_TOPLEVEL);
+	ctk_window_set_default_size (CTK_WINDOW (window), 400, 300);
+	ctk_container_add (CTK_CONTAINER (window), scrolled_window);
+	ctk_widget_show_all (window);
+
+	g_assert_true (ctk_widget_get_realized (view));
+
+	/* The visible lines are highlighted when drawn, with the time
+	 * slices sized after the frame clock of the view. */
+	g_assert_true (wait_for_style_tag_at (buffer, 0, 3));
+	g_assert_true (_ctk_source_buffer_get_frame_clock (buffer) == ctk_widget_get_frame_clock (view));
+	g_assert_true (has_context_class_at (buffer, 0, 3, "comment"));
+	g_assert_true (has_context_class_at (buffer, 1, 11, "string"));
+	g_assert_false (has_style_tag_at (buffer, 1, 5));
+
+	/* The rest is analyzed in the background, and highlighted once
+	 * scrolled to. */
+	ctk_text_buffer_get_end_iter (CTK_TEXT_BUFFER (buffer), &iter);
+	ctk_text_buffer_place_cursor (CTK_TEXT_BUFFER (buffer), &iter);
+	ctk_text_view_scroll_mark_onscreen (CTK_TEXT_VIEW (view),
+					    ctk_text_buffer_get_insert (CTK_TEXT_BUFFER (buffer)));
+
+	g_assert_true (wait_for_style_tag_at (buffer, n_lines - 1, 3));
+	g_assert_true (has_context_class_at (buffer, n_lines - 1, 3, "comment"));
+	g_assert_true (has_context_class_at (buffer, n_lines - 2, 14, "string"));
+
+	ctk_widget_destroy (window);
+	g_object_unref (buffer);
+}
+
+/* Describes the highlighting of the lines from @first_line to @last_line:
+ * the context classes and the number of syntax highlighting tags of each
+ * character. */
+static gchar *
+get_highlighting (CtkSourceBuffer *buffer,
+		  gint             first_line,
+		  gint             last_line)
+{
+	GString *str = g_string_new (NULL);
+	CtkTextIter iter, end;
+
+	ctk_text_buffer_get_iter_at_line (CTK_TEXT_BUFFER (buffer), &iter, first_line);
+	ctk_text_buffer_get_iter_at_line (CTK_TEXT_BUFFER (buffer), &end, last_line);
+
+	for (; ctk_text_iter_compare (&iter, &end) < 0; ctk_text_iter_forward_char (&iter))
+	{
+		gchar **classes;
+		gchar *joined;
+		GSList *tags;
+		GSList *l;
+		guint n_style_tags = 0;
+
+		classes = ctk_source_buffer_get_context_classes_at_iter (buffer, &iter);
+		joined = g_strjoinv (",", classes);
+
+		tags = ctk_text_iter_get_tags (&iter);
+		for (l = tags; l != NULL; l = l->next)
+		{
+			gchar *name;
+
+			g_object_get (l->data, "name", &name, NULL);
+			if (name == NULL)
+				n_style_tags++;
+			g_free (name);
+		}
+
+		g_string_append_printf (str, "%d:%s:%u ", ctk_text_iter_get_offset (&iter), joined, n_style_tags);
+
+		g_slist_free (tags);
+		g_free (joined);
+		g_strfreev (classes);
+	}
+
+	return g_string_free (str, FALSE);
+}
+
+static void
+test_highlight_sync_points (void)
+{
+	const gchar *lang_ids[] = { "c", "chdr", "cpp", "python", "python3", "go", "rust", "java", "javascript" };
+	CtkSourceLanguageManager *lm;
+	CtkSourceLanguage *lang;
+	CtkSourceBuffer *buffer;
+	CtkSourceBuffer *full_buffer;
+	CtkTextIter start, end;
+	gboolean sync_points;
+	GString *text;
+	gchar *from_sync_point;
+	gchar *full;
+	gint first_line = 30 * 118 + 101;
+	gint last_line = first_line + 20;
+	guint i;
+
+	buffer = ctk_source_buffer_new (NULL);
+
+	g_assert_false (ctk_source_buffer_get_highlight_sync_points (buffer));
+
+	ctk_source_buffer_set_highlight_sync_points (buffer, TRUE);
+	g_object_get (buffer, "highlight-sync-points", &sync_points, NULL);
+	g_assert_true (sync_points);
+
+	g_object_set (buffer, "highlight-sync-points", FALSE, NULL);
+	g_assert_false (ctk_source_buffer_get_highlight_sync_points (buffer));
+
+	g_object_unref (buffer);
+
+	lm = ctk_source_language_manager_get_default ();
+
+	for (i = 0; i < G_N_ELEMENTS (lang_ids); i++)
+	{
+		lang = ctk_source_language_manager_get_language (lm, lang_ids[i]);
+		g_assert_true (CTK_SOURCE_IS_LANGUAGE (lang));
+		g_assert_nonnull (ctk_source_language_get_metadata (lang, "sync-point-pattern"));
+	}
+
+	/* The visible text, far below the analyzed part, is highlighted from
+	 * the function definition above it the same way as when the whole
+	 * buffer is analyzed. Starting SYNC_POINT_LINES lines above instead
+	 * would start in the commented out "#if 0". */
+	lang = ctk_source_language_manager_get_language (lm, "c");
+
+	text = g_string_new (NULL);
+	for (i = 0; i < 40; i++)
+	{
+		guint n;
+
+		g_string_append_printf (text,
+					"/* Disabled %u:\n"
+					"#if 0\n"
+					"\told (\"%u\");\n"
+					" */\n"
+					"static int\n"
+					"foo%u (void)\n"
+					"{\n",
+					i, i, i);
+
+		for (n = 0; n < 110; n++)
+			g_string_append_printf (text, "\tx = \"%u\"; // %u\n", n, n);
+
+		g_string_append (text, "}\n");
+	}
+
+	full_buffer = ctk_source_buffer_new_with_language (lang);
+	ctk_text_buffer_set_text (CTK_TEXT_BUFFER (full_buffer), text->str, -1);
+	ensure_highlight_all (full_buffer);
+	full = get_highlighting (full_buffer, first_line, last_line);
+
+	buffer = ctk_source_buffer_new_with_language (lang);
+	ctk_source_buffer_set_highlight_sync_points (buffer, TRUE);
+	ctk_text_buffer_set_text (CTK_TEXT_BUFFER (buffer), text->str, -1);
+	g_string_free (text, TRUE);
+
+	ctk_text_buffer_get_iter_at_line (CTK_TEXT_BUFFER (buffer), &start, first_line);
+	ctk_text_buffer_get_iter_at_line (CTK_TEXT_BUFFER (buffer), &end, last_line);
+	_ctk_source_buffer_update_syntax_highlight (buffer, &start, &end, FALSE);
+
+	/* Not analyzed yet. */
+	g_assert_false (has_context_class_at (buffer, 1, 0, "comment"));
+	g_assert_true (has_context_class_at (buffer, first_line, 6, "string"));
+	g_assert_false (has_context_class_at (buffer, first_line, 6, "comment"));
+
+	from_sync_point = get_highlighting (buffer, first_line, last_line);
+	g_assert_cmpstr (from_sync_point, ==, full);
+
+	g_free (from_sync_point);
+	g_free (full);
+	g_object_unref (buffer);
+	g_object_unref (full_buffer);
+}
+
+static void
+test_highlight_long_line (void)
+{
+	CtkSourceLanguageManager *lm;
+	CtkSourceLanguage *lang;
+	CtkSourceBuffer *buffer;
+	CtkSourceEngine *engine;
+	CtkSourceContextEngineStats stats;
+	CtkTextIter iter;
+	GString *text;
+	gint i;
+
+	lm = ctk_source_language_manager_get_default ();
+	lang = ctk_source_language_manager_get_language (lm, "c");
+	g_assert_true (CTK_SOURCE_IS_LANGUAGE (lang));
+	buffer = ctk_source_buffer_new_with_language (lang);
+	engine = _ctk_source_buffer_get_highlight_engine (buffer);
+
+	/* A single line long enough to be analyzed in several time slices
+	 * by the idle worker. */
+	text = g_string_new (NULL);
+	for (i = 0; i < 40000; i++)
+		g_string_append (text, "x = \"ab\"; ");
+	g_string_append (text, "\n/* c */\n");
+
+	ctk_text_buffer_set_text (CTK_TEXT_BUFFER (buffer), text->str, -1);
+	g_string_free (text, TRUE);
+
+	/* The first time slice stops in the middle of the line. */
+	_ctk_source_context_engine_get_stats (CTK_SOURCE_CONTEXT_ENGINE (engine), &stats);
+	while (!stats.long_line_pending && ctk_events_pending ())
+	{
+		ctk_main_iteration_do (FALSE);
+		_ctk_source_context_engine_get_stats (CTK_SOURCE_CONTEXT_ENGINE (engine), &stats);
+	}
+
+	g_assert_true (stats.long_line_pending);
+	g_assert_cmpuint (stats.n_long_line_resumes, ==, 0);
+	g_assert_true (has_context_class_at (buffer, 0, 5, "string"));
+	g_assert_false (has_context_class_at (buffer, 0, 399995, "string"));
+
+	flush_queue ();
+
+	/* And the next ones go on with the same line. */
+	_ctk_source_context_engine_get_stats (CTK_SOURCE_CONTEXT_ENGINE (engine), &stats);
+	g_assert_false (stats.long_line_pending);
+	g_assert_cmpuint (stats.n_long_line_resumes, >, 0);
+
+	g_assert_true (has_context_class_at (buffer, 0, 5, "string"));
+	g_assert_false (has_context_class_at (buffer, 0, 8, "string"));
+	g_assert_true (has_context_class_at (buffer, 0, 200005, "string"));
+	g_assert_false (has_context_class_at (buffer, 0, 200008, "string"));
+	g_assert_true (has_context_class_at (buffer, 0, 399995, "string"));
+	g_assert_true (has_context_class_at (buffer, 1, 3, "comment"));
+
+	/* An edit in the line while it is analyzed. */
+	ctk_text_buffer_get_start_iter (CTK_TEXT_BUFFER (buffer), &iter);
+	ctk_text_buffer_insert (CTK_TEXT_BUFFER (buffer), &iter, "\"", -1);
+	ctk_main_iteration_do (FALSE);
+	ctk_text_buffer_get_start_iter (CTK_TEXT_BUFFER (buffer), &iter);
+	ctk_text_buffer_insert (CTK_TEXT_BUFFER (buffer), &iter, "\" ", -1);
+	flush_queue ();
+
+	g_assert_true (has_context_class_at (buffer, 0, 0, "string"));
+	g_assert_true (has_context_class_at (buffer, 0, 8, "string"));
+	g_assert_true (has_context_class_at (buffer, 0, 200008, "string"));
+	g_assert_false (has_context_class_at (buffer, 0, 200011, "string"));
+	g_assert_true (has_context_class_at (buffer, 1, 3, "comment"));
+
+	g_object_unref (buffer);
+}
+
+static gchar *
+get_context_class_map (CtkSourceBuffer *buffer,
+		       const gchar     *context_class)
+{
+	GString *map = g_string_new (NULL);
+	CtkTextIter iter;
+
+	ctk_text_buffer_get_start_iter (CTK_TEXT_BUFFER (buffer), &iter);
+
+	do
+	{
+		CtkTextIter toggle = iter;
+		gboolean found;
+
+		g_string_append_c (map, ctk_source_buffer_iter_has_context_class (buffer, &iter, context_class) ? 'x' : '.');
+
+		found = ctk_source_buffer_iter_forward_to_context_class_toggle (buffer, &toggle, context_class);
+		g_string_append_printf (map, "%c%d", found ? '>' : '|', ctk_text_iter_get_offset (&toggle));
+
+		toggle = iter;
+		found = ctk_source_buffer_iter_backward_to_context_class_toggle (buffer, &toggle, context_class);
+		g_string_append_printf (map, "%c%d ", found ? '<' : '|', ctk_text_iter_get_offset (&toggle));
+	}
+	while (ctk_text_iter_forward_char (&iter));
+
+	return g_string_free (map, FALSE);
+}
+
+static void
+test_highlight_on_draw (void)
+{
+	const gchar *classes[] = { "string", "comment", "no-spell-check" };
+	CtkSourceLanguageManager *lm;
+	CtkSourceLanguage *lang;
+	CtkSourceBuffer *buffer;
+	CtkTextTagTable *tag_table;
+	CtkTextTag *tag;
+	CtkTextIter iter;
+	gchar *maps[G_N_ELEMENTS (classes)];
+	gchar **names;
+	gboolean highlight_on_draw;
+	guint i;
+
+	lm = ctk_source_language_manager_get_default ();
+	lang = ctk_source_language_manager_get_language (lm, "c");
+	g_assert_true (CTK_SOURCE_IS_LANGUAGE (lang));
+	buffer = ctk_source_buffer_new_with_language (lang);
+
+	g_assert_false (ctk_source_buffer_get_highlight_on_draw (buffer));
+
+	ctk_text_buffer_set_text (CTK_TEXT_BUFFER (buffer),
+				  "int x = 1; /* a \"b\" */\n"
+				  "char *s = \"c\\n d\"; // e\n"
+				  "\"f\"",
+				  -1);
+	ensure_highlight_all (buffer);
+
+	for (i = 0; i < G_N_ELEMENTS (classes); i++)
+		maps[i] = get_context_class_map (buffer, classes[i]);
+
+	/* The context classes found in the syntax tree must be the same
+	 * as the ones found with the tags.
+	 */
+	ctk_source_buffer_set_highlight_on_draw (buffer, TRUE);
+	g_object_get (buffer, "highlight-on-draw", &highlight_on_draw, NULL);
+	g_assert_true (highlight_on_draw);
+
+	for (i = 0; i < G_N_ELEMENTS (classes); i++)
+	{
+		gchar *map = get_context_class_map (buffer, classes[i]);
+		g_assert_cmpstr (map, ==, maps[i]);
+		g_free (map);
+	}
+
+	tag_table = ctk_text_buffer_get_tag_table (CTK_TEXT_BUFFER (buffer));
+	tag = ctk_text_tag_table_lookup (tag_table, "ctksourceview:context-classes:string");
+	ctk_text_buffer_get_iter_at_line_offset (CTK_TEXT_BUFFER (buffer), &iter, 1, 11);
+	g_assert_true (tag == NULL || !ctk_text_iter_has_tag (&iter, tag));
+
+	names = ctk_source_buffer_get_context_classes_at_iter (buffer, &iter);
+	g_assert_true (g_strv_contains ((const gchar * const *) names, "string"));
+	g_assert_false (g_strv_contains ((const gchar * const *) names, "comment"));
+	g_strfreev (names);
+
+	/* And they follow the edits. */
+	ctk_text_buffer_get_start_iter (CTK_TEXT_BUFFER (buffer), &iter);
+	ctk_text_buffer_insert (CTK_TEXT_BUFFER (buffer), &iter, "/* */", -1);
+	ensure_highlight_all (buffer);
+
+	g_assert_true (has_context_class_at (buffer, 0, 2, "comment"));
+	g_assert_false (has_context_class_at (buffer, 0, 6, "comment"));
+	g_assert_true (has_context_class_at (buffer, 2, 1, "string"));
+
+	g_object_set (buffer, "highlight-on-draw", FALSE, NULL);
+	ensure_highlight_all (buffer);
+
+	g_assert_true (has_context_class_at (buffer, 0, 2, "comment"));
+	g_assert_false (has_context_class_at (buffer, 0, 6, "comment"));
+	g_assert_true (has_context_class_at (buffer, 2, 1, "string"));
+
+	for (i = 0; i < G_N_ELEMENTS (classes); i++)
+		g_free (maps[i]);
+
+	g_object_unref (buffer);
+}
+
+/* While the analysis is frozen, the context classes found in the tree
+ * follow the edits the way the tags do. */
+static void
+test_highlight_on_draw_frozen (void)
+{
+	const gchar *classes[] = { "string", "comment" };
+	CtkSourceLanguageManager *lm;
+	CtkSourceLanguage *lang;
+	CtkSourceBuffer *buffers[2];
+	CtkSourceBuffer *buffer;
+	CtkTextIter iter, end;
+	GString *text;
+	guint i, n;
+
+	lm = ctk_source_language_manager_get_default ();
+	lang = ctk_source_language_manager_get_language (lm, "c");
+	g_assert_true (CTK_SOURCE_IS_LANGUAGE (lang));
+
+	text = g_string_new (NULL);
+	for (i = 0; i < 30; i++)
+		g_string_append (text, "x = \"a\"; /* b */\n");
+
+	for (n = 0; n < G_N_ELEMENTS (buffers); n++)
+	{
+		buffer = buffers[n] = ctk_source_buffer_new_with_language (lang);
+		ctk_source_buffer_set_highlight_on_draw (buffer, n == 1);
+		ctk_text_buffer_set_text (CTK_TEXT_BUFFER (buffer), text->str, -1);
+		ensure_highlight_all (buffer);
+
+		ctk_source_buffer_freeze_highlight (buffer);
+
+		/* Inserted at a line start, the text has no tags. */
+		ctk_text_buffer_get_iter_at_line (CTK_TEXT_BUFFER (buffer), &iter, 5);
+		ctk_text_buffer_insert (CTK_TEXT_BUFFER (buffer), &iter, "y = 1;\n", -1);
+	}
+
+	g_string_free (text, TRUE);
+
+	for (i = 0; i < G_N_ELEMENTS (classes); i++)
+	{
+		gchar *tags_map = get_context_class_map (buffers[0], classes[i]);
+		gchar *tree_map = get_context_class_map (buffers[1], classes[i]);
+
+		g_assert_cmpstr (tree_map, ==, tags_map);
+
+		g_free (tags_map);
+		g_free (tree_map);
+	}
+
+	/* Around a deletion too. */
+	buffer = buffers[1];
+	ctk_text_buffer_get_iter_at_line (CTK_TEXT_BUFFER (buffer), &iter, 12);
+	ctk_text_buffer_get_iter_at_line (CTK_TEXT_BUFFER (buffer), &end, 15);
+	ctk_text_buffer_delete (CTK_TEXT_BUFFER (buffer), &iter, &end);
+
+	g_assert_true (has_context_class_at (buffer, 2, 5, "string"));
+	g_assert_true (has_context_class_at (buffer, 2, 12, "comment"));
+	g_assert_false (has_context_class_at (buffer, 5, 1, "string"));
+	g_assert_true (has_context_class_at (buffer, 20, 5, "string"));
+	g_assert_true (has_context_class_at (buffer, 20, 12, "comment"));
+	g_assert_false (has_context_class_at (buffer, 20, 8, "comment"));
+
+	ctk_text_buffer_get_iter_at_line (CTK_TEXT_BUFFER (buffer), &iter, 20);
+	g_assert_true (ctk_source_buffer_iter_backward_to_context_class_toggle (buffer, &iter, "string"));
+	g_assert_cmpint (ctk_text_iter_get_line (&iter), ==, 19);
+	g_assert_cmpint (ctk_text_iter_get_line_offset (&iter), ==, 7);
+
+	/* Once analyzed again, the new text has its context classes. */
+	ctk_source_buffer_thaw_highlight (buffer);
+	ensure_highlight_all (buffer);
+
+	g_assert_true (has_context_class_at (buffer, 20, 5, "string"));
+	g_assert_true (has_context_class_at (buffer, 20, 12, "comment"));
+
+	for (n = 0; n < G_N_ELEMENTS (buffers); n++)
+		g_object_unref (buffers[n]);
+}
+
+static void
+test_highlight_mirror (void)
+{
+	CtkSourceLanguageManager *lm;
+	CtkSourceLanguage *lang;
+	CtkSourceBuffer *source;
+	CtkSourceBuffer *mirror;
+	CtkSourceContextEngineStats stats;
+	CtkSourceEngine *engine;
+	CtkTextIter iter;
+	const gchar *text = "int x = 1; /* a \"b\" */\n"
+			    "char *s = \"c\"; // e\n";
+
+	lm = ctk_source_language_manager_get_default ();
+	lang = ctk_source_language_manager_get_language (lm, "c");
+	g_assert_true (CTK_SOURCE_IS_LANGUAGE (lang));
+
+	source = ctk_source_buffer_new_with_language (lang);
+	mirror = ctk_source_buffer_new (ctk_text_buffer_get_tag_table (CTK_TEXT_BUFFER (source)));
+	ctk_source_buffer_set_language (mirror, lang);
+	ctk_source_buffer_set_highlight_mirror (mirror, source);
+	g_assert_true (ctk_source_buffer_get_highlight_mirror (mirror) == source);
+
+	ctk_text_buffer_set_text (CTK_TEXT_BUFFER (source), text, -1);
+	ctk_text_buffer_set_text (CTK_TEXT_BUFFER (mirror), text, -1);
+	ensure_highlight_all (mirror);
+
+	g_assert_true (has_context_class_at (mirror, 0, 13, "comment"));
+	g_assert_false (has_context_class_at (mirror, 0, 6, "comment"));
+	g_assert_true (has_context_class_at (mirror, 1, 11, "string"));
+	g_assert_false (has_context_class_at (mirror, 1, 3, "string"));
+
+	/* Only the source has a syntax tree. */
+	engine = _ctk_source_buffer_get_highlight_engine (mirror);
+	g_assert_true (CTK_SOURCE_IS_CONTEXT_ENGINE (engine));
+	_ctk_source_context_engine_get_stats (CTK_SOURCE_CONTEXT_ENGINE (engine), &stats);
+	g_assert_cmpuint (stats.peak_segments, ==, 0);
+
+	engine = _ctk_source_buffer_get_highlight_engine (source);
+	_ctk_source_context_engine_get_stats (CTK_SOURCE_CONTEXT_ENGINE (engine), &stats);
+	g_assert_cmpuint (stats.n_segments, >, 0);
+
+	/* The same edit in both buffers. */
+	ctk_text_buffer_get_start_iter (CTK_TEXT_BUFFER (source), &iter);
+	ctk_text_buffer_insert (CTK_TEXT_BUFFER (source), &iter, "/* */", -1);
+	ctk_text_buffer_get_start_iter (CTK_TEXT_BUFFER (mirror), &iter);
+	ctk_text_buffer_insert (CTK_TEXT_BUFFER (mirror), &iter, "/* */", -1);
+	ensure_highlight_all (mirror);
+
+	g_assert_true (has_context_class_at (mirror, 0, 2, "comment"));
+	g_assert_false (has_context_class_at (mirror, 0, 6, "comment"));
+	g_assert_true (has_context_class_at (mirror, 0, 18, "comment"));
+
+	/* Without the source, the mirror is analyzed on its own. */
+	g_object_unref (source);
+	g_assert_null (ctk_source_buffer_get_highlight_mirror (mirror));
+	ensure_highlight_all (mirror);
+
+	g_assert_true (has_context_class_at (mirror, 0, 18, "comment"));
+	g_assert_true (has_context_class_at (mirror, 1, 11, "string"));
+
+	g_object_unref (mirror);
+}
+
+static void
+test_highlight_mirror_chain (void)
+{
+	CtkSourceLanguageManager *lm;
+	CtkSourceLanguage *lang;
+	CtkSourceBuffer *root;
+	CtkSourceBuffer *middle;
+	CtkSourceBuffer *leaf;
+	CtkSourceContextEngineStats stats;
+	const gchar *text = "int x = 1; /* a \"b\" */\n"
+			    "char *s = \"c\"; // e\n";
+
+	lm = ctk_source_language_manager_get_default ();
+	lang = ctk_source_language_manager_get_language (lm, "c");
+	g_assert_true (CTK_SOURCE_IS_LANGUAGE (lang));
+
+	root = ctk_source_buffer_new_with_language (lang);
+	middle = ctk_source_buffer_new (ctk_text_buffer_get_tag_table (CTK_TEXT_BUFFER (root)));
+	leaf = ctk_source_buffer_new (ctk_text_buffer_get_tag_table (CTK_TEXT_BUFFER (root)));
+	ctk_source_buffer_set_language (middle, lang);
+	ctk_source_buffer_set_language (leaf, lang);
+
+	/* The leaf is set up first, it follows when the middle buffer
+	 * starts mirroring the root. */
+	ctk_source_buffer_set_highlight_mirror (leaf, middle);
+	ctk_source_buffer_set_highlight_mirror (middle, root);
+
+	ctk_text_buffer_set_text (CTK_TEXT_BUFFER (root), text, -1);
+	ctk_text_buffer_set_text (CTK_TEXT_BUFFER (middle), text, -1);
+	ctk_text_buffer_set_text (CTK_TEXT_BUFFER (leaf), text, -1);
+	ensure_highlight_all (leaf);
+
+	g_assert_true (has_context_class_at (leaf, 0, 13, "comment"));
+	g_assert_true (has_context_class_at (leaf, 1, 11, "string"));
+
+	_ctk_source_context_engine_get_stats (CTK_SOURCE_CONTEXT_ENGINE (_ctk_source_buffer_get_highlight_engine (leaf)), &stats);
+	g_assert_cmpuint (stats.peak_segments, ==, 0);
+	_ctk_source_context_engine_get_stats (CTK_SOURCE_CONTEXT_ENGINE (_ctk_source_buffer_get_highlight_engine (middle)), &stats);
+	g_assert_cmpuint (stats.peak_segments, ==, 0);
+	_ctk_source_context_engine_get_stats (CTK_SOURCE_CONTEXT_ENGINE (_ctk_source_buffer_get_highlight_engine (root)), &stats);
+	g_assert_cmpuint (stats.n_segments, >, 0);
+
+	/* No cycles. */
+	g_test_expect_message ("CtkSourceView", G_LOG_LEVEL_CRITICAL, "*is_highlight_mirror_of*");
+	ctk_source_buffer_set_highlight_mirror (root, leaf);
+	g_test_assert_expected_messages ();
+	g_assert_null (ctk_source_buffer_get_highlight_mirror (root));
+
+	/* Once the root has another language, the middle buffer is
+	 * analyzed on its own, and the leaf shares its analysis. */
+	ctk_source_buffer_set_language (root, ctk_source_language_manager_get_language (lm, "python"));
+	ensure_highlight_all (leaf);
+
+	g_assert_true (has_context_class_at (leaf, 0, 13, "comment"));
+	g_assert_true (has_context_class_at (leaf, 1, 11, "string"));
+
+	_ctk_source_context_engine_get_stats (CTK_SOURCE_CONTEXT_ENGINE (_ctk_source_buffer_get_highlight_engine (leaf)), &stats);
+	g_assert_cmpuint (stats.peak_segments, ==, 0);
+	_ctk_source_context_engine_get_stats (CTK_SOURCE_CONTEXT_ENGINE (_ctk_source_buffer_get_highlight_engine (middle)), &stats);
+	g_assert_cmpuint (stats.n_segments, >, 0);
+
+	/* Without the middle buffer, the leaf is analyzed on its own. */
+	g_object_unref (middle);
+	g_assert_null (ctk_source_buffer_get_highlight_mirror (leaf));
+	ensure_highlight_all (leaf);
+
+	g_assert_true (has_context_class_at (leaf, 0, 13, "comment"));
+	g_assert_true (has_context_class_at (leaf, 1, 11, "string"));
+
+	g_object_unref (leaf);
+	g_object_unref (root);
+}
+
+static void
+test_highlight_freeze (void)
+{
+	CtkSourceLanguageManager *lm;
+	CtkSourceLanguage *lang;
+	CtkSourceBuffer *buffer;
+	CtkTextIter iter, end;
+	GString *text;
+	gint i;
+
+	lm = ctk_source_language_manager_get_default ();
+	lang = ctk_source_language_manager_get_language (lm, "c");
+	g_assert_true (CTK_SOURCE_IS_LANGUAGE (lang));
+	buffer = ctk_source_buffer_new_with_language (lang);
+
+	text = g_string_new (NULL);
+	for (i = 0; i < 100; i++)
+		g_string_append (text, "x = 1;\n");
+
+	ctk_text_buffer_set_text (CTK_TEXT_BUFFER (buffer), text->str, -1);
+	g_string_free (text, TRUE);
+	ensure_highlight_all (buffer);
+
+	ctk_source_buffer_freeze_highlight (buffer);
+	ctk_source_buffer_freeze_highlight (buffer);
+
+	/* Edits far from each other, in both directions. */
+	ctk_text_buffer_get_iter_at_line (CTK_TEXT_BUFFER (buffer), &iter, 80);
+	ctk_text_buffer_insert (CTK_TEXT_BUFFER (buffer), &iter, "s = \"t\";", -1);
+	ctk_text_buffer_get_iter_at_line (CTK_TEXT_BUFFER (buffer), &iter, 10);
+	ctk_text_buffer_insert (CTK_TEXT_BUFFER (buffer), &iter, "/*", -1);
+	ctk_text_buffer_get_iter_at_line (CTK_TEXT_BUFFER (buffer), &iter, 20);
+	ctk_text_buffer_insert (CTK_TEXT_BUFFER (buffer), &iter, "*/", -1);
+	ctk_text_buffer_get_iter_at_line (CTK_TEXT_BUFFER (buffer), &iter, 50);
+	ctk_text_buffer_get_iter_at_line (CTK_TEXT_BUFFER (buffer), &end, 60);
+	ctk_text_buffer_delete (CTK_TEXT_BUFFER (buffer), &iter, &end);
+
+	/* Nothing is analyzed until the last thaw. */
+	ensure_highlight_all (buffer);
+	g_assert_false (has_context_class_at (buffer, 15, 1, "comment"));
+
+	ctk_source_buffer_thaw_highlight (buffer);
+	ensure_highlight_all (buffer);
+	g_assert_false (has_context_class_at (buffer, 15, 1, "comment"));
+
+	ctk_source_buffer_thaw_highlight (buffer);
+	ensure_highlight_all (buffer);
+
+	g_assert_true (has_context_class_at (buffer, 15, 1, "comment"));
+	g_assert_true (has_context_class_at (buffer, 20, 0, "comment"));
+	g_assert_false (has_context_class_at (buffer, 20, 4, "comment"));
+	g_assert_true (has_context_class_at (buffer, 70, 5, "string"));
+	g_assert_false (has_context_class_at (buffer, 50, 1, "string"));
+
+	/* An engine created while frozen stays frozen. */
+	ctk_source_buffer_freeze_highlight (buffer);
+	ctk_source_buffer_set_language (buffer, NULL);
+	ctk_source_buffer_set_language (buffer, lang);
+	ensure_highlight_all (buffer);
+	g_assert_false (has_context_class_at (buffer, 15, 1, "comment"));
+
+	ctk_source_buffer_thaw_highlight (buffer);
+	ensure_highlight_all (buffer);
+	g_assert_true (has_context_class_at (buffer, 15, 1, "comment"));
+
+	g_object_unref (buffer);
+}
+
+static void
+test_highlight_non_ascii (void)
+{
+	CtkSourceLanguageManager *lm;
+	CtkSourceLanguage *lang;
+	CtkSourceBuffer *buffer;
+	GString *text;
+	gint line;
+	gint i;
+
+	lm = ctk_source_language_manager_get_default ();
+	lang = ctk_source_language_manager_get_language (lm, "c");
+	g_assert_true (CTK_SOURCE_IS_LANGUAGE (lang));
+	buffer = ctk_source_buffer_new_with_language (lang);
+
+	/* Long lines, where the character offsets are looked up in an
+	 * index, and a short one. */
+	text = g_string_new (NULL);
+	for (line = 0; line < 3; line++)
+	{
+		g_string_append (text, "x = \"");
+		for (i = 0; i < 300; i++)
+			g_string_append (text, "é");
+		g_string_append (text, "\"; /* ü */ y = 1;\n");
+	}
+	g_string_append (text, "\"é\" /* ü */\n");
+
+	ctk_text_buffer_set_text (CTK_TEXT_BUFFER (buffer), text->str, -1);
+	g_string_free (text, TRUE);
+	ensure_highlight_all (buffer);
+
+	for (line = 0; line < 3; line++)
+	{
+		g_assert_false (has_context_class_at (buffer, line, 3, "string"));
+		g_assert_true (has_context_class_at (buffer, line, 5, "string"));
+		g_assert_true (has_context_class_at (buffer, line, 305, "string"));
+		g_assert_false (has_context_class_at (buffer, line, 306, "string"));
+		g_assert_false (has_context_class_at (buffer, line, 307, "comment"));
+		g_assert_true (has_context_class_at (buffer, line, 311, "comment"));
+		g_assert_true (has_context_class_at (buffer, line, 314, "comment"));
+		g_assert_false (has_context_class_at (buffer, line, 316, "comment"));
+	}
+
+	g_assert_true (has_context_class_at (buffer, 3, 1, "string"));
+	g_assert_false (has_context_class_at (buffer, 3, 3, "string"));
+	g_assert_true (has_context_class_at (buffer, 3, 7, "comment"));
+
+	g_object_unref (buffer);
+}
+
+static const gchar *cache_language =
+	"<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+	"<language id=\"test-cache\" name=\"Test Cache\" version=\"2.0\" section=\"Others\">\n"
+	"  <styles>\n"
+	"    <style id=\"comment\" name=\"Comment\"/>\n"
+	"    <style id=\"string\" name=\"String\"/>\n"
+	"  </styles>\n"
+	"  <definitions>\n"
+	"    <context id=\"comment\" style-ref=\"comment\" class=\"comment\">\n"
+	"      <start>/\\*</start>\n"
+	"      <end>\\*/</end>\n"
+	"    </context>\n"
+	"    <context id=\"string\" style-ref=\"string\" class=\"string\" end-at-line-end=\"true\">\n"
+	"      <start>\"</start>\n"
+	"      <end>\"</end>\n"
+	"    </context>\n"
+	"    <context id=\"test-cache\">\n"
+	"      <include>\n"
+	"        <context ref=\"comment\"/>\n"
+	"        <context ref=\"string\"/>\n"
+	"      </include>\n"
+	"    </context>\n"
+	"  </definitions>\n"
+	"</language>\n";
+
+static const gchar *cache_text =
+	"a \"b\" /* c\n"
+	"d */ \"e\n"
+	"f /* \"g\" */\n";
+
+/* A language manager finding the .lang files written in @dir. */
+static CtkSourceLanguageManager *
+new_test_language_manager (const gchar *dir)
+{
+	CtkSourceLanguageManager *lm;
+	gchar *lang_dirs[3];
+
+	/* For the RelaxNG schema. */
+	lang_dirs[0] = (gchar *) dir;
+	lang_dirs[1] = g_build_filename (TOP_SRCDIR, "data", "language-specs", NULL);
+	lang_dirs[2] = NULL;
+
+	lm = ctk_source_language_manager_new ();
+	ctk_source_language_manager_set_search_path (lm, lang_dirs);
+	g_free (lang_dirs[1]);
+
+	return lm;
+}
+
+/* Loads @text as if from a file, and waits for the highlight cache
+ * lookup. */
+static CtkSourceBuffer *
+new_cached_buffer (CtkSourceLanguage           *lang,
+		   CtkSourceContextEngineStats *stats)
+{
+	CtkSourceBuffer *buffer;
+	CtkSourceEngine *engine;
+
+	buffer = ctk_source_buffer_new_with_language (lang);
+	ctk_source_buffer_set_highlight_cache (buffer, TRUE);
+	ctk_text_buffer_set_text (CTK_TEXT_BUFFER (buffer), cache_text, -1);
+	_ctk_source_buffer_text_loaded (buffer);
+
+	engine = _ctk_source_buffer_get_highlight_engine (buffer);
+	g_assert_true (CTK_SOURCE_IS_CONTEXT_ENGINE (engine));
+
+	_ctk_source_context_engine_get_stats (CTK_SOURCE_CONTEXT_ENGINE (engine), stats);
+	while (stats->n_cache_hits + stats->n_cache_misses == 0)
+	{
+		g_main_context_iteration (NULL, TRUE);
+		_ctk_source_context_engine_get_stats (CTK_SOURCE_CONTEXT_ENGINE (engine), stats);
+	}
+
+	return buffer;
+}
+
+/* The cache files are written in a thread. */
+static void
+wait_for_cache_files (guint n_files)
+{
+	gchar *dir;
+	gint i;
+
+	dir = g_build_filename (g_get_user_cache_dir (),
+				"ctksourceview-" GSV_API_VERSION_S,
+				"highlight",
+				NULL);
+
+	for (i = 0; i < 1000; i++)
+	{
+		GDir *cache_dir;
+		guint n = 0;
+
+		cache_dir = g_dir_open (dir, 0, NULL);
+		if (cache_dir != NULL)
+		{
+			while (g_dir_read_name (cache_dir) != NULL)
+				n++;
+			g_dir_close (cache_dir);
+		}
+
+		if (n >= n_files)
+			break;
+
+		g_usleep (G_USEC_PER_SEC / 100);
+	}
+
+	g_assert_cmpint (i, <, 1000);
+	g_free (dir);
+}
+
+static void
+test_highlight_cache (void)
+{
+	const gchar *classes[] = { "string", "comment" };
+	CtkSourceLanguageManager *lm;
+	CtkSourceLanguage *lang;
+	CtkSourceBuffer *buffer;
+	CtkSourceContextEngineStats stats;
+	gchar *lang_dir;
+	gchar *lang_file;
+	gchar *changed_language;
+	gchar *maps[G_N_ELEMENTS (classes)];
+	guint n_segments;
+	guint i;
+
+	lang_dir = g_dir_make_tmp ("test-cache-XXXXXX", NULL);
+	g_assert_nonnull (lang_dir);
+	lang_file = g_build_filename (lang_dir, "test-cache.lang", NULL);
+	g_assert_true (g_file_set_contents (lang_file, cache_language, -1, NULL));
+
+	lm = new_test_language_manager (lang_dir);
+	lang = ctk_source_language_manager_get_language (lm, "test-cache");
+	g_assert_true (CTK_SOURCE_IS_LANGUAGE (lang));
+
+	/* A miss, the tree is saved once analyzed. */
+	buffer = new_cached_buffer (lang, &stats);
+	g_assert_cmpuint (stats.n_cache_hits, ==, 0);
+	g_assert_cmpuint (stats.n_cache_misses, ==, 1);
+
+	ensure_highlight_all (buffer);
+	wait_for_cache_files (1);
+
+	g_assert_true (has_context_class_at (buffer, 1, 1, "comment"));
+	for (i = 0; i < G_N_ELEMENTS (classes); i++)
+		maps[i] = get_context_class_map (buffer, classes[i]);
+
+	_ctk_source_context_engine_get_stats (CTK_SOURCE_CONTEXT_ENGINE (_ctk_source_buffer_get_highlight_engine (buffer)), &stats);
+	n_segments = stats.n_segments;
+	g_object_unref (buffer);
+
+	/* The same text is restored from the cache, and highlighted the
+	 * same way. */
+	buffer = new_cached_buffer (lang, &stats);
+	g_assert_cmpuint (stats.n_cache_hits, ==, 1);
+	g_assert_cmpuint (stats.n_cache_misses, ==, 0);
+	g_assert_cmpuint (stats.n_segments, ==, n_segments);
+
+	ensure_highlight_all (buffer);
+
+	for (i = 0; i < G_N_ELEMENTS (classes); i++)
+	{
+		gchar *map = get_context_class_map (buffer, classes[i]);
+		g_assert_cmpstr (map, ==, maps[i]);
+		g_free (map);
+	}
+
+	g_object_unref (buffer);
+	g_object_unref (lm);
+
+	/* Once the language file changed, the key is stale. */
+	changed_language = g_strconcat (cache_language, "<!-- changed -->\n", NULL);
+	g_assert_true (g_file_set_contents (lang_file, changed_language, -1, NULL));
+	g_free (changed_language);
+
+	lm = new_test_language_manager (lang_dir);
+	lang = ctk_source_language_manager_get_language (lm, "test-cache");
+	g_assert_true (CTK_SOURCE_IS_LANGUAGE (lang));
+
+	buffer = new_cached_buffer (lang, &stats);
+	g_assert_cmpuint (stats.n_cache_hits, ==, 0);
+	g_assert_cmpuint (stats.n_cache_misses, ==, 1);
+
+	ensure_highlight_all (buffer);
+	g_assert_true (has_context_class_at (buffer, 1, 1, "comment"));
+
+	g_object_unref (buffer);
+	g_object_unref (lm);
+
+	for (i = 0; i < G_N_ELEMENTS (classes); i++)
+		g_free (maps[i]);
+
+	g_unlink (lang_file);
+	g_rmdir (lang_dir);
+	g_free (lang_file);
+	g_free (lang_dir);
+}
+
+static const gchar *resolve_language =
+	"<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+	"<language id=\"test-resolve\" name=\"Test Resolve\" version=\"2.0\" section=\"Others\">\n"
+	"  <styles>\n"
+	"    <style id=\"string\" name=\"String\"/>\n"
+	"  </styles>\n"
+	"  <definitions>\n"
+	"    <context id=\"heredoc\" style-ref=\"string\" class=\"string\">\n"
+	"      <start>(?&lt;=(?P&lt;tag&gt;[a-z]):)&lt;&lt;</start>\n"
+	"      <end>\\%{tag@start}</end>\n"
+	"    </context>\n"
+	"    <context id=\"test-resolve\">\n"
+	"      <include>\n"
+	"        <context ref=\"heredoc\"/>\n"
+	"      </include>\n"
+	"    </context>\n"
+	"  </definitions>\n"
+	"</language>\n";
+
+static void
+check_resolved_ends (CtkSourceBuffer *buffer)
+{
+	/* Same start match, the delimiter is captured before it. */
+	g_assert_true (has_context_class_at (buffer, 0, 5, "string"));
+	g_assert_true (has_context_class_at (buffer, 0, 7, "string"));
+	g_assert_false (has_context_class_at (buffer, 0, 9, "string"));
+
+	g_assert_true (has_context_class_at (buffer, 1, 5, "string"));
+	g_assert_true (has_context_class_at (buffer, 1, 7, "string"));
+	g_assert_false (has_context_class_at (buffer, 1, 9, "string"));
+}
+
+static void
+test_highlight_resolved_end (void)
+{
+	CtkSourceLanguageManager *lm;
+	CtkSourceLanguage *lang;
+	CtkSourceBuffer *buffer;
+	CtkSourceContextEngineStats stats;
+	guint n_hits;
+	guint n_misses;
+	gchar *lang_dir;
+	gchar *lang_file;
+
+	lang_dir = g_dir_make_tmp ("test-resolve-XXXXXX", NULL);
+	g_assert_nonnull (lang_dir);
+	lang_file = g_build_filename (lang_dir, "test-resolve.lang", NULL);
+	g_assert_true (g_file_set_contents (lang_file, resolve_language, -1, NULL));
+
+	lm = new_test_language_manager (lang_dir);
+	lang = ctk_source_language_manager_get_language (lm, "test-resolve");
+	g_assert_true (CTK_SOURCE_IS_LANGUAGE (lang));
+
+	buffer = ctk_source_buffer_new_with_language (lang);
+	ctk_text_buffer_set_text (CTK_TEXT_BUFFER (buffer),
+				  "a:<< b a c\n"
+				  "b:<< a b c\n",
+				  -1);
+	ensure_highlight_all (buffer);
+	check_resolved_ends (buffer);
+
+	_ctk_source_context_engine_get_stats (CTK_SOURCE_CONTEXT_ENGINE (_ctk_source_buffer_get_highlight_engine (buffer)), &stats);
+	g_assert_cmpuint (stats.n_resolved_end_misses, ==, 2);
+	n_hits = stats.n_resolved_end_hits;
+	n_misses = stats.n_resolved_end_misses;
+	g_object_unref (buffer);
+
+	/* Another buffer reuses the end regexes resolved for the first
+	 * one. */
+	buffer = ctk_source_buffer_new_with_language (lang);
+	ctk_text_buffer_set_text (CTK_TEXT_BUFFER (buffer),
+				  "a:<< b a c\n"
+				  "b:<< a b c\n",
+				  -1);
+	ensure_highlight_all (buffer);
+	check_resolved_ends (buffer);
+
+	_ctk_source_context_engine_get_stats (CTK_SOURCE_CONTEXT_ENGINE (_ctk_source_buffer_get_highlight_engine (buffer)), &stats);
+	g_assert_cmpuint (stats.n_resolved_end_misses, ==, n_misses);
+	g_assert_cmpuint (stats.n_resolved_end_hits, >, n_hits);
+
+	g_object_unref (buffer);
+	g_object_unref (lm);
+
+	g_unlink (lang_file);
+	g_rmdir (lang_dir);
+	g_free (lang_file);
+	g_free (lang_dir);
+}
+
+static void
+test_highlight_many_segments (void)
+{
+	CtkSourceLanguageManager *lm;
+	CtkSourceLanguage *lang;
+	CtkSourceBuffer *buffer;
+	CtkTextIter iter;
+	GString *text;
+	gint i;
+
+	lm = ctk_source_language_manager_get_default ();
+	lang = ctk_source_language_manager_get_language (lm, "c");
+	g_assert_true (CTK_SOURCE_IS_LANGUAGE (lang));
+	buffer = ctk_source_buffer_new_with_language (lang);
+
+	/* Enough sibling segments for lookups to go through the index. */
+	text = g_string_new (NULL);
+	for (i = 0; i < 200; i++)
+		g_string_append (text, "/* c */ x = \"s\";\n");
+
+	ctk_text_buffer_set_text (CTK_TEXT_BUFFER (buffer), text->str, -1);
+	g_string_free (text, TRUE);
+	ensure_highlight_all (buffer);
+
+	g_assert_true (has_context_class_at (buffer, 150, 3, "comment"));
+	g_assert_true (has_context_class_at (buffer, 150, 13, "string"));
+
+	/* Edits far from each other, in both directions. */
+	ctk_text_buffer_get_iter_at_line_offset (CTK_TEXT_BUFFER (buffer), &iter, 180, 8);
+	ctk_text_buffer_insert (CTK_TEXT_BUFFER (buffer), &iter, "y ", -1);
+	ctk_text_buffer_get_iter_at_line_offset (CTK_TEXT_BUFFER (buffer), &iter, 10, 8);
+	ctk_text_buffer_insert (CTK_TEXT_BUFFER (buffer), &iter, "y ", -1);
+	ctk_text_buffer_get_iter_at_line_offset (CTK_TEXT_BUFFER (buffer), &iter, 120, 3);
+	ctk_text_buffer_insert (CTK_TEXT_BUFFER (buffer), &iter, "*/ /*", -1);
+	ensure_highlight_all (buffer);
+
+	g_assert_true (has_context_class_at (buffer, 10, 3, "comment"));
+	g_assert_false (has_context_class_at (buffer, 10, 8, "comment"));
+	g_assert_true (has_context_class_at (buffer, 10, 15, "string"));
+	g_assert_true (has_context_class_at (buffer, 120, 1, "comment"));
+	g_assert_false (has_context_class_at (buffer, 120, 5, "comment"));
+	g_assert_true (has_context_class_at (buffer, 180, 15, "string"));
+	g_assert_true (has_context_class_at (buffer, 199, 3, "comment"));
+
+	/* A comment left open at the end of a line spans into the next one. */
+	ctk_text_buffer_get_iter_at_line (CTK_TEXT_BUFFER (buffer), &iter, 5);
+	ctk_text_iter_forward_to_line_end (&iter);
+	ctk_text_buffer_insert (CTK_TEXT_BUFFER (buffer), &iter, " /*", -1);
+	ensure_highlight_all (buffer);
+
+	g_assert_true (has_context_class_at (buffer, 6, 0, "comment"));
+	g_assert_false (has_context_class_at (buffer, 6, 8, "comment"));
+	g_assert_true (has_context_class_at (buffer, 7, 3, "comment"));
+	g_assert_true (has_context_class_at (buffer, 150, 13, "string"));
+
+	g_object_unref (buffer);
+}
+
+static void
+assert_same_highlight (CtkSourceBuffer *buffer,
+		       CtkSourceBuffer *expected)
+{
+	CtkTextIter iter;
+	CtkTextIter expected_iter;
+
+	ctk_text_buffer_get_start_iter (CTK_TEXT_BUFFER (buffer), &iter);
+	ctk_text_buffer_get_start_iter (CTK_TEXT_BUFFER (expected), &expected_iter);
+
+	do
+	{
+		g_assert_cmpint (ctk_source_buffer_iter_has_context_class (buffer, &iter, "comment"), ==,
+				 ctk_source_buffer_iter_has_context_class (expected, &expected_iter, "comment"));
+		g_assert_cmpint (ctk_source_buffer_iter_has_context_class (buffer, &iter, "string"), ==,
+				 ctk_source_buffer_iter_has_context_class (expected, &expected_iter, "string"));
+
+		ctk_text_iter_forward_char (&expected_iter);
+	}
+	while (ctk_text_iter_forward_char (&iter));
+}
+
+static void
+test_highlight_edits (void)
+{
+	static const gchar *pieces[] = {
+		"x", " ", "\n", "/*", "*/", "\"", "//", "y = 1;\n", "/* c */ x = \"s\";\n"
+	};
+	CtkSourceLanguageManager *lm;
+	CtkSourceLanguage *lang;
+	CtkSourceBuffer *buffer;
+	CtkSourceBuffer *expected;
+	CtkTextIter start;
+	CtkTextIter end;
+	GString *text;
+	GRand *rand;
+	gchar *contents;
+	gint i;
+
+	lm = ctk_source_language_manager_get_default ();
+	lang = ctk_source_language_manager_get_language (lm, "c");
+	g_assert_true (CTK_SOURCE_IS_LANGUAGE (lang));
+	buffer = ctk_source_buffer_new_with_language (lang);
+
+	/* Edits move the segments after them, and the segments around
+	 * them are split, merged and erased; the result must be the same
+	 * as highlighting the final text from scratch. */
+	text = g_string_new (NULL);
+	for (i = 0; i < 100; i++)
+		g_string_append (text, "/* c */ x = \"s\"; { y = \"t\"; }\n");
+
+	ctk_text_buffer_set_text (CTK_TEXT_BUFFER (buffer), text->str, -1);
+	g_string_free (text, TRUE);
+	ensure_highlight_all (buffer);
+
+	rand = g_rand_new_with_seed (7);
+
+	for (i = 0; i < 200; i++)
+	{
+		gint n_chars = ctk_text_buffer_get_char_count (CTK_TEXT_BUFFER (buffer));
+		gint offset = g_rand_int_range (rand, 0, n_chars + 1);
+
+		ctk_text_buffer_get_iter_at_offset (CTK_TEXT_BUFFER (buffer), &start, offset);
+
+		if (g_rand_boolean (rand) || offset == n_chars)
+		{
+			const gchar *piece = pieces[g_rand_int_range (rand, 0, G_N_ELEMENTS (pieces))];
+
+			ctk_text_buffer_insert (CTK_TEXT_BUFFER (buffer), &start, piece, -1);
+		}
+		else
+		{
+			end = start;
+			ctk_text_iter_forward_chars (&end, g_rand_int_range (rand, 1, 40));
+			ctk_text_buffer_delete (CTK_TEXT_BUFFER (buffer), &start, &end);
+		}
+
+		/* Sometimes several edits go in before the analysis. */
+		if (i % 3 == 0)
+			ensure_highlight_all (buffer);
+	}
+
+	ensure_highlight_all (buffer);
+
+	ctk_text_buffer_get_bounds (CTK_TEXT_BUFFER (buffer), &start, &end);
+	contents = ctk_text_buffer_get_text (CTK_TEXT_BUFFER (buffer), &start, &end, TRUE);
+	expected = ctk_source_buffer_new_with_language (lang);
+	ctk_text_buffer_set_text (CTK_TEXT_BUFFER (expected), contents, -1);
+	ensure_highlight_all (expected);
+
+	assert_same_highlight (buffer, expected);
+
+	g_free (contents);
+	g_rand_free (rand);
+	g_object_unref (expected);
+	g_object_unref (buffer);
+}
+
+/* Runs the main loop until the analysis of @buffer in a thread is
+ * neither running nor scheduled. */
+static void
+wait_thread_analysis (CtkSourceBuffer             *buffer,
+		      CtkSourceContextEngineStats *stats)
+{
+	CtkSourceEngine *engine = _ctk_source_buffer_get_highlight_engine (buffer);
+
+	g_assert_true (CTK_SOURCE_IS_CONTEXT_ENGINE (engine));
+
+	_ctk_source_context_engine_get_stats (CTK_SOURCE_CONTEXT_ENGINE (engine), stats);
+	while (stats->thread_analysis_pending)
+	{
+		g_main_context_iteration (NULL, TRUE);
+		_ctk_source_context_engine_get_stats (CTK_SOURCE_CONTEXT_ENGINE (engine), stats);
+	}
+}
+
+static void
+test_highlight_in_thread (void)
+{
+	CtkSourceLanguageManager *lm;
+	CtkSourceLanguage *lang;
+	CtkSourceBuffer *buffer;
+	CtkSourceBuffer *expected;
+	CtkSourceContextEngineStats stats;
+	CtkTextIter iter;
+	GString *text;
+	gint i;
+
+	lm = ctk_source_language_manager_get_default ();
+	lang = ctk_source_language_manager_get_language (lm, "c");
+	g_assert_true (CTK_SOURCE_IS_LANGUAGE (lang));
+
+	/* Big enough to be analyzed in a thread, with contexts spanning
+	 * several lines. */
+	text = g_string_new (NULL);
+	for (i = 0; i < 6000; i++)
+	{
+		if (i % 100 == 0)
+			g_string_append (text, "/* c\n still c */ x = \"s\\\n t\";\n");
+		else
+			g_string_append (text, "/* c */ x = \"s\"; { y = \"t\"; }\n");
+	}
+
+	expected = ctk_source_buffer_new_with_language (lang);
+	ctk_text_buffer_set_text (CTK_TEXT_BUFFER (expected), text->str, -1);
+	ensure_highlight_all (expected);
+
+	/* A text loaded from a file. */
+	buffer = ctk_source_buffer_new_with_language (lang);
+	ctk_source_buffer_set_highlight_in_thread (buffer, TRUE);
+	ctk_text_buffer_set_text (CTK_TEXT_BUFFER (buffer), text->str, -1);
+	_ctk_source_buffer_text_loaded (buffer);
+
+	wait_thread_analysis (buffer, &stats);
+	g_assert_cmpuint (stats.n_thread_analyses, ==, 1);
+
+	ensure_highlight_all (buffer);
+	assert_same_highlight (buffer, expected);
+	g_object_unref (buffer);
+
+	/* A text which is only set. */
+	buffer = ctk_source_buffer_new_with_language (lang);
+	ctk_source_buffer_set_highlight_in_thread (buffer, TRUE);
+	ctk_text_buffer_set_text (CTK_TEXT_BUFFER (buffer), text->str, -1);
+
+	wait_thread_analysis (buffer, &stats);
+	g_assert_cmpuint (stats.n_thread_analyses, ==, 1);
+
+	ensure_highlight_all (buffer);
+	assert_same_highlight (buffer, expected);
+	g_object_unref (buffer);
+
+	/* A language change. */
+	buffer = ctk_source_buffer_new (NULL);
+	ctk_source_buffer_set_highlight_in_thread (buffer, TRUE);
+	ctk_text_buffer_set_text (CTK_TEXT_BUFFER (buffer), text->str, -1);
+	ctk_source_buffer_set_language (buffer, lang);
+
+	wait_thread_analysis (buffer, &stats);
+	g_assert_cmpuint (stats.n_thread_analyses, ==, 1);
+
+	ensure_highlight_all (buffer);
+	assert_same_highlight (buffer, expected);
+	g_object_unref (buffer);
+
+	/* Edits cancel the analysis, which starts again from the new text
+	 * once they are done. */
+	buffer = ctk_source_buffer_new_with_language (lang);
+	ctk_source_buffer_set_highlight_in_thread (buffer, TRUE);
+	ctk_text_buffer_set_text (CTK_TEXT_BUFFER (buffer), text->str, -1);
+
+	ctk_source_buffer_freeze_highlight (buffer);
+	ctk_text_buffer_get_start_iter (CTK_TEXT_BUFFER (buffer), &iter);
+	ctk_text_buffer_insert (CTK_TEXT_BUFFER (buffer), &iter, "\n", -1);
+	ctk_text_buffer_get_iter_at_line (CTK_TEXT_BUFFER (buffer), &iter, 1);
+	ctk_text_buffer_backspace (CTK_TEXT_BUFFER (buffer), &iter, FALSE, TRUE);
+	ctk_source_buffer_thaw_highlight (buffer);
+
+	wait_thread_analysis (buffer, &stats);
+	g_assert_cmpuint (stats.n_thread_analyses, ==, 1);
+
+	ensure_highlight_all (buffer);
+	assert_same_highlight (buffer, expected);
+	g_object_unref (buffer);
+
+	/* Single edits restart it after a delay, unless the idle worker
+	 * is done by then. */
+	buffer = ctk_source_buffer_new_with_language (lang);
+	ctk_source_buffer_set_highlight_in_thread (buffer, TRUE);
+	ctk_text_buffer_set_text (CTK_TEXT_BUFFER (buffer), text->str, -1);
+
+	ctk_text_buffer_get_start_iter (CTK_TEXT_BUFFER (buffer), &iter);
+	ctk_text_buffer_insert (CTK_TEXT_BUFFER (buffer), &iter, "\n", -1);
+	ctk_text_buffer_get_iter_at_line (CTK_TEXT_BUFFER (buffer), &iter, 1);
+	ctk_text_buffer_backspace (CTK_TEXT_BUFFER (buffer), &iter, FALSE, TRUE);
+
+	wait_thread_analysis (buffer, &stats);
+	g_assert_cmpuint (stats.n_thread_analyses, <=, 1);
+
+	ensure_highlight_all (buffer);
+	assert_same_highlight (buffer, expected);
+
+	g_string_free (text, TRUE);
+	g_object_unref (expected);
+	g_object_unref (buffer);
+}
+
 static void
 do_test_change_case (CtkSourceBuffer         *buffer,
 		     CtkSourceChangeCaseType  case_type,
@@ -489,12 +2046,33 @@ test_bracket_matching (void)
 int
 main (int argc, char** argv)
 {
-	ctk_test_init (&argc, &argv);
+	/* The highlight cache is in the user cache directory. */
+	g_test_init (&argc, &argv, G_TEST_OPTION_ISOLATE_DIRS, NULL);
+	ctk_init (&argc, &argv);
 
 	init_default_manager ();
 
 	g_test_add_func ("/Buffer/bug-634510", test_get_buffer);
 	g_test_add_func ("/Buffer/get-context-classes", test_get_context_classes);
+	g_test_add_func ("/Buffer/incremental-highlight", test_incremental_highlight);
+	g_test_add_func ("/Buffer/highlight-many-segments", test_highlight_many_segments);
+	g_test_add_func ("/Buffer/highlight-edits", test_highlight_edits);
+	g_test_add_func ("/Buffer/highlight-sub-patterns", test_highlight_sub_patterns);
+	g_test_add_func ("/Buffer/highlight-line-terminators", test_highlight_line_terminators);
+	g_test_add_func ("/Buffer/highlight-class-disabled", test_highlight_class_disabled);
+	g_test_add_func ("/Buffer/highlight-schedule", test_highlight_schedule);
+	g_test_add_func ("/Buffer/highlight-frame-clock", test_highlight_frame_clock);
+	g_test_add_func ("/Buffer/highlight-sync-points", test_highlight_sync_points);
+	g_test_add_func ("/Buffer/highlight-long-line", test_highlight_long_line);
+	g_test_add_func ("/Buffer/highlight-on-draw", test_highlight_on_draw);
+	g_test_add_func ("/Buffer/highlight-on-draw-frozen", test_highlight_on_draw_frozen);
+	g_test_add_func ("/Buffer/highlight-mirror", test_highlight_mirror);
+	g_test_add_func ("/Buffer/highlight-mirror-chain", test_highlight_mirror_chain);
+	g_test_add_func ("/Buffer/highlight-freeze", test_highlight_freeze);
+	g_test_add_func ("/Buffer/highlight-non-ascii", test_highlight_non_ascii);
+	g_test_add_func ("/Buffer/highlight-cache", test_highlight_cache);
+	g_test_add_func ("/Buffer/highlight-resolved-end", test_highlight_resolved_end);
+	g_test_add_func ("/Buffer/highlight-in-thread", test_highlight_in_thread);
 	g_test_add_func ("/Buffer/change-case", test_change_case);
 	g_test_add_func ("/Buffer/join-lines", test_join_lines);
 	g_test_add_func ("/Buffer/sort-lines", test_sort_lines);
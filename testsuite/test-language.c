@@ -23,8 +23,10 @@
 #endif
 
 #include <stdlib.h>
+#include <string.h>
 #include <ctk/ctk.h>
 #include <ctksourceview/ctksource.h>
+#include "ctksourceview/ctksourcelanguage-private.h"
 
 typedef struct _TestFixture TestFixture;
 
@@ -157,12 +159,117 @@ test_language (TestFixture   *fixture,
 	check_language (language, "test-empty", "Test Empty", "Others", TRUE, NULL, NULL, NULL, NULL, NULL, NULL);
 }
 
+/* Describes the highlighting of @text with @language: the context
+ * classes and the number of tags of each run of characters. */
+static gchar *
+get_highlighting (CtkSourceLanguage *language,
+		  const gchar       *text)
+{
+	CtkSourceBuffer *buffer;
+	CtkTextIter start;
+	CtkTextIter end;
+	CtkTextIter iter;
+	GString *result;
+	gchar *previous = NULL;
+
+	buffer = ctk_source_buffer_new_with_language (language);
+	ctk_text_buffer_set_text (CTK_TEXT_BUFFER (buffer), text, -1);
+
+	ctk_text_buffer_get_bounds (CTK_TEXT_BUFFER (buffer), &start, &end);
+	ctk_source_buffer_ensure_highlight (buffer, &start, &end);
+
+	result = g_string_new (NULL);
+
+	for (iter = start; !ctk_text_iter_is_end (&iter); ctk_text_iter_forward_char (&iter))
+	{
+		gchar **classes;
+		GSList *tags;
+		gchar *joined;
+		gchar *current;
+
+		classes = ctk_source_buffer_get_context_classes_at_iter (buffer, &iter);
+		tags = ctk_text_iter_get_tags (&iter);
+
+		joined = g_strjoinv (",", classes);
+		current = g_strdup_printf ("%s/%u", joined, g_slist_length (tags));
+
+		if (g_strcmp0 (current, previous) != 0)
+		{
+			g_string_append_printf (result, "%d:%s\n",
+						ctk_text_iter_get_offset (&iter),
+						current);
+		}
+
+		g_free (previous);
+		previous = current;
+
+		g_free (joined);
+		g_slist_free (tags);
+		g_strfreev (classes);
+	}
+
+	g_free (previous);
+	g_object_unref (buffer);
+
+	return g_string_free (result, FALSE);
+}
+
+static void
+test_compiled (TestFixture   *fixture,
+               gconstpointer  data)
+{
+	const gchar *text =
+		"#include <stdio.h>\n"
+		"/* comment */\n"
+		"int\n"
+		"main (int argc, char **argv)\n"
+		"{\n"
+		"\tprintf (\"%s\\n\", \"hello\"); // done\n"
+		"\treturn 0x1F + 'c';\n"
+		"}\n";
+	CtkSourceLanguageManager *compiled_manager;
+	CtkSourceLanguage *language;
+	CtkSourceLanguage *compiled_language;
+	CtkSourceContextData *ctx_data;
+	gchar *highlighting;
+	gchar *compiled_highlighting;
+
+	/* The cache directory is empty, parsing the language writes the
+	 * compiled cache. */
+	language = ctk_source_language_manager_get_language (fixture->manager, "c");
+	highlighting = get_highlighting (language, text);
+	g_assert_true (strstr (highlighting, "comment") != NULL);
+	g_assert_true (strstr (highlighting, "string") != NULL);
+
+	/* Another manager has its own languages, which are loaded from the
+	 * cache. */
+	compiled_manager = ctk_source_language_manager_new ();
+	ctk_source_language_manager_set_search_path (compiled_manager,
+						     (gchar **) ctk_source_language_manager_get_search_path (fixture->manager));
+	compiled_language = ctk_source_language_manager_get_language (compiled_manager, "c");
+
+	ctx_data = _ctk_source_context_data_new (compiled_language);
+	g_assert_true (_ctk_source_language_file_load_compiled (compiled_language, ctx_data));
+	_ctk_source_context_data_unref (ctx_data);
+
+	/* And highlight the same way as the parsed language. */
+	compiled_highlighting = get_highlighting (compiled_language, text);
+	g_assert_cmpstr (compiled_highlighting, ==, highlighting);
+
+	g_free (compiled_highlighting);
+	g_free (highlighting);
+	g_object_unref (compiled_manager);
+}
+
 int
 main (int argc, char** argv)
 {
-	ctk_test_init (&argc, &argv);
+	/* The compiled languages are cached in the user cache directory. */
+	g_test_init (&argc, &argv, G_TEST_OPTION_ISOLATE_DIRS, NULL);
+	ctk_init (&argc, &argv);
 
 	g_test_add ("/Language/language-properties", TestFixture, NULL, test_fixture_setup, test_language, test_fixture_teardown);
+	g_test_add ("/Language/compiled", TestFixture, NULL, test_fixture_setup, test_compiled, test_fixture_teardown);
 
 	return g_test_run();
 }
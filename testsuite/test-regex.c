@@ -18,6 +18,7 @@
  * along with this library; if not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <string.h>
 #include <ctk/ctk.h>
 #include <ctksourceview/ctksource.h>
 #include "ctksourceview/ctksourceregex.h"
@@ -33,12 +34,289 @@ test_slash_c_pattern (void)
 	g_assert_null (regex);
 }
 
+static void
+check_match (const gchar        *pattern,
+	     GRegexCompileFlags  flags,
+	     const gchar        *line,
+	     gint                byte_pos,
+	     gint                expected_start,
+	     gint                expected_end)
+{
+	CtkSourceRegex *regex;
+	GError *error = NULL;
+	gint start = -1;
+	gint end = -1;
+
+	regex = _ctk_source_regex_new (pattern, flags, &error);
+	g_assert_no_error (error);
+	g_assert_nonnull (regex);
+
+	if (_ctk_source_regex_match (regex, line, strlen (line), byte_pos))
+		_ctk_source_regex_fetch_pos_bytes (regex, 0, &start, &end);
+
+	g_assert_cmpint (start, ==, expected_start);
+	g_assert_cmpint (end, ==, expected_end);
+
+	_ctk_source_regex_unref (regex);
+}
+
+static void
+test_first_bytes (void)
+{
+	/* Literals and alternations. */
+	check_match ("\\*/", 0, "a comment */ b", 0, 10, 12);
+	check_match ("\\*/", 0, "a comment * / b", 0, -1, -1);
+	check_match ("(?:foo|bar)", 0, "xx bar foo", 0, 3, 6);
+	check_match ("(?:foo|bar)", 0, "xx bar foo", 4, 7, 10);
+	check_match ("\\bc(?:har|on(?:st|tinue))\\b", 0, "static const", 0, 7, 12);
+
+	/* Anchored regexes only look at the given position. */
+	check_match ("\"", G_REGEX_ANCHORED, "a \"b\"", 0, -1, -1);
+	check_match ("\"", G_REGEX_ANCHORED, "a \"b\"", 2, 2, 3);
+	check_match ("\"", G_REGEX_ANCHORED, "a \"b\"", 5, -1, -1);
+
+	/* Lookbehind looks before the start position. */
+	check_match ("(?<!\\\\)\"", 0, "\\\"a\"", 0, 3, 4);
+
+	/* Character classes and quantifiers. */
+	check_match ("[0-9]+", 0, "abc 123", 0, 4, 7);
+	check_match ("a?b", 0, "xxb", 0, 2, 3);
+	check_match ("(?:ab)*c", 0, "xxabc", 0, 2, 5);
+
+	/* Caseless. */
+	check_match ("(?i)select", 0, "x SELECT", 0, 2, 8);
+	check_match ("select", G_REGEX_CASELESS, "x SeLeCt", 0, 2, 8);
+
+	/* Patterns which can match an empty string. */
+	check_match ("$", 0, "abc", 0, 3, 3);
+	check_match ("x*", 0, "abc", 1, 1, 1);
+
+	/* Non-ASCII. */
+	check_match ("é+", 0, "caféé", 0, 3, 7);
+	check_match ("\\w+", 0, "  été", 0, 2, 7);
+}
+
+static void
+check_match_line (CtkSourceRegex *regex,
+		  const gchar    *line,
+		  guint           stamp,
+		  gint            byte_pos,
+		  gint            expected_start,
+		  gint            expected_end)
+{
+	gint start = -1;
+	gint end = -1;
+
+	if (_ctk_source_regex_match_line (regex, line, strlen (line), stamp, byte_pos, &start, &end))
+	{
+		gint fetched_start;
+		gint fetched_end;
+
+		/* The match is still there for the fetch functions. */
+		_ctk_source_regex_fetch_pos_bytes (regex, 0, &fetched_start, &fetched_end);
+		g_assert_cmpint (fetched_start, ==, start);
+		g_assert_cmpint (fetched_end, ==, end);
+	}
+
+	g_assert_cmpint (start, ==, expected_start);
+	g_assert_cmpint (end, ==, expected_end);
+}
+
+static void
+test_match_line (void)
+{
+	const gchar *line = "aabbcbb";
+	CtkSourceRegex *regex;
+	guint stamp;
+
+	stamp = _ctk_source_regex_new_line_stamp ();
+	g_assert_cmpuint (stamp, !=, 0);
+	g_assert_cmpuint (_ctk_source_regex_new_line_stamp (), !=, stamp);
+
+	regex = _ctk_source_regex_new ("b+", 0, NULL);
+	check_match_line (regex, line, stamp, 0, 2, 4);
+	check_match_line (regex, line, stamp, 1, 2, 4);
+	check_match_line (regex, line, stamp, 2, 2, 4);
+	check_match_line (regex, line, stamp, 3, 3, 4);
+	check_match_line (regex, line, stamp, 4, 5, 7);
+	check_match_line (regex, line, stamp, 7, -1, -1);
+	check_match_line (regex, line, stamp, 4, 5, 7);
+
+	/* Another line. */
+	check_match_line (regex, "xb", _ctk_source_regex_new_line_stamp (), 0, 1, 2);
+	_ctk_source_regex_unref (regex);
+
+	regex = _ctk_source_regex_new ("b", G_REGEX_ANCHORED, NULL);
+	check_match_line (regex, line, stamp, 0, -1, -1);
+	check_match_line (regex, line, stamp, 2, 2, 3);
+	check_match_line (regex, line, stamp, 3, 3, 4);
+	check_match_line (regex, line, stamp, 4, -1, -1);
+	_ctk_source_regex_unref (regex);
+
+	/* \G depends on where the search starts. */
+	regex = _ctk_source_regex_new ("\\Gb", 0, NULL);
+	check_match_line (regex, line, stamp, 0, -1, -1);
+	check_match_line (regex, line, stamp, 2, 2, 3);
+	_ctk_source_regex_unref (regex);
+}
+
+static void
+test_cache (void)
+{
+	CtkSourceRegex *regex1;
+	CtkSourceRegex *regex2;
+	CtkSourceRegex *regex3;
+	guint n_patterns, n_hits, n_misses;
+	guint n_patterns_before, n_hits_before, n_misses_before;
+	gchar *text;
+
+	_ctk_source_regex_get_cache_stats (&n_patterns_before, &n_hits_before, &n_misses_before);
+
+	regex1 = _ctk_source_regex_new ("test-cache[0-9]+", 0, NULL);
+	regex2 = _ctk_source_regex_new ("test-cache[0-9]+", 0, NULL);
+	regex3 = _ctk_source_regex_new ("test-cache[0-9]+", G_REGEX_CASELESS, NULL);
+	g_assert_nonnull (regex1);
+	g_assert_nonnull (regex2);
+	g_assert_nonnull (regex3);
+
+	_ctk_source_regex_get_cache_stats (&n_patterns, &n_hits, &n_misses);
+	g_assert_cmpuint (n_patterns, ==, n_patterns_before + 2);
+	g_assert_cmpuint (n_hits, ==, n_hits_before + 1);
+	g_assert_cmpuint (n_misses, ==, n_misses_before + 2);
+
+	/* Each regex has its own match. */
+	g_assert_true (_ctk_source_regex_match (regex1, "a test-cache12", -1, 0));
+	g_assert_true (_ctk_source_regex_match (regex2, "test-cache3", -1, 0));
+	g_assert_false (_ctk_source_regex_match (regex3, "TEST-CACHE", -1, 0));
+	text = _ctk_source_regex_fetch (regex1, 0);
+	g_assert_cmpstr (text, ==, "test-cache12");
+	g_free (text);
+
+	_ctk_source_regex_unref (regex1);
+	_ctk_source_regex_unref (regex3);
+
+	_ctk_source_regex_get_cache_stats (&n_patterns, NULL, NULL);
+	g_assert_cmpuint (n_patterns, ==, n_patterns_before + 1);
+
+	_ctk_source_regex_unref (regex2);
+
+	_ctk_source_regex_get_cache_stats (&n_patterns, NULL, NULL);
+	g_assert_cmpuint (n_patterns, ==, n_patterns_before);
+}
+
+static void
+test_jit (void)
+{
+	CtkSourceRegexJitMode modes[] = {
+		CTK_SOURCE_REGEX_JIT_NEVER,
+		CTK_SOURCE_REGEX_JIT_LAZY,
+		CTK_SOURCE_REGEX_JIT_ALWAYS
+	};
+	CtkSourceRegexJitMode saved_mode;
+	guint i;
+	gint n;
+
+	saved_mode = _ctk_source_regex_get_jit_mode ();
+
+	/* The results do not change when a regex gets optimized. */
+	for (i = 0; i < G_N_ELEMENTS (modes); i++)
+	{
+		CtkSourceRegex *regex;
+
+		_ctk_source_regex_set_jit_mode (modes[i]);
+		regex = _ctk_source_regex_new ("\\b(?:if|else)\\b", 0, NULL);
+
+		for (n = 0; n < 200; n++)
+		{
+			gint start = -1;
+			gint end = -1;
+
+			g_assert_true (_ctk_source_regex_match (regex, "x; else if", -1, n % 4));
+			_ctk_source_regex_fetch_pos_bytes (regex, 0, &start, &end);
+			g_assert_cmpint (start, ==, 3);
+			g_assert_cmpint (end, ==, 7);
+
+			g_assert_false (_ctk_source_regex_match (regex, "elsewhere", -1, 0));
+		}
+
+		_ctk_source_regex_unref (regex);
+	}
+
+	_ctk_source_regex_set_jit_mode (saved_mode);
+}
+
+static gchar *
+resolve_key_at (CtkSourceRegex *end,
+		CtkSourceRegex *start,
+		const gchar    *line)
+{
+	g_assert_true (_ctk_source_regex_match (start, line, -1, 0));
+	return _ctk_source_regex_resolve_key (end, start);
+}
+
+static void
+test_resolve_key (void)
+{
+	CtkSourceRegex *start;
+	CtkSourceRegex *end;
+	CtkSourceRegex *resolved;
+	gchar *key1;
+	gchar *key2;
+	gchar *text;
+
+	/* The delimiter is captured before the start match. */
+	start = _ctk_source_regex_new ("(?<=(?P<tag>[a-z]):)<<", 0, NULL);
+	end = _ctk_source_regex_new ("\\%{tag@start}", 0, NULL);
+	g_assert_nonnull (start);
+	g_assert_nonnull (end);
+	g_assert_false (_ctk_source_regex_is_resolved (end));
+
+	key1 = resolve_key_at (end, start, "a:<< b a");
+	key2 = resolve_key_at (end, start, "x = a:<<");
+	g_assert_cmpstr (key1, ==, key2);
+	g_free (key2);
+
+	/* Same matched text, different end. */
+	key2 = resolve_key_at (end, start, "b:<< a b");
+	g_assert_cmpstr (key1, !=, key2);
+
+	resolved = _ctk_source_regex_resolve (end, start, NULL);
+	g_assert_true (_ctk_source_regex_match (resolved, "b:<< a b", -1, 5));
+	text = _ctk_source_regex_fetch (resolved, 0);
+	g_assert_cmpstr (text, ==, "b");
+	g_free (text);
+
+	g_free (key1);
+	g_free (key2);
+	_ctk_source_regex_unref (resolved);
+	_ctk_source_regex_unref (end);
+	_ctk_source_regex_unref (start);
+
+	/* Several references are not confused with each other. */
+	start = _ctk_source_regex_new ("(\\w*)-(\\w*)", 0, NULL);
+	end = _ctk_source_regex_new ("\\%{1@start}\\%{2@start}", 0, NULL);
+
+	key1 = resolve_key_at (end, start, "ab-c");
+	key2 = resolve_key_at (end, start, "a-bc");
+	g_assert_cmpstr (key1, !=, key2);
+
+	g_free (key1);
+	g_free (key2);
+	_ctk_source_regex_unref (end);
+	_ctk_source_regex_unref (start);
+}
+
 int
 main (int argc, char** argv)
 {
 	ctk_test_init (&argc, &argv);
 
 	g_test_add_func ("/Regex/slash-c", test_slash_c_pattern);
+	g_test_add_func ("/Regex/first-bytes", test_first_bytes);
+	g_test_add_func ("/Regex/match-line", test_match_line);
+	g_test_add_func ("/Regex/cache", test_cache);
+	g_test_add_func ("/Regex/jit", test_jit);
+	g_test_add_func ("/Regex/resolve-key", test_resolve_key);
 
 	return g_test_run();
 }
@@ -358,6 +358,66 @@ test_case_sensitivity (void)
 	g_object_unref (context);
 }
 
+static void
+test_occurrences_count_long_text (void)
+{
+	CtkSourceBuffer *source_buffer = ctk_source_buffer_new (NULL);
+	CtkTextBuffer *text_buffer = CTK_TEXT_BUFFER (source_buffer);
+	CtkSourceSearchSettings *settings = ctk_source_search_settings_new ();
+	CtkSourceSearchContext *context = ctk_source_search_context_new (source_buffer, settings);
+	GString *text;
+	gint occurrences_count;
+	gint i;
+
+	/* Bigger than the chunks of text searched at once, with non-ASCII
+	 * text first, and ASCII text afterwards. */
+	text = g_string_new (NULL);
+	for (i = 0; i < 5000; i++)
+		g_string_append (text, "foo Foo FOO \303\251 fOo\n");
+	for (i = 0; i < 5000; i++)
+		g_string_append (text, "bar BAR xbarx\n");
+
+	ctk_text_buffer_set_text (text_buffer, text->str, -1);
+	g_string_free (text, TRUE);
+
+	ctk_source_search_settings_set_search_text (settings, "foo");
+	ctk_source_search_settings_set_case_sensitive (settings, TRUE);
+	flush_queue ();
+	occurrences_count = ctk_source_search_context_get_occurrences_count (context);
+	g_assert_cmpint (occurrences_count, ==, 5000);
+
+	ctk_source_search_settings_set_case_sensitive (settings, FALSE);
+	flush_queue ();
+	occurrences_count = ctk_source_search_context_get_occurrences_count (context);
+	g_assert_cmpint (occurrences_count, ==, 20000);
+
+	ctk_source_search_settings_set_search_text (settings, "\303\251 f");
+	flush_queue ();
+	occurrences_count = ctk_source_search_context_get_occurrences_count (context);
+	g_assert_cmpint (occurrences_count, ==, 5000);
+
+	ctk_source_search_settings_set_search_text (settings, "bar");
+	flush_queue ();
+	occurrences_count = ctk_source_search_context_get_occurrences_count (context);
+	g_assert_cmpint (occurrences_count, ==, 15000);
+
+	ctk_source_search_settings_set_at_word_boundaries (settings, TRUE);
+	flush_queue ();
+	occurrences_count = ctk_source_search_context_get_occurrences_count (context);
+	g_assert_cmpint (occurrences_count, ==, 10000);
+
+	/* Invisible text is skipped, the text is searched differently. */
+	ctk_text_buffer_create_tag (text_buffer, NULL, "invisible", TRUE, NULL);
+	ctk_source_search_settings_set_at_word_boundaries (settings, FALSE);
+	flush_queue ();
+	occurrences_count = ctk_source_search_context_get_occurrences_count (context);
+	g_assert_cmpint (occurrences_count, ==, 15000);
+
+	g_object_unref (source_buffer);
+	g_object_unref (settings);
+	g_object_unref (context);
+}
+
 static void
 test_search_at_word_boundaries (void)
 {
@@ -1321,6 +1381,7 @@ main (int argc, char **argv)
 	g_test_add_func ("/Search/occurrences-count/with-insert", test_occurrences_count_with_insert);
 	g_test_add_func ("/Search/occurrences-count/with-delete", test_occurrences_count_with_delete);
 	g_test_add_func ("/Search/occurrences-count/multiple-lines", test_occurrences_count_multiple_lines);
+	g_test_add_func ("/Search/occurrences-count/long-text", test_occurrences_count_long_text);
 	g_test_add_func ("/Search/case-sensitivity", test_case_sensitivity);
 	g_test_add_func ("/Search/at-word-boundaries", test_search_at_word_boundaries);
 	g_test_add_func ("/Search/forward", test_forward_search);